@@ -8,6 +8,12 @@
  * This module was first written on a semi-emergency basis to improve the
  * robustness of the anti-DoS module.  As such, it's written in a pretty
  * conservative way, and should be susceptible to improvement later on.
+ *
+ * The set is a blocked counting Bloom filter. Its counters are grouped in
+ * cache-line-sized blocks, and all the counters for one address live in
+ * the same block, so that a membership test touches a single cache line
+ * and needs a single siphash. Each counter is four bits wide, which is
+ * what lets us remove addresses as well as add them.
  **/
 
 #include "orconfig.h"
@@ -19,49 +25,93 @@
 #include "util.h"
 #include "siphash.h"
 
-/** How many 64-bit siphash values to extract per address */
-#define N_HASHES 2
-/** How many bloom-filter bits we set per address. This is twice the N_HASHES
- * value, since we split the siphash output into two 32-bit values. */
-#define N_BITS_PER_ITEM (N_HASHES * 2)
+#include <math.h>
 
-/* XXXX This code is largely duplicated with digestset_t.  We should merge
- * them together into a common bloom-filter implementation.  I'm keeping
- * them separate for now, though, since this module needs to be backported
- * all the way to 0.2.9.
- *
- * The main difference between digestset_t and this code is that we use
- * independent siphashes rather than messing around with bit-shifts.  The
- * approach here is probably more sound, and we should prefer it if&when we
- * unify the implementations.
- **/
+/** Size in bytes of one block of counters. This is the cache line size on
+ * most CPUs we care about. */
+#define BLOCK_LEN 64
+/** Number of four-bit counters in one block. */
+#define COUNTERS_PER_BLOCK (BLOCK_LEN * 2)
+/** A counter at this value has overflowed: it is never decremented again,
+ * since we no longer know how many addresses use it. */
+#define COUNTER_MAX 15
+/** Largest number of counters we use per address. More would cost more
+ * time per lookup than it saves in space. */
+#define MAX_HASHES 8
+/** False positive rate that address_set_new() aims for. */
+#define DEFAULT_FP_RATE 0.0002
+
+/** One cache line worth of counters, two per byte. */
+typedef struct address_set_block_t {
+  uint8_t counters[BLOCK_LEN];
+} address_set_block_t;
 
 struct address_set_t {
-  /** siphash keys to make N_HASHES independent hashes for each address. */
-  struct sipkey key[N_HASHES];
-  int mask; /**< One less than the number of bits in <b>ba</b>; always one less
-             * than a power of two. */
-  bitarray_t *ba; /**< A bit array to implement the Bloom filter. */
+  /** siphash key for the one hash we compute for each address. */
+  struct sipkey key;
+  /** How many counters we use per address, at most MAX_HASHES. */
+  int n_hashes;
+  /** One less than the number of blocks; always one less than a power of
+   * two. */
+  uint32_t block_mask;
+  /** The blocks, aligned to BLOCK_LEN bytes within <b>mem</b>. */
+  address_set_block_t *blocks;
+  /** The allocation that holds <b>blocks</b>. */
+  void *mem;
 };
 
 /**
  * Allocate and return an address_set, suitable for holding up to
- * <b>max_address_guess</b> distinct values.
+ * <b>max_address_guess</b> distinct values with a false positive rate of
+ * at most about <b>fp_rate</b>.
  */
 address_set_t *
-address_set_new(int max_addresses_guess)
+address_set_new_with_fp_rate(int max_addresses_guess, double fp_rate)
 {
-  /* See digestset_new() for rationale on this equation. */
-  int n_bits = 1u << (tor_log2(max_addresses_guess)+5);
-
   address_set_t *set = tor_malloc_zero(sizeof(address_set_t));
-  set->mask = n_bits - 1;
-  set->ba = bitarray_init_zero(n_bits);
-  crypto_rand((char*) set->key, sizeof(set->key));
+  double counters_per_addr, n_counters;
+  uint32_t n_blocks = 1;
+  uintptr_t p;
+  int k;
+
+  if (max_addresses_guess < 1)
+    max_addresses_guess = 1;
+  if (!(fp_rate > 0.0 && fp_rate < 1.0))
+    fp_rate = DEFAULT_FP_RATE;
+
+  /* The optimal number of hashes is log2(1/fp_rate), for which we need
+   * k / ln 2 counters per address. With fewer hashes than optimal, we need
+   * -k / ln(1 - fp_rate^(1/k)) counters per address. We add a quarter to
+   * make up for the uneven load of the blocks. */
+  k = (int) tor_lround(-tor_mathlog(fp_rate) / tor_mathlog(2.0));
+  k = CLAMP(1, k, MAX_HASHES);
+  counters_per_addr = -k / tor_mathlog(1.0 - pow(fp_rate, 1.0 / k));
+  n_counters = 1.25 * counters_per_addr * max_addresses_guess;
+  while (n_blocks < (UINT32_C(1) << 26) &&
+         (double) n_blocks * COUNTERS_PER_BLOCK < n_counters)
+    n_blocks <<= 1;
+
+  set->n_hashes = k;
+  set->block_mask = n_blocks - 1;
+  set->mem = tor_malloc_zero((size_t) n_blocks * BLOCK_LEN + BLOCK_LEN - 1);
+  p = (uintptr_t) set->mem;
+  p = (p + BLOCK_LEN - 1) & ~(uintptr_t) (BLOCK_LEN - 1);
+  set->blocks = (address_set_block_t *) p;
+  crypto_rand((char*) &set->key, sizeof(set->key));
 
   return set;
 }
 
+/**
+ * Allocate and return an address_set, suitable for holding up to
+ * <b>max_address_guess</b> distinct values.
+ */
+address_set_t *
+address_set_new(int max_addresses_guess)
+{
+  return address_set_new_with_fp_rate(max_addresses_guess, DEFAULT_FP_RATE);
+}
+
 /**
  * Release all storage associated with <b>set</b>
  */
@@ -71,29 +121,72 @@ address_set_free(address_set_t *set)
   if (! set)
     return;
 
-  bitarray_free(set->ba);
+  tor_free(set->mem);
   tor_free(set);
 }
 
-/** Yield the bit index corresponding to 'val' for set. */
-#define BIT(set, val) ((val) & (set)->mask)
+/** Return the number of bytes of counters in <b>set</b>. */
+size_t
+address_set_get_size(const address_set_t *set)
+{
+  return ((size_t) set->block_mask + 1) * BLOCK_LEN;
+}
+
+/** Hash <b>addr</b> for <b>set</b>. Set *<b>block_out</b> to the block
+ * that holds its counters, and fill <b>idx_out</b> with the indices of its
+ * set->n_hashes counters in that block. */
+static inline void
+address_set_locate(const address_set_t *set, const tor_addr_t *addr,
+                   address_set_block_t **block_out,
+                   unsigned idx_out[MAX_HASHES])
+{
+  const uint64_t h = tor_addr_keyed_hash(&set->key, addr);
+  /* Multiplying by an odd constant mixes all the bits of h into the top
+   * ones, so that the counter indices, which we take 7 bits at a time from
+   * the top, still vary between addresses that share a block. */
+  const uint64_t mixed = h * UINT64_C(0x9e3779b97f4a7c15);
+  int i;
+
+  *block_out = &set->blocks[(uint32_t) (h >> 32) & set->block_mask];
+  for (i = 0; i < set->n_hashes; ++i)
+    idx_out[i] = (unsigned) (mixed >> (57 - 7 * i)) &
+                 (COUNTERS_PER_BLOCK - 1);
+}
+
+/** Return the <b>idx</b>th counter of <b>block</b>. */
+static inline unsigned
+counter_get(const address_set_block_t *block, unsigned idx)
+{
+  return (block->counters[idx >> 1] >> ((idx & 1) * 4)) & 0xf;
+}
+
+/** Set the <b>idx</b>th counter of <b>block</b> to <b>val</b>. */
+static inline void
+counter_set(address_set_block_t *block, unsigned idx, unsigned val)
+{
+  const unsigned shift = (idx & 1) * 4;
+  uint8_t *byte = &block->counters[idx >> 1];
+  *byte = (uint8_t) ((*byte & ~(0xf << shift)) | (val << shift));
+}
 
 /**
  * Add <b>addr</b> to <b>set</b>.
  *
- * All future queries for <b>addr</b> in set will return true. Removing
- * items is not possible.
+ * All future queries for <b>addr</b> in set will return true, until it is
+ * removed as many times as it was added.
  */
 void
 address_set_add(address_set_t *set, const struct tor_addr_t *addr)
 {
+  address_set_block_t *block;
+  unsigned idx[MAX_HASHES];
   int i;
-  for (i = 0; i < N_HASHES; ++i) {
-    uint64_t h = tor_addr_keyed_hash(&set->key[i], addr);
-    uint32_t high_bits = (uint32_t)(h >> 32);
-    uint32_t low_bits = (uint32_t)(h);
-    bitarray_set(set->ba, BIT(set, high_bits));
-    bitarray_set(set->ba, BIT(set, low_bits));
+
+  address_set_locate(set, addr, &block, idx);
+  for (i = 0; i < set->n_hashes; ++i) {
+    const unsigned c = counter_get(block, idx[i]);
+    if (c < COUNTER_MAX)
+      counter_set(block, idx[i], c + 1);
   }
 }
 
@@ -106,6 +199,38 @@ address_set_add_ipv4h(address_set_t *set, uint32_t addr)
   address_set_add(set, &a);
 }
 
+/**
+ * Remove one occurrence of <b>addr</b>, which must have been added, from
+ * <b>set</b>.
+ *
+ * Removing an address that wasn't added can make the set forget others.
+ * Counters that overflowed stay put, so at worst some removed addresses
+ * keep being reported.
+ */
+void
+address_set_remove(address_set_t *set, const struct tor_addr_t *addr)
+{
+  address_set_block_t *block;
+  unsigned idx[MAX_HASHES];
+  int i;
+
+  address_set_locate(set, addr, &block, idx);
+  for (i = 0; i < set->n_hashes; ++i) {
+    const unsigned c = counter_get(block, idx[i]);
+    if (c > 0 && c < COUNTER_MAX)
+      counter_set(block, idx[i], c - 1);
+  }
+}
+
+/** As address_set_remove(), but take an ipv4 address in host order. */
+void
+address_set_remove_ipv4h(address_set_t *set, uint32_t addr)
+{
+  tor_addr_t a;
+  tor_addr_from_ipv4h(&a, addr);
+  address_set_remove(set, &a);
+}
+
 /**
  * Return true if <b>addr</b> if a member of <b>set</b>.  (And probably,
  * return false if <b>addr</b> is not a member of set.)
@@ -114,16 +239,15 @@ int
 address_set_probably_contains(address_set_t *set,
                               const struct tor_addr_t *addr)
 {
-  int i, matches = 0;
-  for (i = 0; i < N_HASHES; ++i) {
-    uint64_t h = tor_addr_keyed_hash(&set->key[i], addr);
-    uint32_t high_bits = (uint32_t)(h >> 32);
-    uint32_t low_bits = (uint32_t)(h);
-    // Note that !! is necessary here, since bitarray_is_set does not
-    // necessarily return 1 on true.
-    matches += !! bitarray_is_set(set->ba, BIT(set, high_bits));
-    matches += !! bitarray_is_set(set->ba, BIT(set, low_bits));
+  address_set_block_t *block;
+  unsigned idx[MAX_HASHES];
+  int i;
+
+  address_set_locate(set, addr, &block, idx);
+  for (i = 0; i < set->n_hashes; ++i) {
+    if (counter_get(block, idx[i]) == 0)
+      return 0;
   }
-  return matches == N_BITS_PER_ITEM;
+  return 1;
 }
 
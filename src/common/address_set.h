@@ -18,16 +18,21 @@
 
 /**
  * An address_set_t represents a set of tor_addr_t values. The implementation
- * is probabilistic: false negatives cannot occur but false positives are
- * possible.
+ * is probabilistic: false negatives cannot occur (as long as only addresses
+ * that were added get removed) but false positives are possible.
  */
 typedef struct address_set_t address_set_t;
 struct tor_addr_t;
 
 address_set_t *address_set_new(int max_addresses_guess);
+address_set_t *address_set_new_with_fp_rate(int max_addresses_guess,
+                                             double fp_rate);
 void address_set_free(address_set_t *set);
+size_t address_set_get_size(const address_set_t *set);
 void address_set_add(address_set_t *set, const struct tor_addr_t *addr);
 void address_set_add_ipv4h(address_set_t *set, uint32_t addr);
+void address_set_remove(address_set_t *set, const struct tor_addr_t *addr);
+void address_set_remove_ipv4h(address_set_t *set, uint32_t addr);
 int address_set_probably_contains(address_set_t *set,
                                   const struct tor_addr_t *addr);
 
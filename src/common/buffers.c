@@ -30,6 +30,29 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#ifdef HAVE_SYS_UIO_H
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_LIMITS_H
+#include <limits.h>
+#endif
+
+#if defined(HAVE_SYS_UIO_H) && defined(HAVE_READV) && defined(HAVE_WRITEV)
+/** Defined if we can move data between a socket and several chunks of a
+ * buffer with a single readv()/writev() call. */
+#define USE_VECTORED_IO
+#endif
+
+#ifdef USE_VECTORED_IO
+/** Largest number of chunks we hand to a single writev() call. It's bounded
+ * by IOV_MAX, but we keep it small enough for the iovec array to live on the
+ * stack. */
+#if defined(IOV_MAX) && IOV_MAX < 64
+#define BUF_MAX_IOV IOV_MAX
+#else
+#define BUF_MAX_IOV 64
+#endif
+#endif /* defined(USE_VECTORED_IO) */
 
 //#define PARANOIA
 
@@ -124,6 +147,8 @@ buf_chunk_free_unchecked(chunk_t *chunk)
   tor_assert(total_bytes_allocated_in_chunks >=
              CHUNK_ALLOC_SIZE(chunk->memlen));
   total_bytes_allocated_in_chunks -= CHUNK_ALLOC_SIZE(chunk->memlen);
+  if (chunk->ext_free_fn)
+    chunk->ext_free_fn(chunk->ext_arg);
   tor_free(chunk);
 }
 static inline chunk_t *
@@ -139,10 +164,27 @@ chunk_new_with_alloc_size(size_t alloc)
   ch->memlen = CHUNK_SIZE_WITH_ALLOC(alloc);
   total_bytes_allocated_in_chunks += alloc;
   ch->data = &ch->mem[0];
+  ch->ext_free_fn = NULL;
+  ch->ext_arg = NULL;
   CHUNK_SET_SENTINEL(ch, alloc);
   return ch;
 }
 
+/** Return a new chunk that owns a copy of the data in <b>in_chunk</b>, with
+ * room for at least <b>capacity</b> bytes. */
+static chunk_t *
+chunk_materialize(const chunk_t *in_chunk, size_t capacity)
+{
+  chunk_t *ch;
+  if (capacity < in_chunk->datalen)
+    capacity = in_chunk->datalen;
+  ch = chunk_new_with_alloc_size(buf_preferred_chunk_size(capacity));
+  memcpy(ch->mem, in_chunk->data, in_chunk->datalen);
+  ch->datalen = in_chunk->datalen;
+  ch->inserted_time = in_chunk->inserted_time;
+  return ch;
+}
+
 /** Expand <b>chunk</b> until it can hold <b>sz</b> bytes, and return a
  * new pointer to <b>chunk</b>.  Old pointers are no longer valid. */
 static inline chunk_t *
@@ -217,6 +259,16 @@ buf_pullup(buf_t *buf, size_t bytes, const char **head_out, size_t *len_out)
     return;
   }
 
+  if (buf->head->ext_free_fn) {
+    /* We can't append to data we don't own, so copy it first. */
+    chunk_t *newhead = chunk_materialize(buf->head, capacity);
+    newhead->next = buf->head->next;
+    if (buf->tail == buf->head)
+      buf->tail = newhead;
+    buf_chunk_free_unchecked(buf->head);
+    buf->head = newhead;
+  }
+
   if (buf->head->memlen >= capacity) {
     /* We don't need to grow the first chunk, but we might need to repack it.*/
     size_t needed = capacity - buf->head->datalen;
@@ -419,10 +471,13 @@ buf_free(buf_t *buf)
   tor_free(buf);
 }
 
-/** Return a new copy of <b>in_chunk</b> */
+/** Return a new copy of <b>in_chunk</b>.  If <b>in_chunk</b> refers to data
+ * that it doesn't own, the copy owns a copy of that data. */
 static chunk_t *
 chunk_copy(const chunk_t *in_chunk)
 {
+  if (in_chunk->ext_free_fn)
+    return chunk_materialize(in_chunk, 0);
   chunk_t *newch = tor_memdup(in_chunk, CHUNK_ALLOC_SIZE(in_chunk->memlen));
   total_bytes_allocated_in_chunks += CHUNK_ALLOC_SIZE(in_chunk->memlen);
 #ifdef DEBUG_CHUNK_ALLOC
@@ -544,6 +599,59 @@ read_to_chunk(buf_t *buf, chunk_t *chunk, tor_socket_t fd, size_t at_most,
   }
 }
 
+#ifdef USE_VECTORED_IO
+/** As read_to_chunk(), but read up to <b>at_most</b> bytes into the
+ * remaining capacity of the tail chunk of <b>buf</b> and into a newly
+ * allocated chunk after it, with a single readv() call. The tail chunk must
+ * hold some data, so that it is never left empty if the new chunk isn't. */
+static inline int
+read_to_chunks_vectored(buf_t *buf, tor_socket_t fd, size_t at_most,
+                        int *reached_eof, int *socket_error)
+{
+  struct iovec iov[2];
+  chunk_t *first = buf->tail, *second;
+  size_t first_len = CHUNK_REMAINING_CAPACITY(first), second_len;
+  ssize_t read_result;
+
+  tor_assert(first->datalen);
+  tor_assert(first_len < at_most);
+  second = buf_add_chunk_with_capacity(buf, at_most - first_len, 1);
+  second_len = MIN(at_most - first_len, second->memlen);
+
+  iov[0].iov_base = CHUNK_WRITE_PTR(first);
+  iov[0].iov_len = first_len;
+  iov[1].iov_base = CHUNK_WRITE_PTR(second);
+  iov[1].iov_len = second_len;
+  read_result = readv(fd, iov, 2);
+
+  if (read_result < 0) {
+    int e = tor_socket_errno(fd);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      *socket_error = e;
+      return -1;
+    }
+    return 0; /* would block. */
+  } else if (read_result == 0) {
+    log_debug(LD_NET,"Encountered eof on fd %d", (int)fd);
+    *reached_eof = 1;
+    return 0;
+  } else { /* actually got bytes. */
+    size_t n = (size_t)read_result;
+    if (n <= first_len) {
+      first->datalen += n;
+    } else {
+      first->datalen += first_len;
+      second->datalen += n - first_len;
+    }
+    buf->datalen += n;
+    log_debug(LD_NET,"Read %ld bytes into 2 chunks. %d on inbuf.",
+              (long)read_result, (int)buf->datalen);
+    tor_assert(read_result < INT_MAX);
+    return (int)read_result;
+  }
+}
+#endif /* defined(USE_VECTORED_IO) */
+
 /** Read from socket <b>s</b>, writing onto end of <b>buf</b>.  Read at most
  * <b>at_most</b> bytes, growing the buffer as necessary.  If recv() returns 0
  * (because of EOF), set *<b>reached_eof</b> to 1 and return 0. Return -1 on
@@ -573,6 +681,24 @@ buf_read_from_socket(buf_t *buf, tor_socket_t s, size_t at_most,
   while (at_most > total_read) {
     size_t readlen = at_most - total_read;
     chunk_t *chunk;
+#ifdef USE_VECTORED_IO
+    /* If the tail can't take all we want to read, read into it and into a
+     * new chunk at once rather than doing a second recv() for the rest. */
+    if (buf->tail && buf->tail->datalen &&
+        CHUNK_REMAINING_CAPACITY(buf->tail) >= MIN_READ_LEN &&
+        CHUNK_REMAINING_CAPACITY(buf->tail) < readlen) {
+      r = read_to_chunks_vectored(buf, s, readlen, reached_eof, socket_error);
+      check();
+      if (r < 0)
+        return r; /* Error */
+      tor_assert(total_read+r < INT_MAX);
+      total_read += r;
+      if ((size_t)r < readlen) { /* eof, block, or no more to read. */
+        break;
+      }
+      continue;
+    }
+#endif /* defined(USE_VECTORED_IO) */
     if (!buf->tail || CHUNK_REMAINING_CAPACITY(buf->tail) < MIN_READ_LEN) {
       chunk = buf_add_chunk_with_capacity(buf, at_most, 1);
       if (readlen > chunk->memlen)
@@ -631,6 +757,52 @@ flush_chunk(tor_socket_t s, buf_t *buf, chunk_t *chunk, size_t sz,
   }
 }
 
+#ifdef USE_VECTORED_IO
+/** Helper for buf_flush_to_socket(): try to write <b>sz</b> bytes from the
+ * first chunks of buffer <b>buf</b> onto socket <b>s</b> with a single
+ * writev() call, using at most BUF_MAX_IOV chunks.  Set *<b>attempted_out</b>
+ * to the number of bytes we tried to write.  Otherwise behaves as
+ * flush_chunk().
+ */
+static inline int
+flush_chunks_vectored(tor_socket_t s, buf_t *buf, size_t sz,
+                      size_t *buf_flushlen, size_t *attempted_out)
+{
+  struct iovec iov[BUF_MAX_IOV];
+  int n_iov = 0;
+  size_t attempted = 0;
+  ssize_t write_result;
+  chunk_t *chunk;
+
+  for (chunk = buf->head; chunk && attempted < sz && n_iov < BUF_MAX_IOV;
+       chunk = chunk->next) {
+    size_t len = MIN(chunk->datalen, sz - attempted);
+    if (!len)
+      continue;
+    iov[n_iov].iov_base = chunk->data;
+    iov[n_iov].iov_len = len;
+    ++n_iov;
+    attempted += len;
+  }
+  *attempted_out = attempted;
+  write_result = writev(s, iov, n_iov);
+
+  if (write_result < 0) {
+    int e = tor_socket_errno(s);
+    if (!ERRNO_IS_EAGAIN(e)) { /* it's a real error */
+      return -1;
+    }
+    log_debug(LD_NET,"writev() would block, returning.");
+    return 0;
+  } else {
+    *buf_flushlen -= write_result;
+    buf_drain(buf, write_result);
+    tor_assert(write_result < INT_MAX);
+    return (int)write_result;
+  }
+}
+#endif /* defined(USE_VECTORED_IO) */
+
 /** Write data from <b>buf</b> to the socket <b>s</b>.  Write at most
  * <b>sz</b> bytes, decrement *<b>buf_flushlen</b> by
  * the number of bytes actually written, and remove the written bytes
@@ -659,6 +831,21 @@ buf_flush_to_socket(buf_t *buf, tor_socket_t s, size_t sz,
   while (sz) {
     size_t flushlen0;
     tor_assert(buf->head);
+#ifdef USE_VECTORED_IO
+    /* When what we want to write spans several chunks, write them all with
+     * one system call. */
+    if (buf->head->datalen < sz && buf->head->next) {
+      r = flush_chunks_vectored(s, buf, sz, buf_flushlen, &flushlen0);
+      check();
+      if (r < 0)
+        return r;
+      flushed += r;
+      sz -= r;
+      if (r == 0 || (size_t)r < flushlen0) /* can't flush any more now. */
+        break;
+      continue;
+    }
+#endif /* defined(USE_VECTORED_IO) */
     if (buf->head->datalen >= sz)
       flushlen0 = sz;
     else
@@ -714,6 +901,51 @@ buf_add(buf_t *buf, const char *string, size_t string_len)
   return (int)buf->datalen;
 }
 
+/** Append a chunk to <b>buf</b> that refers to the <b>data_len</b> bytes at
+ * <b>data</b> without copying them.  The buffer calls
+ * <b>free_fn</b>(<b>arg</b>) once it no longer needs the data, which must
+ * stay valid and unchanged until then.  If we can't add the data, call
+ * <b>free_fn</b> right away.
+ *
+ * Return the new length of the buffer on success, -1 on failure.
+ */
+int
+buf_add_external(buf_t *buf, const char *data, size_t data_len,
+                 buf_external_free_fn_t free_fn, void *arg)
+{
+  chunk_t *chunk;
+  tor_assert(free_fn);
+  check();
+
+  if (!data_len) {
+    free_fn(arg);
+    return (int)buf->datalen;
+  }
+  if (BUG(buf->datalen >= INT_MAX) ||
+      BUG(buf->datalen >= INT_MAX - data_len)) {
+    free_fn(arg);
+    return -1;
+  }
+
+  chunk = chunk_new_with_alloc_size(CHUNK_ALLOC_SIZE(0));
+  chunk->data = (char *)data;
+  chunk->datalen = data_len;
+  chunk->ext_free_fn = free_fn;
+  chunk->ext_arg = arg;
+  chunk->inserted_time = (uint32_t)monotime_coarse_absolute_msec();
+
+  if (buf->tail) {
+    buf->tail->next = chunk;
+    buf->tail = chunk;
+  } else {
+    buf->head = buf->tail = chunk;
+  }
+  buf->datalen += data_len;
+
+  check();
+  return (int)buf->datalen;
+}
+
 /** Helper: copy the first <b>string_len</b> bytes from <b>buf</b>
  * onto <b>string</b>.
  */
@@ -767,7 +999,6 @@ buf_get_bytes(buf_t *buf, char *string, size_t string_len)
 int
 buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 {
-  /* We can do way better here, but this doesn't turn up in any profiles. */
   char b[4096];
   size_t cp, len;
 
@@ -782,6 +1013,29 @@ buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen)
 
   cp = len; /* Remember the number of bytes we intend to copy. */
   tor_assert(cp < INT_MAX);
+
+  /* Chunks that we're moving entirely can change buffers without being
+   * copied.  This matters most for chunks that refer to data they don't own:
+   * they stay references all the way. */
+  while (len && buf_in->head && buf_in->head->datalen <= len) {
+    chunk_t *chunk = buf_in->head;
+    buf_in->head = chunk->next;
+    if (buf_in->tail == chunk)
+      buf_in->tail = NULL;
+    buf_in->datalen -= chunk->datalen;
+    len -= chunk->datalen;
+
+    chunk->next = NULL;
+    chunk->inserted_time = (uint32_t)monotime_coarse_absolute_msec();
+    if (buf_out->tail) {
+      buf_out->tail->next = chunk;
+      buf_out->tail = chunk;
+    } else {
+      buf_out->head = buf_out->tail = chunk;
+    }
+    buf_out->datalen += chunk->datalen;
+  }
+
   while (len) {
     /* This isn't the most efficient implementation one could imagine, since
      * it does two copies instead of 1, but I kinda doubt that this will be
@@ -1055,6 +1309,13 @@ buf_assert_ok(buf_t *buf)
     tor_assert(buf->tail);
     for (ch = buf->head; ch; ch = ch->next) {
       total += ch->datalen;
+      if (ch->ext_free_fn) {
+        tor_assert(ch->memlen == 0);
+        tor_assert(ch->data);
+        if (!ch->next)
+          tor_assert(ch == buf->tail);
+        continue;
+      }
       tor_assert(ch->datalen <= ch->memlen);
       tor_assert(ch->data >= &ch->mem[0]);
       tor_assert(ch->data <= &ch->mem[0]+ch->memlen);
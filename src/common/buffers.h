@@ -19,6 +19,10 @@
 
 typedef struct buf_t buf_t;
 
+/** A function that releases memory that a buffer referred to without
+ * owning it.  See buf_add_external(). */
+typedef void (*buf_external_free_fn_t)(void *arg);
+
 struct tor_compress_state_t;
 
 buf_t *buf_new(void);
@@ -43,6 +47,8 @@ int buf_flush_to_socket(buf_t *buf, tor_socket_t s, size_t sz,
                         size_t *buf_flushlen);
 
 int buf_add(buf_t *buf, const char *string, size_t string_len);
+int buf_add_external(buf_t *buf, const char *data, size_t data_len,
+                     buf_external_free_fn_t free_fn, void *arg);
 int buf_add_compress(buf_t *buf, struct tor_compress_state_t *state,
                           const char *data, size_t data_len, int done);
 int buf_move_to_buf(buf_t *buf_out, buf_t *buf_in, size_t *buf_flushlen);
@@ -81,6 +87,11 @@ typedef struct chunk_t {
   char *data; /**< A pointer to the first byte of data stored in <b>mem</b>. */
   uint32_t inserted_time; /**< Timestamp in truncated ms since epoch
                            * when this chunk was inserted. */
+  /** If this chunk refers to data that it doesn't own, the function to call
+   * with <b>ext_arg</b> when we free the chunk; otherwise NULL.  Such chunks
+   * have no storage of their own, and <b>data</b> points outside them. */
+  buf_external_free_fn_t ext_free_fn;
+  void *ext_arg; /**< Argument for <b>ext_free_fn</b>. */
   char mem[FLEXIBLE_ARRAY_MEMBER]; /**< The actual memory used for storage in
                 * this chunk. */
 } chunk_t;
@@ -108,6 +119,8 @@ chunk_t *buf_add_chunk_with_capacity(buf_t *buf, size_t capacity, int capped);
 static inline size_t
 CHUNK_REMAINING_CAPACITY(const chunk_t *chunk)
 {
+  if (chunk->ext_free_fn)
+    return 0;
   return (chunk->mem + chunk->memlen) - (chunk->data + chunk->datalen);
 }
 
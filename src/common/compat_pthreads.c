@@ -14,6 +14,9 @@
 #include <pthread.h>
 #include <signal.h>
 #include <time.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #include "compat.h"
 #include "torlog.h"
@@ -91,6 +94,38 @@ spawn_exit(void)
   pthread_exit(NULL);
 }
 
+/** Try to restrict the calling thread to a single CPU: the <b>n</b>th
+ * (modulo their number) of the CPUs that it is currently allowed to run
+ * on.  Return 0 on success, and -1 on failure or if we don't know how to
+ * do this on this platform. */
+int
+tor_pin_current_thread(int n)
+{
+#if defined(__linux__) && defined(CPU_COUNT)
+  cpu_set_t allowed, pinned;
+  int cpu, n_allowed;
+
+  if (n < 0 || sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return -1;
+  n_allowed = CPU_COUNT(&allowed);
+  if (n_allowed <= 0)
+    return -1;
+  n %= n_allowed;
+  for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+    if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+      CPU_ZERO(&pinned);
+      CPU_SET(cpu, &pinned);
+      return pthread_setaffinity_np(pthread_self(), sizeof(pinned),
+                                    &pinned) ? -1 : 0;
+    }
+  }
+  return -1;
+#else /* !(defined(__linux__) && defined(CPU_COUNT)) */
+  (void)n;
+  return -1;
+#endif /* defined(__linux__) && defined(CPU_COUNT) */
+}
+
 /** A mutex attribute that we're going to use to tell pthreads that we want
  * "recursive" mutexes (i.e., once we can re-lock if we're already holding
  * them.) */
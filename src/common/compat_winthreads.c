@@ -54,6 +54,33 @@ spawn_exit(void)
   _exit(0);
 }
 
+/** Try to restrict the calling thread to a single CPU: the <b>n</b>th
+ * (modulo their number) of the CPUs that our process is allowed to run
+ * on.  Return 0 on success, and -1 on failure. */
+int
+tor_pin_current_thread(int n)
+{
+  DWORD_PTR process_mask, system_mask, bit;
+  int n_allowed = 0;
+
+  if (n < 0 ||
+      !GetProcessAffinityMask(GetCurrentProcess(), &process_mask,
+                              &system_mask))
+    return -1;
+  for (bit = 1; bit; bit <<= 1) {
+    if (process_mask & bit)
+      ++n_allowed;
+  }
+  if (n_allowed == 0)
+    return -1;
+  n %= n_allowed;
+  for (bit = 1; bit; bit <<= 1) {
+    if ((process_mask & bit) && n-- == 0)
+      return SetThreadAffinityMask(GetCurrentThread(), bit) ? 0 : -1;
+  }
+  return -1;
+}
+
 void
 tor_mutex_init(tor_mutex_t *m)
 {
@@ -86,21 +86,23 @@ guess_compress_size(int compress, compress_method_t method,
 }
 
 /** Internal function to implement tor_compress/tor_uncompress, depending on
- * whether <b>compress</b> is set.  All arguments are as for tor_compress or
- * tor_uncompress. */
+ * whether <b>compress</b> is set.  All arguments are as for
+ * tor_compress_with_dict or tor_uncompress_with_dict. */
 static int
 tor_compress_impl(int compress,
                   char **out, size_t *out_len,
                   const char *in, size_t in_len,
                   compress_method_t method,
                   compression_level_t compression_level,
+                  const char *dict, size_t dict_len,
                   int complete_only,
                   int protocol_warn_level)
 {
   tor_compress_state_t *stream;
   int rv;
 
-  stream = tor_compress_new(compress, method, compression_level);
+  stream = tor_compress_new_with_dict(compress, method, compression_level,
+                                      dict, dict_len);
 
   if (stream == NULL) {
     log_warn(LD_GENERAL, "NULL stream while %scompressing",
@@ -132,7 +134,9 @@ tor_compress_impl(int compress,
           // reinitialize the stream if we are handling multiple concatenated
           // inputs.
           tor_compress_free(stream);
-          stream = tor_compress_new(compress, method, compression_level);
+          stream = tor_compress_new_with_dict(compress, method,
+                                              compression_level,
+                                              dict, dict_len);
           if (stream == NULL) {
             log_warn(LD_GENERAL, "NULL stream while %scompressing",
                      compress?"":"de");
@@ -233,9 +237,36 @@ int
 tor_compress(char **out, size_t *out_len,
              const char *in, size_t in_len,
              compress_method_t method)
+{
+  return tor_compress_at_level(out, out_len, in, in_len, method,
+                               BEST_COMPRESSION);
+}
+
+/** As tor_compress(), but trade off bandwidth against CPU and memory as
+ * described by <b>level</b>. */
+int
+tor_compress_at_level(char **out, size_t *out_len,
+                      const char *in, size_t in_len,
+                      compress_method_t method,
+                      compression_level_t level)
+{
+  return tor_compress_impl(1, out, out_len, in, in_len, method,
+                           level, NULL, 0,
+                           1, LOG_WARN);
+}
+
+/** As tor_compress_at_level(), but for a method that uses a shared
+ * dictionary: start from the <b>dict_len</b>-byte dictionary at
+ * <b>dict</b>. */
+int
+tor_compress_with_dict(char **out, size_t *out_len,
+                       const char *in, size_t in_len,
+                       compress_method_t method,
+                       compression_level_t level,
+                       const char *dict, size_t dict_len)
 {
   return tor_compress_impl(1, out, out_len, in, in_len, method,
-                           BEST_COMPRESSION,
+                           level, dict, dict_len,
                            1, LOG_WARN);
 }
 
@@ -263,7 +294,23 @@ tor_uncompress(char **out, size_t *out_len,
                int protocol_warn_level)
 {
   return tor_compress_impl(0, out, out_len, in, in_len, method,
-                           BEST_COMPRESSION,
+                           BEST_COMPRESSION, NULL, 0,
+                           complete_only, protocol_warn_level);
+}
+
+/** As tor_uncompress(), but for a method that uses a shared dictionary:
+ * <b>dict</b> and <b>dict_len</b> must be the dictionary that the data was
+ * compressed with. */
+int
+tor_uncompress_with_dict(char **out, size_t *out_len,
+                         const char *in, size_t in_len,
+                         compress_method_t method,
+                         const char *dict, size_t dict_len,
+                         int complete_only,
+                         int protocol_warn_level)
+{
+  return tor_compress_impl(0, out, out_len, in, in_len, method,
+                           BEST_COMPRESSION, dict, dict_len,
                            complete_only, protocol_warn_level);
 }
 
@@ -302,6 +349,10 @@ tor_compress_supports_method(compress_method_t method)
       return tor_lzma_method_supported();
     case ZSTD_METHOD:
       return tor_zstd_method_supported();
+    case LZMA_DICT_METHOD:
+      return tor_lzma_method_supported();
+    case ZSTD_DICT_METHOD:
+      return tor_zstd_dict_supported();
     case NO_METHOD:
       return 1;
     case UNKNOWN_METHOD:
@@ -310,6 +361,14 @@ tor_compress_supports_method(compress_method_t method)
   }
 }
 
+/** Return 1 if <b>method</b> can only compress and decompress data given a
+ * dictionary that both ends share; otherwise 0. */
+int
+compression_method_uses_dict(compress_method_t method)
+{
+  return method == LZMA_DICT_METHOD || method == ZSTD_DICT_METHOD;
+}
+
 /**
  * Return a bitmask of the supported compression types, where 1&lt;&lt;m is
  * set in the bitmask if and only if compression with method <b>m</b> is
@@ -342,6 +401,11 @@ static const struct {
   // lower maximum memory usage on the decoding side.
   { "x-tor-lzma", LZMA_METHOD },
   { "x-zstd" , ZSTD_METHOD },
+  // The number is the version of the scheme for choosing the dictionary: a
+  // new scheme needs a new name.  Version 1 dictionaries are the signed
+  // part of the consensus that a consensus diff starts from.
+  { "x-tor-lzma-dict1", LZMA_DICT_METHOD },
+  { "x-zstd-dict1", ZSTD_DICT_METHOD },
   { "identity", NO_METHOD },
 
   /* Later entries in this table are not canonical; these are recognized but
@@ -372,6 +436,8 @@ static const struct {
   { ZLIB_METHOD, "deflated" },
   { LZMA_METHOD, "LZMA compressed" },
   { ZSTD_METHOD, "Zstandard compressed" },
+  { LZMA_DICT_METHOD, "LZMA compressed with a dictionary" },
+  { ZSTD_DICT_METHOD, "Zstandard compressed with a dictionary" },
   { UNKNOWN_METHOD, "unknown encoding" },
 };
 
@@ -412,8 +478,10 @@ tor_compress_version_str(compress_method_t method)
     case ZLIB_METHOD:
       return tor_zlib_get_version_str();
     case LZMA_METHOD:
+    case LZMA_DICT_METHOD:
       return tor_lzma_get_version_str();
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       return tor_zstd_get_version_str();
     case NO_METHOD:
     case UNKNOWN_METHOD:
@@ -433,8 +501,10 @@ tor_compress_header_version_str(compress_method_t method)
     case ZLIB_METHOD:
       return tor_zlib_get_header_version_str();
     case LZMA_METHOD:
+    case LZMA_DICT_METHOD:
       return tor_lzma_get_header_version_str();
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       return tor_zstd_get_header_version_str();
     case NO_METHOD:
     case UNKNOWN_METHOD:
@@ -471,9 +541,38 @@ struct tor_compress_state_t {
 tor_compress_state_t *
 tor_compress_new(int compress, compress_method_t method,
                  compression_level_t compression_level)
+{
+  return tor_compress_new_with_dict(compress, method, compression_level,
+                                    NULL, 0);
+}
+
+/** As tor_compress_new(), but if <b>method</b> uses a shared dictionary,
+ * start from the <b>dict_len</b>-byte dictionary at <b>dict</b>.  Only the
+ * last TOR_COMPRESS_DICT_MAX_LEN bytes of the dictionary count.  The
+ * dictionary needn't outlive this call.
+ *
+ * Return NULL if <b>method</b> needs a dictionary and we have none, or if it
+ * doesn't and we have one. */
+tor_compress_state_t *
+tor_compress_new_with_dict(int compress, compress_method_t method,
+                           compression_level_t compression_level,
+                           const char *dict, size_t dict_len)
 {
   tor_compress_state_t *state;
 
+  if (compression_method_uses_dict(method) != (dict != NULL)) {
+    const char *name = compression_method_get_name(method);
+    log_warn(LD_BUG, "Tried to %scompress with %s %s a dictionary.",
+             compress ? "" : "de",
+             name ? name : "an unknown method",
+             dict ? "and" : "but without");
+    return NULL;
+  }
+  if (dict_len > TOR_COMPRESS_DICT_MAX_LEN) {
+    dict += dict_len - TOR_COMPRESS_DICT_MAX_LEN;
+    dict_len = TOR_COMPRESS_DICT_MAX_LEN;
+  }
+
   state = tor_malloc_zero(sizeof(tor_compress_state_t));
   state->method = method;
 
@@ -489,9 +588,11 @@ tor_compress_new(int compress, compress_method_t method,
       state->u.zlib_state = zlib_state;
       break;
     }
-    case LZMA_METHOD: {
+    case LZMA_METHOD:
+    case LZMA_DICT_METHOD: {
       tor_lzma_compress_state_t *lzma_state =
-        tor_lzma_compress_new(compress, method, compression_level);
+        tor_lzma_compress_new(compress, method, compression_level,
+                              dict, dict_len);
 
       if (lzma_state == NULL)
         goto err;
@@ -499,9 +600,11 @@ tor_compress_new(int compress, compress_method_t method,
       state->u.lzma_state = lzma_state;
       break;
     }
-    case ZSTD_METHOD: {
+    case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD: {
       tor_zstd_compress_state_t *zstd_state =
-        tor_zstd_compress_new(compress, method, compression_level);
+        tor_zstd_compress_new(compress, method, compression_level,
+                              dict, dict_len);
 
       if (zstd_state == NULL)
         goto err;
@@ -562,11 +665,13 @@ tor_compress_process(tor_compress_state_t *state,
                                      finish);
       break;
     case LZMA_METHOD:
+    case LZMA_DICT_METHOD:
       rv = tor_lzma_compress_process(state->u.lzma_state,
                                      out, out_len, in, in_len,
                                      finish);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       rv = tor_zstd_compress_process(state->u.zstd_state,
                                      out, out_len, in, in_len,
                                      finish);
@@ -609,9 +714,11 @@ tor_compress_free(tor_compress_state_t *state)
       tor_zlib_compress_free(state->u.zlib_state);
       break;
     case LZMA_METHOD:
+    case LZMA_DICT_METHOD:
       tor_lzma_compress_free(state->u.lzma_state);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       tor_zstd_compress_free(state->u.zstd_state);
       break;
     case NO_METHOD:
@@ -639,9 +746,11 @@ tor_compress_state_size(const tor_compress_state_t *state)
       size += tor_zlib_compress_state_size(state->u.zlib_state);
       break;
     case LZMA_METHOD:
+    case LZMA_DICT_METHOD:
       size += tor_lzma_compress_state_size(state->u.lzma_state);
       break;
     case ZSTD_METHOD:
+    case ZSTD_DICT_METHOD:
       size += tor_zstd_compress_state_size(state->u.zstd_state);
       break;
     case NO_METHOD:
@@ -11,6 +11,10 @@
 #ifndef TOR_COMPRESS_H
 #define TOR_COMPRESS_H
 
+/** The most bytes of a shared dictionary that a compression method which
+ * uses one will look at: only the last this-many bytes count. */
+#define TOR_COMPRESS_DICT_MAX_LEN (2*1024*1024)
+
 /** Enumeration of what kind of compression to use.  Only ZLIB_METHOD and
  * GZIP_METHOD is guaranteed to be supported by the compress/uncompress
  * functions here. Call tor_compress_supports_method() to check if a given
@@ -21,7 +25,9 @@ typedef enum {
   ZLIB_METHOD=2,
   LZMA_METHOD=3,
   ZSTD_METHOD=4,
-  UNKNOWN_METHOD=5, // This method must be last. Add new ones in the middle.
+  LZMA_DICT_METHOD=5,
+  ZSTD_DICT_METHOD=6,
+  UNKNOWN_METHOD=7, // This method must be last. Add new ones in the middle.
 } compress_method_t;
 
 /**
@@ -36,6 +42,10 @@ typedef enum {
 int tor_compress(char **out, size_t *out_len,
                  const char *in, size_t in_len,
                  compress_method_t method);
+int tor_compress_at_level(char **out, size_t *out_len,
+                          const char *in, size_t in_len,
+                          compress_method_t method,
+                          compression_level_t level);
 
 int tor_uncompress(char **out, size_t *out_len,
                    const char *in, size_t in_len,
@@ -43,12 +53,25 @@ int tor_uncompress(char **out, size_t *out_len,
                    int complete_only,
                    int protocol_warn_level);
 
+int tor_compress_with_dict(char **out, size_t *out_len,
+                           const char *in, size_t in_len,
+                           compress_method_t method,
+                           compression_level_t level,
+                           const char *dict, size_t dict_len);
+int tor_uncompress_with_dict(char **out, size_t *out_len,
+                             const char *in, size_t in_len,
+                             compress_method_t method,
+                             const char *dict, size_t dict_len,
+                             int complete_only,
+                             int protocol_warn_level);
+
 compress_method_t detect_compression_method(const char *in, size_t in_len);
 
 MOCK_DECL(int,tor_compress_is_compression_bomb,(size_t size_in,
                                                 size_t size_out));
 
 int tor_compress_supports_method(compress_method_t method);
+int compression_method_uses_dict(compress_method_t method);
 unsigned tor_compress_get_supported_method_bitmask(void);
 const char *compression_method_get_name(compress_method_t method);
 const char *compression_method_get_human_name(compress_method_t method);
@@ -75,6 +98,11 @@ typedef struct tor_compress_state_t tor_compress_state_t;
 tor_compress_state_t *tor_compress_new(int compress,
                                        compress_method_t method,
                                        compression_level_t level);
+tor_compress_state_t *tor_compress_new_with_dict(int compress,
+                                                 compress_method_t method,
+                                                 compression_level_t level,
+                                                 const char *dict,
+                                                 size_t dict_len);
 
 tor_compress_output_t tor_compress_process(tor_compress_state_t *state,
                                            char **out, size_t *out_len,
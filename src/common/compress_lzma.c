@@ -25,6 +25,10 @@
 /** The maximum amount of memory we allow the LZMA decoder to use, in bytes. */
 #define MEMORY_LIMIT (16 * 1024 * 1024)
 
+/** The dictionary size for raw LZMA2 streams that start from a shared
+ * dictionary.  A raw stream doesn't record it, so both ends must agree. */
+#define DICT_STREAM_WINDOW (4 * 1024 * 1024)
+
 /** Total number of bytes allocated for LZMA state. */
 static atomic_counter_t total_lzma_allocation;
 
@@ -131,14 +135,38 @@ struct tor_lzma_compress_state_t {
 };
 
 #ifdef HAVE_LZMA
+/** Fill in <b>filters</b> and <b>options</b> to describe a raw LZMA2 stream
+ * at <b>level</b> that starts from the <b>dict_len</b>-byte dictionary at
+ * <b>dict</b>. */
+static void
+lzma_dict_filters(lzma_filter filters[2], lzma_options_lzma *options,
+                  compression_level_t level,
+                  const char *dict, size_t dict_len)
+{
+  lzma_lzma_preset(options, memory_level(level));
+  options->dict_size = DICT_STREAM_WINDOW;
+  options->preset_dict = (const uint8_t *)dict;
+  options->preset_dict_size = (uint32_t)MIN(dict_len, DICT_STREAM_WINDOW);
+  filters[0].id = LZMA_FILTER_LZMA2;
+  filters[0].options = options;
+  filters[1].id = LZMA_VLI_UNKNOWN;
+  filters[1].options = NULL;
+}
+
 /** Return an approximate number of bytes stored in memory to hold the LZMA
- * encoder/decoder state. */
+ * encoder/decoder state.  If <b>filters</b> is set, the state is for a raw
+ * stream using those filters. */
 static size_t
-tor_lzma_state_size_precalc(int compress, compression_level_t level)
+tor_lzma_state_size_precalc(int compress, compression_level_t level,
+                            const lzma_filter *filters)
 {
   uint64_t memory_usage;
 
-  if (compress)
+  if (filters && compress)
+    memory_usage = lzma_raw_encoder_memusage(filters);
+  else if (filters)
+    memory_usage = lzma_raw_decoder_memusage(filters);
+  else if (compress)
     memory_usage = lzma_easy_encoder_memusage(memory_level(level));
   else
     memory_usage = lzma_easy_decoder_memusage(memory_level(level));
@@ -167,27 +195,51 @@ tor_lzma_state_size_precalc(int compress, compression_level_t level)
 
 /** Construct and return a tor_lzma_compress_state_t object using
  * <b>method</b>. If <b>compress</b>, it's for compression; otherwise it's for
- * decompression. */
+ * decompression.
+ *
+ * If <b>method</b> is LZMA_DICT_METHOD, the stream is a raw LZMA2 stream
+ * that starts from the <b>dict_len</b>-byte dictionary at <b>dict</b>;
+ * otherwise <b>dict</b> must be NULL. */
 tor_lzma_compress_state_t *
 tor_lzma_compress_new(int compress,
                       compress_method_t method,
-                      compression_level_t level)
+                      compression_level_t level,
+                      const char *dict, size_t dict_len)
 {
-  tor_assert(method == LZMA_METHOD);
+  tor_assert(method == LZMA_METHOD || method == LZMA_DICT_METHOD);
+  tor_assert((method == LZMA_DICT_METHOD) == (dict != NULL));
 
 #ifdef HAVE_LZMA
   tor_lzma_compress_state_t *result;
   lzma_ret retval;
   lzma_options_lzma stream_options;
+  lzma_filter filters[2];
+
+  if (dict)
+    lzma_dict_filters(filters, &stream_options, level, dict, dict_len);
 
   // Note that we do not explicitly initialize the lzma_stream object here,
   // since the LZMA_STREAM_INIT "just" initializes all members to 0, which is
   // also what `tor_malloc_zero()` does.
   result = tor_malloc_zero(sizeof(tor_lzma_compress_state_t));
   result->compress = compress;
-  result->allocation = tor_lzma_state_size_precalc(compress, level);
+  result->allocation = tor_lzma_state_size_precalc(compress, level,
+                                                   dict ? filters : NULL);
 
-  if (compress) {
+  if (dict) {
+    /* liblzma copies the dictionary into its window while setting up. */
+    if (compress)
+      retval = lzma_raw_encoder(&result->stream, filters);
+    else
+      retval = lzma_raw_decoder(&result->stream, filters);
+
+    if (retval != LZMA_OK) {
+      log_warn(LD_GENERAL, "Error from LZMA %s: %s (%u).",
+               compress ? "encoder" : "decoder",
+               lzma_error_str(retval), retval);
+      goto err;
+    }
+  } else if (compress) {
     lzma_lzma_preset(&stream_options, memory_level(level));
 
     retval = lzma_alone_encoder(&result->stream, &stream_options);
@@ -223,6 +275,8 @@ tor_lzma_compress_new(int compress,
   (void)compress;
   (void)method;
   (void)level;
+  (void)dict;
+  (void)dict_len;
 
   return NULL;
 #endif /* defined(HAVE_LZMA) */
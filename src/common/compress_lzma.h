@@ -23,7 +23,8 @@ typedef struct tor_lzma_compress_state_t tor_lzma_compress_state_t;
 tor_lzma_compress_state_t *
 tor_lzma_compress_new(int compress,
                       compress_method_t method,
-                      compression_level_t compression_level);
+                      compression_level_t compression_level,
+                      const char *dict, size_t dict_len);
 
 tor_compress_output_t
 tor_lzma_compress_process(tor_lzma_compress_state_t *state,
@@ -51,6 +51,25 @@ tor_zstd_method_supported(void)
 #endif
 }
 
+#if defined(HAVE_ZSTD) && ZSTD_VERSION_NUMBER >= 10400
+/** Defined if our libzstd headers have a stable API for loading a
+ * dictionary into a streaming context. */
+#define HAVE_ZSTD_STREAM_DICT
+#endif
+
+/** Return 1 if we can compress and decompress Zstandard streams with a
+ * shared dictionary; otherwise 0. */
+int
+tor_zstd_dict_supported(void)
+{
+#ifdef HAVE_ZSTD_STREAM_DICT
+  /* We might be running with an older library than we were built with. */
+  return ZSTD_versionNumber() >= 10400;
+#else
+  return 0;
+#endif
+}
+
 /** Return a string representation of the version of the currently running
  * version of libzstd. Returns NULL if Zstandard is unsupported. */
 const char *
@@ -175,22 +194,35 @@ tor_zstd_state_size_precalc(int compress, int preset)
 
 /** Construct and return a tor_zstd_compress_state_t object using
  * <b>method</b>. If <b>compress</b>, it's for compression; otherwise it's for
- * decompression. */
+ * decompression.
+ *
+ * If <b>method</b> is ZSTD_DICT_METHOD, prime the stream with the
+ * <b>dict_len</b>-byte dictionary at <b>dict</b>; otherwise <b>dict</b> must
+ * be NULL. */
 tor_zstd_compress_state_t *
 tor_zstd_compress_new(int compress,
                       compress_method_t method,
-                      compression_level_t level)
+                      compression_level_t level,
+                      const char *dict, size_t dict_len)
 {
-  tor_assert(method == ZSTD_METHOD);
+  tor_assert(method == ZSTD_METHOD || method == ZSTD_DICT_METHOD);
+  tor_assert((method == ZSTD_DICT_METHOD) == (dict != NULL));
 
 #ifdef HAVE_ZSTD
   const int preset = memory_level(level);
   tor_zstd_compress_state_t *result;
   size_t retval;
 
+  if (dict && !tor_zstd_dict_supported()) {
+    log_warn(LD_GENERAL, "This libzstd can't use a shared dictionary.");
+    return NULL;
+  }
+
   result = tor_malloc_zero(sizeof(tor_zstd_compress_state_t));
   result->compress = compress;
   result->allocation = tor_zstd_state_size_precalc(compress, preset);
+  /* libzstd keeps its own copy of the dictionary. */
+  result->allocation += dict_len;
 
   if (compress) {
     result->u.compress_stream = ZSTD_createCStream();
@@ -212,6 +244,18 @@ tor_zstd_compress_new(int compress,
       goto err;
       // LCOV_EXCL_STOP
     }
+
+#ifdef HAVE_ZSTD_STREAM_DICT
+    if (dict) {
+      retval = ZSTD_CCtx_loadDictionary(result->u.compress_stream,
+                                        dict, dict_len);
+      if (ZSTD_isError(retval)) {
+        log_warn(LD_GENERAL, "Zstandard dictionary error: %s",
+                 ZSTD_getErrorName(retval));
+        goto err;
+      }
+    }
+#endif /* defined(HAVE_ZSTD_STREAM_DICT) */
   } else {
     result->u.decompress_stream = ZSTD_createDStream();
 
@@ -232,6 +276,18 @@ tor_zstd_compress_new(int compress,
       goto err;
       // LCOV_EXCL_STOP
     }
+
+#ifdef HAVE_ZSTD_STREAM_DICT
+    if (dict) {
+      retval = ZSTD_DCtx_loadDictionary(result->u.decompress_stream,
+                                        dict, dict_len);
+      if (ZSTD_isError(retval)) {
+        log_warn(LD_GENERAL, "Zstandard dictionary error: %s",
+                 ZSTD_getErrorName(retval));
+        goto err;
+      }
+    }
+#endif /* defined(HAVE_ZSTD_STREAM_DICT) */
   }
 
   atomic_counter_add(&total_zstd_allocation, result->allocation);
@@ -252,6 +308,8 @@ tor_zstd_compress_new(int compress,
   (void)compress;
   (void)method;
   (void)level;
+  (void)dict;
+  (void)dict_len;
 
   return NULL;
 #endif /* defined(HAVE_ZSTD) */
@@ -12,6 +12,7 @@
 #define TOR_COMPRESS_ZSTD_H
 
 int tor_zstd_method_supported(void);
+int tor_zstd_dict_supported(void);
 
 const char *tor_zstd_get_version_str(void);
 
@@ -23,7 +24,8 @@ typedef struct tor_zstd_compress_state_t tor_zstd_compress_state_t;
 tor_zstd_compress_state_t *
 tor_zstd_compress_new(int compress,
                       compress_method_t method,
-                      compression_level_t compression_level);
+                      compression_level_t compression_level,
+                      const char *dict, size_t dict_len);
 
 tor_compress_output_t
 tor_zstd_compress_process(tor_zstd_compress_state_t *state,
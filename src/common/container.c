@@ -1533,3 +1533,160 @@ digestset_free(digestset_t *set)
   tor_free(set);
 }
 
+/** Return a newly allocated count-min sketch with <b>depth</b> rows of
+ * <b>width</b> counters each, rounding <b>width</b> up to a power of two. */
+cmsketch_t *
+cmsketch_new(int depth, int width)
+{
+  cmsketch_t *sketch = tor_malloc_zero(sizeof(cmsketch_t));
+  uint32_t n_counters = 1;
+
+  tor_assert(depth > 0);
+  tor_assert(width > 0 && width <= (1<<24));
+  while (n_counters < (uint32_t) width)
+    n_counters <<= 1;
+  sketch->depth = depth;
+  sketch->mask = n_counters - 1;
+  sketch->counters = tor_calloc((size_t) depth * n_counters,
+                                sizeof(uint16_t));
+  return sketch;
+}
+
+/** Free all storage held in <b>sketch</b>. */
+void
+cmsketch_free(cmsketch_t *sketch)
+{
+  if (!sketch)
+    return;
+  tor_free(sketch->counters);
+  tor_free(sketch);
+}
+
+/** Return a pointer to the counter for the key with the hash <b>hash</b>
+ * in the <b>row</b>th row of <b>sketch</b>. The rows use independent-enough
+ * indices derived from the two halves of one keyed hash. */
+static inline uint16_t *
+cmsketch_counter(const cmsketch_t *sketch, int row, uint64_t hash)
+{
+  const uint32_t h1 = (uint32_t) hash;
+  const uint32_t h2 = ((uint32_t) (hash >> 32)) | 1;
+  const uint32_t idx = (h1 + (uint32_t) row * h2) & sketch->mask;
+  return &sketch->counters[(size_t) row * (sketch->mask + 1) + idx];
+}
+
+/** Count one more occurrence of the <b>keylen</b>-byte key <b>key</b> in
+ * <b>sketch</b>, and return its new estimated count. Only the counters that
+ * are at the current estimate get incremented ("conservative update"), which
+ * keeps keys that share counters with frequent ones from being inflated. */
+unsigned
+cmsketch_add(cmsketch_t *sketch, const void *key, size_t keylen)
+{
+  const uint64_t hash = siphash24g(key, keylen);
+  unsigned est = UINT16_MAX;
+  int row;
+
+  for (row = 0; row < sketch->depth; ++row) {
+    const uint16_t c = *cmsketch_counter(sketch, row, hash);
+    if (c < est)
+      est = c;
+  }
+  if (est == UINT16_MAX)
+    return est;
+  for (row = 0; row < sketch->depth; ++row) {
+    uint16_t *c = cmsketch_counter(sketch, row, hash);
+    if (*c == est)
+      ++*c;
+  }
+  return est + 1;
+}
+
+/** Return the estimated number of occurrences of the <b>keylen</b>-byte key
+ * <b>key</b> in <b>sketch</b>. This is never less than the true count,
+ * unless the sketch has been decayed since. */
+unsigned
+cmsketch_estimate(const cmsketch_t *sketch, const void *key, size_t keylen)
+{
+  const uint64_t hash = siphash24g(key, keylen);
+  unsigned est = UINT16_MAX;
+  int row;
+
+  for (row = 0; row < sketch->depth; ++row) {
+    const uint16_t c = *cmsketch_counter(sketch, row, hash);
+    if (c < est)
+      est = c;
+  }
+  return est;
+}
+
+/** Halve every counter in <b>sketch</b>, so that old occurrences count for
+ * less than recent ones. */
+void
+cmsketch_decay(cmsketch_t *sketch)
+{
+  const size_t n = (size_t) sketch->depth * (sketch->mask + 1);
+  size_t i;
+  for (i = 0; i < n; ++i)
+    sketch->counters[i] >>= 1;
+}
+
+/** Return a newly allocated, empty HyperLogLog counter. */
+hll_t *
+hll_new(void)
+{
+  return tor_malloc_zero(sizeof(hll_t));
+}
+
+/** Free all storage held in <b>hll</b>. */
+void
+hll_free(hll_t *hll)
+{
+  tor_free(hll);
+}
+
+/** Add a key whose hash is <b>hash</b> to <b>hll</b>. The hash must be a
+ * keyed one, such as siphash24g(), or an adversary can inflate or hide
+ * counts at will. */
+void
+hll_add_hash(hll_t *hll, uint64_t hash)
+{
+  const unsigned idx = (unsigned) (hash >> (64 - HLL_PRECISION));
+  const uint64_t rest = hash & ((UINT64_C(1) << (64 - HLL_PRECISION)) - 1);
+  uint8_t rank;
+
+  if (rest == 0)
+    rank = 64 - HLL_PRECISION + 1;
+  else
+    rank = (uint8_t) (64 - HLL_PRECISION - tor_log2(rest));
+  if (rank > hll->registers[idx])
+    hll->registers[idx] = rank;
+}
+
+/** Return the estimated number of distinct keys added to <b>hll</b>. */
+uint64_t
+hll_estimate(const hll_t *hll)
+{
+  const double m = HLL_N_REGISTERS;
+  const double alpha = 0.7213 / (1.0 + 1.079 / m);
+  double sum = 0.0, estimate;
+  unsigned n_zero = 0, i;
+
+  for (i = 0; i < HLL_N_REGISTERS; ++i) {
+    sum += 1.0 / (double) (UINT64_C(1) << hll->registers[i]);
+    if (hll->registers[i] == 0)
+      ++n_zero;
+  }
+  estimate = alpha * m * m / sum;
+  /* For small counts, linear counting on the empty registers is much more
+   * accurate. With 64-bit hashes, we don't need a large-range correction. */
+  if (estimate <= 2.5 * m && n_zero > 0)
+    estimate = m * tor_mathlog(m / n_zero);
+  return (uint64_t) tor_lround(estimate);
+}
+
+/** Forget every key added to <b>hll</b>. */
+void
+hll_clear(hll_t *hll)
+{
+  memset(hll->registers, 0, sizeof(hll->registers));
+}
+
@@ -681,6 +681,50 @@ digestset_contains(const digestset_t *set, const char *digest)
 digestset_t *digestset_new(int max_elements);
 void digestset_free(digestset_t* set);
 
+/** A count-min sketch: an approximate map from keys to small counts, in a
+ * fixed amount of memory. Estimates are never too low, and are too high by
+ * at most about 2N/width with probability 1 - 2^-depth after N additions. */
+typedef struct cmsketch_t {
+  int depth; /**< Number of rows of counters. */
+  uint32_t mask; /**< One less than the number of counters in each row;
+                  * always one less than a power of two. */
+  uint16_t *counters; /**< <b>depth</b> rows of counters, one after the
+                       * other. Counters saturate at UINT16_MAX. */
+} cmsketch_t;
+
+cmsketch_t *cmsketch_new(int depth, int width);
+void cmsketch_free(cmsketch_t *sketch);
+unsigned cmsketch_add(cmsketch_t *sketch, const void *key, size_t keylen);
+unsigned cmsketch_estimate(const cmsketch_t *sketch,
+                           const void *key, size_t keylen);
+void cmsketch_decay(cmsketch_t *sketch);
+
+/** Number of hash bits used to pick a HyperLogLog register. */
+#define HLL_PRECISION 10
+/** Number of registers in a HyperLogLog counter. */
+#define HLL_N_REGISTERS (1u << HLL_PRECISION)
+
+/** A HyperLogLog counter: estimates the number of distinct keys added to it
+ * with a standard error of about 1.04/sqrt(HLL_N_REGISTERS), or 3%, in a
+ * fixed amount of memory. */
+typedef struct hll_t {
+  /** For each register, the largest number of leading zero bits, plus one,
+   * seen in the hashes of the keys that went to it. */
+  uint8_t registers[HLL_N_REGISTERS];
+} hll_t;
+
+hll_t *hll_new(void);
+void hll_free(hll_t *hll);
+void hll_add_hash(hll_t *hll, uint64_t hash);
+/** Add the <b>keylen</b>-byte key <b>key</b> to <b>hll</b>. */
+static inline void
+hll_add(hll_t *hll, const void *key, size_t keylen)
+{
+  hll_add_hash(hll, siphash24g(key, keylen));
+}
+uint64_t hll_estimate(const hll_t *hll);
+void hll_clear(hll_t *hll);
+
 /* These functions, given an <b>array</b> of <b>n_elements</b>, return the
  * <b>nth</b> lowest element. <b>nth</b>=0 gives the lowest element;
  * <b>n_elements</b>-1 gives the highest; and (<b>n_elements</b>-1) / 2 gives
@@ -16,6 +16,12 @@
  * condition variable.  The workers inform the main process of completed work
  * by using an alert_sockets_t object, as implemented in compat_threads.c.
  *
+ * Both directions are batched when there is a lot of work: the main thread
+ * can queue many items under a single lock with threadpool_queue_work_batch(),
+ * and a worker that still has work to do holds on to its replies and hands
+ * them over several at a time, so that the main thread gets one wakeup per
+ * batch rather than one per item.
+ *
  * The main thread can also queue an "update" that will be handled by all the
  * workers.  This is useful for updating state that all the workers share.
  *
@@ -35,6 +41,11 @@
 #define WORKQUEUE_PRIORITY_LAST WQ_PRI_LOW
 #define WORKQUEUE_N_PRIORITIES (((int) WORKQUEUE_PRIORITY_LAST)+1)
 
+/** Largest number of replies that a worker thread holds on to before
+ * passing them to the reply queue. A worker that runs out of work passes
+ * its replies on right away. */
+#define WORKQUEUE_REPLY_BATCH 16
+
 TOR_TAILQ_HEAD(work_tailq_t, workqueue_entry_s);
 typedef struct work_tailq_t work_tailq_t;
 
@@ -66,6 +77,10 @@ struct threadpool_s {
 
   /** Number of elements in threads. */
   int n_threads;
+  /** Number of threads that have exited. */
+  int n_threads_exited;
+  /** Condition variable that gets signaled whenever a thread exits. */
+  tor_cond_t exit_condition;
   /** Mutex to protect all the above fields. */
   tor_mutex_t lock;
 
@@ -76,6 +91,9 @@ struct threadpool_s {
   void *(*new_thread_state_fn)(void*);
   void (*free_thread_state_fn)(void*);
   void *new_thread_state_arg;
+
+  /** Flags passed to threadpool_new(). */
+  unsigned flags;
 };
 
 /** Used to put a workqueue_priority_t value into a bitfield. */
@@ -130,7 +148,9 @@ typedef struct workerthread_s {
   int32_t lower_priority_chance;
 } workerthread_t;
 
-static void queue_reply(replyqueue_t *queue, workqueue_entry_t *work);
+static void queue_replies(replyqueue_t *queue, work_tailq_t *replies);
+static void worker_thread_exit(workerthread_t *thread,
+                               work_tailq_t *replies);
 
 /** Allocate and return a new workqueue_entry_t, set up to run the function
  * <b>fn</b> in the worker thread, and <b>reply_fn</b> in the main
@@ -253,8 +273,19 @@ worker_thread_main(void *thread_)
   threadpool_t *pool = thread->in_pool;
   workqueue_entry_t *work;
   workqueue_reply_t result;
+  /* Replies that we haven't yet passed to the reply queue. */
+  work_tailq_t replies;
+  int n_replies = 0;
+
+  TOR_TAILQ_INIT(&replies);
 
   tor_mutex_acquire(&pool->lock);
+  /* threadpool_start_threads() holds the lock until our index is set. */
+  if ((pool->flags & THREADPOOL_PIN_THREADS) &&
+      tor_pin_current_thread(thread->index) < 0) {
+    log_info(LD_GENERAL, "Couldn't pin worker thread %d to a CPU.",
+             thread->index);
+  }
   while (1) {
     /* lock must be held at this point. */
     while (worker_thread_has_work(thread)) {
@@ -267,9 +298,16 @@ worker_thread_main(void *thread_)
         thread->generation = thread->in_pool->generation;
         tor_mutex_release(&pool->lock);
 
+        /* Don't make finished work wait behind the update. */
+        if (n_replies) {
+          queue_replies(thread->reply_queue, &replies);
+          n_replies = 0;
+        }
+
         workqueue_reply_t r = update_fn(thread->state, arg);
 
         if (r != WQ_RPL_REPLY) {
+          worker_thread_exit(thread, &replies);
           return;
         }
 
@@ -285,18 +323,40 @@ worker_thread_main(void *thread_)
        * is the main thread's first opportunity to give us more work. */
       result = work->fn(thread->state, work->arg);
 
-      /* Queue the reply for the main thread. */
-      queue_reply(thread->reply_queue, work);
+      /* Hold on to the reply for the main thread. */
+      TOR_TAILQ_INSERT_TAIL(&replies, work, next_work);
+      ++n_replies;
 
       /* We may need to exit the thread. */
       if (result != WQ_RPL_REPLY) {
+        worker_thread_exit(thread, &replies);
         return;
       }
       tor_mutex_acquire(&pool->lock);
+
+      /* Pass our replies on once we have a batch of them, or once we have
+       * nothing else to do, so that no reply waits behind idle time. */
+      if (n_replies >= WORKQUEUE_REPLY_BATCH ||
+          !worker_thread_has_work(thread)) {
+        tor_mutex_release(&pool->lock);
+        queue_replies(thread->reply_queue, &replies);
+        n_replies = 0;
+        tor_mutex_acquire(&pool->lock);
+      }
     }
     /* At this point the lock is held, and there is no work in this thread's
      * queue. */
 
+    /* Never go to sleep holding replies.  Since we have to drop the lock to
+     * pass them on, look for new work again afterwards. */
+    if (n_replies) {
+      tor_mutex_release(&pool->lock);
+      queue_replies(thread->reply_queue, &replies);
+      n_replies = 0;
+      tor_mutex_acquire(&pool->lock);
+      continue;
+    }
+
     /* TODO: support an idle-function */
 
     /* Okay. Now, wait till somebody has work for us. */
@@ -306,15 +366,18 @@ worker_thread_main(void *thread_)
   }
 }
 
-/** Put a reply on the reply queue.  The reply must not currently be on
- * any thread's work queue. */
+/** Move all the replies in <b>replies</b> to the end of the reply queue,
+ * leaving <b>replies</b> empty.  The replies must not currently be on any
+ * thread's work queue. */
 static void
-queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
+queue_replies(replyqueue_t *queue, work_tailq_t *replies)
 {
   int was_empty;
+  if (TOR_TAILQ_EMPTY(replies))
+    return;
   tor_mutex_acquire(&queue->lock);
   was_empty = TOR_TAILQ_EMPTY(&queue->answers);
-  TOR_TAILQ_INSERT_TAIL(&queue->answers, work, next_work);
+  TOR_TAILQ_CONCAT(&queue->answers, replies, next_work);
   tor_mutex_release(&queue->lock);
 
   if (was_empty) {
@@ -324,6 +387,22 @@ queue_reply(replyqueue_t *queue, workqueue_entry_t *work)
   }
 }
 
+/** Pass on the <b>replies</b> that <b>thread</b> still holds, and tell its
+ * pool that it is exiting.  The thread must not touch the pool or its reply
+ * queue after this. */
+static void
+worker_thread_exit(workerthread_t *thread, work_tailq_t *replies)
+{
+  threadpool_t *pool = thread->in_pool;
+
+  queue_replies(thread->reply_queue, replies);
+
+  tor_mutex_acquire(&pool->lock);
+  ++pool->n_threads_exited;
+  tor_cond_signal_all(&pool->exit_condition);
+  tor_mutex_release(&pool->lock);
+}
+
 /** Allocate and start a new worker thread to use state object <b>state</b>,
  * and send responses to <b>replyqueue</b>. */
 static workerthread_t *
@@ -396,6 +475,57 @@ threadpool_queue_work_priority(threadpool_t *pool,
   return ent;
 }
 
+/**
+ * Queue <b>n</b> items of work for a thread in a thread pool, one for each
+ * element of <b>args</b>, as if by calling threadpool_queue_work_priority()
+ * on each of them.  Unlike calling threadpool_queue_work_priority()
+ * <b>n</b> times, this takes the pool's lock only once.  Store the
+ * workqueue_entry_t objects for the work in <b>entries_out</b>, which must
+ * have room for <b>n</b> of them.
+ *
+ * Return 0 on success, -1 on failure.  (Failure is not currently possible,
+ * but callers should check anyway.)
+ */
+int
+threadpool_queue_work_batch(threadpool_t *pool,
+                            workqueue_priority_t prio,
+                            workqueue_reply_t (*fn)(void *, void *),
+                            void (*reply_fn)(void *),
+                            void **args, int n,
+                            workqueue_entry_t **entries_out)
+{
+  int i;
+  tor_assert(((int)prio) >= WORKQUEUE_PRIORITY_FIRST &&
+             ((int)prio) <= WORKQUEUE_PRIORITY_LAST);
+
+  if (n <= 0)
+    return 0;
+
+  for (i = 0; i < n; ++i) {
+    workqueue_entry_t *ent = workqueue_entry_new(fn, reply_fn, args[i]);
+    ent->on_pool = pool;
+    ent->pending = 1;
+    ent->priority = prio;
+    entries_out[i] = ent;
+  }
+
+  tor_mutex_acquire(&pool->lock);
+
+  for (i = 0; i < n; ++i)
+    TOR_TAILQ_INSERT_TAIL(&pool->work[prio], entries_out[i], next_work);
+
+  if (n >= pool->n_threads) {
+    tor_cond_signal_all(&pool->condition);
+  } else {
+    for (i = 0; i < n; ++i)
+      tor_cond_signal_one(&pool->condition);
+  }
+
+  tor_mutex_release(&pool->lock);
+
+  return 0;
+}
+
 /** As threadpool_queue_work_priority(), but assumes WQ_PRI_HIGH */
 workqueue_entry_t *
 threadpool_queue_work(threadpool_t *pool,
@@ -524,18 +654,23 @@ threadpool_start_threads(threadpool_t *pool, int n)
  * constructed with the <b>new_thread_state_fn</b> call, receiving <b>arg</b>
  * as its argument.  When the threads close, they will call
  * <b>free_thread_state_fn</b> on their states.
+ *
+ * If <b>flags</b> includes THREADPOOL_PIN_THREADS, each thread tries to
+ * restrict itself to a different CPU, for as long as there are CPUs left.
  */
 threadpool_t *
 threadpool_new(int n_threads,
                replyqueue_t *replyqueue,
                void *(*new_thread_state_fn)(void*),
                void (*free_thread_state_fn)(void*),
-               void *arg)
+               void *arg,
+               unsigned flags)
 {
   threadpool_t *pool;
   pool = tor_malloc_zero(sizeof(threadpool_t));
   tor_mutex_init_nonrecursive(&pool->lock);
   tor_cond_init(&pool->condition);
+  tor_cond_init(&pool->exit_condition);
   unsigned i;
   for (i = WORKQUEUE_PRIORITY_FIRST; i <= WORKQUEUE_PRIORITY_LAST; ++i) {
     TOR_TAILQ_INIT(&pool->work[i]);
@@ -550,10 +685,12 @@ threadpool_new(int n_threads,
   pool->new_thread_state_arg = arg;
   pool->free_thread_state_fn = free_thread_state_fn;
   pool->reply_queue = replyqueue;
+  pool->flags = flags;
 
   if (threadpool_start_threads(pool, n_threads) < 0) {
     //LCOV_EXCL_START
     tor_assert_nonfatal_unreached();
+    tor_cond_uninit(&pool->exit_condition);
     tor_cond_uninit(&pool->condition);
     tor_mutex_uninit(&pool->lock);
     tor_free(pool);
@@ -564,6 +701,60 @@ threadpool_new(int n_threads,
   return pool;
 }
 
+/**
+ * Wait for every thread in <b>pool</b> to exit, then release all storage
+ * held by <b>pool</b>.  Only call this once you have queued an update, with
+ * threadpool_queue_update(), whose function returns WQ_RPL_SHUTDOWN;
+ * otherwise, this function never returns.
+ *
+ * Work that no thread has taken is dropped without its reply function being
+ * run; freeing its argument is the caller's responsibility.  The thread
+ * states and the pool's reply queue are not freed.
+ */
+void
+threadpool_free(threadpool_t *pool)
+{
+  int i;
+  unsigned prio;
+
+  if (!pool)
+    return;
+
+  tor_mutex_acquire(&pool->lock);
+  while (pool->n_threads_exited < pool->n_threads) {
+    if (tor_cond_wait(&pool->exit_condition, &pool->lock, NULL) < 0) {
+      log_warn(LD_GENERAL, "Fail tor_cond_wait.");
+    }
+  }
+  tor_mutex_release(&pool->lock);
+
+  for (i = 0; i < pool->n_threads; ++i)
+    tor_free(pool->threads[i]);
+  tor_free(pool->threads);
+
+  for (prio = WORKQUEUE_PRIORITY_FIRST; prio <= WORKQUEUE_PRIORITY_LAST;
+       ++prio) {
+    while (!TOR_TAILQ_EMPTY(&pool->work[prio])) {
+      workqueue_entry_t *work = TOR_TAILQ_FIRST(&pool->work[prio]);
+      TOR_TAILQ_REMOVE(&pool->work[prio], work, next_work);
+      workqueue_entry_free(work);
+    }
+  }
+
+  if (pool->update_args) {
+    for (i = 0; i < pool->n_threads; ++i) {
+      if (pool->update_args[i] && pool->free_update_arg_fn)
+        pool->free_update_arg_fn(pool->update_args[i]);
+    }
+    tor_free(pool->update_args);
+  }
+
+  tor_cond_uninit(&pool->exit_condition);
+  tor_cond_uninit(&pool->condition);
+  tor_mutex_uninit(&pool->lock);
+  tor_free(pool);
+}
+
 /** Return the reply queue associated with a given thread pool. */
 replyqueue_t *
 threadpool_get_replyqueue(threadpool_t *tp)
@@ -594,6 +785,27 @@ replyqueue_new(uint32_t alertsocks_flags)
   return rq;
 }
 
+/**
+ * Release all storage held by the reply queue <b>queue</b>.  No thread pool
+ * may still be sending it replies.  Replies that haven't been processed are
+ * dropped without their reply functions being run.
+ */
+void
+replyqueue_free(replyqueue_t *queue)
+{
+  if (!queue)
+    return;
+
+  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
+    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
+    workqueue_entry_free(work);
+  }
+  alert_sockets_close(&queue->alert);
+  tor_mutex_uninit(&queue->lock);
+  tor_free(queue);
+}
+
 /**
  * Return the "read socket" for a given reply queue.  The main thread should
  * listen for read events on this socket, and call replyqueue_process() every
@@ -613,6 +825,7 @@ replyqueue_get_socket(replyqueue_t *rq)
 void
 replyqueue_process(replyqueue_t *queue)
 {
+  work_tailq_t answers;
   int r = queue->alert.drain_fn(queue->alert.read_fd);
   if (r < 0) {
     //LCOV_EXCL_START
@@ -623,20 +836,21 @@ replyqueue_process(replyqueue_t *queue)
     //LCOV_EXCL_STOP
   }
 
+  /* Take all the answers at once, so that the workers can keep adding to
+   * the queue while we handle them. Anything they add after this will have
+   * woken us up again. */
+  TOR_TAILQ_INIT(&answers);
   tor_mutex_acquire(&queue->lock);
-  while (!TOR_TAILQ_EMPTY(&queue->answers)) {
-    /* lock must be held at this point.*/
-    workqueue_entry_t *work = TOR_TAILQ_FIRST(&queue->answers);
-    TOR_TAILQ_REMOVE(&queue->answers, work, next_work);
-    tor_mutex_release(&queue->lock);
+  TOR_TAILQ_CONCAT(&answers, &queue->answers, next_work);
+  tor_mutex_release(&queue->lock);
+
+  while (!TOR_TAILQ_EMPTY(&answers)) {
+    workqueue_entry_t *work = TOR_TAILQ_FIRST(&answers);
+    TOR_TAILQ_REMOVE(&answers, work, next_work);
     work->on_pool = NULL;
 
     work->reply_fn(work->arg);
     workqueue_entry_free(work);
-
-    tor_mutex_acquire(&queue->lock);
   }
-
-  tor_mutex_release(&queue->lock);
 }
 
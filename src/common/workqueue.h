@@ -36,6 +36,13 @@ workqueue_entry_t *threadpool_queue_work_priority(threadpool_t *pool,
                                     void (*reply_fn)(void *),
                                     void *arg);
 
+int threadpool_queue_work_batch(threadpool_t *pool,
+                                workqueue_priority_t prio,
+                                workqueue_reply_t (*fn)(void *, void *),
+                                void (*reply_fn)(void *),
+                                void **args, int n,
+                                workqueue_entry_t **entries_out);
+
 workqueue_entry_t *threadpool_queue_work(threadpool_t *pool,
                                          workqueue_reply_t (*fn)(void *,
                                                                  void *),
@@ -48,14 +55,21 @@ int threadpool_queue_update(threadpool_t *pool,
                             void (*free_fn)(void *),
                             void *arg);
 void *workqueue_entry_cancel(workqueue_entry_t *pending_work);
+
+/** Flag for threadpool_new(): pin each worker thread to its own CPU. */
+#define THREADPOOL_PIN_THREADS (1u<<0)
+
 threadpool_t *threadpool_new(int n_threads,
                              replyqueue_t *replyqueue,
                              void *(*new_thread_state_fn)(void*),
                              void (*free_thread_state_fn)(void*),
-                             void *arg);
+                             void *arg,
+                             unsigned flags);
+void threadpool_free(threadpool_t *pool);
 replyqueue_t *threadpool_get_replyqueue(threadpool_t *tp);
 
 replyqueue_t *replyqueue_new(uint32_t alertsocks_flags);
+void replyqueue_free(replyqueue_t *queue);
 tor_socket_t replyqueue_get_socket(replyqueue_t *rq);
 void replyqueue_process(replyqueue_t *queue);
 
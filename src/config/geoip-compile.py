@@ -0,0 +1,94 @@
+#!/usr/bin/python3
+
+#   This software has been dedicated to the public domain under the CC0
+#   public domain dedication.
+#
+#   To the extent possible under law, the person who associated CC0
+#   with geoip-compile.py has waived all copyright and related or
+#   neighboring rights to geoip-compile.py.
+#
+#   You should have received a copy of the CC0 legalcode along with this
+#   work in doc/cc0.txt.  If not, see
+#      <http://creativecommons.org/publicdomain/zero/1.0/>.
+
+"""Compile a geoip or geoip6 file, as written by mmdb-convert.py, into the
+   precompiled format that Tor can memory-map instead of parsing.
+
+   Usage: geoip-compile.py geoip geoip.db
+          geoip-compile.py geoip6 geoip6.db
+
+   Then point GeoIPFile or GeoIPv6File at the output.  The format is
+   documented next to GEOIP_DB_HEADER_LEN in src/or/geoip.c.
+"""
+
+import hashlib
+import socket
+import struct
+import sys
+
+MAGIC = b"TORGEOIP"
+VERSION = 1
+
+def parse_line(line):
+    """Return (family, low, high, cc) for a line of a geoip file, or None
+       if it is blank or a comment.  Addresses are big-endian bytes."""
+    line = line.strip()
+    if not line or line.startswith("#"):
+        return None
+    fields = [f.strip('"') for f in line.split(",")]
+    if ":" in fields[0]:
+        return (6, socket.inet_pton(socket.AF_INET6, fields[0]),
+                socket.inet_pton(socket.AF_INET6, fields[1]), fields[2])
+    return (4, struct.pack("!I", int(fields[0])),
+            struct.pack("!I", int(fields[1])), fields[2])
+
+def compile_geoip(text):
+    """Return the precompiled database for the contents of a geoip file."""
+    family = None
+    entries = []
+    for line in text.decode("ascii").splitlines():
+        parsed = parse_line(line)
+        if parsed is None:
+            continue
+        fam, low, high, cc = parsed
+        if family is None:
+            family = fam
+        elif fam != family:
+            raise ValueError("Mixed IPv4 and IPv6 entries")
+        if len(cc) != 2:
+            raise ValueError("Bad country code %r" % cc)
+        entries.append((low, high, cc.lower()))
+    if family is None:
+        raise ValueError("No entries")
+    entries.sort()
+    for (a, b) in zip(entries, entries[1:]):
+        if a[1] >= b[0]:
+            raise ValueError("Overlapping ranges")
+
+    countries = sorted(set(e[2] for e in entries))
+    country_idx = dict((cc, i) for (i, cc) in enumerate(countries))
+
+    out = [MAGIC,
+           struct.pack("!BBHI", VERSION, family, len(countries),
+                       len(entries)),
+           hashlib.sha1(text).digest(),
+           b"\0" * 4]
+    table = "".join(countries).encode("ascii")
+    out.append(table + b"\0" * (-len(table) % 8))
+    out.extend(e[0] for e in entries)
+    out.extend(e[1] for e in entries)
+    out.extend(struct.pack("!H", country_idx[e[2]]) for e in entries)
+    return b"".join(out)
+
+def main(argv):
+    if len(argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+    with open(argv[1], "rb") as f:
+        text = f.read()
+    with open(argv[2], "wb") as f:
+        f.write(compile_geoip(text))
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
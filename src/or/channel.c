@@ -56,6 +56,7 @@
 #include "config.h"
 #include "connection_or.h" /* For var_cell_free() */
 #include "circuitmux.h"
+#include "dos.h"
 #include "entrynodes.h"
 #include "geoip.h"
 #include "nodelist.h"
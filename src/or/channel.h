@@ -23,6 +23,10 @@ struct cell_queue_entry_s;
 TOR_SIMPLEQ_HEAD(chan_cell_queue, cell_queue_entry_s);
 typedef struct chan_cell_queue chan_cell_queue_t;
 
+/** Number of slots in the per-channel circuit ID cache. Must be a power of
+ * two. */
+#define CHANNEL_CIRCID_CACHE_SIZE 32
+
 /**
  * This enum is used by channelpadding to decide when to pad channels.
  * Don't add values to it without updating the checks in
@@ -157,6 +161,19 @@ struct channel_s {
   /** Heap index for use by the scheduler */
   int sched_heap_idx;
 
+  /** Direct-mapped cache from circuit ID to circuit for the circuits on this
+   * channel, consulted before the global channel/circuit ID map in
+   * circuitlist.c. Only circuitlist.c may touch it. A slot is empty if its
+   * circ is NULL. */
+  struct {
+    circid_t circ_id;
+    struct circuit_t *circ;
+  } circid_cache[CHANNEL_CIRCID_CACHE_SIZE];
+
+  /** Per-socket information kept by the KIST scheduler for this channel, or
+   * NULL if KIST isn't tracking it. Owned by scheduler_kist.c. */
+  struct socket_table_ent_s *kist_sock_info;
+
   /** Timestamps for both cell channels and listeners */
   time_t timestamp_created; /* Channel created */
   time_t timestamp_active; /* Any activity */
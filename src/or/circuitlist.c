@@ -156,11 +156,36 @@ HT_GENERATE2(chan_circid_map, chan_circid_circuit_map_t, node,
              chan_circid_entry_hash_, chan_circid_entries_eq_, 0.6,
              tor_reallocarray_, tor_free_)
 
-/** The most recently returned entry from circuit_get_by_circid_chan;
- * used to improve performance when many cells arrive in a row from the
- * same circuit.
- */
-static chan_circid_circuit_map_t *_last_circid_chan_ent = NULL;
+/** Return the slot of <b>chan</b>'s circuit ID cache that <b>circ_id</b>
+ * maps to. Circuit IDs are mostly random, but fold the high bits in anyway
+ * so that sequential and random IDs both spread over the cache. */
+static inline unsigned
+chan_circid_cache_idx(circid_t circ_id)
+{
+  return (unsigned) ((circ_id ^ (circ_id >> 16)) &
+                     (CHANNEL_CIRCID_CACHE_SIZE - 1));
+}
+
+/** Forget anything <b>chan</b>'s circuit ID cache knows about
+ * <b>circ_id</b>. Must be called whenever the map entry for
+ * [<b>chan</b>,<b>circ_id</b>] changes or goes away. */
+static inline void
+chan_circid_cache_forget(channel_t *chan, circid_t circ_id)
+{
+  unsigned idx = chan_circid_cache_idx(circ_id);
+  if (chan->circid_cache[idx].circ_id == circ_id)
+    chan->circid_cache[idx].circ = NULL;
+}
+
+/** Remember in <b>chan</b>'s circuit ID cache that <b>circ_id</b> is
+ * <b>circ</b>. */
+static inline void
+chan_circid_cache_set(channel_t *chan, circid_t circ_id, circuit_t *circ)
+{
+  unsigned idx = chan_circid_cache_idx(circ_id);
+  chan->circid_cache[idx].circ_id = circ_id;
+  chan->circid_cache[idx].circ = circ;
+}
 
 /** Implementation helper for circuit_set_{p,n}_circid_channel: A circuit ID
  * and/or channel for circ has just changed from <b>old_chan, old_id</b>
@@ -193,14 +218,6 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
   if (id == old_id && chan == old_chan)
     return;
 
-  if (_last_circid_chan_ent &&
-      ((old_id == _last_circid_chan_ent->circ_id &&
-        old_chan == _last_circid_chan_ent->chan) ||
-       (id == _last_circid_chan_ent->circ_id &&
-        chan == _last_circid_chan_ent->chan))) {
-    _last_circid_chan_ent = NULL;
-  }
-
   if (old_chan) {
     /*
      * If we're changing channels or ID and had an old channel and a non
@@ -219,6 +236,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     search.chan = old_chan;
     found = HT_REMOVE(chan_circid_map, &chan_circid_map, &search);
     if (found) {
+      chan_circid_cache_forget(old_chan, old_id);
       tor_free(found);
       if (direction == CELL_DIRECTION_OUT) {
         /* One fewer circuits use old_chan as n_chan */
@@ -252,6 +270,7 @@ circuit_set_circid_chan_helper(circuit_t *circ, int direction,
     found->circuit = circ;
     HT_INSERT(chan_circid_map, &chan_circid_map, found);
   }
+  chan_circid_cache_set(chan, id, circ);
 
   /*
    * Attach to the circuitmux if we're changing channels or IDs and
@@ -297,6 +316,7 @@ channel_mark_circid_unusable(channel_t *chan, circid_t id)
   search.chan = chan;
   search.circ_id = id;
   ent = HT_FIND(chan_circid_map, &chan_circid_map, &search);
+  chan_circid_cache_forget(chan, id);
 
   if (ent && ent->circuit) {
     /* we have a problem. */
@@ -335,8 +355,6 @@ channel_mark_circid_usable(channel_t *chan, circid_t id)
              "a circuit there.", (unsigned)id, chan);
     return;
   }
-  if (_last_circid_chan_ent == ent)
-    _last_circid_chan_ent = NULL;
   tor_free(ent);
 }
 
@@ -1287,17 +1305,25 @@ circuit_get_by_circid_channel_impl(circid_t circ_id, channel_t *chan,
   chan_circid_circuit_map_t search;
   chan_circid_circuit_map_t *found;
 
-  if (_last_circid_chan_ent &&
-      circ_id == _last_circid_chan_ent->circ_id &&
-      chan == _last_circid_chan_ent->chan) {
-    found = _last_circid_chan_ent;
-  } else {
-    search.circ_id = circ_id;
-    search.chan = chan;
-    found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
-    _last_circid_chan_ent = found;
+  /* Most cells are for a circuit we've seen recently on this channel: try
+   * the channel's own cache before hashing into the global map. Only
+   * circuits are cached, never placeholders. */
+  if (chan) {
+    unsigned idx = chan_circid_cache_idx(circ_id);
+    if (chan->circid_cache[idx].circ &&
+        chan->circid_cache[idx].circ_id == circ_id) {
+      if (found_entry_out)
+        *found_entry_out = 1;
+      return chan->circid_cache[idx].circ;
+    }
   }
+
+  search.circ_id = circ_id;
+  search.chan = chan;
+  found = HT_FIND(chan_circid_map, &chan_circid_map, &search);
   if (found && found->circuit) {
+    if (chan)
+      chan_circid_cache_set(chan, circ_id, found->circuit);
     log_debug(LD_CIRC,
               "circuit_get_by_circid_channel_impl() returning circuit %p for"
               " circ_id %u, channel ID " U64_FORMAT " (%p)",
@@ -2353,6 +2379,54 @@ circuits_compare_by_oldest_queued_item_(const void **a_, const void **b_)
     return -1;
 }
 
+/** Number of age buckets circuits_handle_oom() spreads the circuits over.
+ * Only the circuits in the buckets we actually kill from ever get sorted. */
+#define OOM_N_AGE_BUCKETS 256
+
+/** Set the age_tmp of every circuit in <b>circlist</b> to the age of its
+ * oldest queued item as of <b>now_ms</b>, and spread the circuits over
+ * OOM_N_AGE_BUCKETS buckets of equal age width, oldest bucket last. On
+ * return, <b>by_age</b> (which must have room for every circuit) holds the
+ * circuits of bucket i at indices bucket_start[i] up to (not including)
+ * bucket_start[i+1]; <b>bucket_start</b> must have room for
+ * OOM_N_AGE_BUCKETS+1 entries.
+ *
+ * This is a single counting sort pass, so it's linear in the number of
+ * circuits, which matters since we do it at the worst time: when we're out
+ * of memory, perhaps because someone is opening a lot of circuits. */
+STATIC void
+circuits_bucket_by_oldest_queued_item(smartlist_t *circlist, uint32_t now_ms,
+                                      circuit_t **by_age, int *bucket_start)
+{
+  uint32_t max_age = 0;
+  int b;
+
+  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+    circ->age_tmp = circuit_max_queued_item_age(circ, now_ms);
+    if (circ->age_tmp > max_age)
+      max_age = circ->age_tmp;
+  } SMARTLIST_FOREACH_END(circ);
+
+#define AGE_BUCKET(age) \
+  (max_age ? (int)(((uint64_t)(age) * (OOM_N_AGE_BUCKETS - 1)) / max_age) : 0)
+
+  memset(bucket_start, 0, sizeof(int) * (OOM_N_AGE_BUCKETS + 1));
+  SMARTLIST_FOREACH(circlist, circuit_t *, circ,
+                    ++bucket_start[AGE_BUCKET(circ->age_tmp) + 1]);
+  for (b = 0; b < OOM_N_AGE_BUCKETS; ++b)
+    bucket_start[b + 1] += bucket_start[b];
+  /* Use the start of each bucket as its fill pointer; afterwards each one
+   * points at the start of the next bucket, so shift them back by one. */
+  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
+    by_age[bucket_start[AGE_BUCKET(circ->age_tmp)]++] = circ;
+  } SMARTLIST_FOREACH_END(circ);
+  for (b = OOM_N_AGE_BUCKETS - 1; b > 0; --b)
+    bucket_start[b] = bucket_start[b - 1];
+  bucket_start[0] = 0;
+
+#undef AGE_BUCKET
+}
+
 static uint32_t now_ms_for_buf_cmp;
 
 /** Helper to sort a list of circuit_t by age of oldest item, in descending
@@ -2383,7 +2457,10 @@ circuits_handle_oom(size_t current_allocation)
 {
   smartlist_t *circlist;
   smartlist_t *connection_array = get_connection_array();
-  int conn_idx;
+  smartlist_t *bucket;
+  circuit_t **by_age;
+  int *bucket_start;
+  int conn_idx, b, i;
   size_t mem_to_recover;
   size_t mem_recovered=0;
   int n_circuits_killed=0;
@@ -2403,19 +2480,14 @@ circuits_handle_oom(size_t current_allocation)
 
   now_ms = (uint32_t)monotime_coarse_absolute_msec();
 
+  /* Bucket the circuits by age in linear time. We sort each bucket only
+   * when we get to it, and we usually stop after the oldest few. */
   circlist = circuit_get_global_list();
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->age_tmp = circuit_max_queued_item_age(circ, now_ms);
-  } SMARTLIST_FOREACH_END(circ);
-
-  /* This is O(n log n); there are faster algorithms we could use instead.
-   * Let's hope this doesn't happen enough to be in the critical path. */
-  smartlist_sort(circlist, circuits_compare_by_oldest_queued_item_);
-
-  /* Fix up the indices before we run into trouble */
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    circ->global_circuitlist_idx = circ_sl_idx;
-  } SMARTLIST_FOREACH_END(circ);
+  by_age = tor_calloc(smartlist_len(circlist) + 1, sizeof(circuit_t *));
+  bucket_start = tor_calloc(OOM_N_AGE_BUCKETS + 1, sizeof(int));
+  circuits_bucket_by_oldest_queued_item(circlist, now_ms, by_age,
+                                        bucket_start);
+  bucket = smartlist_new();
 
   /* Now sort the connection array ... */
   now_ms_for_buf_cmp = now_ms;
@@ -2427,53 +2499,62 @@ circuits_handle_oom(size_t current_allocation)
     conn->conn_array_index = conn_sl_idx;
   } SMARTLIST_FOREACH_END(conn);
 
-  /* Okay, now the worst circuits and connections are at the front of their
-   * respective lists. Let's mark them, and reclaim their storage
-   * aggressively. */
+  /* Okay, now the worst circuits are in the last bucket and the worst
+   * connections are at the front of their list. Let's mark them, and reclaim
+   * their storage aggressively. */
   conn_idx = 0;
-  SMARTLIST_FOREACH_BEGIN(circlist, circuit_t *, circ) {
-    size_t n;
-    size_t freed;
-
-    /* Free storage in any non-linked directory connections that have buffered
-     * data older than this circuit. */
-    while (conn_idx < smartlist_len(connection_array)) {
-      connection_t *conn = smartlist_get(connection_array, conn_idx);
-      uint32_t conn_age = conn_get_buffer_age(conn, now_ms);
-      if (conn_age < circ->age_tmp) {
-        break;
-      }
-      if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
-        if (!conn->marked_for_close)
-          connection_mark_for_close(conn);
-        mem_recovered += single_conn_free_bytes(conn);
+  for (b = OOM_N_AGE_BUCKETS - 1; b >= 0; --b) {
+    smartlist_clear(bucket);
+    for (i = bucket_start[b]; i < bucket_start[b + 1]; ++i)
+      smartlist_add(bucket, by_age[i]);
+    smartlist_sort(bucket, circuits_compare_by_oldest_queued_item_);
+    SMARTLIST_FOREACH_BEGIN(bucket, circuit_t *, circ) {
+      size_t n;
+      size_t freed;
+
+      /* Free storage in any non-linked directory connections that have
+       * buffered data older than this circuit. */
+      while (conn_idx < smartlist_len(connection_array)) {
+        connection_t *conn = smartlist_get(connection_array, conn_idx);
+        uint32_t conn_age = conn_get_buffer_age(conn, now_ms);
+        if (conn_age < circ->age_tmp) {
+          break;
+        }
+        if (conn->type == CONN_TYPE_DIR && conn->linked_conn == NULL) {
+          if (!conn->marked_for_close)
+            connection_mark_for_close(conn);
+          mem_recovered += single_conn_free_bytes(conn);
 
-        ++n_dirconns_killed;
+          ++n_dirconns_killed;
 
-        if (mem_recovered >= mem_to_recover)
-          goto done_recovering_mem;
+          if (mem_recovered >= mem_to_recover)
+            goto done_recovering_mem;
+        }
+        ++conn_idx;
       }
-      ++conn_idx;
-    }
 
-    /* Now, kill the circuit. */
-    n = n_cells_in_circ_queues(circ);
-    if (! circ->marked_for_close) {
-      circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
-    }
-    marked_circuit_free_cells(circ);
-    freed = marked_circuit_free_stream_bytes(circ);
+      /* Now, kill the circuit. */
+      n = n_cells_in_circ_queues(circ);
+      if (! circ->marked_for_close) {
+        circuit_mark_for_close(circ, END_CIRC_REASON_RESOURCELIMIT);
+      }
+      marked_circuit_free_cells(circ);
+      freed = marked_circuit_free_stream_bytes(circ);
 
-    ++n_circuits_killed;
+      ++n_circuits_killed;
 
-    mem_recovered += n * packed_cell_mem_cost();
-    mem_recovered += freed;
+      mem_recovered += n * packed_cell_mem_cost();
+      mem_recovered += freed;
 
-    if (mem_recovered >= mem_to_recover)
-      goto done_recovering_mem;
-  } SMARTLIST_FOREACH_END(circ);
+      if (mem_recovered >= mem_to_recover)
+        goto done_recovering_mem;
+    } SMARTLIST_FOREACH_END(circ);
+  }
 
  done_recovering_mem:
+  smartlist_free(bucket);
+  tor_free(by_age);
+  tor_free(bucket_start);
 
   log_notice(LD_GENERAL, "Removed "U64_FORMAT" bytes by killing %d circuits; "
              "%d circuits remain alive. Also killed %d non-linked directory "
@@ -223,6 +223,7 @@ static config_var_t option_vars_[] = {
   V(AlternateBridgeAuthority,    LINELIST, NULL),
   V(AlternateDirAuthority,       LINELIST, NULL),
   OBSOLETE("AlternateHSAuthority"),
+  V(ApproximateClientStatistics, BOOL,     "0"),
   V(AssumeReachable,             BOOL,     "0"),
   OBSOLETE("AuthDirBadDir"),
   OBSOLETE("AuthDirBadDirCCs"),
@@ -327,6 +328,7 @@ static config_var_t option_vars_[] = {
   V(DoSConnectionDefenseType,    INT,      "0"),
   /* DoS single hop client options. */
   V(DoSRefuseSingleHopClientRendezvous,    AUTOBOOL, "auto"),
+  V(DoSClientTableMaxMem,        MEMUNIT,  "32 MB"),
   V(DownloadExtraInfo,           BOOL,     "0"),
   V(TestingEnableConnBwEvent,    BOOL,     "0"),
   V(TestingEnableCellStatsEvent, BOOL,     "0"),
@@ -426,6 +428,7 @@ static config_var_t option_vars_[] = {
   V(MaxCircuitDirtiness,         INTERVAL, "10 minutes"),
   V(MaxClientCircuitsPending,    UINT,     "32"),
   V(MaxConsensusAgeForDiffs,     INTERVAL, "0 seconds"),
+  V(MaxMemInDNSCache,            MEMUNIT,   "0"),
   VAR("MaxMemInQueues",          MEMUNIT,   MaxMemInQueues_raw, "0"),
   OBSOLETE("MaxOnionsPending"),
   V(MaxOnionQueueDelay,          MSEC_INTERVAL, "1750 msec"),
@@ -471,6 +474,7 @@ static config_var_t option_vars_[] = {
   V(PerConnBWBurst,              MEMUNIT,  "0"),
   V(PerConnBWRate,               MEMUNIT,  "0"),
   V(PidFile,                     STRING,   NULL),
+  V(PinCPUWorkers,               BOOL,     "0"),
   V(TestingTorNetwork,           BOOL,     "0"),
   V(TestingMinExitFlagThreshold, MEMUNIT,  "0"),
   V(TestingMinFastFlagThreshold, MEMUNIT,  "0"),
@@ -526,6 +530,7 @@ static config_var_t option_vars_[] = {
   OBSOLETE("SchedulerMaxFlushCells__"),
   V(KISTSchedRunInterval,        MSEC_INTERVAL, "0 msec"),
   V(KISTSockBufSizeFactor,       DOUBLE,   "1.0"),
+  V(KISTSockInfoCacheTime,       MSEC_INTERVAL, "0 msec"),
   V(Schedulers,                  CSV,      "KIST,KISTLite,Vanilla"),
   V(ShutdownWaitLength,          INTERVAL, "30 seconds"),
   OBSOLETE("SocksListenAddress"),
@@ -3163,6 +3168,13 @@ options_validate_scheduler(or_options_t *options, char **msg)
     return -1;
   }
 
+  if (options->KISTSockInfoCacheTime < 0 ||
+      options->KISTSockInfoCacheTime > KIST_SOCK_INFO_CACHE_TIME_MAX) {
+    tor_asprintf(msg, "KISTSockInfoCacheTime must be between 0 and %d (ms)",
+                 KIST_SOCK_INFO_CACHE_TIME_MAX);
+    return -1;
+  }
+
   return 0;
 }
 
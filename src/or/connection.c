@@ -4142,6 +4142,33 @@ connection_write_to_buf_impl_,(const char *string, size_t len,
   }
 }
 
+/** Append the <b>len</b> bytes at <b>data</b> to <b>conn</b>'s outbuf
+ * without copying them.  <b>conn</b> calls <b>free_fn</b>(<b>arg</b>) once
+ * it's done with the data; see buf_add_external().  Never compresses. */
+void
+connection_buf_add_external(const char *data, size_t len,
+                            buf_external_free_fn_t free_fn, void *arg,
+                            connection_t *conn)
+{
+  /* if it's marked for close, only allow write if we mean to flush it */
+  if (!len || (conn->marked_for_close && !conn->hold_open_until_flushed)) {
+    free_fn(arg);
+    return;
+  }
+
+  if (buf_add_external(conn->outbuf, data, len, free_fn, arg) < 0) {
+    log_warn(LD_NET, "write_to_buf failed. Closing connection (fd %d).",
+             (int)conn->s);
+    connection_mark_for_close(conn);
+    return;
+  }
+
+  if (conn->write_event) {
+    connection_start_writing(conn);
+  }
+  conn->outbuf_flushlen += len;
+}
+
 #define CONN_GET_ALL_TEMPLATE(var, test) \
   STMT_BEGIN \
     smartlist_t *conns = get_connection_array();   \
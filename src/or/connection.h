@@ -138,6 +138,9 @@ int connection_flush(connection_t *conn);
 
 MOCK_DECL(void, connection_write_to_buf_impl_,
           (const char *string, size_t len, connection_t *conn, int zlib));
+void connection_buf_add_external(const char *data, size_t len,
+                                 buf_external_free_fn_t free_fn, void *arg,
+                                 connection_t *conn);
 /* DOCDOC connection_write_to_buf */
 static void connection_buf_add(const char *string, size_t len,
                                     connection_t *conn);
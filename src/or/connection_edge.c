@@ -3707,8 +3707,10 @@ connection_exit_connect(edge_connection_t *edge_conn)
   int socket_error = 0, result;
   const char *why_failed_exit_policy = NULL;
 
-  /* Apply exit policy to non-rendezvous connections. */
+  /* Apply exit policy to non-rendezvous connections, unless the DNS cache
+   * already told us that our policy accepts this address and port. */
   if (! connection_edge_is_rendezvous_stream(edge_conn) &&
+      ! edge_conn->exit_policy_accepted &&
       my_exit_policy_rejects(&edge_conn->base_.addr,
                              edge_conn->base_.port,
                              &why_failed_exit_policy)) {
@@ -6,6 +6,7 @@
 #include "config.h"
 #include "conscache.h"
 #include "storagedir.h"
+#include "ht.h"
 
 #define CCE_MAGIC 0x17162253
 
@@ -49,6 +50,21 @@ struct consensus_cache_entry_t {
   const uint8_t *body;
 };
 
+/**
+ * Hashtable node: the list of entries in a consensus_cache_t that have a
+ * given value for a given label key.
+ */
+typedef struct cce_label_bucket_t {
+  HT_ENTRY(cce_label_bucket_t) node;
+  /** The label key (part of the ht key) */
+  char *key;
+  /** The label value (part of the ht key) */
+  char *value;
+  /** The entries with <b>key</b>=<b>value</b>, in the order we added
+   * them.  Never empty. */
+  smartlist_t *entries;
+} cce_label_bucket_t;
+
 /**
  * A consensus_cache_t holds a directory full of labeled items.
  */
@@ -57,6 +73,9 @@ struct consensus_cache_t {
   storage_dir_t *dir;
   /** List of all the entries in the directory. */
   smartlist_t *entries;
+  /** Index of <b>entries</b> by each of their labels, so that we can find
+   * the entries with a given label without looking at all the others. */
+  HT_HEAD(cce_label_map, cce_label_bucket_t) label_index;
 
   /** The maximum number of entries that we'd like to allow in this cache.
    * This is the same as the storagedir limit when MUST_UNMAP_TO_UNLINK is
@@ -70,6 +89,112 @@ static void consensus_cache_entry_map(consensus_cache_t *,
                                       consensus_cache_entry_t *);
 static void consensus_cache_entry_unmap(consensus_cache_entry_t *ent);
 
+/** Helper: hash the key of a cce_label_bucket_t. */
+static unsigned
+cce_label_bucket_hash(const cce_label_bucket_t *b)
+{
+  /* Include the NULs, so that "ab"="c" and "a"="bc" hash differently. */
+  const uint64_t h1 = siphash24g(b->key, strlen(b->key) + 1);
+  const uint64_t h2 = siphash24g(b->value, strlen(b->value) + 1);
+  return (unsigned) (h1 ^ (h2 * 3));
+}
+/** Helper: compare two cce_label_bucket_t objects for key equality */
+static int
+cce_label_bucket_eq(const cce_label_bucket_t *a, const cce_label_bucket_t *b)
+{
+  return !strcmp(a->key, b->key) && !strcmp(a->value, b->value);
+}
+
+HT_PROTOTYPE(cce_label_map, cce_label_bucket_t, node, cce_label_bucket_hash,
+             cce_label_bucket_eq)
+HT_GENERATE2(cce_label_map, cce_label_bucket_t, node, cce_label_bucket_hash,
+             cce_label_bucket_eq, 0.6, tor_reallocarray, tor_free_)
+
+/** Return the bucket in <b>cache</b>'s label index for
+ * <b>key</b>=<b>value</b>, or NULL if no entry has that label. */
+static cce_label_bucket_t *
+consensus_cache_index_find(consensus_cache_t *cache,
+                           const char *key, const char *value)
+{
+  cce_label_bucket_t search;
+  memset(&search, 0, sizeof(search));
+  search.key = (char *) key;
+  search.value = (char *) value;
+  return HT_FIND(cce_label_map, &cache->label_index, &search);
+}
+
+/** Add <b>ent</b> to <b>cache</b>'s label index, under each of its
+ * labels. */
+static void
+consensus_cache_index_add(consensus_cache_t *cache,
+                          consensus_cache_entry_t *ent)
+{
+  const config_line_t *line;
+  for (line = ent->labels; line; line = line->next) {
+    /* For duplicate keys, only the first value counts, as in
+     * consensus_cache_entry_get_value(). */
+    if (config_line_find(ent->labels, line->key) != line)
+      continue;
+    cce_label_bucket_t *b =
+      consensus_cache_index_find(cache, line->key, line->value);
+    if (!b) {
+      b = tor_malloc_zero(sizeof(cce_label_bucket_t));
+      b->key = tor_strdup(line->key);
+      b->value = tor_strdup(line->value);
+      b->entries = smartlist_new();
+      HT_INSERT(cce_label_map, &cache->label_index, b);
+    }
+    smartlist_add(b->entries, ent);
+  }
+}
+
+/** Release all storage held in <b>b</b>. */
+static void
+cce_label_bucket_free(cce_label_bucket_t *b)
+{
+  if (!b)
+    return;
+  tor_free(b->key);
+  tor_free(b->value);
+  smartlist_free(b->entries);
+  tor_free(b);
+}
+
+/** Remove <b>ent</b> from <b>cache</b>'s label index. */
+static void
+consensus_cache_index_remove(consensus_cache_t *cache,
+                             consensus_cache_entry_t *ent)
+{
+  const config_line_t *line;
+  for (line = ent->labels; line; line = line->next) {
+    if (config_line_find(ent->labels, line->key) != line)
+      continue;
+    cce_label_bucket_t *b =
+      consensus_cache_index_find(cache, line->key, line->value);
+    if (BUG(!b))
+      continue; // LCOV_EXCL_LINE
+    /* We usually remove the oldest entries, which are near the front. */
+    smartlist_remove_keeporder(b->entries, ent);
+    if (smartlist_len(b->entries) == 0) {
+      HT_REMOVE(cce_label_map, &cache->label_index, b);
+      cce_label_bucket_free(b);
+    }
+  }
+}
+
+/** Remove everything from <b>cache</b>'s label index. */
+static void
+consensus_cache_index_clear(consensus_cache_t *cache)
+{
+  cce_label_bucket_t **b, **next;
+  for (b = HT_START(cce_label_map, &cache->label_index); b; b = next) {
+    cce_label_bucket_t *victim = *b;
+    next = HT_NEXT_RMV(cce_label_map, &cache->label_index, b);
+    cce_label_bucket_free(victim);
+  }
+  HT_CLEAR(cce_label_map, &cache->label_index);
+}
+
 /**
  * Helper: Open a consensus cache in subdirectory <b>subdir</b> of the
  * data directory, to hold up to <b>max_entries</b> of data.
@@ -81,6 +206,7 @@ consensus_cache_open(const char *subdir, int max_entries)
   consensus_cache_t *cache = tor_malloc_zero(sizeof(consensus_cache_t));
   char *directory = get_datadir_fname(subdir);
   cache->max_entries = max_entries;
+  HT_INIT(cce_label_map, &cache->label_index);
 
 #ifdef MUST_UNMAP_TO_UNLINK
   /* If we can't unlink the files that we're still using, then we need to
@@ -157,6 +283,7 @@ static void
 consensus_cache_clear(consensus_cache_t *cache)
 {
   consensus_cache_delete_pending(cache, 0);
+  consensus_cache_index_clear(cache);
 
   SMARTLIST_FOREACH_BEGIN(cache->entries, consensus_cache_entry_t *, ent) {
     ent->in_cache = NULL;
@@ -215,6 +342,7 @@ consensus_cache_add(consensus_cache_t *cache,
   ent->in_cache = cache;
   ent->unused_since = TIME_MAX;
   smartlist_add(cache->entries, ent);
+  consensus_cache_index_add(cache, ent);
   /* Start the reference count at 2: the caller owns one copy, and the
    * cache owns another.
    */
@@ -234,13 +362,12 @@ consensus_cache_find_first(consensus_cache_t *cache,
                            const char *key,
                            const char *value)
 {
-  smartlist_t *tmp = smartlist_new();
-  consensus_cache_find_all(tmp, cache, key, value);
-  consensus_cache_entry_t *ent = NULL;
-  if (smartlist_len(tmp))
-    ent = smartlist_get(tmp, 0);
-  smartlist_free(tmp);
-  return ent;
+  const cce_label_bucket_t *b = consensus_cache_index_find(cache, key, value);
+  if (!b)
+    return NULL;
+  SMARTLIST_FOREACH(b->entries, consensus_cache_entry_t *, ent,
+                    if (ent->can_remove == 0) return ent);
+  return NULL;
 }
 
 /**
@@ -257,19 +384,20 @@ consensus_cache_find_all(smartlist_t *out,
                          const char *key,
                          const char *value)
 {
-  SMARTLIST_FOREACH_BEGIN(cache->entries, consensus_cache_entry_t *, ent) {
+  const smartlist_t *candidates = cache->entries;
+  if (key) {
+    const cce_label_bucket_t *b =
+      consensus_cache_index_find(cache, key, value);
+    if (!b)
+      return;
+    candidates = b->entries;
+  }
+  SMARTLIST_FOREACH_BEGIN(candidates, consensus_cache_entry_t *, ent) {
     if (ent->can_remove == 1) {
       /* We want to delete this; pretend it isn't there. */
       continue;
     }
-    if (! key) {
-      smartlist_add(out, ent);
-      continue;
-    }
-    const char *found_val = consensus_cache_entry_get_value(ent, key);
-    if (found_val && !strcmp(value, found_val)) {
-      smartlist_add(out, ent);
-    }
+    smartlist_add(out, ent);
   } SMARTLIST_FOREACH_END(ent);
 }
 
@@ -511,6 +639,7 @@ consensus_cache_delete_pending(consensus_cache_t *cache, int force)
     }
 
     SMARTLIST_DEL_CURRENT(cache->entries, ent);
+    consensus_cache_index_remove(cache, ent);
     ent->in_cache = NULL;
     char *fname = tor_strdup(ent->fname); /* save a copy */
     consensus_cache_entry_decref(ent);
@@ -564,6 +693,7 @@ consensus_cache_rescan(consensus_cache_t *cache)
     ent->in_cache = cache;
     ent->unused_since = TIME_MAX;
     smartlist_add(cache->entries, ent);
+    consensus_cache_index_add(cache, ent);
     tor_munmap_file(map); /* don't actually need to keep this around */
   } SMARTLIST_FOREACH_END(fname);
 }
@@ -34,6 +34,10 @@
  * allocate cdline_t objects, each of which represents a line in the original
  * object or in the output.  We use memarea_t allocators to manage the
  * temporary memory we use when generating or applying diffs.
+ *
+ * When generating a diff, we give every line a 64-bit fingerprint right
+ * after we split the inputs, so that the LCS code can compare lines as
+ * integers.  Only lines with equal fingerprints need their contents compared.
  **/
 
 #define CONSDIFF_PRIVATE
@@ -48,10 +52,46 @@ static const char* hash_token = "hash";
 
 static char *consensus_join_lines(const smartlist_t *inp);
 
+/** Return the fingerprint to use for a line with the <b>len</b> bytes at
+ * <b>s</b>.  Never returns 0.
+ *
+ * This is a fast multiplicative hash, not a keyed one: a collision can only
+ * make a diff longer than it needs to be, since we compare the contents of
+ * lines before treating them as equal.  Most lines are short, so the cost of
+ * setting up a stronger hash would dominate.
+ */
+STATIC uint64_t
+cdline_hash(const char *s, uint32_t len)
+{
+  const uint64_t mul = UINT64_C(0x9e3779b97f4a7c15);
+  uint64_t h = len * mul;
+  uint64_t w;
+
+  while (len >= 8) {
+    memcpy(&w, s, 8);
+    h = ((h << 23) | (h >> 41)) ^ w;
+    h *= mul;
+    s += 8;
+    len -= 8;
+  }
+  if (len) {
+    w = 0;
+    memcpy(&w, s, len);
+    h = ((h << 23) | (h >> 41)) ^ w;
+    h *= mul;
+  }
+  h ^= h >> 29;
+  h *= mul;
+  h ^= h >> 32;
+  return h ? h : 1;
+}
+
 /** Return true iff a and b have the same contents. */
 STATIC int
 lines_eq(const cdline_t *a, const cdline_t *b)
 {
+  if (a->hash && b->hash && a->hash != b->hash)
+    return 0;
   return a->len == b->len && fast_memeq(a->s, b->s, a->len);
 }
 
@@ -61,7 +101,7 @@ line_str_eq(const cdline_t *a, const char *b)
 {
   const size_t len = strlen(b);
   tor_assert(len <= UINT32_MAX);
-  cdline_t bline = { b, (uint32_t)len };
+  cdline_t bline = { b, (uint32_t)len, 0 };
   return lines_eq(a, &bline);
 }
 
@@ -85,6 +125,7 @@ cdline_linecpy(memarea_t *area, const char *s)
   cdline_t *line = memarea_alloc(area, sizeof(cdline_t));
   line->s = ss;
   line->len = (uint32_t)len;
+  line->hash = cdline_hash(ss, line->len);
   return line;
 }
 
@@ -160,20 +201,37 @@ smartlist_slice(const smartlist_t *list, int start, int end)
  * If direction is -1, the navigation is reversed. Otherwise it must be 1.
  * The length of the resulting integer array is that of the second slice plus
  * one.
+ *
+ * Lines are compared by fingerprint only.  That's enough here: this function
+ * only picks where to split, and calc_changes compares contents before
+ * deciding that any line is unchanged.
  */
 STATIC int *
 lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
             int direction)
 {
-  size_t a_size = sizeof(int) * (slice2->len+1);
+  const int len2 = slice2->len;
+  size_t a_size = sizeof(int) * (len2+1);
 
   /* Resulting lcs lengths. */
   int *result = tor_malloc_zero(a_size);
-  /* Copy of the lcs lengths from the last iteration. */
+  /* The lcs lengths from the last iteration. */
   int *prev = tor_malloc(a_size);
+  /* The fingerprints of slice2, in the order we visit them, so that the
+   * inner loop walks two flat arrays. */
+  uint64_t *hashes2 = tor_malloc(sizeof(uint64_t) * (len2+1));
 
   tor_assert(direction == 1 || direction == -1);
 
+  int sj = slice2->offset;
+  if (direction == -1) {
+    sj += (len2-1);
+  }
+  for (int j = 0; j < len2; ++j, sj+=direction) {
+    const cdline_t *line2 = smartlist_get(slice2->list, sj);
+    hashes2[j] = line2->hash;
+  }
+
   int si = slice1->offset;
   if (direction == -1) {
     si += (slice1->len-1);
@@ -182,18 +240,15 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
   for (int i = 0; i < slice1->len; ++i, si+=direction) {
 
     const cdline_t *line1 = smartlist_get(slice1->list, si);
-    /* Store the last results. */
-    memcpy(prev, result, a_size);
-
-    int sj = slice2->offset;
-    if (direction == -1) {
-      sj += (slice2->len-1);
-    }
-
-    for (int j = 0; j < slice2->len; ++j, sj+=direction) {
-
-      const cdline_t *line2 = smartlist_get(slice2->list, sj);
-      if (lines_eq(line1, line2)) {
+    const uint64_t hash1 = line1->hash;
+    /* The results of the last iteration become the previous ones. */
+    int *tmp = prev;
+    prev = result;
+    result = tmp;
+    result[0] = 0;
+
+    for (int j = 0; j < len2; ++j) {
+      if (hash1 == hashes2[j]) {
         /* If the lines are equal, the lcs is one line longer. */
         result[j + 1] = prev[j] + 1;
       } else {
@@ -202,6 +257,7 @@ lcs_lengths(const smartlist_slice_t *slice1, const smartlist_slice_t *slice2,
       }
     }
   }
+  tor_free(hashes2);
   tor_free(prev);
   return result;
 }
@@ -361,6 +417,17 @@ calc_changes(smartlist_slice_t *slice1,
   }
 }
 
+/** Helper: add the time since *<b>start</b> to *<b>usec</b>, and restart
+ * *<b>start</b> from now. */
+static void
+timing_add_elapsed(int64_t *usec, monotime_t *start)
+{
+  monotime_t now;
+  monotime_get(&now);
+  *usec += monotime_diff_usec(start, &now);
+  *start = now;
+}
+
 /* This table is from crypto.c. The SP and PAD defines are different. */
 #define NOT_VALID_BASE64 255
 #define X NOT_VALID_BASE64
@@ -533,7 +600,7 @@ typedef struct router_id_iterator_t {
 /**
  * Initializer for a router_id_iterator_t.
  */
-#define ROUTER_ID_ITERATOR_INIT { { NULL, 0 }, { NULL, 0 } }
+#define ROUTER_ID_ITERATOR_INIT { { NULL, 0, 0 }, { NULL, 0, 0 } }
 
 /** Given an index *<b>idxp</b> into the consensus at <b>cons</b>, advance
  * the index to the next router line ("r ...") in the consensus, or to
@@ -607,6 +674,9 @@ preprocess_consensus(memarea_t *area,
  * All cdline_t objects in the resulting object are either references to lines
  * in one of the inputs, or are newly allocated lines in the provided memarea.
  *
+ * If <b>timing</b> is set, add the time we spend finding the changed lines
+ * and encoding them to it.
+ *
  * This implementation is consensus-specific. To generate an ed diff for any
  * given input in quadratic time, you can replace all the code until the
  * navigation in reverse order with the following:
@@ -621,8 +691,12 @@ preprocess_consensus(memarea_t *area,
  */
 STATIC smartlist_t *
 gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
-            memarea_t *area)
+            memarea_t *area, consdiff_timing_t *timing)
 {
+  monotime_t start;
+  if (timing)
+    monotime_get(&start);
+
   smartlist_t *cons1 = smartlist_new();
   smartlist_add_all(cons1, cons1_orig);
   cdline_t *remove_trailer = preprocess_consensus(area, cons1);
@@ -741,6 +815,9 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
     start1 = i1, start2 = i2;
   }
 
+  if (timing)
+    timing_add_elapsed(&timing->lcs_usec, &start);
+
   /* Navigate the changes in reverse order and generate one ed command for
    * each chunk of changes.
    */
@@ -813,6 +890,9 @@ gen_ed_diff(const smartlist_t *cons1_orig, const smartlist_t *cons2,
   bitarray_free(changed1);
   bitarray_free(changed2);
 
+  if (timing)
+    timing_add_elapsed(&timing->encode_usec, &start);
+
   return result;
 
  error_cleanup:
@@ -1019,19 +1099,25 @@ apply_ed_diff(const smartlist_t *cons1, const smartlist_t *diff,
  * as smartlists. Will return NULL if the consensus diff could not be
  * generated. Neither of the two consensuses are modified in any way, so it's
  * up to the caller to free their resources.
+ *
+ * If <b>timing</b> is set, add the time we spend in each phase to it.
  */
 smartlist_t *
 consdiff_gen_diff(const smartlist_t *cons1,
                   const smartlist_t *cons2,
                   const consensus_digest_t *digests1,
                   const consensus_digest_t *digests2,
-                  memarea_t *area)
+                  memarea_t *area,
+                  consdiff_timing_t *timing)
 {
-  smartlist_t *ed_diff = gen_ed_diff(cons1, cons2, area);
+  monotime_t start;
+  smartlist_t *ed_diff = gen_ed_diff(cons1, cons2, area, timing);
   /* ed diff could not be generated - reason already logged by gen_ed_diff. */
   if (!ed_diff) {
     goto error_cleanup;
   }
+  if (timing)
+    monotime_get(&start);
 
   /* See that the script actually produces what we want. */
   smartlist_t *ed_cons2 = apply_ed_diff(cons1, ed_diff, 0);
@@ -1065,6 +1151,8 @@ consdiff_gen_diff(const smartlist_t *cons1,
     goto error_cleanup;
     /* LCOV_EXCL_STOP */
   }
+  if (timing)
+    timing_add_elapsed(&timing->verify_usec, &start);
 
   char cons1_hash_hex[HEX_DIGEST256_LEN+1];
   char cons2_hash_hex[HEX_DIGEST256_LEN+1];
@@ -1281,6 +1369,9 @@ consdiff_apply_diff(const smartlist_t *cons1,
  * All cdline_t objects are allocated in the provided memarea.  Strings
  * are not copied: if <b>s</b> changes or becomes invalid, then all
  * generated cdlines will become invalid.
+ *
+ * We also compute the fingerprint of every line, so that lines_eq() can
+ * tell most unequal lines apart without comparing them.
  */
 STATIC int
 consensus_split_lines(smartlist_t *out, const char *s, memarea_t *area)
@@ -1301,6 +1392,7 @@ consensus_split_lines(smartlist_t *out, const char *s, memarea_t *area)
     cdline_t *line = memarea_alloc(area, sizeof(cdline_t));
     line->s = s;
     line->len = (uint32_t)(eol - s);
+    line->hash = cdline_hash(s, line->len);
     smartlist_add(out, line);
     s = eol+1;
   }
@@ -1336,17 +1428,31 @@ consensus_join_lines(const smartlist_t *inp)
 char *
 consensus_diff_generate(const char *cons1,
                         const char *cons2)
+{
+  return consensus_diff_generate_timed(cons1, cons2, NULL);
+}
+
+/** As consensus_diff_generate, but if <b>timing_out</b> is set, add the time
+ * we spend in each phase of generating the diff to it. */
+char *
+consensus_diff_generate_timed(const char *cons1,
+                              const char *cons2,
+                              consdiff_timing_t *timing_out)
 {
   consensus_digest_t d1, d2;
   smartlist_t *lines1 = NULL, *lines2 = NULL, *result_lines = NULL;
   int r1, r2;
   char *result = NULL;
+  monotime_t start;
 
   r1 = consensus_compute_digest_as_signed(cons1, &d1);
   r2 = consensus_compute_digest(cons2, &d2);
   if (BUG(r1 < 0 || r2 < 0))
     return NULL; // LCOV_EXCL_LINE
 
+  if (timing_out)
+    monotime_get(&start);
+
   memarea_t *area = memarea_new();
   lines1 = smartlist_new();
   lines2 = smartlist_new();
@@ -1354,13 +1460,20 @@ consensus_diff_generate(const char *cons1,
     goto done;
   if (consensus_split_lines(lines2, cons2, area) < 0)
     goto done;
+  if (timing_out)
+    timing_add_elapsed(&timing_out->split_usec, &start);
 
-  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area);
+  result_lines = consdiff_gen_diff(lines1, lines2, &d1, &d2, area,
+                                   timing_out);
 
  done:
   if (result_lines) {
+    if (timing_out)
+      monotime_get(&start);
     result = consensus_join_lines(result_lines);
     smartlist_free(result_lines);
+    if (timing_out)
+      timing_add_elapsed(&timing_out->encode_usec, &start);
   }
 
   memarea_drop_all(area);
@@ -1413,3 +1526,23 @@ looks_like_a_consensus_diff(const char *document, size_t len)
           fast_memeq(document, ns_diff_version, strlen(ns_diff_version)));
 }
 
+/** Set *<b>dict_out</b> and *<b>dict_len_out</b> to the part of
+ * <b>consensus</b> that we use as the shared dictionary when compressing a
+ * diff from it with a method that uses one.  That's the part which the
+ * diff's source digest covers: the signed part, if we can find it, since
+ * caches and clients can hold different signatures on the same consensus.
+ */
+void
+consensus_diff_get_dict(const char *consensus,
+                        const char **dict_out, size_t *dict_len_out)
+{
+  const char *start, *end;
+  if (router_get_networkstatus_v3_signed_boundaries(consensus,
+                                                    &start, &end) < 0) {
+    start = consensus;
+    end = consensus + strlen(consensus);
+  }
+  *dict_out = start;
+  *dict_len_out = end - start;
+}
+
@@ -7,12 +7,30 @@
 
 #include "or.h"
 
+/** Time spent, in microseconds, in each phase of generating one consensus
+ * diff.  Only used for benchmarking. */
+typedef struct consdiff_timing_t {
+  /** Splitting both consensuses into lines, and fingerprinting them. */
+  int64_t split_usec;
+  /** Finding the changed lines between each pair of router sections. */
+  int64_t lcs_usec;
+  /** Turning the changed lines into ed commands. */
+  int64_t encode_usec;
+  /** Checking that the ed commands really produce the target consensus. */
+  int64_t verify_usec;
+} consdiff_timing_t;
+
 char *consensus_diff_generate(const char *cons1,
                               const char *cons2);
+char *consensus_diff_generate_timed(const char *cons1,
+                                    const char *cons2,
+                                    consdiff_timing_t *timing_out);
 char *consensus_diff_apply(const char *consensus,
                            const char *diff);
 
 int looks_like_a_consensus_diff(const char *document, size_t len);
+void consensus_diff_get_dict(const char *consensus,
+                             const char **dict_out, size_t *dict_len_out);
 
 #ifdef CONSDIFF_PRIVATE
 struct memarea_t;
@@ -23,6 +41,9 @@ struct memarea_t;
 typedef struct cdline_t {
   const char *s;
   uint32_t len;
+  /** A fingerprint of the contents of this line, or 0 if we haven't computed
+   * one.  Lines with different nonzero fingerprints are never equal. */
+  uint64_t hash;
 } cdline_t;
 
 typedef struct consensus_digest_t {
@@ -33,7 +54,8 @@ STATIC smartlist_t *consdiff_gen_diff(const smartlist_t *cons1,
                                       const smartlist_t *cons2,
                                       const consensus_digest_t *digests1,
                                       const consensus_digest_t *digests2,
-                                      struct memarea_t *area);
+                                      struct memarea_t *area,
+                                      consdiff_timing_t *timing);
 STATIC char *consdiff_apply_diff(const smartlist_t *cons1,
                                  const smartlist_t *diff,
                                  const consensus_digest_t *digests1);
@@ -55,7 +77,8 @@ typedef struct smartlist_slice_t {
 } smartlist_slice_t;
 STATIC smartlist_t *gen_ed_diff(const smartlist_t *cons1,
                                 const smartlist_t *cons2,
-                                struct memarea_t *area);
+                                struct memarea_t *area,
+                                consdiff_timing_t *timing);
 STATIC smartlist_t *apply_ed_diff(const smartlist_t *cons1,
                                   const smartlist_t *diff,
                                   int start_line);
@@ -78,6 +101,7 @@ STATIC void set_changed(bitarray_t *changed1, bitarray_t *changed2,
                         const smartlist_slice_t *slice2);
 STATIC int consensus_split_lines(smartlist_t *out, const char *s,
                                  struct memarea_t *area);
+STATIC uint64_t cdline_hash(const char *s, uint32_t len);
 STATIC void smartlist_add_linecpy(smartlist_t *lst, struct memarea_t *area,
                                   const char *s);
 STATIC int lines_eq(const cdline_t *a, const cdline_t *b);
@@ -87,15 +87,18 @@ typedef enum cdm_diff_status_t {
   CDM_DIFF_ERROR=3,
 } cdm_diff_status_t;
 
-/** Which methods do we use for precompressing diffs? */
+/** Which methods do we use for precompressing diffs?  The methods that use
+ * a dictionary use the diff's source consensus as one. */
 static const compress_method_t compress_diffs_with[] = {
   NO_METHOD,
   GZIP_METHOD,
 #ifdef HAVE_LZMA
   LZMA_METHOD,
+  LZMA_DICT_METHOD,
 #endif
 #ifdef HAVE_ZSTD
   ZSTD_METHOD,
+  ZSTD_DICT_METHOD,
 #endif
 };
 
@@ -124,6 +127,25 @@ n_consensus_compression_methods(void)
   return ARRAY_LENGTH(compress_consensus_with);
 }
 
+/** If a compression method has been serving at least this many copies of
+ * each document it compresses, we give it our best compression level. */
+#define CDM_POPULAR_HITS_PER_DOC 8
+/** If a compression method takes at least this long to compress one
+ * document, on average, we back it off when the worker pool is busy. */
+#define CDM_SLOW_COMPRESS_USEC (500*1000)
+/** If we have at least this many compression jobs outstanding per worker
+ * thread, we compress as cheaply as we can until we catch up. */
+#define CDM_COMPRESS_BACKLOG_PER_THREAD 2
+
+/** Running totals for each kind of document we compress, and for each
+ * method we compress it with. */
+static consdiff_compress_stats_t
+  compress_stats[CONSDIFF_N_DOCTYPES][UNKNOWN_METHOD];
+
+/** How many compression jobs have we queued whose replies haven't come
+ * back yet? */
+static int n_compress_jobs_pending = 0;
+
 /** For which compression method do we retain old consensuses?  There's no
  * need to keep all of them, since we won't be serving them.  We'll
  * go with ZLIB_METHOD because it's pretty fast and everyone has it.
@@ -594,10 +616,12 @@ consdiffmgr_find_consensus(struct consensus_cache_entry_t **entry_out,
   if (!handle)
     return CONSDIFF_NOT_FOUND;
   *entry_out = consensus_cache_entry_handle_get(handle);
-  if (*entry_out)
+  if (*entry_out) {
+    ++compress_stats[CONSDIFF_DOC_CONSENSUS][method].n_served;
     return CONSDIFF_AVAILABLE;
-  else
+  } else {
     return CONSDIFF_NOT_FOUND;
+  }
 }
 
 /**
@@ -608,13 +632,13 @@ consdiffmgr_find_consensus(struct consensus_cache_entry_t **entry_out,
  * CONSDIFF_AVAILABLE. Otherwise return CONSDIFF_NOT_FOUND or
  * CONSDIFF_IN_PROGRESS.
  */
-consdiff_status_t
-consdiffmgr_find_diff_from(consensus_cache_entry_t **entry_out,
-                           consensus_flavor_t flavor,
-                           int digest_type,
-                           const uint8_t *digest,
-                           size_t digestlen,
-                           compress_method_t method)
+MOCK_IMPL(consdiff_status_t,
+consdiffmgr_find_diff_from,(consensus_cache_entry_t **entry_out,
+                            consensus_flavor_t flavor,
+                            int digest_type,
+                            const uint8_t *digest,
+                            size_t digestlen,
+                            compress_method_t method))
 {
   if (BUG(digest_type != DIGEST_SHA3_256) ||
       BUG(digestlen != DIGEST256_LEN)) {
@@ -642,7 +666,10 @@ consdiffmgr_find_diff_from(consensus_cache_entry_t **entry_out,
     return CONSDIFF_NOT_FOUND;
   }
   *entry_out = consensus_cache_entry_handle_get(ent->entry);
-  return (*entry_out) ? CONSDIFF_AVAILABLE : CONSDIFF_NOT_FOUND;
+  if (! *entry_out)
+    return CONSDIFF_NOT_FOUND;
+  ++compress_stats[CONSDIFF_DOC_DIFF][method].n_served;
+  return CONSDIFF_AVAILABLE;
 
 #if 0
   // XXXX Remove this.  I'm keeping it around for now in case we need to
@@ -1214,6 +1241,8 @@ consdiffmgr_free_all(void)
     }
   }
   memset(latest_consensus, 0, sizeof(latest_consensus));
+  memset(compress_stats, 0, sizeof(compress_stats));
+  n_compress_jobs_pending = 0;
   consensus_cache_free(cons_diff_cache);
   cons_diff_cache = NULL;
 }
@@ -1235,95 +1264,407 @@ typedef struct compressed_result_t {
 } compressed_result_t;
 
 /**
- * Compress the bytestring <b>input</b> of length <b>len</b> using the
- * <n>n_methods</b> compression methods listed in the array <b>methods</b>.
- *
- * For each successful compression, set the fields in the <b>results_out</b>
- * array in the position corresponding to the compression method. Use
- * <b>labels_in</b> as a basis for the labels of the result.
+ * If true, we compress in worker threads.
+ */
+static int background_compression = 0;
+
+/**
+ * Return the compression level to use for the next document that we
+ * compress, given the running totals in <b>stats</b> for that kind of
+ * document and method, the number of compression jobs <b>n_pending</b>
+ * that are already outstanding, and the number of worker threads
+ * <b>n_threads</b>.
+ */
+STATIC compression_level_t
+cdm_choose_compression_level(const consdiff_compress_stats_t *stats,
+                             int n_pending, int n_threads)
+{
+  if (n_threads < 1)
+    n_threads = 1;
+
+  /* If the pool is swamped, get the work done quickly. */
+  if (n_pending >= n_threads * CDM_COMPRESS_BACKLOG_PER_THREAD)
+    return LOW_COMPRESSION;
+  /* With nothing to go on, do what we always did. */
+  if (stats->n_compressed == 0)
+    return BEST_COMPRESSION;
+  /* Every byte we save on a popular document, we save over and over. */
+  if (stats->n_served >= stats->n_compressed * CDM_POPULAR_HITS_PER_DOC)
+    return BEST_COMPRESSION;
+  if (n_pending >= n_threads &&
+      stats->compress_usec >= stats->n_compressed * CDM_SLOW_COMPRESS_USEC)
+    return MEDIUM_COMPRESSION;
+  return HIGH_COMPRESSION;
+}
+
+/**
+ * Return the running totals for documents of type <b>doctype</b>
+ * compressed with <b>method</b>, or NULL if we don't know that method.
+ */
+const consdiff_compress_stats_t *
+consdiffmgr_get_compress_stats(consdiff_doctype_t doctype,
+                               compress_method_t method)
+{
+  if (BUG((int)doctype < 0 || (int)doctype >= CONSDIFF_N_DOCTYPES))
+    return NULL; // LCOV_EXCL_LINE
+  if ((int)method < 0 || method >= UNKNOWN_METHOD)
+    return NULL;
+  return &compress_stats[doctype][method];
+}
+
+/**
+ * Log, at notice level, how many documents of each kind we have compressed,
+ * how long that took, and how often we served the results.  Log the same
+ * details for each compression method, along with how well it did, at info
+ * level.
+ */
+void
+consdiffmgr_log_heartbeat(void)
+{
+  static const char *doctype_names[CONSDIFF_N_DOCTYPES] = {
+    "consensuses", "consensus diffs"
+  };
+  uint64_t n_compressed[CONSDIFF_N_DOCTYPES];
+  uint64_t total_compressed = 0, total_usec = 0, total_served = 0;
+  int d;
+  compress_method_t m;
+  for (d = 0; d < CONSDIFF_N_DOCTYPES; ++d) {
+    n_compressed[d] = 0;
+    for (m = NO_METHOD; m < UNKNOWN_METHOD; ++m) {
+      const consdiff_compress_stats_t *st = &compress_stats[d][m];
+      if (st->n_compressed == 0)
+        continue;
+      n_compressed[d] += st->n_compressed;
+      total_usec += st->compress_usec;
+      total_served += st->n_served;
+      double ratio = st->bytes_in ?
+        U64_TO_DBL(st->bytes_out) / U64_TO_DBL(st->bytes_in) : 1.0;
+      log_info(LD_HEARTBEAT, "Compressed "U64_FORMAT" %s "
+               "with %s in %.1f msec on average, to %.1f%% of their "
+               "size. Served them "U64_FORMAT" times.",
+               U64_PRINTF_ARG(st->n_compressed), doctype_names[d],
+               compression_method_get_human_name(m),
+               U64_TO_DBL(st->compress_usec) /
+                 U64_TO_DBL(st->n_compressed) / 1000.0,
+               ratio * 100.0,
+               U64_PRINTF_ARG(st->n_served));
+    }
+    total_compressed += n_compressed[d];
+  }
+  if (total_compressed == 0)
+    return;
+
+  log_notice(LD_HEARTBEAT, "Heartbeat: Compressed "U64_FORMAT" %s and "
+             U64_FORMAT" %s in %.1f msec on average. Served them "
+             U64_FORMAT" times.",
+             U64_PRINTF_ARG(n_compressed[CONSDIFF_DOC_CONSENSUS]),
+             doctype_names[CONSDIFF_DOC_CONSENSUS],
+             U64_PRINTF_ARG(n_compressed[CONSDIFF_DOC_DIFF]),
+             doctype_names[CONSDIFF_DOC_DIFF],
+             U64_TO_DBL(total_usec) / U64_TO_DBL(total_compressed) / 1000.0,
+             U64_PRINTF_ARG(total_served));
+}
+
+/**
+ * Compress the bytestring <b>input</b> of length <b>len</b> with
+ * <b>method</b> at <b>level</b>.  If <b>method</b> uses a dictionary, use
+ * the <b>dict_len</b>-byte one at <b>dict</b>.
  *
- * Return 0 if all compression succeeded; -1 if any failed.
+ * On success, set the fields of <b>result_out</b>, using <b>labels_in</b> as
+ * a basis for the labels of the result, and return 0.  Return -1 on failure.
  */
 static int
-compress_multiple(compressed_result_t *results_out, int n_methods,
-                  const compress_method_t *methods,
-                  const uint8_t *input, size_t len,
-                  const config_line_t *labels_in)
+compress_one(compressed_result_t *result_out,
+             compress_method_t method, compression_level_t level,
+             const uint8_t *input, size_t len,
+             const char *dict, size_t dict_len,
+             const config_line_t *labels_in)
 {
-  int rv = 0;
-  int i;
-  for (i = 0; i < n_methods; ++i) {
-    compress_method_t method = methods[i];
-    const char *methodname = compression_method_get_name(method);
-    char *result;
-    size_t sz;
-    if (0 == tor_compress(&result, &sz, (const char*)input, len, method)) {
-      results_out[i].body = (uint8_t*)result;
-      results_out[i].bodylen = sz;
-      results_out[i].labels = config_lines_dup(labels_in);
-      cdm_labels_prepend_sha3(&results_out[i].labels, LABEL_SHA3_DIGEST,
-                              results_out[i].body,
-                              results_out[i].bodylen);
-      config_line_prepend(&results_out[i].labels,
-                          LABEL_COMPRESSION_TYPE,
-                          methodname);
-    } else {
-      rv = -1;
+  const char *methodname = compression_method_get_name(method);
+  char *result;
+  size_t sz;
+  int r;
+  if (compression_method_uses_dict(method)) {
+    if (!dict)
+      return -1;
+    r = tor_compress_with_dict(&result, &sz, (const char*)input, len,
+                               method, level, dict, dict_len);
+  } else {
+    r = tor_compress_at_level(&result, &sz, (const char*)input, len,
+                              method, level);
+  }
+  if (r < 0)
+    return -1;
+
+  result_out->body = (uint8_t*)result;
+  result_out->bodylen = sz;
+  result_out->labels = config_lines_dup(labels_in);
+  cdm_labels_prepend_sha3(&result_out->labels, LABEL_SHA3_DIGEST,
+                          result_out->body,
+                          result_out->bodylen);
+  config_line_prepend(&result_out->labels,
+                      LABEL_COMPRESSION_TYPE,
+                      methodname);
+  return 0;
+}
+
+/**
+ * Given a compressed_result_t in <b>result</b>, as produced by
+ * compress_one, store it into the consdiffmgr, and return a handle to it.
+ * Return NULL if there was nothing to store or we couldn't store it.
+ */
+static consensus_cache_entry_handle_t *
+store_one(compress_method_t method,
+          const compressed_result_t *result,
+          const char *description)
+{
+  uint8_t *body_out = result->body;
+  size_t bodylen_out = result->bodylen;
+  config_line_t *labels = result->labels;
+  const char *methodname = compression_method_get_name(method);
+  if (!body_out || !bodylen_out || !labels)
+    return NULL;
+
+  consdiffmgr_ensure_space_for_files(1);
+
+  /* Success! Store the results */
+  log_info(LD_DIRSERV, "Adding %s, compressed with %s",
+           description, methodname);
+
+  consensus_cache_entry_t *ent =
+    consensus_cache_add(cdm_cache_get(),
+                        labels,
+                        body_out,
+                        bodylen_out);
+  if (ent == NULL) {
+    static ratelim_t cant_store_ratelim = RATELIM_INIT(5*60);
+    log_fn_ratelim(&cant_store_ratelim, LOG_WARN, LD_FS,
+                   "Unable to store object %s compressed with %s.",
+                   description, methodname);
+    return NULL;
+  }
+
+  consensus_cache_entry_handle_t *h = consensus_cache_entry_handle_new(ent);
+  consensus_cache_entry_decref(ent);
+  return h;
+}
+
+/**
+ * A document that we're compressing with one or more methods, shared by all
+ * of the compression jobs for it.  Only the main thread changes the
+ * reference count, and no thread changes anything else once the jobs are
+ * queued.
+ */
+typedef struct cdm_compress_input_t {
+  int refcnt;
+  consdiff_doctype_t doctype;
+  /** The document, uncompressed. */
+  uint8_t *body;
+  size_t bodylen;
+  /** Labels for every compressed copy of the document.  For a consensus,
+   * the workers add the digest labels themselves. */
+  config_line_t *labels;
+  /** Consensus only: the flavor of the consensus. */
+  consensus_flavor_t flavor;
+  /** Diff only: true if we can record the results in cdm_diff_ht under
+   * <b>from_sha3</b> and <b>to_sha3</b>. */
+  int cache_diff;
+  uint8_t from_sha3[DIGEST256_LEN];
+  uint8_t to_sha3[DIGEST256_LEN];
+  /** Diff only: the source consensus, and the <b>dict_len</b> bytes of it
+   * at <b>dict</b> that the methods which use a dictionary start from. */
+  char *dict_source;
+  const char *dict;
+  size_t dict_len;
+  /** A description of the document, for the logs. */
+  char *description;
+} cdm_compress_input_t;
+
+/**
+ * Release a reference to <b>input</b>, freeing it if that was the last one.
+ */
+static void
+cdm_compress_input_decref(cdm_compress_input_t *input)
+{
+  if (!input || --input->refcnt > 0)
+    return;
+  tor_free(input->body);
+  config_free_lines(input->labels);
+  tor_free(input->dict_source);
+  tor_free(input->description);
+  tor_free(input);
+}
+
+/**
+ * Holds requests and replies for consensus_compress_workers: each one
+ * compresses one document with one method.
+ */
+typedef struct consensus_compress_worker_job_t {
+  /** Input: the document to compress.  Holds a reference. */
+  cdm_compress_input_t *input;
+  /** Input: how to compress it. */
+  compress_method_t method;
+  compression_level_t level;
+  /** Output: the compressed document and its labels. */
+  compressed_result_t out;
+  /** Output: how long compressing took, in microseconds. */
+  int64_t usec;
+} consensus_compress_worker_job_t;
+
+/**
+ * Free all resources held in <b>job</b>
+ */
+static void
+consensus_compress_worker_job_free(consensus_compress_worker_job_t *job)
+{
+  if (!job)
+    return;
+  cdm_compress_input_decref(job->input);
+  config_free_lines(job->out.labels);
+  tor_free(job->out.body);
+  tor_free(job);
+}
+
+/**
+ * Helper: prepend the labels that describe the consensus in <b>input</b> as
+ * a whole to <b>labels</b>.
+ */
+static void
+cdm_labels_prepend_consensus(config_line_t **labels,
+                             const cdm_compress_input_t *input)
+{
+  const char *consensus = (const char *)input->body;
+  size_t bodylen = input->bodylen;
+  const char *flavname = networkstatus_get_flavor_name(input->flavor);
+
+  cdm_labels_prepend_sha3(labels, LABEL_SHA3_DIGEST_UNCOMPRESSED,
+                          input->body, bodylen);
+  {
+    const char *start, *end;
+    if (router_get_networkstatus_v3_signed_boundaries(consensus,
+                                                        &start, &end) < 0) {
+      start = consensus;
+      end = consensus+bodylen;
     }
+    cdm_labels_prepend_sha3(labels, LABEL_SHA3_DIGEST_AS_SIGNED,
+                            (const uint8_t *)start,
+                            end - start);
   }
-  return rv;
+  config_line_prepend(labels, LABEL_FLAVOR, flavname);
+  config_line_prepend(labels, LABEL_DOCTYPE, DOCTYPE_CONSENSUS);
 }
 
 /**
- * Given an array of <b>n</b> compressed_result_t in <b>results</b>,
- * as produced by compress_multiple, store them all into the
- * consdiffmgr, and store handles to them in the <b>handles_out</b>
- * array.
- *
- * Return CDM_DIFF_PRESENT if any was stored, and CDM_DIFF_ERROR if none
- * was stored.
+ * Worker function. This function runs inside a worker thread and receives
+ * a consensus_compress_worker_job_t as its input.
  */
-static cdm_diff_status_t
-store_multiple(consensus_cache_entry_handle_t **handles_out,
-               int n,
-               const compress_method_t *methods,
-               const compressed_result_t *results,
-               const char *description)
+static workqueue_reply_t
+consensus_compress_worker_threadfn(void *state_, void *work_)
 {
-  cdm_diff_status_t status = CDM_DIFF_ERROR;
-  consdiffmgr_ensure_space_for_files(n);
+  (void)state_;
+  consensus_compress_worker_job_t *job = work_;
+  const cdm_compress_input_t *input = job->input;
+  monotime_t start, end;
+
+  config_line_t *labels = config_lines_dup(input->labels);
+  /* Each job hashes the consensus for itself: that costs much less than
+   * compressing it, and saves a round trip through the main thread. */
+  if (input->doctype == CONSDIFF_DOC_CONSENSUS)
+    cdm_labels_prepend_consensus(&labels, input);
+
+  monotime_get(&start);
+  compress_one(&job->out, job->method, job->level,
+               input->body, input->bodylen,
+               input->dict, input->dict_len, labels);
+  monotime_get(&end);
+  job->usec = monotime_diff_usec(&start, &end);
 
-  int i;
-  for (i = 0; i < n; ++i) {
-    compress_method_t method = methods[i];
-    uint8_t *body_out = results[i].body;
-    size_t bodylen_out = results[i].bodylen;
-    config_line_t *labels = results[i].labels;
-    const char *methodname = compression_method_get_name(method);
-    if (body_out && bodylen_out && labels) {
-      /* Success! Store the results */
-      log_info(LD_DIRSERV, "Adding %s, compressed with %s",
-               description, methodname);
-
-      consensus_cache_entry_t *ent =
-        consensus_cache_add(cdm_cache_get(),
-                            labels,
-                            body_out,
-                            bodylen_out);
-      if (ent == NULL) {
-        static ratelim_t cant_store_ratelim = RATELIM_INIT(5*60);
-        log_fn_ratelim(&cant_store_ratelim, LOG_WARN, LD_FS,
-                       "Unable to store object %s compressed with %s.",
-                       description, methodname);
-        continue;
-      }
+  config_free_lines(labels);
+  return WQ_RPL_REPLY;
+}
+
+/**
+ * Worker function: This function runs in the main thread, and receives
+ * a consensus_compress_worker_job_t that the worker thread has already
+ * processed.
+ */
+static void
+consensus_compress_worker_replyfn(void *work_)
+{
+  tor_assert(in_main_thread());
+  consensus_compress_worker_job_t *job = work_;
+  const cdm_compress_input_t *input = job->input;
+  compress_method_t method = job->method;
+
+  --n_compress_jobs_pending;
+  if (job->out.body) {
+    consdiff_compress_stats_t *st = &compress_stats[input->doctype][method];
+    ++st->n_compressed;
+    st->compress_usec += job->usec;
+    st->bytes_in += input->bodylen;
+    st->bytes_out += job->out.bodylen;
+  }
 
-      status = CDM_DIFF_PRESENT;
-      handles_out[i] = consensus_cache_entry_handle_new(ent);
-      consensus_cache_entry_decref(ent);
+  consensus_cache_entry_handle_t *h =
+    store_one(method, &job->out, input->description);
+
+  if (input->doctype == CONSDIFF_DOC_CONSENSUS) {
+    consensus_flavor_t f = input->flavor;
+    int pos = consensus_compression_method_pos(method);
+    tor_assert((int)f < N_CONSENSUS_FLAVORS);
+    cdm_cache_dirty = 1;
+    if (h && !BUG(pos < 0)) {
+      consensus_cache_entry_handle_free(latest_consensus[f][pos]);
+      latest_consensus[f][pos] = h;
+    } else {
+      consensus_cache_entry_handle_free(h);
     }
+  } else if (input->cache_diff) {
+    cdm_diff_ht_set_status(input->flavor, input->from_sha3, input->to_sha3,
+                           method, h ? CDM_DIFF_PRESENT : CDM_DIFF_ERROR, h);
+  } else {
+    consensus_cache_entry_handle_free(h);
   }
-  return status;
+
+  consensus_compress_worker_job_free(job);
+}
+
+/**
+ * Queue a job to compress <b>input</b> with <b>method</b> and store the
+ * result, at a level that suits how that method has been doing lately.
+ * The job takes a new reference to <b>input</b>.  If <b>in_background</b> is
+ * false, do the job right now instead.  Return 0 on success, -1 on failure.
+ */
+static int
+cdm_queue_compress_one(cdm_compress_input_t *input, compress_method_t method,
+                       int in_background)
+{
+  consensus_compress_worker_job_t *job = tor_malloc_zero(sizeof(*job));
+  job->input = input;
+  ++input->refcnt;
+  job->method = method;
+  job->level =
+    cdm_choose_compression_level(&compress_stats[input->doctype][method],
+                                 n_compress_jobs_pending,
+                                 get_num_cpus(get_options()));
+  ++n_compress_jobs_pending;
+
+  if (in_background) {
+    workqueue_entry_t *work;
+    work = cpuworker_queue_work(WQ_PRI_LOW,
+                                consensus_compress_worker_threadfn,
+                                consensus_compress_worker_replyfn,
+                                job);
+    if (!work) {
+      --n_compress_jobs_pending;
+      consensus_compress_worker_job_free(job);
+      return -1;
+    }
+  } else {
+    consensus_compress_worker_threadfn(NULL, job);
+    consensus_compress_worker_replyfn(job);
+  }
+  return 0;
 }
 
 /**
@@ -1344,8 +1685,12 @@ typedef struct consensus_diff_worker_job_t {
    */
   consensus_cache_entry_t *diff_to;
 
-  /** Output: labels and bodies */
-  compressed_result_t out[ARRAY_LENGTH(compress_diffs_with)];
+  /** Output: the uncompressed diff, and its labels. */
+  compressed_result_t out;
+  /** Output: the labels that every compressed copy of the diff shares. */
+  config_line_t *common_labels;
+  /** Output: the source consensus, uncompressed, to use as a dictionary. */
+  char *dict_source;
 } consensus_diff_worker_job_t;
 
 /** Given a consensus_cache_entry_t, check whether it has a label claiming
@@ -1378,7 +1723,8 @@ uncompress_or_copy(char **out, size_t *outlen,
 
 /**
  * Worker function. This function runs inside a worker thread and receives
- * a consensus_diff_worker_job_t as its input.
+ * a consensus_diff_worker_job_t as its input.  It computes the diff, but
+ * leaves compressing it to separate jobs.
  */
 static workqueue_reply_t
 consensus_diff_worker_threadfn(void *state_, void *work_)
@@ -1459,7 +1805,7 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     // XXXX inputs again, even though we already have that. Maybe it's time
     // XXXX to change the API here?
     consensus_diff = consensus_diff_generate(diff_from_nt, diff_to_nt);
-    tor_free(diff_from_nt);
+    job->dict_source = diff_from_nt;
     tor_free(diff_to_nt);
   }
   if (!consensus_diff) {
@@ -1467,11 +1813,10 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     return WQ_RPL_REPLY;
   }
 
-  /* Compress the results and send the reply */
-  tor_assert(compress_diffs_with[0] == NO_METHOD);
+  /* Label the results and send the reply */
   size_t difflen = strlen(consensus_diff);
-  job->out[0].body = (uint8_t *) consensus_diff;
-  job->out[0].bodylen = difflen;
+  job->out.body = (uint8_t *) consensus_diff;
+  job->out.bodylen = difflen;
 
   config_line_t *common_labels = NULL;
   if (lv_to_valid_until)
@@ -1482,8 +1827,8 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
     config_line_prepend(&common_labels, LABEL_SIGNATORIES, lv_to_signatories);
   cdm_labels_prepend_sha3(&common_labels,
                           LABEL_SHA3_DIGEST_UNCOMPRESSED,
-                          job->out[0].body,
-                          job->out[0].bodylen);
+                          job->out.body,
+                          job->out.bodylen);
   config_line_prepend(&common_labels, LABEL_FROM_VALID_AFTER,
                       lv_from_valid_after);
   config_line_prepend(&common_labels, LABEL_VALID_AFTER,
@@ -1496,18 +1841,13 @@ consensus_diff_worker_threadfn(void *state_, void *work_)
   config_line_prepend(&common_labels, LABEL_DOCTYPE,
                       DOCTYPE_CONSENSUS_DIFF);
 
-  job->out[0].labels = config_lines_dup(common_labels);
-  cdm_labels_prepend_sha3(&job->out[0].labels,
+  job->out.labels = config_lines_dup(common_labels);
+  cdm_labels_prepend_sha3(&job->out.labels,
                           LABEL_SHA3_DIGEST,
-                          job->out[0].body,
-                          job->out[0].bodylen);
-
-  compress_multiple(job->out+1,
-                    n_diff_compression_methods()-1,
-                    compress_diffs_with+1,
-                    (const uint8_t*)consensus_diff, difflen, common_labels);
+                          job->out.body,
+                          job->out.bodylen);
+  job->common_labels = common_labels;
 
-  config_free_lines(common_labels);
   return WQ_RPL_REPLY;
 }
 
@@ -1519,11 +1859,10 @@ consensus_diff_worker_job_free(consensus_diff_worker_job_t *job)
 {
   if (!job)
     return;
-  unsigned u;
-  for (u = 0; u < n_diff_compression_methods(); ++u) {
-    config_free_lines(job->out[u].labels);
-    tor_free(job->out[u].body);
-  }
+  config_free_lines(job->out.labels);
+  tor_free(job->out.body);
+  config_free_lines(job->common_labels);
+  tor_free(job->dict_source);
   consensus_cache_entry_decref(job->diff_from);
   consensus_cache_entry_decref(job->diff_to);
   tor_free(job);
@@ -1532,7 +1871,8 @@ consensus_diff_worker_job_free(consensus_diff_worker_job_t *job)
 /**
  * Worker function: This function runs in the main thread, and receives
  * a consensus_diff_worker_job_t that the worker thread has already
- * processed.
+ * processed.  Store the uncompressed diff, and queue a job to compress it
+ * with each of our other methods.
  */
 static void
 consensus_diff_worker_replyfn(void *work_)
@@ -1571,45 +1911,72 @@ consensus_diff_worker_replyfn(void *work_)
     cache = 0;
   }
 
-  consensus_cache_entry_handle_t *handles[ARRAY_LENGTH(compress_diffs_with)];
-  memset(handles, 0, sizeof(handles));
-
   char description[128];
   tor_snprintf(description, sizeof(description),
                "consensus diff from %s to %s",
                lv_from_digest, lv_to_digest);
 
-  int status = store_multiple(handles,
-                              n_diff_compression_methods(),
-                              compress_diffs_with,
-                              job->out,
-                              description);
+  tor_assert(compress_diffs_with[0] == NO_METHOD);
+  consensus_cache_entry_handle_t *h =
+    store_one(NO_METHOD, &job->out, description);
 
-  if (status != CDM_DIFF_PRESENT) {
+  if (h == NULL) {
     /* Failure! Nothing to do but complain */
     log_warn(LD_DIRSERV,
              "Worker was unable to compute consensus diff "
              "from %s to %s", lv_from_digest, lv_to_digest);
-    /* Cache this error so we don't try to compute this one again. */
-    status = CDM_DIFF_ERROR;
+  } else {
+    consdiff_compress_stats_t *st =
+      &compress_stats[CONSDIFF_DOC_DIFF][NO_METHOD];
+    ++st->n_compressed;
+    st->bytes_in += job->out.bodylen;
+    st->bytes_out += job->out.bodylen;
+  }
+
+  /* Hand the diff over to one compression job per method. */
+  cdm_compress_input_t *input = NULL;
+  if (h) {
+    input = tor_malloc_zero(sizeof(*input));
+    input->refcnt = 1;
+    input->doctype = CONSDIFF_DOC_DIFF;
+    input->body = job->out.body;
+    input->bodylen = job->out.bodylen;
+    job->out.body = NULL;
+    input->labels = job->common_labels;
+    job->common_labels = NULL;
+    input->flavor = flav;
+    input->cache_diff = cache;
+    memcpy(input->from_sha3, from_sha3, DIGEST256_LEN);
+    memcpy(input->to_sha3, to_sha3, DIGEST256_LEN);
+    input->description = tor_strdup(description);
+    if (job->dict_source) {
+      input->dict_source = job->dict_source;
+      job->dict_source = NULL;
+      consensus_diff_get_dict(input->dict_source,
+                              &input->dict, &input->dict_len);
+    }
   }
 
   unsigned u;
-  for (u = 0; u < ARRAY_LENGTH(handles); ++u) {
+  for (u = 0; u < n_diff_compression_methods(); ++u) {
     compress_method_t method = compress_diffs_with[u];
-    if (cache) {
-      consensus_cache_entry_handle_t *h = handles[u];
-      int this_status = status;
-      if (h == NULL) {
-        this_status = CDM_DIFF_ERROR;
+    if (method == NO_METHOD) {
+      if (cache) {
+        cdm_diff_ht_set_status(flav, from_sha3, to_sha3, method,
+                               h ? CDM_DIFF_PRESENT : CDM_DIFF_ERROR, h);
+      } else {
+        consensus_cache_entry_handle_free(h);
       }
-      tor_assert_nonfatal(h != NULL || this_status == CDM_DIFF_ERROR);
-      cdm_diff_ht_set_status(flav, from_sha3, to_sha3, method, this_status, h);
-    } else {
-      consensus_cache_entry_handle_free(handles[u]);
+    } else if (!input || !tor_compress_supports_method(method) ||
+               cdm_queue_compress_one(input, method, 1) < 0) {
+      /* Cache this error so we don't try to compute this one again. */
+      if (cache)
+        cdm_diff_ht_set_status(flav, from_sha3, to_sha3, method,
+                               CDM_DIFF_ERROR, NULL);
     }
   }
 
+  cdm_compress_input_decref(input);
   consensus_diff_worker_job_free(job);
 }
 
@@ -1653,115 +2020,8 @@ consensus_diff_queue_diff_work(consensus_cache_entry_t *diff_from,
 }
 
 /**
- * Holds requests and replies for consensus_compress_workers.
- */
-typedef struct consensus_compress_worker_job_t {
-  char *consensus;
-  size_t consensus_len;
-  consensus_flavor_t flavor;
-  config_line_t *labels_in;
-  compressed_result_t out[ARRAY_LENGTH(compress_consensus_with)];
-} consensus_compress_worker_job_t;
-
-/**
- * Free all resources held in <b>job</b>
- */
-static void
-consensus_compress_worker_job_free(consensus_compress_worker_job_t *job)
-{
-  if (!job)
-    return;
-  tor_free(job->consensus);
-  config_free_lines(job->labels_in);
-  unsigned u;
-  for (u = 0; u < n_consensus_compression_methods(); ++u) {
-    config_free_lines(job->out[u].labels);
-    tor_free(job->out[u].body);
-  }
-  tor_free(job);
-}
-/**
- * Worker function. This function runs inside a worker thread and receives
- * a consensus_compress_worker_job_t as its input.
- */
-static workqueue_reply_t
-consensus_compress_worker_threadfn(void *state_, void *work_)
-{
-  (void)state_;
-  consensus_compress_worker_job_t *job = work_;
-  consensus_flavor_t flavor = job->flavor;
-  const char *consensus = job->consensus;
-  size_t bodylen = job->consensus_len;
-
-  config_line_t *labels = config_lines_dup(job->labels_in);
-  const char *flavname = networkstatus_get_flavor_name(flavor);
-
-  cdm_labels_prepend_sha3(&labels, LABEL_SHA3_DIGEST_UNCOMPRESSED,
-                          (const uint8_t *)consensus, bodylen);
-  {
-    const char *start, *end;
-    if (router_get_networkstatus_v3_signed_boundaries(consensus,
-                                                        &start, &end) < 0) {
-      start = consensus;
-      end = consensus+bodylen;
-    }
-    cdm_labels_prepend_sha3(&labels, LABEL_SHA3_DIGEST_AS_SIGNED,
-                            (const uint8_t *)start,
-                            end - start);
-  }
-  config_line_prepend(&labels, LABEL_FLAVOR, flavname);
-  config_line_prepend(&labels, LABEL_DOCTYPE, DOCTYPE_CONSENSUS);
-
-  compress_multiple(job->out,
-                    n_consensus_compression_methods(),
-                    compress_consensus_with,
-                    (const uint8_t*)consensus, bodylen, labels);
-  config_free_lines(labels);
-  return WQ_RPL_REPLY;
-}
-
-/**
- * Worker function: This function runs in the main thread, and receives
- * a consensus_diff_compress_job_t that the worker thread has already
- * processed.
- */
-static void
-consensus_compress_worker_replyfn(void *work_)
-{
-  consensus_compress_worker_job_t *job = work_;
-
-  consensus_cache_entry_handle_t *handles[
-                               ARRAY_LENGTH(compress_consensus_with)];
-  memset(handles, 0, sizeof(handles));
-
-  store_multiple(handles,
-                 n_consensus_compression_methods(),
-                 compress_consensus_with,
-                 job->out,
-                 "consensus");
-  cdm_cache_dirty = 1;
-
-  unsigned u;
-  consensus_flavor_t f = job->flavor;
-  tor_assert((int)f < N_CONSENSUS_FLAVORS);
-  for (u = 0; u < ARRAY_LENGTH(handles); ++u) {
-    if (handles[u] == NULL)
-      continue;
-    consensus_cache_entry_handle_free(latest_consensus[f][u]);
-    latest_consensus[f][u] = handles[u];
-  }
-
-  consensus_compress_worker_job_free(job);
-}
-
-/**
- * If true, we compress in worker threads.
- */
-static int background_compression = 0;
-
-/**
- * Queue a job to compress <b>consensus</b> and store its compressed
- * text in the cache.
+ * Queue one job per compression method to compress <b>consensus</b> and
+ * store its compressed text in the cache.
  */
 static int
 consensus_queue_compression_work(const char *consensus,
@@ -1770,10 +2030,13 @@ consensus_queue_compression_work(const char *consensus,
   tor_assert(consensus);
   tor_assert(as_parsed);
 
-  consensus_compress_worker_job_t *job = tor_malloc_zero(sizeof(*job));
-  job->consensus = tor_strdup(consensus);
-  job->consensus_len = strlen(consensus);
-  job->flavor = as_parsed->flavor;
+  cdm_compress_input_t *input = tor_malloc_zero(sizeof(*input));
+  input->refcnt = 1;
+  input->doctype = CONSDIFF_DOC_CONSENSUS;
+  input->bodylen = strlen(consensus);
+  input->body = tor_memdup_nulterm(consensus, input->bodylen);
+  input->flavor = as_parsed->flavor;
+  input->description = tor_strdup("consensus");
 
   char va_str[ISO_TIME_LEN+1];
   char vu_str[ISO_TIME_LEN+1];
@@ -1781,9 +2044,9 @@ consensus_queue_compression_work(const char *consensus,
   format_iso_time_nospace(va_str, as_parsed->valid_after);
   format_iso_time_nospace(fu_str, as_parsed->fresh_until);
   format_iso_time_nospace(vu_str, as_parsed->valid_until);
-  config_line_append(&job->labels_in, LABEL_VALID_AFTER, va_str);
-  config_line_append(&job->labels_in, LABEL_FRESH_UNTIL, fu_str);
-  config_line_append(&job->labels_in, LABEL_VALID_UNTIL, vu_str);
+  config_line_append(&input->labels, LABEL_VALID_AFTER, va_str);
+  config_line_append(&input->labels, LABEL_FRESH_UNTIL, fu_str);
+  config_line_append(&input->labels, LABEL_VALID_UNTIL, vu_str);
   if (as_parsed->voters) {
     smartlist_t *hexvoters = smartlist_new();
     SMARTLIST_FOREACH_BEGIN(as_parsed->voters,
@@ -1795,29 +2058,21 @@ consensus_queue_compression_work(const char *consensus,
       smartlist_add_strdup(hexvoters, d);
     } SMARTLIST_FOREACH_END(vi);
     char *signers = smartlist_join_strings(hexvoters, ",", 0, NULL);
-    config_line_prepend(&job->labels_in, LABEL_SIGNATORIES, signers);
+    config_line_prepend(&input->labels, LABEL_SIGNATORIES, signers);
     tor_free(signers);
     SMARTLIST_FOREACH(hexvoters, char *, cp, tor_free(cp));
     smartlist_free(hexvoters);
   }
 
-  if (background_compression) {
-    workqueue_entry_t *work;
-    work = cpuworker_queue_work(WQ_PRI_LOW,
-                                consensus_compress_worker_threadfn,
-                                consensus_compress_worker_replyfn,
-                                job);
-    if (!work) {
-      consensus_compress_worker_job_free(job);
-      return -1;
-    }
-
-    return 0;
-  } else {
-    consensus_compress_worker_threadfn(NULL, job);
-    consensus_compress_worker_replyfn(job);
-    return 0;
+  int rv = 0;
+  unsigned u;
+  for (u = 0; u < n_consensus_compression_methods(); ++u) {
+    if (cdm_queue_compress_one(input, compress_consensus_with[u],
+                               background_compression) < 0)
+      rv = -1;
   }
+  cdm_compress_input_decref(input);
+  return rv;
 }
 
 /**
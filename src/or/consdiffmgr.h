@@ -17,6 +17,30 @@ typedef struct consdiff_cfg_t {
   int32_t cache_max_num;
 } consdiff_cfg_t;
 
+/**
+ * Kinds of document that the consdiffmgr compresses and serves.
+ */
+typedef enum consdiff_doctype_t {
+  CONSDIFF_DOC_CONSENSUS = 0,
+  CONSDIFF_DOC_DIFF = 1,
+} consdiff_doctype_t;
+#define CONSDIFF_N_DOCTYPES 2
+
+/**
+ * Running totals for one kind of document, compressed with one method.
+ */
+typedef struct consdiff_compress_stats_t {
+  /** How many documents have we compressed? */
+  uint64_t n_compressed;
+  /** How long did compressing them take, in total, in microseconds? */
+  uint64_t compress_usec;
+  /** How many bytes went into the compressor, and how many came out? */
+  uint64_t bytes_in;
+  uint64_t bytes_out;
+  /** How many times have we handed out a compressed document? */
+  uint64_t n_served;
+} consdiff_compress_stats_t;
+
 struct consensus_cache_entry_t; // from conscache.h
 
 int consdiffmgr_add_consensus(const char *consensus,
@@ -27,13 +51,13 @@ consdiff_status_t consdiffmgr_find_consensus(
                            consensus_flavor_t flavor,
                            compress_method_t method);
 
-consdiff_status_t consdiffmgr_find_diff_from(
+MOCK_DECL(consdiff_status_t, consdiffmgr_find_diff_from, (
                            struct consensus_cache_entry_t **entry_out,
                            consensus_flavor_t flavor,
                            int digest_type,
                            const uint8_t *digest,
                            size_t digestlen,
-                           compress_method_t method);
+                           compress_method_t method));
 
 int consensus_cache_entry_get_voter_id_digests(
                                   const struct consensus_cache_entry_t *ent,
@@ -56,6 +80,10 @@ struct sandbox_cfg_elem;
 int consdiffmgr_register_with_sandbox(struct sandbox_cfg_elem **cfg);
 void consdiffmgr_free_all(void);
 int consdiffmgr_validate(void);
+const consdiff_compress_stats_t *consdiffmgr_get_compress_stats(
+                                               consdiff_doctype_t doctype,
+                                               compress_method_t method);
+void consdiffmgr_log_heartbeat(void);
 
 #ifdef CONSDIFFMGR_PRIVATE
 STATIC unsigned n_diff_compression_methods(void);
@@ -68,6 +96,9 @@ STATIC int cdm_entry_get_sha3_value(uint8_t *digest_out,
                                     const char *label);
 STATIC int uncompress_or_copy(char **out, size_t *outlen,
                               consensus_cache_entry_t *ent);
+STATIC compression_level_t cdm_choose_compression_level(
+                               const consdiff_compress_stats_t *stats,
+                               int n_pending, int n_threads);
 #endif /* defined(CONSDIFFMGR_PRIVATE) */
 
 #endif /* !defined(TOR_CONSDIFFMGR_H) */
@@ -54,6 +54,7 @@
 #include "control.h"
 #include "directory.h"
 #include "dirserv.h"
+#include "dns.h"
 #include "dnsserv.h"
 #include "entrynodes.h"
 #include "geoip.h"
@@ -63,6 +64,7 @@
 #include "microdesc.h"
 #include "networkstatus.h"
 #include "nodelist.h"
+#include "onion.h"
 #include "policies.h"
 #include "proto_control0.h"
 #include "proto_http.h"
@@ -3166,6 +3168,29 @@ static const getinfo_item_t getinfo_items[] = {
        "Username under which the tor process is running."),
   ITEM("process/descriptor-limit", misc, "File descriptor limit."),
   ITEM("limits/max-mem-in-queues", misc, "Actual limit on memory in queues"),
+  PREFIX("dns/cache/", dns, NULL),
+  DOC("dns/cache/entries", "Number of entries in the exit DNS cache."),
+  DOC("dns/cache/bytes", "Bytes of memory used by the exit DNS cache."),
+  DOC("dns/cache/max-bytes", "Actual limit on memory in the exit DNS cache."),
+  DOC("dns/cache/hits", "Number of requests answered from the DNS cache."),
+  DOC("dns/cache/misses",
+      "Number of requests that launched a new DNS resolve."),
+  DOC("dns/cache/evictions",
+      "Number of cached DNS answers evicted before they expired."),
+  DOC("dns/cache/negative-hits",
+      "Number of DNS cache hits that were cached failures."),
+  DOC("dns/cache/coalesced",
+      "Number of requests that joined a DNS resolve already in flight."),
+  DOC("dns/cache/verdict-hits",
+      "Number of exit policy checks answered from the DNS cache."),
+  PREFIX("dns/stats/", dns, NULL),
+  DOC("dns/stats/A", "Outcome and latency counts for upstream A requests."),
+  DOC("dns/stats/AAAA",
+      "Outcome and latency counts for upstream AAAA requests."),
+  DOC("dns/stats/PTR",
+      "Outcome and latency counts for upstream PTR requests."),
+  ITEM("onionskins/admission", onion,
+       "Signals that decide whether we queue or drop new onionskins."),
   PREFIX("desc-annotations/id/", dir, "Router annotations by hexdigest."),
   PREFIX("dir/server/", dir,"Router descriptors as retrieved from a DirPort."),
   PREFIX("dir/status/", dir,
@@ -14,7 +14,8 @@
  * Right now, we use this infrastructure
  *  <ul><li>for processing onionskins in onion.c
  *      <li>for compressing consensuses in consdiffmgr.c,
- *      <li>and for calculating diffs and compressing them in consdiffmgr.c.
+ *      <li>for calculating diffs and compressing them in consdiffmgr.c,
+ *      <li>and for parsing big directory documents in routerparse.c.
  *  </ul>
  **/
 #include "or.h"
@@ -65,6 +66,9 @@ static tor_weak_rng_t request_sample_rng = TOR_WEAK_RNG_INIT;
 static int total_pending_tasks = 0;
 static int max_pending_tasks = 128;
 
+/** Largest number of onionskins that we hand to the threadpool at once. */
+#define CPUWORKER_QUEUE_BATCH 32
+
 static void
 replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
 {
@@ -72,6 +76,9 @@ replyqueue_process_cb(evutil_socket_t sock, short events, void *arg)
   (void) sock;
   (void) events;
   replyqueue_process(rq);
+  /* Refill the threadpool once per batch of replies, rather than once per
+   * reply, so that we can hand it a batch of onionskins. */
+  queue_pending_tasks();
 }
 
 /** Initialize the cpuworker subsystem. It is OK to call this more than once
@@ -103,7 +110,9 @@ cpu_init(void)
                                 replyqueue,
                                 worker_state_new,
                                 worker_state_free,
-                                NULL);
+                                NULL,
+                                get_options()->PinCPUWorkers ?
+                                  THREADPOOL_PIN_THREADS : 0);
   }
   /* Total voodoo. Can we make this more sensible? */
   max_pending_tasks = get_num_cpus(get_options()) * 64;
@@ -164,6 +173,8 @@ typedef struct cpuworker_reply_t {
 
 typedef struct cpuworker_job_u {
   or_circuit_t *circ;
+  /** The handshake type of the onionskin, for counting pending jobs. */
+  uint16_t handshake_type;
   union {
     cpuworker_request_t request;
     cpuworker_reply_t reply;
@@ -216,6 +227,15 @@ static uint64_t onionskins_usec_internal[MAX_ONION_HANDSHAKE_TYPE+1];
  * cpuworkers to give us answers for that kind of onionskin?
  */
 static uint64_t onionskins_usec_roundtrip[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Indexed by handshake type: exponentially weighted moving average of how
+ * many microseconds a worker thread has lately needed for one onionskin of
+ * that type, or 0 if we haven't measured any. */
+static double onionskins_usec_ewma[MAX_ONION_HANDSHAKE_TYPE+1];
+/** Weight of each new measurement in onionskins_usec_ewma. */
+#define ONIONSKIN_EWMA_WEIGHT 0.125
+/** Indexed by handshake type: how many onionskins of that type have we
+ * given to the worker threads without getting an answer yet? */
+static int pending_tasks_by_type[MAX_ONION_HANDSHAKE_TYPE+1];
 
 /** If any onionskin takes longer than this, we clip them to this
  * time. (microseconds) */
@@ -260,6 +280,34 @@ estimated_usec_for_onionskins(uint32_t n_requests, uint16_t onionskin_type)
   }
 }
 
+/** Return our best guess of how many microseconds a single cpuworker needs,
+ * right now, to process one onionskin of type <b>onionskin_type</b>. Unlike
+ * estimated_usec_for_onionskins(), this follows recent measurements
+ * closely. */
+uint64_t
+cpuworker_onionskin_cost_usec(uint16_t onionskin_type)
+{
+  if (onionskin_type > MAX_ONION_HANDSHAKE_TYPE) /* should be impossible */
+    return 1000;
+  if (onionskins_usec_ewma[onionskin_type] >= 1.0)
+    return (uint64_t) onionskins_usec_ewma[onionskin_type];
+  return estimated_usec_for_onionskins(1, onionskin_type);
+}
+
+/** Return an estimate of how many microseconds of work we have given to
+ * the cpuworkers without getting an answer yet, summed over all workers. */
+uint64_t
+cpuworker_backlog_usec(void)
+{
+  uint64_t usec = 0;
+  uint16_t type;
+  for (type = 0; type <= MAX_ONION_HANDSHAKE_TYPE; ++type) {
+    usec += cpuworker_onionskin_cost_usec(type) *
+      (uint64_t) pending_tasks_by_type[type];
+  }
+  return usec;
+}
+
 /** Compute the absolute and relative overhead of using the cpuworker
  * framework for onionskins of type <b>onionskin_type</b>.*/
 static int
@@ -318,6 +366,8 @@ cpuworker_onion_handshake_replyfn(void *work_)
 
   tor_assert(total_pending_tasks > 0);
   --total_pending_tasks;
+  if (job->handshake_type <= MAX_ONION_HANDSHAKE_TYPE)
+    --pending_tasks_by_type[job->handshake_type];
 
   /* Could avoid this, but doesn't matter. */
   memcpy(&rpl, &job->u.reply, sizeof(rpl));
@@ -335,6 +385,11 @@ cpuworker_onion_handshake_replyfn(void *work_)
     usec_roundtrip = ((int64_t)tv_diff.tv_sec)*1000000 + tv_diff.tv_usec;
     if (usec_roundtrip >= 0 &&
         usec_roundtrip < MAX_BELIEVABLE_ONIONSKIN_DELAY) {
+      double *ewma = &onionskins_usec_ewma[rpl.handshake_type];
+      if (*ewma < 1.0)
+        *ewma = rpl.n_usec;
+      else
+        *ewma += (rpl.n_usec - *ewma) * ONIONSKIN_EWMA_WEIGHT;
       ++onionskins_n_processed[rpl.handshake_type];
       onionskins_usec_internal[rpl.handshake_type] += rpl.n_usec;
       onionskins_usec_roundtrip[rpl.handshake_type] += usec_roundtrip;
@@ -394,7 +449,6 @@ cpuworker_onion_handshake_replyfn(void *work_)
   memwipe(&rpl, 0, sizeof(rpl));
   memwipe(job, 0, sizeof(*job));
   tor_free(job);
-  queue_pending_tasks();
 }
 
 /** Implementation function for onion handshake requests. */
@@ -471,22 +525,113 @@ cpuworker_onion_handshake_threadfn(void *state_, void *work_)
   return WQ_RPL_REPLY;
 }
 
-/** Take pending tasks from the queue and assign them to cpuworkers. */
+/** Build a job for a cpuworker to answer <b>onionskin</b> on the circuit
+ * <b>circ</b>, taking ownership of <b>onionskin</b>.  Return the job, or
+ * NULL if the circuit can't take an answer any more. */
+static cpuworker_job_t *
+cpuworker_job_new(or_circuit_t *circ, create_cell_t *onionskin)
+{
+  cpuworker_job_t *job;
+  cpuworker_request_t req;
+  int should_time;
+
+  if (!circ->p_chan) {
+    log_info(LD_OR,"circ->p_chan gone. Failing circ.");
+    tor_free(onionskin);
+    return NULL;
+  }
+
+  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
+    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
+
+  should_time = should_time_request(onionskin->handshake_type);
+  memset(&req, 0, sizeof(req));
+  req.magic = CPUWORKER_REQUEST_MAGIC;
+  req.timed = should_time;
+
+  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
+
+  tor_free(onionskin);
+
+  if (should_time)
+    tor_gettimeofday(&req.started_at);
+
+  job = tor_malloc_zero(sizeof(cpuworker_job_t));
+  job->circ = circ;
+  job->handshake_type = req.create_cell.handshake_type;
+  memcpy(&job->u.request, &req, sizeof(req));
+  memwipe(&req, 0, sizeof(req));
+
+  return job;
+}
+
+/** Hand the <b>n</b> cpuworker_job_t objects in <b>jobs</b> to the
+ * threadpool all at once.  Return 0 on success; on failure, free the jobs
+ * and return -1. */
+static int
+queue_onionskin_jobs(void **jobs, int n)
+{
+  workqueue_entry_t *entries[CPUWORKER_QUEUE_BATCH];
+  int i;
+
+  tor_assert(n <= CPUWORKER_QUEUE_BATCH);
+
+  if (threadpool_queue_work_batch(threadpool,
+                                  WQ_PRI_HIGH,
+                                  cpuworker_onion_handshake_threadfn,
+                                  cpuworker_onion_handshake_replyfn,
+                                  jobs, n, entries) < 0) {
+    log_warn(LD_BUG, "Couldn't queue work on threadpool");
+    for (i = 0; i < n; ++i)
+      tor_free(jobs[i]);
+    return -1;
+  }
+
+  total_pending_tasks += n;
+  for (i = 0; i < n; ++i) {
+    cpuworker_job_t *job = jobs[i];
+    if (job->handshake_type <= MAX_ONION_HANDSHAKE_TYPE)
+      ++pending_tasks_by_type[job->handshake_type];
+    log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
+              job, entries[i], job->circ);
+    job->circ->workqueue_entry = entries[i];
+  }
+
+  return 0;
+}
+
+/** Take pending tasks from the queue and assign them to cpuworkers, a
+ * batch at a time. */
 static void
 queue_pending_tasks(void)
 {
   or_circuit_t *circ;
   create_cell_t *onionskin = NULL;
+  void *jobs[CPUWORKER_QUEUE_BATCH];
+  cpuworker_job_t *job;
+  int n_jobs = 0;
 
-  while (total_pending_tasks < max_pending_tasks) {
+  while (total_pending_tasks + n_jobs < max_pending_tasks) {
     circ = onion_next_task(&onionskin);
 
     if (!circ)
-      return;
+      break;
 
-    if (assign_onionskin_to_cpuworker(circ, onionskin) < 0)
+    job = cpuworker_job_new(circ, onionskin);
+    if (!job) {
       log_info(LD_OR,"assign_to_cpuworker failed. Ignoring.");
+      continue;
+    }
+    jobs[n_jobs++] = job;
+    if (n_jobs == CPUWORKER_QUEUE_BATCH) {
+      if (queue_onionskin_jobs(jobs, n_jobs) < 0)
+        return;
+      n_jobs = 0;
+    }
   }
+
+  if (n_jobs)
+    queue_onionskin_jobs(jobs, n_jobs);
 }
 
 /** DOCDOC */
@@ -505,6 +650,137 @@ cpuworker_queue_work,(workqueue_priority_t priority,
                                         arg);
 }
 
+/** Shared state for one call to cpuworker_parallel_for(). */
+typedef struct parallel_for_t {
+  /** Protects <b>next_item</b> and <b>n_running</b>. */
+  tor_mutex_t lock;
+  /** Signalled when the last item finishes. */
+  tor_cond_t cond;
+  /** Function to run on each item; see cpuworker_parallel_for(). */
+  void (*fn)(void *arg, int idx);
+  void *arg;
+  /** How many items there are. */
+  int n_items;
+  /** Index of the first item that nobody has claimed yet. */
+  int next_item;
+  /** How many claimed items are still running. */
+  int n_running;
+  /** One for the caller of cpuworker_parallel_for(), and one for each
+   * helper job that may still call our reply function.  Only touched from
+   * the main thread. */
+  int refcnt;
+} parallel_for_t;
+
+/** Claim and run items from <b>pf</b> until there are none left. */
+static void
+parallel_for_run_items(parallel_for_t *pf)
+{
+  tor_mutex_acquire(&pf->lock);
+  while (pf->next_item < pf->n_items) {
+    const int idx = pf->next_item++;
+    ++pf->n_running;
+    tor_mutex_release(&pf->lock);
+    pf->fn(pf->arg, idx);
+    tor_mutex_acquire(&pf->lock);
+    if (--pf->n_running == 0 && pf->next_item == pf->n_items)
+      tor_cond_signal_all(&pf->cond);
+  }
+  tor_mutex_release(&pf->lock);
+}
+
+/** Drop a reference to <b>pf</b>, freeing it when there are none left. */
+static void
+parallel_for_decref(parallel_for_t *pf)
+{
+  if (--pf->refcnt > 0)
+    return;
+  tor_cond_uninit(&pf->cond);
+  tor_mutex_uninit(&pf->lock);
+  tor_free(pf);
+}
+
+/** Threadpool function for a cpuworker_parallel_for() helper. */
+static workqueue_reply_t
+parallel_for_threadfn(void *state_, void *work_)
+{
+  (void)state_;
+  parallel_for_run_items(work_);
+  return WQ_RPL_REPLY;
+}
+
+/** Reply function for a cpuworker_parallel_for() helper. */
+static void
+parallel_for_replyfn(void *work_)
+{
+  parallel_for_decref(work_);
+}
+
+/** Call <b>fn</b>(<b>arg</b>, <b>i</b>) for every <b>i</b> from 0 to
+ * <b>n_items</b>-1, spreading the calls over the cpuworker threads and
+ * this one, and return once they have all finished.  The calls may happen
+ * in any order, and at the same time, so <b>fn</b> must be thread-safe, and
+ * must not touch anything the main thread owns without a lock.
+ *
+ * We take items on this thread too, so that a busy threadpool only makes
+ * us slower.  If there is no threadpool, or we aren't the main thread, we
+ * just make all the calls here. */
+void
+cpuworker_parallel_for(int n_items, void (*fn)(void *arg, int idx),
+                       void *arg)
+{
+  parallel_for_t *pf;
+  workqueue_entry_t **helpers;
+  int n_helpers, i;
+
+  if (!threadpool || n_items < 2 || !in_main_thread()) {
+    for (i = 0; i < n_items; ++i)
+      fn(arg, i);
+    return;
+  }
+
+  pf = tor_malloc_zero(sizeof(parallel_for_t));
+  tor_mutex_init_for_cond(&pf->lock);
+  tor_cond_init(&pf->cond);
+  pf->fn = fn;
+  pf->arg = arg;
+  pf->n_items = n_items;
+  pf->refcnt = 1;
+
+  n_helpers = MIN(n_items - 1, get_num_cpus(get_options()));
+  helpers = tor_calloc(n_helpers, sizeof(workqueue_entry_t *));
+  for (i = 0; i < n_helpers; ++i) {
+    helpers[i] = threadpool_queue_work_priority(threadpool, WQ_PRI_HIGH,
+                                                parallel_for_threadfn,
+                                                parallel_for_replyfn, pf);
+    if (helpers[i])
+      ++pf->refcnt;
+  }
+
+  parallel_for_run_items(pf);
+  tor_mutex_acquire(&pf->lock);
+  while (pf->n_running > 0)
+    tor_cond_wait(&pf->cond, &pf->lock, NULL);
+  tor_mutex_release(&pf->lock);
+
+  /* Helpers that haven't started yet have nothing left to do. */
+  for (i = 0; i < n_helpers; ++i) {
+    if (helpers[i] && workqueue_entry_cancel(helpers[i]))
+      --pf->refcnt;
+  }
+  tor_free(helpers);
+  parallel_for_decref(pf);
+}
+
+#ifdef TOR_UNIT_TESTS
+/** Make cpuworker_parallel_for() hand work to <b>pool</b>, or to no
+ * threadpool at all if <b>pool</b> is NULL. */
+void
+cpuworker_set_threadpool_for_testing_(threadpool_t *pool)
+{
+  threadpool = pool;
+}
+#endif /* defined(TOR_UNIT_TESTS) */
+
 /** Try to tell a cpuworker to perform the public key operations necessary to
  * respond to <b>onionskin</b> for the circuit <b>circ</b>.
  *
@@ -514,10 +790,7 @@ int
 assign_onionskin_to_cpuworker(or_circuit_t *circ,
                               create_cell_t *onionskin)
 {
-  workqueue_entry_t *queue_entry;
-  cpuworker_job_t *job;
-  cpuworker_request_t req;
-  int should_time;
+  void *job;
 
   tor_assert(threadpool);
 
@@ -536,44 +809,11 @@ assign_onionskin_to_cpuworker(or_circuit_t *circ,
     return 0;
   }
 
-  if (connection_or_digest_is_known_relay(circ->p_chan->identity_digest))
-    rep_hist_note_circuit_handshake_assigned(onionskin->handshake_type);
-
-  should_time = should_time_request(onionskin->handshake_type);
-  memset(&req, 0, sizeof(req));
-  req.magic = CPUWORKER_REQUEST_MAGIC;
-  req.timed = should_time;
-
-  memcpy(&req.create_cell, onionskin, sizeof(create_cell_t));
-
-  tor_free(onionskin);
-
-  if (should_time)
-    tor_gettimeofday(&req.started_at);
-
-  job = tor_malloc_zero(sizeof(cpuworker_job_t));
-  job->circ = circ;
-  memcpy(&job->u.request, &req, sizeof(req));
-  memwipe(&req, 0, sizeof(req));
-
-  ++total_pending_tasks;
-  queue_entry = threadpool_queue_work_priority(threadpool,
-                                      WQ_PRI_HIGH,
-                                      cpuworker_onion_handshake_threadfn,
-                                      cpuworker_onion_handshake_replyfn,
-                                      job);
-  if (!queue_entry) {
-    log_warn(LD_BUG, "Couldn't queue work on threadpool");
-    tor_free(job);
+  job = cpuworker_job_new(circ, onionskin);
+  if (!job)
     return -1;
-  }
-
-  log_debug(LD_OR, "Queued task %p (qe=%p, circ=%p)",
-            job, queue_entry, job->circ);
 
-  circ->workqueue_entry = queue_entry;
-
-  return 0;
+  return queue_onionskin_jobs(&job, 1);
 }
 
 /** If <b>circ</b> has a pending handshake that hasn't been processed yet,
@@ -588,6 +828,8 @@ cpuworker_cancel_circ_handshake(or_circuit_t *circ)
   job = workqueue_entry_cancel(circ->workqueue_entry);
   if (job) {
     /* It successfully cancelled. */
+    if (job->handshake_type <= MAX_ONION_HANDSHAKE_TYPE)
+      --pending_tasks_by_type[job->handshake_type];
     memwipe(job, 0xe0, sizeof(*job));
     tor_free(job);
     tor_assert(total_pending_tasks > 0);
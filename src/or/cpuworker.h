@@ -14,6 +14,10 @@
 
 void cpu_init(void);
 void cpuworkers_rotate_keyinfo(void);
+#ifdef TOR_UNIT_TESTS
+struct threadpool_s;
+void cpuworker_set_threadpool_for_testing_(struct threadpool_s *pool);
+#endif
 struct workqueue_entry_s;
 enum workqueue_reply_t;
 enum workqueue_priority_t;
@@ -22,6 +26,8 @@ MOCK_DECL(struct workqueue_entry_s *, cpuworker_queue_work, (
                     enum workqueue_reply_t (*fn)(void *, void *),
                     void (*reply_fn)(void *),
                     void *arg));
+void cpuworker_parallel_for(int n_items, void (*fn)(void *arg, int idx),
+                            void *arg);
 
 struct create_cell_t;
 int assign_onionskin_to_cpuworker(or_circuit_t *circ,
@@ -29,6 +35,8 @@ int assign_onionskin_to_cpuworker(or_circuit_t *circ,
 
 uint64_t estimated_usec_for_onionskins(uint32_t n_requests,
                                        uint16_t onionskin_type);
+uint64_t cpuworker_onionskin_cost_usec(uint16_t onionskin_type);
+uint64_t cpuworker_backlog_usec(void);
 void cpuworker_log_onionskin_overhead(int severity, int onionskin_type,
                                       const char *onionskin_type_name);
 void cpuworker_cancel_circ_handshake(or_circuit_t *circ);
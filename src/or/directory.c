@@ -1747,8 +1747,12 @@ directory_send_command(dir_connection_t *conn,
   }
 
   if (! anonymized_connection) {
-    /* Add Accept-Encoding. */
-    accept_encoding = accept_encoding_header();
+    /* Add Accept-Encoding.  If we're asking for a consensus diff, we can
+     * also take it compressed with our current consensus as a dictionary. */
+    const int diff_dict_ok = (purpose == DIR_PURPOSE_FETCH_CONSENSUS &&
+      config_line_find(req->additional_headers,
+                       X_OR_DIFF_FROM_CONSENSUS_HEADER) != NULL);
+    accept_encoding = accept_encoding_header(diff_dict_ok);
     smartlist_add_asprintf(headers, "Accept-Encoding: %s\r\n",
                            accept_encoding);
     tor_free(accept_encoding);
@@ -2219,6 +2223,72 @@ static int handle_response_upload_renddesc_v2(dir_connection_t *,
 static int handle_response_upload_hsdesc(dir_connection_t *,
                                          const response_handler_args_t *);
 
+/** Return the text of the consensus of flavor <b>flavname</b> that we would
+ * apply a consensus diff to, or NULL if we have none.  If we had to read it
+ * from disk, set *<b>owned_out</b> to that copy, which the caller must free;
+ * otherwise set it to NULL. */
+static const char *
+dir_client_get_diff_base(const char *flavname, char **owned_out)
+{
+  /* Maybe it's in ram, maybe not. */
+  cached_dir_t *cd = dirserv_get_consensus(flavname);
+  *owned_out = NULL;
+  if (cd)
+    return cd->dir;
+  *owned_out = networkstatus_read_cached_consensus(flavname);
+  return *owned_out;
+}
+
+/** Helper for dir_client_decompress_response_body(): uncompress the
+ * consensus diff in *<b>bodyp</b>, which the server compressed with
+ * <b>compression</b> using the diff's source consensus as a dictionary.
+ * That's our current consensus, since it's the one we asked for a diff
+ * from. */
+static int
+dir_client_decompress_with_diff_dict(char **bodyp, size_t *bodylenp,
+                                     dir_connection_t *conn,
+                                     compress_method_t compression)
+{
+  const char *flavname = conn->requested_resource;
+  const char *consensus_body, *dict;
+  char *owned_consensus = NULL;
+  char *new_body = NULL;
+  size_t dict_len, new_len = 0;
+
+  if (conn->base_.purpose != DIR_PURPOSE_FETCH_CONSENSUS || !flavname) {
+    log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+           "Server '%s:%d' sent us something %s, but it wasn't a consensus.",
+           conn->base_.address, conn->base_.port,
+           compression_method_get_human_name(compression));
+    return -1;
+  }
+  consensus_body = dir_client_get_diff_base(flavname, &owned_consensus);
+  if (!consensus_body) {
+    log_warn(LD_DIR, "Received a consensus diff %s, but we can't find "
+             "any %s-flavored consensus in our current cache.",
+             compression_method_get_human_name(compression), flavname);
+    return -1;
+  }
+
+  consensus_diff_get_dict(consensus_body, &dict, &dict_len);
+  tor_uncompress_with_dict(&new_body, &new_len, *bodyp, *bodylenp,
+                           compression, dict, dict_len,
+                           1, LOG_PROTOCOL_WARN);
+  tor_free(owned_consensus);
+  if (!new_body) {
+    log_fn(LOG_PROTOCOL_WARN, LD_HTTP,
+           "Unable to decompress HTTP body (tried %s, server '%s:%d').",
+           compression_method_get_human_name(compression),
+           conn->base_.address, conn->base_.port);
+    return -1;
+  }
+
+  tor_free(*bodyp);
+  *bodyp = new_body;
+  *bodylenp = new_len;
+  return 0;
+}
+
 static int
 dir_client_decompress_response_body(char **bodyp, size_t *bodylenp,
                                     dir_connection_t *conn,
@@ -2232,6 +2302,17 @@ dir_client_decompress_response_body(char **bodyp, size_t *bodylenp,
                        conn->base_.purpose == DIR_PURPOSE_FETCH_EXTRAINFO ||
                        conn->base_.purpose == DIR_PURPOSE_FETCH_MICRODESC);
 
+  /* We can't guess at these: there's no way to tell them apart from
+   * compression without a dictionary, or to undo them without one. */
+  if (compression_method_uses_dict(compression)) {
+    if (anonymized_connection) {
+      warn_disallowed_anonymous_compression_method(compression);
+      return -1;
+    }
+    return dir_client_decompress_with_diff_dict(bodyp, bodylenp, conn,
+                                                compression);
+  }
+
   int plausible = body_is_plausible(body, body_len, conn->base_.purpose);
 
   if (plausible && compression == NO_METHOD) {
@@ -2571,16 +2652,10 @@ handle_response_fetch_consensus(dir_connection_t *conn,
   }
 
   if (looks_like_a_consensus_diff(body, body_len)) {
-    /* First find our previous consensus. Maybe it's in ram, maybe not. */
-    cached_dir_t *cd = dirserv_get_consensus(flavname);
-    const char *consensus_body;
+    /* First find our previous consensus. */
     char *owned_consensus = NULL;
-    if (cd) {
-      consensus_body = cd->dir;
-    } else {
-      owned_consensus = networkstatus_read_cached_consensus(flavname);
-      consensus_body = owned_consensus;
-    }
+    const char *consensus_body =
+      dir_client_get_diff_base(flavname, &owned_consensus);
     if (!consensus_body) {
       log_warn(LD_DIR, "Received a consensus diff, but we can't find "
                "any %s-flavored consensus in our current cache.",flavname);
@@ -3574,6 +3649,15 @@ static compress_method_t srv_meth_pref_precompressed[] = {
   NO_METHOD
 };
 
+/** Array of compression methods to use (if supported) for serving consensus
+ * diffs, ordered from best to worst.  These use the diff's source consensus
+ * as a dictionary, so they only work for diffs, and we try them before any
+ * method in srv_meth_pref_precompressed. */
+static compress_method_t srv_meth_pref_diff_dict[] = {
+  LZMA_DICT_METHOD,
+  ZSTD_DICT_METHOD,
+};
+
 /** Array of compression methods to use (if supported) for serving
  * streamed data, ordered from best to worst. */
 static compress_method_t srv_meth_pref_streaming_compression[] = {
@@ -3626,16 +3710,31 @@ static compress_method_t client_meth_pref[] = {
   NO_METHOD
 };
 
+/** Array of compression methods that use our current consensus as a
+ * dictionary, ordered from best to worst.  We only ask for these along with
+ * a consensus diff from that consensus. */
+static compress_method_t client_meth_pref_diff_dict[] = {
+  LZMA_DICT_METHOD,
+  ZSTD_DICT_METHOD,
+};
+
 /** Return a newly allocated string containing a comma separated list of
- * supported encodings. */
+ * supported encodings.  If <b>diff_dict_ok</b>, include the ones that
+ * compress a consensus diff using its source consensus as a dictionary. */
 STATIC char *
-accept_encoding_header(void)
+accept_encoding_header(int diff_dict_ok)
 {
   smartlist_t *methods = smartlist_new();
   char *header = NULL;
   compress_method_t method;
   unsigned i;
 
+  for (i = 0; diff_dict_ok && i < ARRAY_LENGTH(client_meth_pref_diff_dict);
+       ++i) {
+    method = client_meth_pref_diff_dict[i];
+    if (tor_compress_supports_method(method))
+      smartlist_add(methods, (char *)compression_method_get_name(method));
+  }
   for (i = 0; i < ARRAY_LENGTH(client_meth_pref); ++i) {
     method = client_meth_pref[i];
     if (tor_compress_supports_method(method))
@@ -3992,7 +4091,7 @@ parse_or_diff_from_header(smartlist_t **digests_out, const char *headers)
  * compression methods listed in the <b>compression_methods</b> bitfield:
  * place the method chosen (if any) into <b>compression_used_out</b>.
  */
-static struct consensus_cache_entry_t *
+STATIC struct consensus_cache_entry_t *
 find_best_diff(const smartlist_t *digests, int flav,
                unsigned compression_methods,
                compress_method_t *compression_used_out)
@@ -4001,6 +4100,18 @@ find_best_diff(const smartlist_t *digests, int flav,
 
   SMARTLIST_FOREACH_BEGIN(digests, const uint8_t *, diff_from) {
     unsigned u;
+    for (u = 0; u < ARRAY_LENGTH(srv_meth_pref_diff_dict); ++u) {
+      compress_method_t method = srv_meth_pref_diff_dict[u];
+      if (0 == (compression_methods & (1u<<method)))
+        continue;
+      if (consdiffmgr_find_diff_from(&result, flav, DIGEST_SHA3_256,
+                                     diff_from, DIGEST256_LEN,
+                                     method) == CONSDIFF_AVAILABLE) {
+        tor_assert_nonfatal(result);
+        *compression_used_out = method;
+        return result;
+      }
+    }
     for (u = 0; u < ARRAY_LENGTH(srv_meth_pref_precompressed); ++u) {
       compress_method_t method = srv_meth_pref_precompressed[u];
       if (0 == (compression_methods & (1u<<method)))
@@ -4398,14 +4509,16 @@ handle_get_current_consensus(dir_connection_t *conn,
 
   // The compress_method might have been NO_METHOD, but we store the data
   // compressed. Decompress them using `compression_used`. See fallback code in
-  // find_best_consensus() and find_best_diff().
+  // find_best_consensus() and find_best_diff().  We never pick a method that
+  // uses a dictionary unless the client asked for it.
+  const int decompress = (compress_method == NO_METHOD &&
+                          !compression_method_uses_dict(compression_used));
   write_http_response_headers(conn, -1,
-                             compress_method == NO_METHOD ?
-                               NO_METHOD : compression_used,
+                             decompress ? NO_METHOD : compression_used,
                              vary_header,
                              smartlist_len(conn->spool) == 1 ? lifetime : 0);
 
-  if (compress_method == NO_METHOD && smartlist_len(conn->spool))
+  if (decompress && smartlist_len(conn->spool))
     conn->compress_state = tor_compress_new(0, compression_used,
                                             HIGH_COMPRESSION);
 
@@ -229,7 +229,12 @@ struct get_handler_args_t;
 STATIC int handle_get_hs_descriptor_v3(dir_connection_t *conn,
                                        const struct get_handler_args_t *args);
 STATIC int directory_handle_command(dir_connection_t *conn);
-STATIC char *accept_encoding_header(void);
+STATIC char *accept_encoding_header(int diff_dict_ok);
+struct consensus_cache_entry_t;
+STATIC struct consensus_cache_entry_t *find_best_diff(
+                                     const smartlist_t *digests, int flav,
+                                     unsigned compression_methods,
+                                     compress_method_t *compression_used_out);
 STATIC int allowed_anonymous_connection_compression_method(compress_method_t);
 STATIC void warn_disallowed_anonymous_compression_method(compress_method_t);
 
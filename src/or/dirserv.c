@@ -3590,6 +3590,22 @@ typedef enum {
   SRFS_DONE
 } spooled_resource_flush_status_t;
 
+/** Helper for spooled_resource_flush_some(): release the reference that an
+ * outbuf held to the cached_dir_t <b>arg</b>. */
+static void
+spooled_cached_dir_release(void *arg)
+{
+  cached_dir_decref(arg);
+}
+
+/** Helper for spooled_resource_flush_some(): release the reference that an
+ * outbuf held to the consensus_cache_entry_t <b>arg</b>. */
+static void
+spooled_cache_entry_release(void *arg)
+{
+  consensus_cache_entry_decref(arg);
+}
+
 /** Flush some or all of the bytes from <b>spooled</b> onto <b>conn</b>.
  * Return SRFS_ERR on error, SRFS_MORE if there are more bytes to flush from
  * this spooled resource, or SRFS_DONE if we are done flushing this spooled
@@ -3648,15 +3664,30 @@ spooled_resource_flush_some(spooled_resource_t *spooled,
     remaining = total_len - spooled->cached_dir_offset;
     if (BUG(remaining < 0))
       return SRFS_ERR;
+    if (!conn->compress_state) {
+      /* The body is stored the way we mean to send it, so let the outbuf
+       * refer to all the rest of it instead of copying it.  The outbuf
+       * holds its own reference until it has flushed the last byte. */
+      if (cached) {
+        ++cached->refcnt;
+        connection_buf_add_external(ptr + spooled->cached_dir_offset,
+                                    (size_t) remaining,
+                                    spooled_cached_dir_release, cached,
+                                    TO_CONN(conn));
+      } else {
+        consensus_cache_entry_incref(cce);
+        connection_buf_add_external(ptr + spooled->cached_dir_offset,
+                                    (size_t) remaining,
+                                    spooled_cache_entry_release, cce,
+                                    TO_CONN(conn));
+      }
+      spooled->cached_dir_offset = total_len;
+      return SRFS_DONE;
+    }
     ssize_t bytes = (ssize_t) MIN(DIRSERV_CACHED_DIR_CHUNK_SIZE, remaining);
-    if (conn->compress_state) {
-      connection_buf_add_compress(
+    connection_buf_add_compress(
               ptr + spooled->cached_dir_offset,
               bytes, conn, 0);
-    } else {
-      connection_buf_add(ptr + spooled->cached_dir_offset,
-                              bytes, TO_CONN(conn));
-    }
     spooled->cached_dir_offset += bytes;
     if (spooled->cached_dir_offset >= (off_t)total_len) {
       return SRFS_DONE;
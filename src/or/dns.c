@@ -109,6 +109,69 @@ static void assert_resolve_ok(cached_resolve_t *resolve);
 /** Hash table of cached_resolve objects. */
 static HT_HEAD(cache_map, cached_resolve_t) cache_root;
 
+/** List of the answers in cache_root that we may evict to stay under the
+ * cache size limit, least recently used first. */
+static TOR_TAILQ_HEAD(cached_resolve_lru_head_t, cached_resolve_t)
+  cached_resolve_lru = TOR_TAILQ_HEAD_INITIALIZER(cached_resolve_lru);
+/** Total number of bytes charged to the entries in cache_root. */
+static size_t dns_cache_total_bytes = 0;
+/** How many requests have we answered from a cached answer? */
+static uint64_t n_dns_cache_hits = 0;
+/** How many requests have we had to launch a new resolve for? */
+static uint64_t n_dns_cache_misses = 0;
+/** How many cached answers have we evicted before they expired? */
+static uint64_t n_dns_cache_evictions = 0;
+/** How many of n_dns_cache_hits were cached failures? */
+static uint64_t n_dns_cache_negative_hits = 0;
+/** How many requests have we attached to a resolve that was already in
+ * flight, instead of launching a new one? */
+static uint64_t n_dns_coalesced = 0;
+/** How many exit policy verdicts have we reused from a cached answer? */
+static uint64_t n_dns_verdict_hits = 0;
+
+/** Number of buckets in a DNS latency histogram.  Bucket 0 counts answers
+ * that took under 1 msec; bucket i counts answers that took at least
+ * 2^(i-1) msec but under 2^i msec, and the last bucket counts everything
+ * slower than that. */
+#define DNS_LATENCY_N_BUCKETS 16
+
+/** Statistics about the upstream DNS requests of one query type. */
+typedef struct dns_query_stats_t {
+  uint64_t n_launched; /**< Requests we handed to eventdns. */
+  uint64_t n_ok; /**< Requests that got an answer. */
+  uint64_t n_notexist; /**< NXDOMAIN, or a hijacked answer. */
+  uint64_t n_servfail; /**< The server said it failed. */
+  uint64_t n_timeout; /**< We gave up waiting. */
+  uint64_t n_other_err; /**< Any other error. */
+  /** How long the answers and errors took to come back. */
+  uint64_t latency[DNS_LATENCY_N_BUCKETS];
+} dns_query_stats_t;
+
+/** Indices into dns_query_stats. */
+#define DNS_STATS_IDX_A 0
+#define DNS_STATS_IDX_AAAA 1
+#define DNS_STATS_IDX_PTR 2
+#define DNS_STATS_N_IDX 3
+/** Statistics for A, AAAA, and PTR requests. */
+static dns_query_stats_t dns_query_stats[DNS_STATS_N_IDX];
+/** Names of the query types in dns_query_stats, for GETINFO and logs. */
+static const char *dns_query_stats_names[DNS_STATS_N_IDX] = {
+  "A", "AAAA", "PTR"
+};
+
+/** The argument we give eventdns for each request we launch, which it
+ * passes back to evdns_callback(). */
+typedef struct dns_request_arg_t {
+  /** When did we launch this request?  In msec of the coarse monotonic
+   * clock, as given by monotime_coarse_absolute_msec(), for DNS latency
+   * statistics only. */
+  uint64_t launched_msec;
+  /** DNS_IPv4_A, DNS_IPv6_AAAA, or DNS_PTR. */
+  uint8_t query_type;
+  /** The address we are resolving, as given to launch_one_resolve(). */
+  char address[FLEXIBLE_ARRAY_MEMBER];
+} dns_request_arg_t;
+
 /** Global: how many IPv6 requests have we made in all? */
 static uint64_t n_ipv6_requests_made = 0;
 /** Global: how many IPv6 requests have timed out? */
@@ -143,6 +206,52 @@ static void
 init_cache_map(void)
 {
   HT_INIT(cache_map, &cache_root);
+  TOR_TAILQ_INIT(&cached_resolve_lru);
+  dns_cache_total_bytes = 0;
+}
+
+/** Return the number of bytes to charge the DNS cache for <b>resolve</b>. */
+static size_t
+cached_resolve_get_allocation(const cached_resolve_t *resolve)
+{
+  size_t n = sizeof(cached_resolve_t);
+  if (resolve->res_status_hostname == RES_STATUS_DONE_OK &&
+      resolve->result_ptr.hostname)
+    n += strlen(resolve->result_ptr.hostname) + 1;
+  return n;
+}
+
+/** Add <b>resolve</b> to the cache hash table, and charge its memory to the
+ * cache.  If it holds an answer, it becomes the most recently used answer
+ * in the LRU list. */
+static void
+cache_map_insert(cached_resolve_t *resolve)
+{
+  HT_INSERT(cache_map, &cache_root, resolve);
+  resolve->cache_bytes = cached_resolve_get_allocation(resolve);
+  dns_cache_total_bytes += resolve->cache_bytes;
+  if (resolve->state == CACHE_STATE_CACHED) {
+    TOR_TAILQ_INSERT_TAIL(&cached_resolve_lru, resolve, lru_entry);
+    resolve->in_lru = 1;
+  }
+}
+
+/** Remove the entry for the address of <b>resolve</b> from the cache hash
+ * table and the LRU list, and stop charging its memory to the cache.
+ * Return the entry we removed, or NULL if there was none. */
+static cached_resolve_t *
+cache_map_remove(cached_resolve_t *resolve)
+{
+  cached_resolve_t *removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  if (removed) {
+    tor_assert(dns_cache_total_bytes >= removed->cache_bytes);
+    dns_cache_total_bytes -= removed->cache_bytes;
+    if (removed->in_lru) {
+      TOR_TAILQ_REMOVE(&cached_resolve_lru, removed, lru_entry);
+      removed->in_lru = 0;
+    }
+  }
+  return removed;
 }
 
 /** Helper: called by eventdns when eventdns wants to log something. */
@@ -383,6 +492,159 @@ set_expiry(cached_resolve_t *resolve, time_t expires)
                        resolve);
 }
 
+/** Return the dns_query_stats entry for the eventdns query type
+ * <b>query_type</b>, or NULL if we don't keep statistics for it. */
+static dns_query_stats_t *
+dns_query_stats_for_type(uint8_t query_type)
+{
+  switch (query_type) {
+    case DNS_IPv4_A: return &dns_query_stats[DNS_STATS_IDX_A];
+    case DNS_IPv6_AAAA: return &dns_query_stats[DNS_STATS_IDX_AAAA];
+    case DNS_PTR: return &dns_query_stats[DNS_STATS_IDX_PTR];
+    default: return NULL;
+  }
+}
+
+/** Return the latency histogram bucket for an answer that took
+ * <b>msec</b> milliseconds. */
+STATIC int
+dns_latency_bucket(uint64_t msec)
+{
+  if (msec == 0)
+    return 0;
+  return MIN(tor_log2(msec) + 1, DNS_LATENCY_N_BUCKETS - 1);
+}
+
+/** Note that an upstream request of type <b>query_type</b>, launched at
+ * <b>launched_msec</b>, finished with the eventdns result <b>result</b> at
+ * <b>now_msec</b>. */
+STATIC void
+dns_note_request_done(uint8_t query_type, int result,
+                      uint64_t launched_msec, uint64_t now_msec)
+{
+  dns_query_stats_t *stats = dns_query_stats_for_type(query_type);
+  if (!stats)
+    return;
+
+  switch (result) {
+    case DNS_ERR_NONE: ++stats->n_ok; break;
+    case DNS_ERR_NOTEXIST: ++stats->n_notexist; break;
+    case DNS_ERR_SERVERFAILED: ++stats->n_servfail; break;
+    case DNS_ERR_TIMEOUT: ++stats->n_timeout; break;
+    default: ++stats->n_other_err; break;
+  }
+  if (now_msec >= launched_msec)
+    ++stats->latency[dns_latency_bucket(now_msec - launched_msec)];
+}
+
+/** Return the latency histogram bucket that holds the median answer for
+ * <b>stats</b>, or -1 if there were no answers. */
+static int
+dns_query_stats_median_bucket(const dns_query_stats_t *stats)
+{
+  uint64_t total = 0, seen = 0;
+  int i;
+  for (i = 0; i < DNS_LATENCY_N_BUCKETS; ++i)
+    total += stats->latency[i];
+  if (!total)
+    return -1;
+  for (i = 0; i < DNS_LATENCY_N_BUCKETS; ++i) {
+    seen += stats->latency[i];
+    if (seen * 2 >= total)
+      break;
+  }
+  return i;
+}
+
+/** Note that we answered a request from the cached answer
+ * <b>resolve</b>, and make that answer the most recently used one. */
+void
+dns_note_cache_hit(cached_resolve_t *resolve)
+{
+  ++n_dns_cache_hits;
+  if (resolve->res_status_ipv4 != RES_STATUS_DONE_OK &&
+      resolve->res_status_ipv6 != RES_STATUS_DONE_OK &&
+      resolve->res_status_hostname != RES_STATUS_DONE_OK)
+    ++n_dns_cache_negative_hits;
+  if (resolve->in_lru) {
+    TOR_TAILQ_REMOVE(&cached_resolve_lru, resolve, lru_entry);
+    TOR_TAILQ_INSERT_TAIL(&cached_resolve_lru, resolve, lru_entry);
+  }
+}
+
+/** Evict cached answers, least recently used first, until we have freed at
+ * least <b>min_remove_bytes</b> or there are no answers left.  Pending
+ * resolves are never evicted.  Return the number of bytes we freed. */
+STATIC size_t
+dns_cache_evict_lru(size_t min_remove_bytes)
+{
+  size_t bytes_removed = 0;
+  cached_resolve_t *resolve;
+
+  while (bytes_removed < min_remove_bytes &&
+         (resolve = TOR_TAILQ_FIRST(&cached_resolve_lru))) {
+    tor_assert(resolve->state == CACHE_STATE_CACHED);
+    tor_assert(!resolve->pending_connections);
+    bytes_removed += resolve->cache_bytes;
+    cache_map_remove(resolve);
+    if (cached_resolve_pqueue && resolve->minheap_idx >= 0)
+      smartlist_pqueue_remove(cached_resolve_pqueue,
+                              compare_cached_resolves_by_expiry_,
+                              offsetof(cached_resolve_t, minheap_idx),
+                              resolve);
+    ++n_dns_cache_evictions;
+    free_cached_resolve_(resolve);
+  }
+
+  return bytes_removed;
+}
+
+/** Return the most memory we want to spend on the DNS cache, or 0 if there
+ * is no limit. */
+static size_t
+dns_cache_get_max_allocation(void)
+{
+  const or_options_t *options = get_options();
+  if (options->MaxMemInDNSCache)
+    return (size_t) options->MaxMemInDNSCache;
+  return (size_t) (options->MaxMemInQueues / 10);
+}
+
+/** If the DNS cache is over its size limit, evict the least recently used
+ * answers until it isn't. */
+static void
+dns_cache_enforce_limit(void)
+{
+  const size_t max_bytes = dns_cache_get_max_allocation();
+  if (max_bytes && dns_cache_total_bytes > max_bytes)
+    dns_cache_evict_lru(dns_cache_total_bytes - max_bytes);
+}
+
+/** Return the number of bytes of memory the DNS cache is using. */
+size_t
+dns_cache_total_allocation(void)
+{
+  return dns_cache_total_bytes;
+}
+
+/** We're low on memory: remove expired entries from the DNS cache, then
+ * evict answers that are still valid, least recently used first, until we
+ * have freed at least <b>min_remove_bytes</b>.  Return the number of bytes
+ * we freed. */
+size_t
+dns_cache_handle_oom(time_t now, size_t min_remove_bytes)
+{
+  const size_t bytes_before = dns_cache_total_bytes;
+  size_t bytes_removed;
+
+  purge_expired_resolves(now);
+  bytes_removed = bytes_before - dns_cache_total_bytes;
+  if (bytes_removed < min_remove_bytes)
+    bytes_removed += dns_cache_evict_lru(min_remove_bytes - bytes_removed);
+
+  return bytes_removed;
+}
+
 /** Free all storage held in the DNS cache and related structures. */
 void
 dns_free_all(void)
@@ -402,6 +664,8 @@ dns_free_all(void)
     free_cached_resolve_(item);
   }
   HT_CLEAR(cache_map, &cache_root);
+  TOR_TAILQ_INIT(&cached_resolve_lru);
+  dns_cache_total_bytes = 0;
   smartlist_free(cached_resolve_pqueue);
   cached_resolve_pqueue = NULL;
   tor_free(resolv_conf_fname);
@@ -466,7 +730,7 @@ purge_expired_resolves(time_t now)
 
     if (resolve->state == CACHE_STATE_CACHED ||
         resolve->state == CACHE_STATE_PENDING) {
-      removed = HT_REMOVE(cache_map, &cache_root, resolve);
+      removed = cache_map_remove(resolve);
       if (removed != resolve) {
         log_err(LD_BUG, "The expired resolve we purged didn't match any in"
                 " the cache. Tried to purge %s (%p); instead got %s (%p).",
@@ -792,6 +1056,7 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
         pending_connection->next = resolve->pending_connections;
         resolve->pending_connections = pending_connection;
         *made_connection_pending_out = 1;
+        ++n_dns_coalesced;
         log_debug(LD_EXIT,"Connection (fd "TOR_SOCKET_T_FORMAT") waiting "
                   "for pending DNS resolve of %s", exitconn->base_.s,
                   escaped_safe_str(exitconn->base_.address));
@@ -802,6 +1067,8 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
                   exitconn->base_.s,
                   escaped_safe_str(resolve->address));
 
+        dns_note_cache_hit(resolve);
+
         *resolve_out = resolve;
 
         return set_exitconn_info_from_resolve(exitconn, resolve, hostname_out);
@@ -826,7 +1093,8 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
   *made_connection_pending_out = 1;
 
   /* Add this resolve to the cache and priority queue. */
-  HT_INSERT(cache_map, &cache_root, resolve);
+  ++n_dns_cache_misses;
+  cache_map_insert(resolve);
   set_expiry(resolve, now + RESOLVE_MAX_TIMEOUT);
 
   log_debug(LD_EXIT,"Launching %s.",
@@ -854,12 +1122,13 @@ dns_resolve_impl,(edge_connection_t *exitconn, int is_resolve,
  */
 MOCK_IMPL(STATIC int,
 set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
-                                const cached_resolve_t *resolve,
+                                cached_resolve_t *resolve,
                                 char **hostname_out))
 {
   int ipv4_ok, ipv6_ok, answer_with_ipv4, r;
   uint32_t begincell_flags;
   const int is_resolve = exitconn->base_.purpose == EXIT_PURPOSE_RESOLVE;
+  const dns_policy_verdict_t *verdict = NULL;
   tor_assert(exitconn);
   tor_assert(resolve);
 
@@ -892,13 +1161,10 @@ set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
     answer_with_ipv4 = 1;
   } else if (ipv4_ok && ipv6_ok) {
     /* If we have both, see if our exit policy has an opinion. */
-    const uint16_t port = exitconn->base_.port;
     int ipv4_allowed, ipv6_allowed;
-    tor_addr_t a4, a6;
-    tor_addr_from_ipv4h(&a4, resolve->result_ipv4.addr_ipv4);
-    tor_addr_from_in6(&a6, &resolve->result_ipv6.addr_ipv6);
-    ipv4_allowed = !router_compare_to_my_exit_policy(&a4, port);
-    ipv6_allowed = !router_compare_to_my_exit_policy(&a6, port);
+    verdict = dns_get_policy_verdict(resolve, exitconn->base_.port);
+    ipv4_allowed = verdict && verdict->ipv4_accepted;
+    ipv6_allowed = verdict && verdict->ipv6_accepted;
     if (ipv4_allowed && !ipv6_allowed) {
       answer_with_ipv4 = 1;
     } else if (ipv6_allowed && !ipv4_allowed) {
@@ -944,9 +1210,64 @@ set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
     exitconn->address_ttl = resolve->ttl_ipv6;
   }
 
+  /* Remember whether our exit policy accepts the answer we gave, so that
+   * connection_exit_connect() doesn't have to ask again. */
+  if (r == 1 && !is_resolve) {
+    if (!verdict)
+      verdict = dns_get_policy_verdict(resolve, exitconn->base_.port);
+    if (answer_with_ipv4)
+      exitconn->exit_policy_accepted = verdict && verdict->ipv4_accepted;
+    else
+      exitconn->exit_policy_accepted = verdict && verdict->ipv6_accepted &&
+        get_options()->IPv6Exit;
+  }
+
   return r;
 }
 
+/** Return whether our exit policy accepts the answers in <b>resolve</b> on
+ * <b>port</b>, computing and remembering the verdict if we haven't already
+ * done so since our policy last changed. Return NULL if we have no exit
+ * policy yet.
+ */
+STATIC const dns_policy_verdict_t *
+dns_get_policy_verdict(cached_resolve_t *resolve, uint16_t port)
+{
+  dns_policy_verdict_t *verdict;
+  uint32_t generation;
+  tor_addr_t addr;
+  int i;
+
+  /* This may rebuild our descriptor, so look at the generation after. */
+  if (!router_get_my_routerinfo())
+    return NULL;
+  generation = router_get_my_exit_policy_generation();
+
+  for (i = 0; i < DNS_N_POLICY_VERDICTS; ++i) {
+    verdict = &resolve->policy_verdicts[i];
+    if (verdict->policy_generation == generation && verdict->port == port) {
+      ++n_dns_verdict_hits;
+      return verdict;
+    }
+  }
+
+  verdict = &resolve->policy_verdicts[resolve->next_policy_verdict];
+  resolve->next_policy_verdict =
+    (resolve->next_policy_verdict + 1) % DNS_N_POLICY_VERDICTS;
+  memset(verdict, 0, sizeof(*verdict));
+  verdict->policy_generation = generation;
+  verdict->port = port;
+  if (resolve->res_status_ipv4 == RES_STATUS_DONE_OK) {
+    tor_addr_from_ipv4h(&addr, resolve->result_ipv4.addr_ipv4);
+    verdict->ipv4_accepted = !router_compare_to_my_exit_policy(&addr, port);
+  }
+  if (resolve->res_status_ipv6 == RES_STATUS_DONE_OK) {
+    tor_addr_from_in6(&addr, &resolve->result_ipv6.addr_ipv6);
+    verdict->ipv6_accepted = !router_compare_to_my_exit_policy(&addr, port);
+  }
+  return verdict;
+}
+
 /** Log an error and abort if conn is waiting for a DNS resolve.
  */
 void
@@ -1109,7 +1430,7 @@ dns_cancel_pending_resolve,(const char *address))
     tor_free(pend);
   }
 
-  tmp = HT_REMOVE(cache_map, &cache_root, resolve);
+  tmp = cache_map_remove(resolve);
   if (tmp != resolve) {
     log_err(LD_BUG, "The cancelled resolve we purged didn't match any in"
             " the cache. Tried to purge %s (%p); instead got %s (%p).",
@@ -1283,7 +1604,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
   cached_resolve_t *removed;
 
   resolve->state = CACHE_STATE_DONE;
-  removed = HT_REMOVE(cache_map, &cache_root, resolve);
+  removed = cache_map_remove(resolve);
   if (removed != resolve) {
     log_err(LD_BUG, "The pending resolve we found wasn't removable from"
             " the cache. Tried to purge %s (%p); instead got %s (%p).",
@@ -1308,7 +1629,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
     new_resolve->state = CACHE_STATE_CACHED;
 
     assert_resolve_ok(new_resolve);
-    HT_INSERT(cache_map, &cache_root, new_resolve);
+    cache_map_insert(new_resolve);
 
     if ((resolve->res_status_ipv4 == RES_STATUS_DONE_OK ||
          resolve->res_status_ipv4 == RES_STATUS_DONE_ERR) &&
@@ -1328,6 +1649,7 @@ make_pending_resolve_cached(cached_resolve_t *resolve)
     set_expiry(new_resolve, time(NULL) + dns_clip_ttl(ttl));
   }
 
+  dns_cache_enforce_limit();
   assert_cache_ok();
 }
 
@@ -1500,9 +1822,9 @@ static void
 evdns_callback(int result, char type, int count, int ttl, void *addresses,
                void *arg)
 {
-  char *arg_ = arg;
-  uint8_t orig_query_type = arg_[0];
-  char *string_address = arg_ + 1;
+  dns_request_arg_t *arg_ = arg;
+  uint8_t orig_query_type = arg_->query_type;
+  char *string_address = arg_->address;
   tor_addr_t addr;
   const char *hostname = NULL;
   int was_wildcarded = 0;
@@ -1601,9 +1923,12 @@ evdns_callback(int result, char type, int count, int ttl, void *addresses,
     log_warn(LD_BUG, "Weird; orig_query_type == %d but type == %d",
              (int)orig_query_type, (int)type);
   }
-  if (result != DNS_ERR_SHUTDOWN)
+  if (result != DNS_ERR_SHUTDOWN) {
+    dns_note_request_done(orig_query_type, result, arg_->launched_msec,
+                          monotime_coarse_absolute_msec());
     dns_found_answer(string_address, orig_query_type,
                      result, &addr, hostname, ttl);
+  }
 
   tor_free(arg_);
 }
@@ -1619,9 +1944,11 @@ launch_one_resolve(const char *address, uint8_t query_type,
     : DNS_QUERY_NO_SEARCH;
   const size_t addr_len = strlen(address);
   struct evdns_request *req = 0;
-  char *addr = tor_malloc(addr_len + 2);
-  addr[0] = (char) query_type;
-  memcpy(addr+1, address, addr_len + 1);
+  dns_request_arg_t *addr =
+    tor_malloc(offsetof(dns_request_arg_t, address) + addr_len + 1);
+  addr->launched_msec = monotime_coarse_absolute_msec();
+  addr->query_type = query_type;
+  memcpy(addr->address, address, addr_len + 1);
 
   switch (query_type) {
   case DNS_IPv4_A:
@@ -1653,6 +1980,9 @@ launch_one_resolve(const char *address, uint8_t query_type,
   }
 
   if (req) {
+    dns_query_stats_t *stats = dns_query_stats_for_type(query_type);
+    if (stats)
+      ++stats->n_launched;
     return 0;
   } else {
     tor_free(addr);
@@ -2072,12 +2402,10 @@ dump_dns_mem_usage(int severity)
 {
   /* This should never be larger than INT_MAX. */
   int hash_count = dns_cache_entry_count();
-  size_t hash_mem = sizeof(struct cached_resolve_t) * hash_count;
+  size_t hash_mem = dns_cache_total_bytes;
   hash_mem += HT_MEM_USAGE(&cache_root);
 
-  /* Print out the count and estimated size of our &cache_root.  It undercounts
-     hostnames in cached reverse resolves.
-   */
+  /* Print out the count and estimated size of our &cache_root. */
   tor_log(severity, LD_MM, "Our DNS cache has %d entries.", hash_count);
   tor_log(severity, LD_MM, "Our DNS cache size is approximately %u bytes.",
       (unsigned)hash_mem);
@@ -2129,6 +2457,134 @@ dns_get_cache_entry(cached_resolve_t *query)
 void
 dns_insert_cache_entry(cached_resolve_t *new_entry)
 {
-  HT_INSERT(cache_map, &cache_root, new_entry);
+  cache_map_insert(new_entry);
+  if (new_entry->state == CACHE_STATE_CACHED)
+    dns_cache_enforce_limit();
+}
+
+/** Return a newly allocated string describing <b>stats</b>, for
+ * GETINFO dns/stats/. */
+static char *
+dns_query_stats_format(const dns_query_stats_t *stats)
+{
+  smartlist_t *latency = smartlist_new();
+  char *latency_str, *result;
+  int i;
+  for (i = 0; i < DNS_LATENCY_N_BUCKETS; ++i)
+    smartlist_add_asprintf(latency, U64_FORMAT,
+                           U64_PRINTF_ARG(stats->latency[i]));
+  latency_str = smartlist_join_strings(latency, ",", 0, NULL);
+  tor_asprintf(&result, "launched="U64_FORMAT" ok="U64_FORMAT
+               " nxdomain="U64_FORMAT" servfail="U64_FORMAT
+               " timeout="U64_FORMAT" other="U64_FORMAT" latency-ms=%s",
+               U64_PRINTF_ARG(stats->n_launched),
+               U64_PRINTF_ARG(stats->n_ok),
+               U64_PRINTF_ARG(stats->n_notexist),
+               U64_PRINTF_ARG(stats->n_servfail),
+               U64_PRINTF_ARG(stats->n_timeout),
+               U64_PRINTF_ARG(stats->n_other_err),
+               latency_str);
+  tor_free(latency_str);
+  SMARTLIST_FOREACH(latency, char *, cp, tor_free(cp));
+  smartlist_free(latency);
+  return result;
+}
+
+/** Implementation helper for GETINFO: answers queries about the exit
+ * DNS cache and our upstream DNS requests. */
+int
+getinfo_helper_dns(control_connection_t *control_conn,
+                   const char *question, char **answer,
+                   const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+
+  if (!strcmp(question, "dns/cache/entries")) {
+    tor_asprintf(answer, "%d", dns_cache_entry_count());
+  } else if (!strcmp(question, "dns/cache/bytes")) {
+    tor_asprintf(answer, U64_FORMAT,
+                 U64_PRINTF_ARG(dns_cache_total_bytes));
+  } else if (!strcmp(question, "dns/cache/max-bytes")) {
+    tor_asprintf(answer, U64_FORMAT,
+                 U64_PRINTF_ARG(dns_cache_get_max_allocation()));
+  } else if (!strcmp(question, "dns/cache/hits")) {
+    tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(n_dns_cache_hits));
+  } else if (!strcmp(question, "dns/cache/misses")) {
+    tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(n_dns_cache_misses));
+  } else if (!strcmp(question, "dns/cache/evictions")) {
+    tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(n_dns_cache_evictions));
+  } else if (!strcmp(question, "dns/cache/negative-hits")) {
+    tor_asprintf(answer, U64_FORMAT,
+                 U64_PRINTF_ARG(n_dns_cache_negative_hits));
+  } else if (!strcmp(question, "dns/cache/coalesced")) {
+    tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(n_dns_coalesced));
+  } else if (!strcmp(question, "dns/cache/verdict-hits")) {
+    tor_asprintf(answer, U64_FORMAT, U64_PRINTF_ARG(n_dns_verdict_hits));
+  } else if (!strcmpstart(question, "dns/stats/")) {
+    const char *type = question + strlen("dns/stats/");
+    int i;
+    for (i = 0; i < DNS_STATS_N_IDX; ++i) {
+      if (!strcmp(type, dns_query_stats_names[i]))
+        *answer = dns_query_stats_format(&dns_query_stats[i]);
+    }
+  }
+  return 0;
+}
+
+/** Log a heartbeat message about how well the exit DNS cache and our
+ * upstream resolvers are doing, if we have resolved anything. */
+void
+dns_log_heartbeat(void)
+{
+  const uint64_t n_requests =
+    n_dns_cache_hits + n_dns_cache_misses + n_dns_coalesced;
+  int i;
+
+  if (!n_requests)
+    return;
+
+  log_notice(LD_HEARTBEAT, "DNS cache: %d entries using "U64_FORMAT" bytes. "
+             "Of "U64_FORMAT" requests, "U64_FORMAT" (%.1f%%) were answered "
+             "from the cache ("U64_FORMAT" negative), and "U64_FORMAT
+             " (%.1f%%) joined a resolve already in flight. "
+             U64_FORMAT" cached answers were evicted early.",
+             dns_cache_entry_count(), U64_PRINTF_ARG(dns_cache_total_bytes),
+             U64_PRINTF_ARG(n_requests), U64_PRINTF_ARG(n_dns_cache_hits),
+             100.0 * U64_TO_DBL(n_dns_cache_hits) / U64_TO_DBL(n_requests),
+             U64_PRINTF_ARG(n_dns_cache_negative_hits),
+             U64_PRINTF_ARG(n_dns_coalesced),
+             100.0 * U64_TO_DBL(n_dns_coalesced) / U64_TO_DBL(n_requests),
+             U64_PRINTF_ARG(n_dns_cache_evictions));
+
+  for (i = 0; i < DNS_STATS_N_IDX; ++i) {
+    const dns_query_stats_t *stats = &dns_query_stats[i];
+    const int median = dns_query_stats_median_bucket(stats);
+    char median_str[64];
+    if (!stats->n_launched)
+      continue;
+    if (median < 0) {
+      strlcpy(median_str, "No answers yet.", sizeof(median_str));
+    } else if (median == DNS_LATENCY_N_BUCKETS - 1) {
+      /* The last bucket has no upper bound. */
+      tor_snprintf(median_str, sizeof(median_str),
+                   "Median latency at least %d msec.", 1 << (median - 1));
+    } else {
+      tor_snprintf(median_str, sizeof(median_str),
+                   "Median latency under %d msec.", 1 << median);
+    }
+    log_notice(LD_HEARTBEAT, "DNS %s requests: "U64_FORMAT" launched, "
+               U64_FORMAT" answered, "U64_FORMAT" not found, "U64_FORMAT
+               " server failures, "U64_FORMAT" timeouts, "U64_FORMAT
+               " other errors. %s",
+               dns_query_stats_names[i],
+               U64_PRINTF_ARG(stats->n_launched),
+               U64_PRINTF_ARG(stats->n_ok),
+               U64_PRINTF_ARG(stats->n_notexist),
+               U64_PRINTF_ARG(stats->n_servfail),
+               U64_PRINTF_ARG(stats->n_timeout),
+               U64_PRINTF_ARG(stats->n_other_err),
+               median_str);
+  }
 }
 
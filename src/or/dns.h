@@ -39,6 +39,19 @@ int dns_seems_to_be_broken(void);
 int dns_seems_to_be_broken_for_ipv6(void);
 void dns_reset_correctness_checks(void);
 void dump_dns_mem_usage(int severity);
+size_t dns_cache_total_allocation(void);
+size_t dns_cache_handle_oom(time_t now, size_t min_remove_bytes);
+int getinfo_helper_dns(control_connection_t *control_conn,
+                       const char *question, char **answer,
+                       const char **errmsg);
+void dns_log_heartbeat(void);
+
+/* Direct access to the cache, for dns.c itself, the unit tests and the
+ * benchmarks.  The structure is defined in dns_structs.h. */
+struct cached_resolve_t;
+struct cached_resolve_t *dns_get_cache_entry(struct cached_resolve_t *query);
+void dns_insert_cache_entry(struct cached_resolve_t *new_entry);
+void dns_note_cache_hit(struct cached_resolve_t *resolve);
 
 #ifdef DNS_PRIVATE
 #include "dns_structs.h"
@@ -53,12 +66,16 @@ uint8_t answer_type,const cached_resolve_t *resolved));
 MOCK_DECL(STATIC void,send_resolved_hostname_cell,(edge_connection_t *conn,
 const char *hostname));
 
-cached_resolve_t *dns_get_cache_entry(cached_resolve_t *query);
-void dns_insert_cache_entry(cached_resolve_t *new_entry);
+STATIC size_t dns_cache_evict_lru(size_t min_remove_bytes);
+STATIC int dns_latency_bucket(uint64_t msec);
+STATIC const dns_policy_verdict_t *dns_get_policy_verdict(
+                                    cached_resolve_t *resolve, uint16_t port);
+STATIC void dns_note_request_done(uint8_t query_type, int result,
+                                  uint64_t launched_msec, uint64_t now_msec);
 
 MOCK_DECL(STATIC int,
 set_exitconn_info_from_resolve,(edge_connection_t *exitconn,
-                                const cached_resolve_t *resolve,
+                                cached_resolve_t *resolve,
                                 char **hostname_out));
 
 MOCK_DECL(STATIC int,
@@ -6,8 +6,8 @@
 /**
  * \file dns_structs.h
  *
- * \brief Structures used in dns.c. Exposed to dns.c, and to the unit tests
- * that declare DNS_PRIVATE.
+ * \brief Structures used in dns.c. Exposed to dns.c, to the unit tests
+ * that declare DNS_PRIVATE, and to the benchmarks.
  */
 
 #ifndef TOR_DNS_STRUCTS_H
@@ -53,6 +53,23 @@ typedef struct pending_connection_t {
 #define RES_STATUS_DONE_ERR 3
 /**@}*/
 
+/** Number of exit policy verdicts we remember for each cached answer. */
+#define DNS_N_POLICY_VERDICTS 4
+
+/** Whether our exit policy accepts the answers of a cached_resolve_t on one
+ * port. */
+typedef struct dns_policy_verdict_t {
+  /** router_get_my_exit_policy_generation() when we computed this verdict,
+   * or 0 if this slot is unused. */
+  uint32_t policy_generation;
+  /** The port this verdict is for. */
+  uint16_t port;
+  /** Does our exit policy accept the IPv4 answer on <b>port</b>? */
+  unsigned int ipv4_accepted : 1;
+  /** Does our exit policy accept the IPv6 answer on <b>port</b>? */
+  unsigned int ipv6_accepted : 1;
+} dns_policy_verdict_t;
+
 /** A DNS request: possibly completed, possibly pending; cached_resolve
  * structs are stored at the OR side in a hash table, and as a linked
  * list from oldest to newest.
@@ -96,6 +113,19 @@ typedef struct cached_resolve_t {
   pending_connection_t *pending_connections;
   /** Position of this element in the heap*/
   int minheap_idx;
+  /** Number of bytes we charged to the cache when we added this entry to the
+   * hash table. */
+  size_t cache_bytes;
+  /** True iff this entry is in the LRU list of answers we can evict. */
+  unsigned int in_lru : 1;
+  /** Links for the LRU list of cached answers, most recently used last. */
+  TOR_TAILQ_ENTRY(cached_resolve_t) lru_entry;
+  /** Exit policy verdicts for the answers above, on recently used ports, so
+   * that repeated streams to the same destination skip the policy. They
+   * expire with the answers, or when our policy changes. */
+  dns_policy_verdict_t policy_verdicts[DNS_N_POLICY_VERDICTS];
+  /** Index of the policy_verdicts slot to replace next. */
+  uint8_t next_policy_verdict;
 } cached_resolve_t;
 
 #endif /* !defined(TOR_DNS_STRUCTS_H) */
@@ -11,7 +11,6 @@
 #include "or.h"
 #include "channel.h"
 #include "config.h"
-#include "geoip.h"
 #include "main.h"
 #include "networkstatus.h"
 #include "nodelist.h"
@@ -65,6 +64,77 @@ static uint64_t conn_num_addr_rejected;
 /* Keep stats for the heartbeat. */
 static uint64_t num_single_hop_client_refused;
 
+/*
+ * Per-address client statistics.
+ *
+ * The statistics for every client address we track live in one open
+ * addressing hash table of fixed-size entries with linear probing, so that
+ * the per-cell lookups don't chase pointers. The table grows up to a size
+ * bounded by DoSClientTableMaxMem. Instead of sweeping it, every insertion
+ * looks at a few slots after an aging cursor and drops entries that no
+ * longer hold any information. Once the table is at its maximum size and
+ * mostly full, new addresses are only admitted with some probability, and
+ * must take the slot of a stale-ish inactive entry near their own: an
+ * address that keeps coming back, as an attacker's does, gets in quickly,
+ * while a flood of one-off addresses can't push everything else out.
+ *
+ * With ApproximateClientStatistics, the coin flip is replaced by a count-min
+ * sketch of recent connections per address: once the table is full, only
+ * addresses that the sketch has seen connect a few times get in, so the
+ * table holds the heavy hitters and everybody else costs a few counters.
+ */
+
+/* A slot in the DoS client table. */
+typedef struct dos_client_entry_t {
+  /* The client address as an IPv6 address, with IPv4 addresses mapped into
+   * ::ffff:0:0/96. All zeros means the slot is empty. */
+  uint8_t addr[16];
+  /* The statistics for this address. */
+  dos_client_stats_t stats;
+} dos_client_entry_t;
+
+/* Number of slots the table starts with. Must be a power of two. */
+#define DOS_CLIENT_TABLE_MIN_SIZE 1024
+/* We grow the table, or start refusing entries, once more than this many
+ * eighths of it are used. */
+#define DOS_CLIENT_TABLE_MAX_LOAD_EIGHTHS 6
+/* How many slots past the cursor we look at for stale entries on every
+ * insertion. */
+#define DOS_CLIENT_TABLE_AGE_STEP 4
+/* Once the table is full, admit a new address only one time in this many. */
+#define DOS_CLIENT_TABLE_ADMIT_ONE_IN 4
+/* How many entries from a new address' home slot on we consider when
+ * looking for one to evict in its favour. */
+#define DOS_CLIENT_TABLE_EVICT_WINDOW 8
+/* Size of the sketch of recent connections per address: 4 rows of 4096
+ * 16-bit counters, or 32 KB. */
+#define DOS_CLIENT_SKETCH_DEPTH 4
+#define DOS_CLIENT_SKETCH_WIDTH 4096
+/* Halve the sketch counters after this many connections, so that it
+ * reflects recent ones. */
+#define DOS_CLIENT_SKETCH_DECAY_PERIOD (1 << 16)
+/* Once the table is full, admit a new address only if the sketch has seen
+ * at least this many connections from it. */
+#define DOS_CLIENT_SKETCH_ADMIT_MIN 3
+
+/* The table, its number of slots (a power of two, or 0), and the number of
+ * slots in use. */
+static dos_client_entry_t *dos_client_table = NULL;
+static uint32_t dos_client_table_size = 0;
+static uint32_t dos_client_table_n_entries = 0;
+/* Next slot that the incremental aging will look at. */
+static uint32_t dos_client_table_age_cursor = 0;
+
+/* Sketch of recent connections per client address, or NULL if we aren't
+ * keeping approximate client statistics, and the number of connections
+ * added to it since it was last decayed. */
+static cmsketch_t *dos_client_sketch = NULL;
+static uint32_t dos_client_sketch_n_added = 0;
+
+/* Keep some stats for the heartbeat so we can report out. */
+static uint64_t dos_client_table_num_evicted;
+static uint64_t dos_client_table_num_refused;
+
 /* Return true iff the circuit creation mitigation is enabled. We look at the
  * consensus for this else a default value is returned. */
 MOCK_IMPL(STATIC unsigned int,
@@ -201,6 +271,336 @@ set_dos_parameters(const networkstatus_t *ns)
   dos_conn_defense_type = get_param_conn_defense_type(ns);
 }
 
+/* DoS client table private API. */
+
+/* Set <b>key_out</b> to the 16-byte DoS client table key for <b>addr</b>.
+ * Return 0 on success, or -1 if we can't track that address. */
+static int
+dos_client_key(const tor_addr_t *addr, uint8_t *key_out)
+{
+  switch (tor_addr_family(addr)) {
+    case AF_INET:
+      memset(key_out, 0, 10);
+      key_out[10] = key_out[11] = 0xff;
+      set_uint32(key_out + 12, tor_addr_to_ipv4n(addr));
+      break;
+    case AF_INET6:
+      memcpy(key_out, tor_addr_to_in6_addr8(addr), 16);
+      break;
+    default:
+      return -1;
+  }
+  /* All zeros marks an empty slot. No client connects from "::". */
+  return tor_mem_is_zero((const char *) key_out, 16) ? -1 : 0;
+}
+
+/* Return true iff the DoS client table slot <b>ent</b> is empty. */
+static inline int
+dos_client_entry_is_empty(const dos_client_entry_t *ent)
+{
+  return tor_mem_is_zero((const char *) ent->addr, sizeof(ent->addr));
+}
+
+/* Return the slot where an entry with the key <b>key</b> would go if there
+ * were no collisions. */
+static inline uint32_t
+dos_client_table_home(const uint8_t *key)
+{
+  return ((uint32_t) siphash24g(key, 16)) & (dos_client_table_size - 1);
+}
+
+/* Return the DoS client table entry with the key <b>key</b>, or NULL if
+ * there is none. */
+static dos_client_entry_t *
+dos_client_table_find(const uint8_t *key)
+{
+  uint32_t idx, mask;
+
+  if (!dos_client_table) {
+    return NULL;
+  }
+  /* The table is never full, so this ends at an empty slot at the latest. */
+  mask = dos_client_table_size - 1;
+  for (idx = dos_client_table_home(key); ; idx = (idx + 1) & mask) {
+    dos_client_entry_t *ent = &dos_client_table[idx];
+    if (dos_client_entry_is_empty(ent)) {
+      return NULL;
+    }
+    if (fast_memeq(ent->addr, key, sizeof(ent->addr))) {
+      return ent;
+    }
+  }
+}
+
+/* Put a copy of <b>ent</b> in the first empty slot of the DoS client table
+ * at or after its home slot, and return that copy. */
+static dos_client_entry_t *
+dos_client_table_place(const dos_client_entry_t *ent)
+{
+  const uint32_t mask = dos_client_table_size - 1;
+  uint32_t idx = dos_client_table_home(ent->addr);
+
+  while (!dos_client_entry_is_empty(&dos_client_table[idx])) {
+    idx = (idx + 1) & mask;
+  }
+  memcpy(&dos_client_table[idx], ent, sizeof(*ent));
+  ++dos_client_table_n_entries;
+  return &dos_client_table[idx];
+}
+
+/* Remove the entry in slot <b>idx</b> of the DoS client table. Rather than
+ * leaving a tombstone, move back any later entries of the same probe run
+ * that would otherwise become unreachable. */
+static void
+dos_client_table_remove_at(uint32_t idx)
+{
+  const uint32_t mask = dos_client_table_size - 1;
+  uint32_t hole = idx, i = idx;
+
+  for (;;) {
+    uint32_t home;
+    i = (i + 1) & mask;
+    if (dos_client_entry_is_empty(&dos_client_table[i])) {
+      break;
+    }
+    /* The entry at i may move into the hole iff the hole lies between its
+     * home slot and i. */
+    home = dos_client_table_home(dos_client_table[i].addr);
+    if (((i - hole) & mask) <= ((i - home) & mask)) {
+      memcpy(&dos_client_table[hole], &dos_client_table[i],
+             sizeof(dos_client_entry_t));
+      hole = i;
+    }
+  }
+  memset(&dos_client_table[hole], 0, sizeof(dos_client_entry_t));
+  --dos_client_table_n_entries;
+}
+
+/* Replace the DoS client table by one with <b>new_size</b> slots, which
+ * must be a power of two, holding the same entries. */
+static void
+dos_client_table_resize(uint32_t new_size)
+{
+  dos_client_entry_t *old_table = dos_client_table;
+  const uint32_t old_size = dos_client_table_size;
+  uint32_t i;
+
+  tor_assert((new_size & (new_size - 1)) == 0);
+  tor_assert(new_size > dos_client_table_n_entries);
+
+  dos_client_table = tor_calloc(new_size, sizeof(dos_client_entry_t));
+  dos_client_table_size = new_size;
+  dos_client_table_n_entries = 0;
+  dos_client_table_age_cursor = 0;
+  for (i = 0; i < old_size; ++i) {
+    if (!dos_client_entry_is_empty(&old_table[i])) {
+      dos_client_table_place(&old_table[i]);
+    }
+  }
+  tor_free(old_table);
+}
+
+/* Return the largest number of slots the DoS client table may have, given
+ * DoSClientTableMaxMem. */
+static uint32_t
+dos_client_table_max_size(void)
+{
+  const uint64_t max_entries =
+    get_options()->DoSClientTableMaxMem / sizeof(dos_client_entry_t);
+  uint32_t size = DOS_CLIENT_TABLE_MIN_SIZE;
+
+  while (size < (UINT32_C(1) << 30) && (uint64_t) size * 2 <= max_entries) {
+    size *= 2;
+  }
+  return size;
+}
+
+/* Return true iff forgetting the DoS client table entry <b>ent</b> at time
+ * <b>now</b> would change nothing: it has no connections, it isn't marked,
+ * and a new entry for its address would have the same circuit bucket. */
+static int
+dos_client_entry_is_stale(const dos_client_entry_t *ent, time_t now)
+{
+  const cc_client_stats_t *cc_stats = &ent->stats.cc_stats;
+  uint64_t elapsed;
+
+  if (ent->stats.concurrent_count > 0 || cc_stats->marked_until_ts >= now) {
+    return 0;
+  }
+  /* A new entry starts with a full bucket. */
+  if (cc_stats->last_circ_bucket_refill_ts == 0 ||
+      cc_stats->last_circ_bucket_refill_ts > now ||
+      cc_stats->circuit_bucket >= dos_cc_circuit_burst) {
+    return 1;
+  }
+  elapsed = (uint64_t) (now - cc_stats->last_circ_bucket_refill_ts);
+  return elapsed * dos_cc_circuit_rate >=
+         dos_cc_circuit_burst - cc_stats->circuit_bucket;
+}
+
+/* Look at the next few slots of the DoS client table after the aging
+ * cursor, and remove the stale entries we find. */
+static void
+dos_client_table_age(time_t now)
+{
+  const uint32_t mask = dos_client_table_size - 1;
+  int i;
+
+  for (i = 0; i < DOS_CLIENT_TABLE_AGE_STEP; ++i) {
+    const uint32_t idx = dos_client_table_age_cursor & mask;
+    const dos_client_entry_t *ent = &dos_client_table[idx];
+    if (!dos_client_entry_is_empty(ent) &&
+        dos_client_entry_is_stale(ent, now)) {
+      /* Another entry may move into this slot: look at it again next. */
+      dos_client_table_remove_at(idx);
+    } else {
+      dos_client_table_age_cursor = (idx + 1) & mask;
+    }
+  }
+}
+
+/* Count a connection from the address with the key <b>key</b> in the
+ * connection sketch, creating or freeing the sketch if the
+ * ApproximateClientStatistics option has changed. */
+static void
+dos_client_sketch_note(const uint8_t *key)
+{
+  if (!get_options()->ApproximateClientStatistics) {
+    cmsketch_free(dos_client_sketch);
+    dos_client_sketch = NULL;
+    return;
+  }
+  if (!dos_client_sketch) {
+    dos_client_sketch = cmsketch_new(DOS_CLIENT_SKETCH_DEPTH,
+                                     DOS_CLIENT_SKETCH_WIDTH);
+    dos_client_sketch_n_added = 0;
+  }
+  cmsketch_add(dos_client_sketch, key, 16);
+  if (++dos_client_sketch_n_added >= DOS_CLIENT_SKETCH_DECAY_PERIOD) {
+    cmsketch_decay(dos_client_sketch);
+    dos_client_sketch_n_added = 0;
+  }
+}
+
+/* The DoS client table is as large as it may get and full. Decide whether
+ * to admit a new address with the key <b>key</b> and, if so, evict an
+ * inactive entry near its home slot, preferring the one that made a
+ * circuit the longest ago. Return true iff there is now room for it. */
+static int
+dos_client_table_make_room(const uint8_t *key, time_t now)
+{
+  const uint32_t mask = dos_client_table_size - 1;
+  const uint32_t home = dos_client_table_home(key);
+  int64_t victim = -1;
+  time_t victim_ts = 0;
+  uint32_t i, n_seen = 0;
+
+  if (dos_client_sketch) {
+    if (cmsketch_estimate(dos_client_sketch, key, 16) <
+        DOS_CLIENT_SKETCH_ADMIT_MIN) {
+      return 0;
+    }
+  } else if (crypto_rand_int(DOS_CLIENT_TABLE_ADMIT_ONE_IN) != 0) {
+    return 0;
+  }
+
+  for (i = 0; i <= mask && n_seen < DOS_CLIENT_TABLE_EVICT_WINDOW; ++i) {
+    const uint32_t idx = (home + i) & mask;
+    const dos_client_entry_t *ent = &dos_client_table[idx];
+    if (dos_client_entry_is_empty(ent)) {
+      continue;
+    }
+    ++n_seen;
+    if (ent->stats.concurrent_count > 0 ||
+        ent->stats.cc_stats.marked_until_ts >= now) {
+      continue;
+    }
+    if (victim < 0 ||
+        ent->stats.cc_stats.last_circ_bucket_refill_ts < victim_ts) {
+      victim = idx;
+      victim_ts = ent->stats.cc_stats.last_circ_bucket_refill_ts;
+    }
+  }
+  if (victim < 0) {
+    return 0;
+  }
+  dos_client_table_remove_at((uint32_t) victim);
+  dos_client_table_num_evicted++;
+  return 1;
+}
+
+/* Return the statistics for the client address <b>addr</b>, or NULL if we
+ * aren't tracking it. */
+STATIC dos_client_stats_t *
+dos_client_table_lookup(const tor_addr_t *addr)
+{
+  uint8_t key[16];
+  dos_client_entry_t *ent;
+
+  if (dos_client_key(addr, key) < 0) {
+    return NULL;
+  }
+  ent = dos_client_table_find(key);
+  return ent ? &ent->stats : NULL;
+}
+
+/* Return the statistics for the client address <b>addr</b>, starting to
+ * track it if we weren't. Return NULL if we can't track that address, or if
+ * the table is full and didn't admit it. */
+static dos_client_stats_t *
+dos_client_table_get_or_add(const tor_addr_t *addr)
+{
+  const time_t now = approx_time();
+  dos_client_entry_t new_ent, *ent;
+
+  memset(&new_ent, 0, sizeof(new_ent));
+  if (dos_client_key(addr, new_ent.addr) < 0) {
+    return NULL;
+  }
+  dos_client_sketch_note(new_ent.addr);
+  ent = dos_client_table_find(new_ent.addr);
+  if (ent) {
+    return &ent->stats;
+  }
+
+  if (!dos_client_table) {
+    dos_client_table_resize(DOS_CLIENT_TABLE_MIN_SIZE);
+  }
+  dos_client_table_age(now);
+
+  if ((uint64_t) (dos_client_table_n_entries + 1) * 8 >
+      (uint64_t) dos_client_table_size * DOS_CLIENT_TABLE_MAX_LOAD_EIGHTHS) {
+    if (dos_client_table_size < dos_client_table_max_size()) {
+      dos_client_table_resize(dos_client_table_size * 2);
+    } else if (!dos_client_table_make_room(new_ent.addr, now)) {
+      dos_client_table_num_refused++;
+      return NULL;
+    }
+  }
+
+  return &dos_client_table_place(&new_ent)->stats;
+}
+
+/* Free the DoS client table. */
+static void
+dos_client_table_free_all(void)
+{
+  /* Connections tracked against the table we're freeing must not decrement
+   * whatever entry their address gets in the next one. */
+  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
+    if (conn->type == CONN_TYPE_OR) {
+      TO_OR_CONN(conn)->tracked_for_dos_mitigation = 0;
+    }
+  } SMARTLIST_FOREACH_END(conn);
+
+  tor_free(dos_client_table);
+  cmsketch_free(dos_client_sketch);
+  dos_client_sketch = NULL;
+  dos_client_table_size = 0;
+  dos_client_table_n_entries = 0;
+  dos_client_table_age_cursor = 0;
+}
+
 /* Free everything for the circuit creation DoS mitigation subsystem. */
 static void
 cc_free_all(void)
@@ -364,7 +764,7 @@ cc_channel_addr_is_marked(channel_t *chan)
 {
   time_t now;
   tor_addr_t addr;
-  clientmap_entry_t *entry;
+  dos_client_stats_t *client_stats;
   cc_client_stats_t *stats = NULL;
 
   if (chan == NULL) {
@@ -379,16 +779,16 @@ cc_channel_addr_is_marked(channel_t *chan)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
+  /* We are only interested in client addresses that we are tracking. */
+  client_stats = dos_client_table_lookup(&addr);
+  if (client_stats == NULL) {
+    /* We can have a connection creating circuits but not tracked by the
+     * client table. Once this DoS subsystem is enabled, we can end up here
+     * with no entry for the channel. */
     goto end;
   }
   now = approx_time();
-  stats = &entry->dos_stats.cc_stats;
+  stats = &client_stats->cc_stats;
 
  end:
   return stats && stats->marked_until_ts >= now;
@@ -432,7 +832,7 @@ void
 dos_cc_new_create_cell(channel_t *chan)
 {
   tor_addr_t addr;
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(chan);
 
@@ -450,12 +850,12 @@ dos_cc_new_create_cell(channel_t *chan)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* We can have a connection creating circuits but not tracked by the geoip
-     * cache. Once this DoS subsystem is enabled, we can end up here with no
-     * entry for the channel. */
+  /* We are only interested in client addresses that we are tracking. */
+  stats = dos_client_table_lookup(&addr);
+  if (stats == NULL) {
+    /* We can have a connection creating circuits but not tracked by the
+     * client table. Once this DoS subsystem is enabled, we can end up here
+     * with no entry for the channel. */
     goto end;
   }
 
@@ -466,26 +866,26 @@ dos_cc_new_create_cell(channel_t *chan)
 
   /* First of all, we'll try to refill the circuit bucket opportunistically
    * before we assess. */
-  cc_stats_refill_bucket(&entry->dos_stats.cc_stats, &addr);
+  cc_stats_refill_bucket(&stats->cc_stats, &addr);
 
   /* Take a token out of the circuit bucket if we are above 0 so we don't
    * underflow the bucket. */
-  if (entry->dos_stats.cc_stats.circuit_bucket > 0) {
-    entry->dos_stats.cc_stats.circuit_bucket--;
+  if (stats->cc_stats.circuit_bucket > 0) {
+    stats->cc_stats.circuit_bucket--;
   }
 
   /* This is the detection. Assess at every CREATE cell if the client should
    * get marked as malicious. This should be kept as fast as possible. */
-  if (cc_has_exhausted_circuits(&entry->dos_stats)) {
+  if (cc_has_exhausted_circuits(stats)) {
     /* If this is the first time we mark this entry, log it a info level.
      * Under heavy DDoS, logging each time we mark would results in lots and
      * lots of logs. */
-    if (entry->dos_stats.cc_stats.marked_until_ts == 0) {
+    if (stats->cc_stats.marked_until_ts == 0) {
       log_debug(LD_DOS, "Detected circuit creation DoS by address: %s",
                 fmt_addr(&addr));
       cc_num_marked_addrs++;
     }
-    cc_mark_client(&entry->dos_stats.cc_stats);
+    cc_mark_client(&stats->cc_stats);
   }
 
  end:
@@ -525,7 +925,7 @@ dos_cc_get_defense_type(channel_t *chan)
 dos_conn_defense_type_t
 dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(addr);
 
@@ -534,15 +934,15 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(addr, NULL, GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
+  /* We are only interested in client addresses that we are tracking. */
+  stats = dos_client_table_lookup(addr);
+  if (stats == NULL) {
     goto end;
   }
 
   /* Need to be above the maximum concurrent connection count to trigger a
    * defense. */
-  if (entry->dos_stats.concurrent_count > dos_conn_max_concurrent_count) {
+  if (stats->concurrent_count > dos_conn_max_concurrent_count) {
     conn_num_addr_rejected++;
     return dos_conn_defense_type;
   }
@@ -553,41 +953,6 @@ dos_conn_addr_get_defense_type(const tor_addr_t *addr)
 
 /* General API */
 
-/* Take any appropriate actions for the given geoip entry that is about to get
- * freed. This is called for every entry that is being freed.
- *
- * This function will clear out the connection tracked flag if the concurrent
- * count of the entry is above 0 so if those connections end up being seen by
- * this subsystem, we won't try to decrement the counter for a new geoip entry
- * that might have been added after this call for the same address. */
-void
-dos_geoip_entry_about_to_free(const clientmap_entry_t *geoip_ent)
-{
-  tor_assert(geoip_ent);
-
-  /* The count is down to 0 meaning no connections right now, we can safely
-   * clear the geoip entry from the cache. */
-  if (geoip_ent->dos_stats.concurrent_count == 0) {
-    goto end;
-  }
-
-  /* For each connection matching the geoip entry address, we'll clear the
-   * tracked flag because the entry is about to get removed from the geoip
-   * cache. We do not try to decrement if the flag is not set. */
-  SMARTLIST_FOREACH_BEGIN(get_connection_array(), connection_t *, conn) {
-    if (conn->type == CONN_TYPE_OR) {
-      or_connection_t *or_conn = TO_OR_CONN(conn);
-      if (!tor_addr_compare(&geoip_ent->addr, &or_conn->real_addr,
-                            CMP_EXACT)) {
-        or_conn->tracked_for_dos_mitigation = 0;
-      }
-    }
-  } SMARTLIST_FOREACH_END(conn);
-
- end:
-  return;
-}
-
 /* Note down that we've just refused a single hop client. This increments a
  * counter later used for the heartbeat. */
 void
@@ -622,6 +987,7 @@ dos_log_heartbeat(void)
   char *conn_msg = NULL;
   char *cc_msg = NULL;
   char *single_hop_client_msg = NULL;
+  char *table_msg = NULL;
 
   if (!dos_is_enabled()) {
     goto end;
@@ -640,6 +1006,12 @@ dos_log_heartbeat(void)
                  conn_num_addr_rejected);
   }
 
+  tor_asprintf(&table_msg,
+               " %" PRIu32 " client addresses tracked,"
+               " %" PRIu64 " evicted, %" PRIu64 " refused.",
+               dos_client_table_n_entries, dos_client_table_num_evicted,
+               dos_client_table_num_refused);
+
   if (dos_should_refuse_single_hop_client()) {
     tor_asprintf(&single_hop_client_msg,
                  " %" PRIu64 " single hop clients refused.",
@@ -647,14 +1019,16 @@ dos_log_heartbeat(void)
   }
 
   log_notice(LD_HEARTBEAT,
-             "DoS mitigation since startup:%s%s%s",
+             "DoS mitigation since startup:%s%s%s%s",
              (cc_msg != NULL) ? cc_msg : " [cc not enabled]",
              (conn_msg != NULL) ? conn_msg : " [conn not enabled]",
-             (single_hop_client_msg != NULL) ? single_hop_client_msg : "");
+             (single_hop_client_msg != NULL) ? single_hop_client_msg : "",
+             table_msg);
 
   tor_free(conn_msg);
   tor_free(cc_msg);
   tor_free(single_hop_client_msg);
+  tor_free(table_msg);
 
  end:
   return;
@@ -665,7 +1039,7 @@ dos_log_heartbeat(void)
 void
 dos_new_client_conn(or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(or_conn);
 
@@ -683,20 +1057,17 @@ dos_new_client_conn(or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (BUG(entry == NULL)) {
-    /* Should never happen because we note down the address in the geoip
-     * cache before this is called. */
+  stats = dos_client_table_get_or_add(&or_conn->real_addr);
+  if (stats == NULL) {
+    /* Either we can't track this kind of address, or the client table is
+     * full and didn't admit it this time. */
     goto end;
   }
 
-  entry->dos_stats.concurrent_count++;
+  stats->concurrent_count++;
   or_conn->tracked_for_dos_mitigation = 1;
   log_debug(LD_DOS, "Client address %s has now %u concurrent connections.",
-            fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            fmt_addr(&or_conn->real_addr), stats->concurrent_count);
 
  end:
   return;
@@ -706,7 +1077,7 @@ dos_new_client_conn(or_connection_t *or_conn)
 void
 dos_close_client_conn(const or_connection_t *or_conn)
 {
-  clientmap_entry_t *entry;
+  dos_client_stats_t *stats;
 
   tor_assert(or_conn);
 
@@ -717,27 +1088,24 @@ dos_close_client_conn(const or_connection_t *or_conn)
     goto end;
   }
 
-  /* We are only interested in client connection from the geoip cache. */
-  entry = geoip_lookup_client(&or_conn->real_addr, NULL,
-                              GEOIP_CLIENT_CONNECT);
-  if (entry == NULL) {
-    /* This can happen because we can close a connection before the channel
-     * got to be noted down in the geoip cache. */
+  /* Entries with connections are never removed from the client table, but
+   * the whole table is freed along with the rest of this subsystem. */
+  stats = dos_client_table_lookup(&or_conn->real_addr);
+  if (stats == NULL) {
     goto end;
   }
 
   /* Extra super duper safety. Going below 0 means an underflow which could
    * lead to most likely a false positive. In theory, this should never happen
    * but lets be extra safe. */
-  if (BUG(entry->dos_stats.concurrent_count == 0)) {
+  if (BUG(stats->concurrent_count == 0)) {
     goto end;
   }
 
-  entry->dos_stats.concurrent_count--;
+  stats->concurrent_count--;
   log_debug(LD_DOS, "Client address %s has lost a connection. Concurrent "
                     "connections are now at %u",
-            fmt_addr(&or_conn->real_addr),
-            entry->dos_stats.concurrent_count);
+            fmt_addr(&or_conn->real_addr), stats->concurrent_count);
 
  end:
   return;
@@ -782,6 +1150,8 @@ dos_free_all(void)
   /* Free the connection mitigation subsystem. It is safe to do this even if
    * it wasn't initialized. */
   conn_free_all();
+
+  dos_client_table_free_all();
 }
 
 /* Initialize the Denial of Service subsystem. */
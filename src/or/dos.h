@@ -29,8 +29,8 @@ typedef struct cc_client_stats_t {
 } cc_client_stats_t;
 
 /* This object is a top level object that contains everything related to the
- * per-IP client DoS mitigation. Because it is per-IP, it is used in the geoip
- * clientmap_entry_t object. */
+ * per-IP client DoS mitigation. Because it is per-IP, it is kept in the DoS
+ * client table of dos.c. */
 typedef struct dos_client_stats_t {
   /* Concurrent connection count from the specific address. 2^32 is most
    * likely way too big for the amount of allowed file descriptors. */
@@ -43,15 +43,11 @@ typedef struct dos_client_stats_t {
 
 /* General API. */
 
-/* Stub. */
-struct clientmap_entry_t;
-
 void dos_init(void);
 void dos_free_all(void);
 void dos_consensus_has_changed(const networkstatus_t *ns);
 int dos_enabled(void);
 void dos_log_heartbeat(void);
-void dos_geoip_entry_about_to_free(const struct clientmap_entry_t *geoip_ent);
 
 void dos_new_client_conn(or_connection_t *or_conn);
 void dos_close_client_conn(const or_connection_t *or_conn);
@@ -126,6 +122,7 @@ STATIC uint32_t get_param_cc_min_concurrent_connection(
                                             const networkstatus_t *ns);
 
 STATIC uint64_t get_circuit_rate_per_second(void);
+STATIC dos_client_stats_t *dos_client_table_lookup(const tor_addr_t *addr);
 STATIC void cc_stats_refill_bucket(cc_client_stats_t *stats,
                                    const tor_addr_t *addr);
 
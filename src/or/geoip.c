@@ -13,14 +13,16 @@
  * statistical functions, which collect statistics about different kinds of
  * per-country usage.
  *
- * The geoip lookup tables are implemented as sorted lists of disjoint address
- * ranges, each mapping to a singleton geoip_country_t.  These country objects
- * are also indexed by their names in a hashtable.
+ * The geoip lookup tables are implemented as flat, sorted arrays of disjoint
+ * address ranges, each mapping to a singleton geoip_country_t.  These
+ * country objects are also indexed by their names in a hashtable.
  *
  * The tables are populated from disk at startup by the geoip_load_file()
- * function.  For more information on the file format they read, see that
- * function.  See the scripts and the README file in src/config for more
- * information about how those files are generated.
+ * function, either by parsing a text file or by memory-mapping a database
+ * precompiled by src/config/geoip-compile.py.  For more information on the
+ * file formats they read, see that function.  See the scripts and the README
+ * file in src/config for more information about how those files are
+ * generated.
  *
  * Tor uses GeoIP information in order to implement user requests (such as
  * ExcludeNodes {cc}), and to keep track of how much usage relays are getting
@@ -33,25 +35,68 @@
 #include "config.h"
 #include "control.h"
 #include "dnsserv.h"
-#include "dos.h"
 #include "geoip.h"
 #include "routerlist.h"
 
 static void init_geoip_countries(void);
 
-/** An entry from the GeoIP IPv4 file: maps an IPv4 range to a country. */
-typedef struct geoip_ipv4_entry_t {
-  uint32_t ip_low; /**< The lowest IP in the range, in host order */
-  uint32_t ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv4_entry_t;
+/** Magic string at the start of a precompiled GeoIP database. */
+#define GEOIP_DB_MAGIC "TORGEOIP"
+/** Length of GEOIP_DB_MAGIC, without its NUL. */
+#define GEOIP_DB_MAGIC_LEN 8
+/** The only precompiled GeoIP database version we understand. */
+#define GEOIP_DB_VERSION 1
+/** Length of the header of a precompiled GeoIP database.
+ *
+ * A precompiled database is a header, followed by a table of 2-letter
+ * country codes, followed by the address ranges in three arrays: the lowest
+ * address of each range, the highest address of each range, and the index
+ * of each range's country in the country code table.  All integers and
+ * addresses are big-endian, and the ranges are sorted and disjoint.  The
+ * header is:
+ *
+ *    magic           [8 bytes]    GEOIP_DB_MAGIC
+ *    version         [1 byte]     GEOIP_DB_VERSION
+ *    family          [1 byte]     4 or 6
+ *    n_countries     [2 bytes]
+ *    n_entries       [4 bytes]
+ *    source digest   [20 bytes]   SHA1 of the text file it was compiled from
+ *    padding         [4 bytes]
+ *
+ * The country code table is padded with zeros to a multiple of 8 bytes.
+ */
+#define GEOIP_DB_HEADER_LEN 40
 
-/** An entry from the GeoIP IPv6 file: maps an IPv6 range to a country. */
-typedef struct geoip_ipv6_entry_t {
-  struct in6_addr ip_low; /**< The lowest IP in the range, in host order */
-  struct in6_addr ip_high; /**< The highest IP in the range, in host order */
-  intptr_t country; /**< An index into geoip_countries */
-} geoip_ipv6_entry_t;
+/** A GeoIP database for one address family.
+ *
+ * We keep the ranges in flat arrays of big-endian addresses and country
+ * indices, rather than as a list of separately allocated entries, so that
+ * lookups don't chase pointers, and so that a precompiled database can be
+ * used straight out of a memory-mapped file. */
+typedef struct geoip_table_t {
+  /** Length of an address: 4 for IPv4, 16 for IPv6. */
+  size_t addr_len;
+  /** Number of ranges in this table. */
+  uint32_t n_entries;
+  /** Number of ranges we have allocated room for, if we parsed this table
+   * from a text file; 0 if it is memory-mapped. */
+  uint32_t n_allocated;
+  /** The lowest address of each range, sorted. */
+  uint8_t *ip_low;
+  /** The highest address of each range. */
+  uint8_t *ip_high;
+  /** The country of each range, as a 2-byte big-endian index.  If
+   * country_map is set, this indexes country_map; otherwise, it indexes
+   * geoip_countries. */
+  uint8_t *country;
+  /** If this table is memory-mapped, a map from the database's country
+   * indices to indices in geoip_countries, and its length. */
+  country_t *country_map;
+  uint16_t n_mapped_countries;
+  /** If this table is memory-mapped, the mapping; else NULL.  We never
+   * write to ip_low, ip_high, or country when this is set. */
+  tor_mmap_t *mmap;
+} geoip_table_t;
 
 /** A per-country record for GeoIP request history. */
 typedef struct geoip_country_t {
@@ -65,9 +110,8 @@ static smartlist_t *geoip_countries = NULL;
  * The index is encoded in the pointer, and 1 is added so that NULL can mean
  * not found. */
 static strmap_t *country_idxplus1_by_lc_code = NULL;
-/** Lists of all known geoip_ipv4_entry_t and geoip_ipv6_entry_t, sorted
- * by their respective ip_low. */
-static smartlist_t *geoip_ipv4_entries = NULL, *geoip_ipv6_entries = NULL;
+/** The IPv4 and IPv6 GeoIP databases, or NULL if we have none. */
+static geoip_table_t *geoip_ipv4_table = NULL, *geoip_ipv6_table = NULL;
 
 /** SHA1 digest of the GeoIP files to include in extra-info descriptors. */
 static char geoip_digest[DIGEST_LEN];
@@ -122,20 +166,14 @@ geoip_get_country,(const char *country))
   return (country_t)idx;
 }
 
-/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
- * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
-static void
-geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
-                const char *country)
+/** Return the index in geoip_countries of the 2-letter country code
+ * <b>country</b>, adding it if we haven't seen it before. */
+static intptr_t
+geoip_add_country(const char *country)
 {
   intptr_t idx;
   void *idxplus1_;
 
-  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
-    return;
-  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
-    return;
-
   idxplus1_ = strmap_get_lc(country_idxplus1_by_lc_code, country);
 
   if (!idxplus1_) {
@@ -152,19 +190,172 @@ geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
     geoip_country_t *c = smartlist_get(geoip_countries, idx);
     tor_assert(!strcasecmp(c->countrycode, country));
   }
+  return idx;
+}
+
+/** Allocate and return a new, empty GeoIP table for addresses
+ * <b>addr_len</b> bytes long. */
+static geoip_table_t *
+geoip_table_new(size_t addr_len)
+{
+  geoip_table_t *t = tor_malloc_zero(sizeof(geoip_table_t));
+  t->addr_len = addr_len;
+  return t;
+}
+
+/** Release all storage held by the GeoIP table <b>t</b>. */
+static void
+geoip_table_free(geoip_table_t *t)
+{
+  if (!t)
+    return;
+  if (t->mmap) {
+    tor_munmap_file(t->mmap);
+  } else {
+    tor_free(t->ip_low);
+    tor_free(t->ip_high);
+    tor_free(t->country);
+  }
+  tor_free(t->country_map);
+  tor_free(t);
+}
+
+/** Append a range from the big-endian address <b>low</b> to the big-endian
+ * address <b>high</b>, mapping to the country index <b>idx</b>, to the
+ * in-memory GeoIP table <b>t</b>. */
+static void
+geoip_table_add(geoip_table_t *t, const uint8_t *low, const uint8_t *high,
+                intptr_t idx)
+{
+  tor_assert(!t->mmap);
+  tor_assert(idx >= 0 && idx <= UINT16_MAX);
+  if (t->n_entries == t->n_allocated) {
+    t->n_allocated = t->n_allocated ? t->n_allocated * 2 : 256;
+    t->ip_low = tor_reallocarray(t->ip_low, t->n_allocated, t->addr_len);
+    t->ip_high = tor_reallocarray(t->ip_high, t->n_allocated, t->addr_len);
+    t->country = tor_reallocarray(t->country, t->n_allocated, 2);
+  }
+  memcpy(t->ip_low + t->n_entries * t->addr_len, low, t->addr_len);
+  memcpy(t->ip_high + t->n_entries * t->addr_len, high, t->addr_len);
+  set_uint16(t->country + t->n_entries * 2, htons((uint16_t)idx));
+  ++t->n_entries;
+}
+
+/** A GeoIP range, as used while sorting a geoip_table_t. */
+typedef struct geoip_range_t {
+  uint8_t ip_low[16];
+  uint8_t ip_high[16];
+  uint8_t country[2];
+} geoip_range_t;
+
+/** Sorting helper: return -1, 1, or 0 based on comparison of the lowest
+ * addresses of two geoip_range_t. */
+static int
+geoip_compare_ranges_(const void *_a, const void *_b)
+{
+  const geoip_range_t *a = _a, *b = _b;
+  return fast_memcmp(a->ip_low, b->ip_low, sizeof(a->ip_low));
+}
+
+/** Sort the ranges in the in-memory GeoIP table <b>t</b> by their lowest
+ * address, if they aren't sorted already. */
+static void
+geoip_table_sort(geoip_table_t *t)
+{
+  const size_t len = t->addr_len;
+  geoip_range_t *ranges;
+  uint32_t i;
+
+  tor_assert(!t->mmap);
+  for (i = 1; i < t->n_entries; ++i) {
+    if (fast_memcmp(t->ip_low + (i-1)*len, t->ip_low + i*len, len) > 0)
+      break;
+  }
+  if (i >= t->n_entries)
+    return;
+
+  /* Addresses are left-aligned in ip_low and ip_high, and big-endian, so
+   * memcmp() orders them correctly. */
+  ranges = tor_calloc(t->n_entries, sizeof(geoip_range_t));
+  for (i = 0; i < t->n_entries; ++i) {
+    memcpy(ranges[i].ip_low, t->ip_low + i*len, len);
+    memcpy(ranges[i].ip_high, t->ip_high + i*len, len);
+    memcpy(ranges[i].country, t->country + i*2, 2);
+  }
+  qsort(ranges, t->n_entries, sizeof(geoip_range_t), geoip_compare_ranges_);
+  for (i = 0; i < t->n_entries; ++i) {
+    memcpy(t->ip_low + i*len, ranges[i].ip_low, len);
+    memcpy(t->ip_high + i*len, ranges[i].ip_high, len);
+    memcpy(t->country + i*2, ranges[i].country, 2);
+  }
+  tor_free(ranges);
+}
+
+/** Return the index in geoip_countries of the country for the big-endian
+ * address <b>addr</b> in the GeoIP table <b>t</b>, or 0 if it is in no
+ * range. */
+static int
+geoip_table_lookup(const geoip_table_t *t, const uint8_t *addr)
+{
+  const size_t len = t->addr_len;
+  uint32_t lo = 0, hi = t->n_entries;
+  uint16_t idx;
+
+  /* Find the number of ranges that start at or below addr: the last of
+   * those is the only one that might contain it. */
+  if (len == 4) {
+    const uint32_t a = ntohl(get_uint32(addr));
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (ntohl(get_uint32(t->ip_low + mid*4)) <= a)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == 0 || ntohl(get_uint32(t->ip_high + (lo-1)*4)) < a)
+      return 0;
+  } else {
+    while (lo < hi) {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (fast_memcmp(t->ip_low + mid*len, addr, len) <= 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == 0 || fast_memcmp(t->ip_high + (lo-1)*len, addr, len) < 0)
+      return 0;
+  }
+
+  idx = ntohs(get_uint16(t->country + (lo-1)*2));
+  if (t->country_map)
+    return idx < t->n_mapped_countries ? (int)t->country_map[idx] : 0;
+  return idx;
+}
+
+/** Add an entry to a GeoIP table, mapping all IP addresses between <b>low</b>
+ * and <b>high</b>, inclusive, to the 2-letter country code <b>country</b>. */
+static void
+geoip_add_entry(const tor_addr_t *low, const tor_addr_t *high,
+                const char *country)
+{
+  intptr_t idx;
+
+  IF_BUG_ONCE(tor_addr_family(low) != tor_addr_family(high))
+    return;
+  IF_BUG_ONCE(tor_addr_compare(high, low, CMP_EXACT) < 0)
+    return;
+
+  idx = geoip_add_country(country);
 
   if (tor_addr_family(low) == AF_INET) {
-    geoip_ipv4_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv4_entry_t));
-    ent->ip_low = tor_addr_to_ipv4h(low);
-    ent->ip_high = tor_addr_to_ipv4h(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv4_entries, ent);
+    uint8_t low_be[4], high_be[4];
+    set_uint32(low_be, tor_addr_to_ipv4n(low));
+    set_uint32(high_be, tor_addr_to_ipv4n(high));
+    geoip_table_add(geoip_ipv4_table, low_be, high_be, idx);
   } else if (tor_addr_family(low) == AF_INET6) {
-    geoip_ipv6_entry_t *ent = tor_malloc_zero(sizeof(geoip_ipv6_entry_t));
-    ent->ip_low = *tor_addr_to_in6_assert(low);
-    ent->ip_high = *tor_addr_to_in6_assert(high);
-    ent->country = idx;
-    smartlist_add(geoip_ipv6_entries, ent);
+    geoip_table_add(geoip_ipv6_table,
+                    tor_addr_to_in6_assert(low)->s6_addr,
+                    tor_addr_to_in6_assert(high)->s6_addr, idx);
   }
 }
 
@@ -180,11 +371,15 @@ geoip_parse_entry(const char *line, sa_family_t family)
   if (!geoip_countries)
     init_geoip_countries();
   if (family == AF_INET) {
-    if (!geoip_ipv4_entries)
-      geoip_ipv4_entries = smartlist_new();
+    if (!geoip_ipv4_table || geoip_ipv4_table->mmap) {
+      geoip_table_free(geoip_ipv4_table);
+      geoip_ipv4_table = geoip_table_new(4);
+    }
   } else if (family == AF_INET6) {
-    if (!geoip_ipv6_entries)
-      geoip_ipv6_entries = smartlist_new();
+    if (!geoip_ipv6_table || geoip_ipv6_table->mmap) {
+      geoip_table_free(geoip_ipv6_table);
+      geoip_ipv6_table = geoip_table_new(16);
+    }
   } else {
     log_warn(LD_GENERAL, "Unsupported family: %d", family);
     return -1;
@@ -237,64 +432,6 @@ geoip_parse_entry(const char *line, sa_family_t family)
   return -1;
 }
 
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_entries_(const void **_a, const void **_b)
-{
-  const geoip_ipv4_entry_t *a = *_a, *b = *_b;
-  if (a->ip_low < b->ip_low)
-    return -1;
-  else if (a->ip_low > b->ip_low)
-    return 1;
-  else
-    return 0;
-}
-
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IP (a pointer
- * to a uint32_t in host order) to a geoip_ipv4_entry_t */
-static int
-geoip_ipv4_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  /* No alignment issue here, since _key really is a pointer to uint32_t */
-  const uint32_t addr = *(uint32_t *)_key;
-  const geoip_ipv4_entry_t *entry = *_member;
-  if (addr < entry->ip_low)
-    return -1;
-  else if (addr > entry->ip_high)
-    return 1;
-  else
-    return 0;
-}
-
-/** Sorting helper: return -1, 1, or 0 based on comparison of two
- * geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_entries_(const void **_a, const void **_b)
-{
-  const geoip_ipv6_entry_t *a = *_a, *b = *_b;
-  return fast_memcmp(a->ip_low.s6_addr, b->ip_low.s6_addr,
-                     sizeof(struct in6_addr));
-}
-
-/** bsearch helper: return -1, 1, or 0 based on comparison of an IPv6
- * (a pointer to a in6_addr) to a geoip_ipv6_entry_t */
-static int
-geoip_ipv6_compare_key_to_entry_(const void *_key, const void **_member)
-{
-  const struct in6_addr *addr = (struct in6_addr *)_key;
-  const geoip_ipv6_entry_t *entry = *_member;
-
-  if (fast_memcmp(addr->s6_addr, entry->ip_low.s6_addr,
-             sizeof(struct in6_addr)) < 0)
-    return -1;
-  else if (fast_memcmp(addr->s6_addr, entry->ip_high.s6_addr,
-                  sizeof(struct in6_addr)) > 0)
-    return 1;
-  else
-    return 0;
-}
-
 /** Return 1 if we should collect geoip stats on bridge users, and
  * include them in our extrainfo descriptor. Else return 0. */
 int
@@ -321,6 +458,70 @@ init_geoip_countries(void)
   strmap_set_lc(country_idxplus1_by_lc_code, "??", (void*)(1));
 }
 
+/** Try to use the memory-mapped file <b>map</b>, named <b>filename</b>, as
+ * a precompiled GeoIP database for <b>family</b>.  On success, take
+ * ownership of <b>map</b>, remember the digest of the text file it was
+ * compiled from in <b>digest_out</b>, and return a new geoip_table_t.  On
+ * failure, return NULL.  See GEOIP_DB_HEADER_LEN for the format. */
+static geoip_table_t *
+geoip_table_from_mmap(sa_family_t family, const char *filename,
+                      tor_mmap_t *map, char *digest_out)
+{
+  const uint8_t *data = (const uint8_t *)map->data;
+  const size_t addr_len = (family == AF_INET) ? 4 : 16;
+  geoip_table_t *t;
+  uint16_t n_countries, i;
+  uint32_t n_entries;
+  uint64_t countries_len, needed;
+
+  if (map->size < GEOIP_DB_HEADER_LEN ||
+      fast_memneq(data, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN)) {
+    log_warn(LD_GENERAL, "GEOIP file %s is not a precompiled database.",
+             filename);
+    return NULL;
+  }
+  if (data[8] != GEOIP_DB_VERSION ||
+      data[9] != ((family == AF_INET) ? 4 : 6)) {
+    log_warn(LD_GENERAL, "Precompiled GEOIP file %s has version %d for "
+             "IPv%d; we wanted version %d for %s.", filename,
+             (int)data[8], (int)data[9], GEOIP_DB_VERSION,
+             (family == AF_INET) ? "IPv4" : "IPv6");
+    return NULL;
+  }
+  n_countries = ntohs(get_uint16(data + 10));
+  n_entries = ntohl(get_uint32(data + 12));
+  countries_len = (n_countries * 2 + 7) & ~7;
+  needed = GEOIP_DB_HEADER_LEN + countries_len +
+    (uint64_t)n_entries * (2 * addr_len + 2);
+  if (needed > map->size) {
+    log_warn(LD_GENERAL, "Precompiled GEOIP file %s is truncated.",
+             filename);
+    return NULL;
+  }
+
+  t = geoip_table_new(addr_len);
+  t->n_entries = n_entries;
+  /* We never write to these: see geoip_table_t. */
+  t->ip_low = (uint8_t *)data + GEOIP_DB_HEADER_LEN + countries_len;
+  t->ip_high = t->ip_low + (size_t)n_entries * addr_len;
+  t->country = t->ip_high + (size_t)n_entries * addr_len;
+  t->country_map = tor_calloc(MAX(n_countries, 1), sizeof(country_t));
+  t->n_mapped_countries = n_countries;
+  for (i = 0; i < n_countries; ++i) {
+    char code[3];
+    memcpy(code, data + GEOIP_DB_HEADER_LEN + i*2, 2);
+    code[2] = '\0';
+    if ((TOR_ISALNUM(code[0]) || code[0] == '?') &&
+        (TOR_ISALNUM(code[1]) || code[1] == '?'))
+      t->country_map[i] = (country_t)geoip_add_country(code);
+    else
+      t->country_map[i] = 0;
+  }
+  t->mmap = map;
+  memcpy(digest_out, data + 16, DIGEST_LEN);
+  return t;
+}
+
 /** Clear appropriate GeoIP database, based on <b>family</b>, and
  * reload it from the file <b>filename</b>. Return 0 on success, -1 on
  * failure.
@@ -338,6 +539,10 @@ init_geoip_countries(void)
  *
  * It also recognizes, and skips over, blank lines and lines that start
  * with '#' (comments).
+ *
+ * If the file starts with GEOIP_DB_MAGIC instead, it is a database
+ * precompiled from one of these text files by src/config/geoip-compile.py,
+ * and we memory-map it rather than parsing it.
  */
 int
 geoip_load_file(sa_family_t family, const char *filename)
@@ -347,6 +552,9 @@ geoip_load_file(sa_family_t family, const char *filename)
   const or_options_t *options = get_options();
   int severity = options_need_geoip_info(options, &msg) ? LOG_WARN : LOG_INFO;
   crypto_digest_t *geoip_digest_env = NULL;
+  geoip_table_t **tablep;
+  char *digest_out;
+  char magic[GEOIP_DB_MAGIC_LEN];
 
   tor_assert(family == AF_INET || family == AF_INET6);
 
@@ -359,20 +567,39 @@ geoip_load_file(sa_family_t family, const char *filename)
     init_geoip_countries();
 
   if (family == AF_INET) {
-    if (geoip_ipv4_entries) {
-      SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv4_entries);
-    }
-    geoip_ipv4_entries = smartlist_new();
+    tablep = &geoip_ipv4_table;
+    digest_out = geoip_digest;
   } else { /* AF_INET6 */
-    if (geoip_ipv6_entries) {
-      SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, e,
-                        tor_free(e));
-      smartlist_free(geoip_ipv6_entries);
+    tablep = &geoip_ipv6_table;
+    digest_out = geoip6_digest;
+  }
+  geoip_table_free(*tablep);
+  *tablep = NULL;
+
+  if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+      fast_memeq(magic, GEOIP_DB_MAGIC, GEOIP_DB_MAGIC_LEN)) {
+    tor_mmap_t *map;
+    fclose(f);
+    log_notice(LD_GENERAL, "Mapping precompiled GEOIP %s file %s.",
+               (family == AF_INET) ? "IPv4" : "IPv6", filename);
+    map = tor_mmap_file(filename);
+    if (!map) {
+      log_fn(severity, LD_GENERAL, "Failed to map GEOIP file %s.  %s",
+             filename, msg);
+      return -1;
     }
-    geoip_ipv6_entries = smartlist_new();
+    *tablep = geoip_table_from_mmap(family, filename, map, digest_out);
+    if (!*tablep) {
+      tor_munmap_file(map);
+      return -1;
+    }
+    if (family == AF_INET)
+      refresh_all_country_info();
+    return 0;
   }
+  rewind(f);
+
+  *tablep = geoip_table_new((family == AF_INET) ? 4 : 16);
   geoip_digest_env = crypto_digest_new();
 
   log_notice(LD_GENERAL, "Parsing GEOIP %s file %s.",
@@ -388,20 +615,16 @@ geoip_load_file(sa_family_t family, const char *filename)
   /*XXXX abort and return -1 if no entries/illformed?*/
   fclose(f);
 
-  /* Sort list and remember file digests so that we can include it in
+  /* Sort the table and remember file digests so that we can include it in
    * our extra-info descriptors. */
+  geoip_table_sort(*tablep);
   if (family == AF_INET) {
-    smartlist_sort(geoip_ipv4_entries, geoip_ipv4_compare_entries_);
     /* Okay, now we need to maybe change our mind about what is in
      * which country. We do this for IPv4 only since that's what we
      * store in node->country. */
     refresh_all_country_info();
-    crypto_digest_get_digest(geoip_digest_env, geoip_digest, DIGEST_LEN);
-  } else {
-    /* AF_INET6 */
-    smartlist_sort(geoip_ipv6_entries, geoip_ipv6_compare_entries_);
-    crypto_digest_get_digest(geoip_digest_env, geoip6_digest, DIGEST_LEN);
   }
+  crypto_digest_get_digest(geoip_digest_env, digest_out, DIGEST_LEN);
   crypto_digest_free(geoip_digest_env);
 
   return 0;
@@ -416,12 +639,11 @@ geoip_load_file(sa_family_t family, const char *filename)
 STATIC int
 geoip_get_country_by_ipv4(uint32_t ipaddr)
 {
-  geoip_ipv4_entry_t *ent;
-  if (!geoip_ipv4_entries)
+  uint8_t addr[4];
+  if (!geoip_ipv4_table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv4_entries, &ipaddr,
-                          geoip_ipv4_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  set_uint32(addr, htonl(ipaddr));
+  return geoip_table_lookup(geoip_ipv4_table, addr);
 }
 
 /** Given an IPv6 address, return a number representing the country to
@@ -432,13 +654,9 @@ geoip_get_country_by_ipv4(uint32_t ipaddr)
 STATIC int
 geoip_get_country_by_ipv6(const struct in6_addr *addr)
 {
-  geoip_ipv6_entry_t *ent;
-
-  if (!geoip_ipv6_entries)
+  if (!geoip_ipv6_table)
     return -1;
-  ent = smartlist_bsearch(geoip_ipv6_entries, addr,
-                          geoip_ipv6_compare_key_to_entry_);
-  return ent ? (int)ent->country : 0;
+  return geoip_table_lookup(geoip_ipv6_table, addr->s6_addr);
 }
 
 /** Given an IP address, return a number representing the country to which
@@ -487,9 +705,9 @@ geoip_is_loaded,(sa_family_t family))
   if (geoip_countries == NULL)
     return 0;
   if (family == AF_INET)
-    return geoip_ipv4_entries != NULL;
+    return geoip_ipv4_table != NULL;
   else                          /* AF_INET6 */
-    return geoip_ipv6_entries != NULL;
+    return geoip_ipv6_table != NULL;
 }
 
 /** Return the hex-encoded SHA1 digest of the loaded GeoIP file. The
@@ -557,9 +775,6 @@ clientmap_entry_free(clientmap_entry_t *ent)
   if (!ent)
     return;
 
-  /* This entry is about to be freed so pass it to the DoS subsystem to see if
-   * any actions can be taken about it. */
-  dos_geoip_entry_about_to_free(ent);
   geoip_decrement_client_history_cache_size(clientmap_entry_size(ent));
 
   tor_free(ent->transport_name);
@@ -591,6 +806,110 @@ clientmap_entry_new(geoip_client_action_t action, const tor_addr_t *addr,
   return entry;
 }
 
+/** Approximate history of the clients seen for one geoip_client_action_t,
+ * kept instead of client_history entries when ApproximateClientStatistics
+ * is set. Every address goes into one HyperLogLog counter per country,
+ * address family and transport, so that the memory used depends on the
+ * number of countries and transports, not on the number of clients. */
+typedef struct approx_client_history_t {
+  /** Distinct addresses by country index, or NULL for countries we haven't
+   * seen anybody from. */
+  smartlist_t *by_country;
+  /** Distinct IPv4 and IPv6 addresses. */
+  hll_t *by_family[2];
+  /** Map from transport name, or "<OR>" for none, to distinct addresses. */
+  strmap_t *by_transport;
+} approx_client_history_t;
+
+/** Approximate client history, indexed by geoip_client_action_t. */
+static approx_client_history_t approx_client_history[2];
+
+/* Special string to signify that no transport was used for a connection.
+ * Pluggable transport names can't have symbols in their names, so this
+ * string will never collide with a real transport. */
+static const char no_transport_str[] = "<OR>";
+
+/** Return true iff we keep approximate client statistics. */
+static inline int
+use_approx_client_history(void)
+{
+  return get_options()->ApproximateClientStatistics;
+}
+
+/** Add the client address <b>addr</b>, seen with the transport
+ * <b>transport_name</b> (if any), to the approximate client history for
+ * <b>action</b>. */
+static void
+approx_client_history_note(geoip_client_action_t action,
+                           const tor_addr_t *addr,
+                           const char *transport_name)
+{
+  approx_client_history_t *hist = &approx_client_history[action];
+  uint64_t hash;
+  int country_idx, family;
+  hll_t *hll;
+
+  switch (tor_addr_family(addr)) {
+    case AF_INET: {
+      const uint32_t a = tor_addr_to_ipv4n(addr);
+      hash = siphash24g(&a, sizeof(a));
+      family = 0;
+      break;
+    }
+    case AF_INET6:
+      hash = siphash24g(tor_addr_to_in6_addr8(addr), 16);
+      family = 1;
+      break;
+    default:
+      return;
+  }
+
+  country_idx = geoip_get_country_by_addr(addr);
+  if (country_idx < 0)
+    country_idx = 0; /** unresolved requests are stored at index 0. */
+  if (!hist->by_country)
+    hist->by_country = smartlist_new();
+  while (country_idx >= smartlist_len(hist->by_country))
+    smartlist_add(hist->by_country, NULL);
+  hll = smartlist_get(hist->by_country, country_idx);
+  if (!hll) {
+    hll = hll_new();
+    smartlist_set(hist->by_country, country_idx, hll);
+  }
+  hll_add_hash(hll, hash);
+
+  if (!hist->by_family[family])
+    hist->by_family[family] = hll_new();
+  hll_add_hash(hist->by_family[family], hash);
+
+  if (!transport_name)
+    transport_name = no_transport_str;
+  if (!hist->by_transport)
+    hist->by_transport = strmap_new();
+  hll = strmap_get(hist->by_transport, transport_name);
+  if (!hll) {
+    hll = hll_new();
+    strmap_set(hist->by_transport, transport_name, hll);
+  }
+  hll_add_hash(hll, hash);
+}
+
+/** Forget the approximate client history for <b>action</b>. */
+static void
+approx_client_history_clear(geoip_client_action_t action)
+{
+  approx_client_history_t *hist = &approx_client_history[action];
+
+  if (hist->by_country) {
+    SMARTLIST_FOREACH(hist->by_country, hll_t *, hll, hll_free(hll));
+    smartlist_free(hist->by_country);
+  }
+  hll_free(hist->by_family[0]);
+  hll_free(hist->by_family[1]);
+  strmap_free(hist->by_transport, (void (*)(void *)) hll_free);
+  memset(hist, 0, sizeof(*hist));
+}
+
 /** Clear history of connecting clients used by entry and bridge stats. */
 static void
 client_history_clear(void)
@@ -606,6 +925,7 @@ client_history_clear(void)
       next = HT_NEXT(clientmap, &client_history, ent);
     }
   }
+  approx_client_history_clear(GEOIP_CLIENT_CONNECT);
 }
 
 /** Note that we've seen a client connect from the IP <b>addr</b>
@@ -621,13 +941,11 @@ geoip_note_client_seen(geoip_client_action_t action,
   clientmap_entry_t *ent;
 
   if (action == GEOIP_CLIENT_CONNECT) {
-    /* Only remember statistics if the DoS mitigation subsystem is enabled. If
-     * not, only if as entry guard or as bridge. */
-    if (!dos_enabled()) {
-      if (!options->EntryStatistics &&
-          (!(options->BridgeRelay && options->BridgeRecordUsageByCountry))) {
-        return;
-      }
+    /* Only remember statistics if we are an entry guard or a bridge that
+     * collects them. The DoS mitigation subsystem keeps its own table. */
+    if (!options->EntryStatistics &&
+        (!(options->BridgeRelay && options->BridgeRecordUsageByCountry))) {
+      return;
     }
   } else {
     /* Only gather directory-request statistics if configured, and
@@ -640,15 +958,19 @@ geoip_note_client_seen(geoip_client_action_t action,
             safe_str_client(fmt_addr((addr))),
             transport_name ? transport_name : "<no transport>");
 
-  ent = geoip_lookup_client(addr, transport_name, action);
-  if (! ent) {
-    ent = clientmap_entry_new(action, addr, transport_name);
-    HT_INSERT(clientmap, &client_history, ent);
+  if (use_approx_client_history()) {
+    approx_client_history_note(action, addr, transport_name);
+  } else {
+    ent = geoip_lookup_client(addr, transport_name, action);
+    if (! ent) {
+      ent = clientmap_entry_new(action, addr, transport_name);
+      HT_INSERT(clientmap, &client_history, ent);
+    }
+    if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
+      ent->last_seen_in_minutes = (unsigned)(now/60);
+    else
+      ent->last_seen_in_minutes = 0;
   }
-  if (now / 60 <= (int)MAX_LAST_SEEN_IN_MINUTES && now >= 0)
-    ent->last_seen_in_minutes = (unsigned)(now/60);
-  else
-    ent->last_seen_in_minutes = 0;
 
   if (action == GEOIP_CLIENT_NETWORKSTATUS) {
     int country_idx = geoip_get_country_by_addr(addr);
@@ -675,7 +997,9 @@ remove_old_client_helper_(struct clientmap_entry_t *ent, void *_cutoff)
   }
 }
 
-/** Forget about all clients that haven't connected since <b>cutoff</b>. */
+/** Forget about all clients that haven't connected since <b>cutoff</b>.
+ * This doesn't touch the approximate client history, which can't forget
+ * single clients: it is cleared when its statistics interval starts over. */
 void
 geoip_remove_old_clients(time_t cutoff)
 {
@@ -973,15 +1297,24 @@ geoip_get_transport_history(void)
       that have been used. */
   smartlist_t *transports_used = smartlist_new();
 
-  /* Special string to signify that no transport was used for this
-     connection. Pluggable transport names can't have symbols in their
-     names, so this string will never collide with a real transport. */
-  static const char* no_transport_str = "<OR>";
-
   clientmap_entry_t **ent;
   smartlist_t *string_chunks = smartlist_new();
   char *the_string = NULL;
 
+  if (use_approx_client_history()) {
+    const approx_client_history_t *hist =
+      &approx_client_history[GEOIP_CLIENT_CONNECT];
+    /* If we haven't seen any clients yet, return NULL. */
+    if (!hist->by_transport || strmap_isempty(hist->by_transport))
+      goto done;
+    STRMAP_FOREACH(hist->by_transport, transport_name, hll_t *, hll) {
+      strmap_set(transport_counts, transport_name,
+                 (void*)(uintptr_t) hll_estimate(hll));
+      smartlist_add_strdup(transports_used, transport_name);
+    } STRMAP_FOREACH_END;
+    goto format;
+  }
+
   /* If we haven't seen any clients yet, return NULL. */
   if (HT_EMPTY(&client_history))
     goto done;
@@ -1026,6 +1359,7 @@ geoip_get_transport_history(void)
               (int)val);
   }
 
+ format:
   /* Sort the transport names (helps with unit testing). */
   smartlist_sort_strings(transports_used);
 
@@ -1187,6 +1521,22 @@ geoip_get_client_history(geoip_client_action_t action,
     return -1;
 
   counts = tor_calloc(n_countries, sizeof(unsigned));
+  if (use_approx_client_history()) {
+    const approx_client_history_t *hist = &approx_client_history[action];
+    if (hist->by_country) {
+      SMARTLIST_FOREACH_BEGIN(hist->by_country, const hll_t *, hll) {
+        if (hll && hll_sl_idx < n_countries) {
+          counts[hll_sl_idx] = (unsigned) hll_estimate(hll);
+          total += counts[hll_sl_idx];
+        }
+      } SMARTLIST_FOREACH_END(hll);
+    }
+    if (hist->by_family[0])
+      ipv4_count = (unsigned) hll_estimate(hist->by_family[0]);
+    if (hist->by_family[1])
+      ipv6_count = (unsigned) hll_estimate(hist->by_family[1]);
+    goto counted;
+  }
   HT_FOREACH(cm_ent, clientmap, &client_history) {
     int country;
     if ((*cm_ent)->action != (int)action)
@@ -1206,6 +1556,7 @@ geoip_get_client_history(geoip_client_action_t action,
       break;
     }
   }
+ counted:
   if (ipver_str) {
     smartlist_t *chunks = smartlist_new();
     smartlist_add_asprintf(chunks, "v4=%u",
@@ -1319,6 +1670,7 @@ geoip_reset_dirreq_stats(time_t now)
   SMARTLIST_FOREACH(geoip_countries, geoip_country_t *, c, {
       c->n_v3_ns_requests = 0;
   });
+  approx_client_history_clear(GEOIP_CLIENT_NETWORKSTATUS);
   {
     clientmap_entry_t **ent, **next, *this;
     for (ent = HT_START(clientmap, &client_history); ent != NULL;
@@ -1662,6 +2014,10 @@ geoip_bridge_stats_write(time_t now)
     }
   }
 
+  /* The approximate client history can't drop clients that haven't been
+   * seen since the start of the new interval, so start it over. */
+  approx_client_history_clear(GEOIP_CLIENT_CONNECT);
+
  done:
   return start_of_bridge_stats_interval + WRITE_STATS_INTERVAL;
 }
@@ -1839,20 +2195,12 @@ clear_geoip_db(void)
   }
 
   strmap_free(country_idxplus1_by_lc_code, NULL);
-  if (geoip_ipv4_entries) {
-    SMARTLIST_FOREACH(geoip_ipv4_entries, geoip_ipv4_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv4_entries);
-  }
-  if (geoip_ipv6_entries) {
-    SMARTLIST_FOREACH(geoip_ipv6_entries, geoip_ipv6_entry_t *, ent,
-                      tor_free(ent));
-    smartlist_free(geoip_ipv6_entries);
-  }
+  geoip_table_free(geoip_ipv4_table);
+  geoip_table_free(geoip_ipv6_table);
   geoip_countries = NULL;
   country_idxplus1_by_lc_code = NULL;
-  geoip_ipv4_entries = NULL;
-  geoip_ipv6_entries = NULL;
+  geoip_ipv4_table = NULL;
+  geoip_ipv6_table = NULL;
 }
 
 /** Release all storage held in this file. */
@@ -1868,6 +2216,8 @@ geoip_free_all(void)
     }
     HT_CLEAR(clientmap, &client_history);
   }
+  approx_client_history_clear(GEOIP_CLIENT_CONNECT);
+  approx_client_history_clear(GEOIP_CLIENT_NETWORKSTATUS);
   {
     dirreq_map_entry_t **ent, **next, *this;
     for (ent = HT_START(dirreqmap, &dirreq_map); ent != NULL; ent = next) {
@@ -2603,3 +2603,13 @@ hs_desc_lspec_to_trunnel(const hs_desc_link_specifier_t *spec)
   return ls;
 }
 
+/* Build the keyword indices for the descriptor token tables. */
+void
+hs_desc_add_token_indices(void)
+{
+  token_table_add_index(hs_desc_v3_token_table);
+  token_table_add_index(hs_desc_superencrypted_v3_token_table);
+  token_table_add_index(hs_desc_encrypted_v3_token_table);
+  token_table_add_index(hs_desc_intro_point_v3_token_table);
+}
+
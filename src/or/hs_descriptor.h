@@ -239,6 +239,8 @@ void hs_desc_intro_point_free(hs_desc_intro_point_t *ip);
 link_specifier_t *hs_desc_lspec_to_trunnel(
                                    const hs_desc_link_specifier_t *spec);
 
+void hs_desc_add_token_indices(void);
+
 #ifdef HS_DESCRIPTOR_PRIVATE
 
 /* Encoding. */
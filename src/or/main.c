@@ -90,6 +90,7 @@
 #include "nodelist.h"
 #include "ntmain.h"
 #include "onion.h"
+#include "parsecommon.h"
 #include "periodic.h"
 #include "policies.h"
 #include "protover.h"
@@ -2130,6 +2131,45 @@ hs_service_callback(time_t now, const or_options_t *options)
 static periodic_timer_t *second_timer = NULL;
 /** Number of libevent errors in the last second: we die if we get too many. */
 static int n_libevent_errors = 0;
+/** Exponentially weighted moving average of how many msec late
+ * second_elapsed_callback() has been running: a measure of how long the
+ * main loop takes to get around to things. */
+static double main_loop_lag_msec = 0.0;
+/** Weight of each new sample in main_loop_lag_msec. */
+#define MAIN_LOOP_LAG_EWMA_WEIGHT 0.25
+/** Samples larger than this are more likely a suspended process or a
+ * stepped clock than a slow main loop, so we ignore them. */
+#define MAIN_LOOP_LAG_MAX_BELIEVABLE_MSEC 10000
+
+/** Update main_loop_lag_msec: we expect to be called once a second. */
+static void
+note_main_loop_tick(void)
+{
+  static monotime_t last_tick;
+  static int have_last_tick = 0;
+  monotime_t tick;
+  int64_t lag;
+
+  monotime_get(&tick);
+  if (have_last_tick) {
+    lag = monotime_diff_msec(&last_tick, &tick) - 1000;
+    if (lag < 0)
+      lag = 0;
+    if (lag <= MAIN_LOOP_LAG_MAX_BELIEVABLE_MSEC)
+      main_loop_lag_msec += (lag - main_loop_lag_msec) *
+        MAIN_LOOP_LAG_EWMA_WEIGHT;
+  }
+  last_tick = tick;
+  have_last_tick = 1;
+}
+
+/** Return how many msec late, on average, our once-a-second housekeeping
+ * has been running lately. */
+MOCK_IMPL(uint32_t,
+get_main_loop_lag_msec,(void))
+{
+  return (uint32_t) main_loop_lag_msec;
+}
 
 /** Libevent callback: invoked once every second. */
 static void
@@ -2148,6 +2188,7 @@ second_elapsed_callback(periodic_timer_t *timer, void *arg)
   (void)arg;
 
   n_libevent_errors = 0;
+  note_main_loop_tick();
 
   /* log_notice(LD_GENERAL, "Tick."); */
   now = time(NULL);
@@ -3751,6 +3792,7 @@ tor_main(int argc, char *argv[])
   update_approx_time(time(NULL));
   tor_threads_init();
   tor_compress_init();
+  parsecommon_init();
   init_logging(0);
   monotime_init();
 #ifdef USE_DMALLOC
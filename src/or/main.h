@@ -61,6 +61,7 @@ void reschedule_descriptor_update_check(void);
 void reschedule_directory_downloads(void);
 
 MOCK_DECL(long,get_uptime,(void));
+MOCK_DECL(uint32_t,get_main_loop_lag_msec,(void));
 
 unsigned get_signewnym_epoch(void);
 
@@ -25,7 +25,9 @@
 /** A data structure to hold a bunch of cached microdescriptors.  There are
  * two active files in the cache: a "cache file" that we mmap, and a "journal
  * file" that we append to.  Periodically, we rebuild the cache file to hold
- * only the microdescriptors that we want to keep */
+ * only the microdescriptors that we want to keep.  Whenever we rebuild it,
+ * we also write an "index file" listing where each microdescriptor lives in
+ * the cache file, so that we can load the cache file without parsing it. */
 struct microdesc_cache_t {
   /** Map from sha256-digest to microdesc_t for every microdesc_t in the
    * cache. */
@@ -35,6 +37,8 @@ struct microdesc_cache_t {
   char *cache_fname;
   /** Name of the journal file. */
   char *journal_fname;
+  /** Name of the index file. */
+  char *index_fname;
   /** Mmap'd contents of the cache file, or NULL if there is none. */
   tor_mmap_t *cache_content;
   /** Number of bytes used in the journal file. */
@@ -49,6 +53,8 @@ struct microdesc_cache_t {
 
   /** True iff we have loaded this cache from disk ever. */
   int is_loaded;
+  /** True iff the index file describes the cache file we have mapped. */
+  int index_is_current;
 };
 
 static microdesc_cache_t *get_microdesc_cache_noload(void);
@@ -240,6 +246,7 @@ get_microdesc_cache_noload(void)
     HT_INIT(microdesc_map, &cache->map);
     cache->cache_fname = get_datadir_fname("cached-microdescs");
     cache->journal_fname = get_datadir_fname("cached-microdescs.new");
+    cache->index_fname = get_datadir_fname("cached-microdescs.idx");
     the_microdesc_cache = cache;
   }
   return the_microdesc_cache;
@@ -459,10 +466,217 @@ microdesc_cache_clear(microdesc_cache_t *cache)
   cache->total_len_seen = 0;
   cache->n_seen = 0;
   cache->bytes_dropped = 0;
+  cache->index_is_current = 0;
+}
+
+/** Magic string at the start of a microdescriptor cache index. */
+#define MD_INDEX_MAGIC "TORMDIDX"
+/** Length of MD_INDEX_MAGIC, without its NUL. */
+#define MD_INDEX_MAGIC_LEN 8
+/** The only microdescriptor cache index version we understand. */
+#define MD_INDEX_VERSION 1
+/** Length of the header of a microdescriptor cache index.
+ *
+ * An index is a header followed by one entry for every microdescriptor in
+ * the cache file, sorted by digest.  All integers are big-endian.  The
+ * header is:
+ *
+ *    magic           [8 bytes]    MD_INDEX_MAGIC
+ *    version         [4 bytes]    MD_INDEX_VERSION
+ *    n_entries       [4 bytes]
+ *    cache length    [8 bytes]    size of the cache file it describes
+ *    cache mtime     [8 bytes]    modification time of that file
+ *
+ * and each entry is:
+ *
+ *    digest          [32 bytes]   sha256 digest of the microdescriptor
+ *    offset          [8 bytes]    where its body starts in the cache file
+ *    last listed     [8 bytes]
+ *    body length     [4 bytes]
+ *    padding         [4 bytes]
+ */
+#define MD_INDEX_HEADER_LEN 32
+/** Length of one entry in a microdescriptor cache index. */
+#define MD_INDEX_ENTRY_LEN 56
+
+/** Helper: sort microdescriptors by digest. */
+static int
+compare_microdescs_by_digest_(const void **a, const void **b)
+{
+  const microdesc_t *md1 = *a, *md2 = *b;
+  return fast_memcmp(md1->digest, md2->digest, DIGEST256_LEN);
+}
+
+/** Write an index of the microdescriptors in the cache file of <b>cache</b>
+ * to its index file.  Return 0 on success, -1 on failure. */
+static int
+microdesc_cache_write_index(microdesc_cache_t *cache)
+{
+  struct stat st;
+  smartlist_t *mds;
+  microdesc_t **mdp;
+  char *buf, *cp;
+  size_t len;
+  int r;
+
+  if (!cache->cache_content || stat(cache->cache_fname, &st) < 0)
+    return -1;
+
+  mds = smartlist_new();
+  HT_FOREACH(mdp, microdesc_map, &cache->map) {
+    if ((*mdp)->saved_location == SAVED_IN_CACHE && (*mdp)->body)
+      smartlist_add(mds, *mdp);
+  }
+  smartlist_sort(mds, compare_microdescs_by_digest_);
+
+  len = MD_INDEX_HEADER_LEN + (size_t)smartlist_len(mds) * MD_INDEX_ENTRY_LEN;
+  buf = cp = tor_malloc_zero(len);
+  memcpy(cp, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN);
+  set_uint32(cp + 8, htonl(MD_INDEX_VERSION));
+  set_uint32(cp + 12, htonl(smartlist_len(mds)));
+  set_uint64(cp + 16, tor_htonll(cache->cache_content->size));
+  set_uint64(cp + 24, tor_htonll((uint64_t)st.st_mtime));
+  cp += MD_INDEX_HEADER_LEN;
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    memcpy(cp, md->digest, DIGEST256_LEN);
+    set_uint64(cp + 32, tor_htonll((uint64_t)md->off));
+    set_uint64(cp + 40, tor_htonll((uint64_t)md->last_listed));
+    set_uint32(cp + 48, htonl((uint32_t)md->bodylen));
+    cp += MD_INDEX_ENTRY_LEN;
+  } SMARTLIST_FOREACH_END(md);
+
+  r = write_bytes_to_file(cache->index_fname, buf, len, 1);
+  cache->index_is_current = (r == 0);
+  smartlist_free(mds);
+  tor_free(buf);
+  return r;
+}
+
+/** Try to add every microdescriptor in the cache file of <b>cache</b> from
+ * its index file, without parsing any of them: we parse each one the first
+ * time it is looked up.  Return the number of microdescriptors we added, or
+ * -1 if the index is missing, corrupt, or describes some other cache file.
+ */
+static int
+microdesc_cache_load_index(microdesc_cache_t *cache)
+{
+  const tor_mmap_t *content = cache->cache_content;
+  tor_mmap_t *map;
+  const char *data, *cp;
+  struct stat st;
+  uint32_t n_entries, i;
+  int n_added = -1;
+
+  if (!content || stat(cache->cache_fname, &st) < 0)
+    return -1;
+  map = tor_mmap_file(cache->index_fname);
+  if (!map)
+    return -1;
+
+  data = map->data;
+  if (map->size < MD_INDEX_HEADER_LEN ||
+      fast_memneq(data, MD_INDEX_MAGIC, MD_INDEX_MAGIC_LEN) ||
+      ntohl(get_uint32(data + 8)) != MD_INDEX_VERSION)
+    goto done;
+  n_entries = ntohl(get_uint32(data + 12));
+  if ((map->size - MD_INDEX_HEADER_LEN) % MD_INDEX_ENTRY_LEN ||
+      (map->size - MD_INDEX_HEADER_LEN) / MD_INDEX_ENTRY_LEN != n_entries)
+    goto done;
+  if (tor_ntohll(get_uint64(data + 16)) != (uint64_t)content->size ||
+      tor_ntohll(get_uint64(data + 24)) != (uint64_t)st.st_mtime)
+    goto done;
+
+  /* Check every entry before we believe any of them. */
+  cp = data + MD_INDEX_HEADER_LEN;
+  for (i = 0; i < n_entries; ++i, cp += MD_INDEX_ENTRY_LEN) {
+    const uint64_t off = tor_ntohll(get_uint64(cp + 32));
+    const uint32_t bodylen = ntohl(get_uint32(cp + 48));
+    if (off > content->size || bodylen > content->size - off ||
+        bodylen < 9 || fast_memneq(content->data + off, "onion-key", 9))
+      goto done;
+  }
+
+  n_added = 0;
+  cp = data + MD_INDEX_HEADER_LEN;
+  for (i = 0; i < n_entries; ++i, cp += MD_INDEX_ENTRY_LEN) {
+    microdesc_t *md = tor_malloc_zero(sizeof(microdesc_t));
+    memcpy(md->digest, cp, DIGEST256_LEN);
+    if (HT_FIND(microdesc_map, &cache->map, md)) {
+      tor_free(md);
+      continue;
+    }
+    md->off = (off_t) tor_ntohll(get_uint64(cp + 32));
+    md->last_listed = (time_t) tor_ntohll(get_uint64(cp + 40));
+    md->bodylen = ntohl(get_uint32(cp + 48));
+    md->body = (char*)content->data + md->off;
+    md->saved_location = SAVED_IN_CACHE;
+    md->is_unparsed = 1;
+
+    HT_INSERT(microdesc_map, &cache->map, md);
+    md->held_in_map = 1;
+    ++n_added;
+    ++cache->n_seen;
+    cache->total_len_seen += md->bodylen;
+  }
+  cache->index_is_current = 1;
+
+ done:
+  if (tor_munmap_file(map) != 0)
+    log_warn(LD_FS, "Failed to unmap microdescriptor cache index");
+  if (n_added < 0)
+    log_info(LD_DIR, "Microdescriptor cache index is out of date or "
+             "unreadable; parsing the whole cache instead.");
+  return n_added;
+}
+
+/** Parse the body of <b>md</b>, which we added from the cache index, and
+ * fill in its fields.  Return 0 on success, or -1 if the body isn't a
+ * single microdescriptor with the digest we expected. */
+static int
+microdesc_parse_lazily(microdesc_t *md)
+{
+  smartlist_t *parsed;
+  microdesc_t *md2 = NULL;
+  int r = -1;
+
+  tor_assert(md->is_unparsed);
+  if (!md->body)
+    return -1;
+
+  parsed = microdescs_parse_from_string(md->body, md->body + md->bodylen,
+                                        0, SAVED_IN_CACHE, NULL);
+  if (smartlist_len(parsed) == 1)
+    md2 = smartlist_get(parsed, 0);
+  if (md2 && md2->bodylen == md->bodylen &&
+      tor_memeq(md2->digest, md->digest, DIGEST256_LEN)) {
+    md->onion_pkey = md2->onion_pkey;
+    md->onion_curve25519_pkey = md2->onion_curve25519_pkey;
+    md->ed25519_identity_pkey = md2->ed25519_identity_pkey;
+    tor_addr_copy(&md->ipv6_addr, &md2->ipv6_addr);
+    md->ipv6_orport = md2->ipv6_orport;
+    md->family = md2->family;
+    md->exit_policy = md2->exit_policy;
+    md->ipv6_exit_policy = md2->ipv6_exit_policy;
+    md2->onion_pkey = NULL;
+    md2->onion_curve25519_pkey = NULL;
+    md2->ed25519_identity_pkey = NULL;
+    md2->family = NULL;
+    md2->exit_policy = md2->ipv6_exit_policy = NULL;
+    md->is_unparsed = 0;
+    r = 0;
+  }
+
+  SMARTLIST_FOREACH(parsed, microdesc_t *, m, microdesc_free(m));
+  smartlist_free(parsed);
+  return r;
 }
 
 /** Reload the contents of <b>cache</b> from disk.  If it is empty, load it
- * for the first time.  Return 0 on success, -1 on failure. */
+ * for the first time.  Return 0 on success, -1 on failure.
+ *
+ * If the index file matches the cache file, we take the microdescriptors
+ * in the cache file from the index, and put off parsing each of them until
+ * somebody looks it up. */
 int
 microdesc_cache_reload(microdesc_cache_t *cache)
 {
@@ -470,14 +684,18 @@ microdesc_cache_reload(microdesc_cache_t *cache)
   char *journal_content;
   smartlist_t *added;
   tor_mmap_t *mm;
-  int total = 0;
+  int total = 0, n_indexed = -1;
 
   microdesc_cache_clear(cache);
 
   cache->is_loaded = 1;
 
   mm = cache->cache_content = tor_mmap_file(cache->cache_fname);
-  if (mm) {
+  if (mm)
+    n_indexed = microdesc_cache_load_index(cache);
+  if (n_indexed >= 0) {
+    total += n_indexed;
+  } else if (mm) {
     added = microdescs_add_to_cache(cache, mm->data, mm->data+mm->size,
                                     SAVED_IN_CACHE, 0, -1, NULL);
     if (added) {
@@ -502,8 +720,24 @@ microdesc_cache_reload(microdesc_cache_t *cache)
   log_info(LD_DIR, "Reloaded microdescriptor cache. Found %d descriptors.",
            total);
 
+  if (n_indexed > 0) {
+    /* microdescs_add_to_cache() would have given these to the nodes. */
+    networkstatus_t *ns = networkstatus_get_latest_consensus();
+    if (ns && ns->flavor == FLAV_MICRODESC) {
+      SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
+        microdesc_t *md =
+          microdesc_cache_lookup_by_digest256(cache, rs->descriptor_digest);
+        if (md)
+          nodelist_add_microdesc(md);
+      } SMARTLIST_FOREACH_END(rs);
+    }
+  }
+
   microdesc_cache_rebuild(cache, 0 /* don't force */);
 
+  if (cache->cache_content && !cache->index_is_current)
+    microdesc_cache_write_index(cache);
+
   return 0;
 }
 
@@ -779,6 +1013,9 @@ microdesc_cache_rebuild(microdesc_cache_t *cache, int force)
   cache->journal_len = 0;
   cache->bytes_dropped = 0;
 
+  cache->index_is_current = 0;
+  microdesc_cache_write_index(cache);
+
   new_size = cache->cache_content ? (int)cache->cache_content->size : 0;
   log_info(LD_DIR, "Done rebuilding microdesc cache. "
            "Saved %d bytes; %d still used.",
@@ -883,6 +1120,7 @@ microdesc_free_all(void)
     microdesc_cache_clear(the_microdesc_cache);
     tor_free(the_microdesc_cache->cache_fname);
     tor_free(the_microdesc_cache->journal_fname);
+    tor_free(the_microdesc_cache->index_fname);
     tor_free(the_microdesc_cache);
   }
 
@@ -893,7 +1131,8 @@ microdesc_free_all(void)
 }
 
 /** If there is a microdescriptor in <b>cache</b> whose sha256 digest is
- * <b>d</b>, return it.  Otherwise return NULL. */
+ * <b>d</b>, return it.  Otherwise return NULL.  If we haven't parsed it yet,
+ * parse it now. */
 microdesc_t *
 microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
 {
@@ -902,6 +1141,16 @@ microdesc_cache_lookup_by_digest256(microdesc_cache_t *cache, const char *d)
     cache = get_microdesc_cache();
   memcpy(search.digest, d, DIGEST256_LEN);
   md = HT_FIND(microdesc_map, &cache->map, &search);
+  if (md && PREDICT_UNLIKELY(md->is_unparsed) &&
+      microdesc_parse_lazily(md) < 0) {
+    log_warn(LD_DIR, "A microdescriptor in our cache didn't match the cache "
+             "index. Dropping it.");
+    HT_REMOVE(microdesc_map, &cache->map, md);
+    md->held_in_map = 0;
+    cache->bytes_dropped += md->bodylen;
+    microdesc_free(md);
+    md = NULL;
+  }
   return md;
 }
 
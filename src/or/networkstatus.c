@@ -439,25 +439,35 @@ networkstatus_check_document_signature(const networkstatus_t *consensus,
   return 0;
 }
 
-/** Given a v3 networkstatus consensus in <b>consensus</b>, check every
- * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
- * signature from every recognized authority on it, 0 if there are
- * enough good signatures from recognized authorities on it, -1 if we might
- * get enough good signatures by fetching missing certificates, and -2
- * otherwise.  Log messages at INFO or WARN: if <b>warn</b> is over 1, warn
- * about every problem; if warn is at least 1, warn only if we can't get
- * enough signatures; if warn is negative, log nothing at all. */
-int
-networkstatus_check_consensus_signature(networkstatus_t *consensus,
-                                        int warn)
+/** Return true iff we have already found a good signature from
+ * <b>voter</b>. */
+static int
+voter_has_good_signature(const networkstatus_voter_info_t *voter)
+{
+  SMARTLIST_FOREACH(voter->sigs, const document_signature_t *, sig,
+                    if (sig->good_signature) return 1);
+  return 0;
+}
+
+/** Helper for networkstatus_check_consensus_signature() and
+ * networkstatus_check_consensus_signature_lazily(): if
+ * <b>stop_when_enough</b> is true, don't check any more signatures once
+ * we've found good ones from enough recognized authorities. */
+static int
+check_consensus_signatures_impl(networkstatus_t *consensus, int warn,
+                                int stop_when_enough)
 {
   int n_good = 0;
   int n_missing_key = 0, n_dl_failed_key = 0;
   int n_bad = 0;
   int n_unknown = 0;
+  int n_unchecked = 0;
   int n_no_signature = 0;
   int n_v3_authorities = get_n_authorities(V3_DIRINFO);
   int n_required = n_v3_authorities/2 + 1;
+  /* How many voters we know to have signed, including those further on
+   * in the list whose signatures we checked on an earlier call. */
+  int n_good_known = 0;
   smartlist_t *list_good = smartlist_new();
   smartlist_t *list_no_signature = smartlist_new();
   smartlist_t *need_certs_from = smartlist_new();
@@ -468,12 +478,19 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
   tor_assert(consensus->type == NS_TYPE_CONSENSUS);
 
+  if (stop_when_enough) {
+    SMARTLIST_FOREACH(consensus->voters, networkstatus_voter_info_t *, voter,
+                      n_good_known += voter_has_good_signature(voter));
+  }
+
   SMARTLIST_FOREACH_BEGIN(consensus->voters, networkstatus_voter_info_t *,
                           voter) {
     int good_here = 0;
     int bad_here = 0;
     int unknown_here = 0;
+    int unchecked_here = 0;
     int missing_key_here = 0, dl_failed_key_here = 0;
+    const int was_good = stop_when_enough && voter_has_good_signature(voter);
     SMARTLIST_FOREACH_BEGIN(voter->sigs, document_signature_t *, sig) {
       if (!sig->good_signature && !sig->bad_signature &&
           sig->signature) {
@@ -497,6 +514,13 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
             ++dl_failed_key_here;
           continue;
         }
+        if (stop_when_enough &&
+            (was_good || good_here || n_good_known >= n_required)) {
+          /* This signature can't change whether we accept the consensus:
+           * don't spend an RSA operation on it. */
+          ++unchecked_here;
+          continue;
+        }
         if (networkstatus_check_document_signature(consensus, sig, cert) < 0) {
           smartlist_add(need_certs_from, voter);
           ++missing_key_here;
@@ -513,6 +537,8 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
 
     if (good_here) {
       ++n_good;
+      if (!was_good)
+        ++n_good_known;
       smartlist_add(list_good, voter->nickname);
     } else if (bad_here) {
       ++n_bad;
@@ -520,6 +546,8 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
       ++n_missing_key;
       if (dl_failed_key_here)
         ++n_dl_failed_key;
+    } else if (unchecked_here) {
+      ++n_unchecked;
     } else if (unknown_here) {
       ++n_unknown;
     } else {
@@ -599,6 +627,11 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
                       "We were unable to check %d of the signatures, "
                       "because we were missing the keys.", n_missing_key);
       }
+      if (n_unchecked) {
+        smartlist_add_asprintf(sl,
+                      "We didn't check %d of the signatures, because we "
+                      "already had enough good ones.", n_unchecked);
+      }
       joined = smartlist_join_strings(sl, " ", 0, NULL);
       tor_log(severity, LD_DIR, "%s", joined);
       tor_free(joined);
@@ -623,6 +656,35 @@ networkstatus_check_consensus_signature(networkstatus_t *consensus,
     return -2;
 }
 
+/** Given a v3 networkstatus consensus in <b>consensus</b>, check every
+ * as-yet-unchecked signature on <b>consensus</b>.  Return 1 if there is a
+ * signature from every recognized authority on it, 0 if there are
+ * enough good signatures from recognized authorities on it, -1 if we might
+ * get enough good signatures by fetching missing certificates, and -2
+ * otherwise.  Log messages at INFO or WARN: if <b>warn</b> is over 1, warn
+ * about every problem; if warn is at least 1, warn only if we can't get
+ * enough signatures; if warn is negative, log nothing at all. */
+int
+networkstatus_check_consensus_signature(networkstatus_t *consensus,
+                                        int warn)
+{
+  return check_consensus_signatures_impl(consensus, warn, 0);
+}
+
+/** As networkstatus_check_consensus_signature(), but stop checking
+ * signatures once we've found good ones from enough recognized authorities
+ * to accept <b>consensus</b>, and leave the others unchecked.  Return 1
+ * only if every recognized authority's signature has been found good, by
+ * this call or an earlier one: when accepting a consensus takes all of
+ * them, as with one or two authorities, a single call can do that.  Use
+ * this when all we need to know is whether we can use the consensus. */
+int
+networkstatus_check_consensus_signature_lazily(networkstatus_t *consensus,
+                                               int warn)
+{
+  return check_consensus_signatures_impl(consensus, warn, 1);
+}
+
 /** How far in the future do we allow a network-status to get before removing
  * it? (seconds) */
 #define NETWORKSTATUS_ALLOW_SKEW (24*60*60)
@@ -1839,7 +1901,7 @@ networkstatus_set_current_consensus(const char *consensus,
   }
 
   /* Make sure it's signed enough. */
-  if ((r=networkstatus_check_consensus_signature(c, 1))<0) {
+  if ((r=networkstatus_check_consensus_signature_lazily(c, 1))<0) {
     if (r == -1) {
       /* Okay, so it _might_ be signed enough if we get more certificates. */
       if (!was_waiting_for_certs) {
@@ -2061,7 +2123,8 @@ networkstatus_note_certs_arrived(const char *source_dir)
     consensus_waiting_for_certs_t *waiting = &consensus_waiting_for_certs[i];
     if (!waiting->consensus)
       continue;
-    if (networkstatus_check_consensus_signature(waiting->consensus, 0)>=0) {
+    if (networkstatus_check_consensus_signature_lazily(waiting->consensus,
+                                                       0) >= 0) {
       char *waiting_body = waiting->body;
       if (!networkstatus_set_current_consensus(
                                  waiting_body,
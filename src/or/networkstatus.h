@@ -25,6 +25,8 @@ networkstatus_voter_info_t *networkstatus_get_voter_by_id(
                                        const char *identity);
 int networkstatus_check_consensus_signature(networkstatus_t *consensus,
                                             int warn);
+int networkstatus_check_consensus_signature_lazily(networkstatus_t *consensus,
+                                                   int warn);
 int networkstatus_check_document_signature(const networkstatus_t *consensus,
                                            document_signature_t *sig,
                                            const authority_cert_t *cert);
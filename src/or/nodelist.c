@@ -86,7 +86,8 @@ static void count_usable_descriptors(int *num_present,
 static void update_router_have_minimum_dir_info(void);
 static double get_frac_paths_needed_for_circs(const or_options_t *options,
                                               const networkstatus_t *ns);
-static void node_add_to_address_set(const node_t *node);
+static void node_add_to_address_set(node_t *node);
+static void node_remove_from_address_set(node_t *node);
 
 /** A nodelist_t holds a node_t object for every router we're "willing to use
  * for something".  Specifically, it should hold a node_t for every node that
@@ -107,6 +108,8 @@ typedef struct nodelist_t {
   HT_HEAD(nodelist_ed_map, node_t) nodes_by_ed_id;
   /* Set of addresses that belong to nodes we believe in. */
   address_set_t *node_addrs;
+  /* How many addresses we sized node_addrs for. */
+  int node_addrs_sized_for;
 } nodelist_t;
 
 static inline unsigned int
@@ -236,6 +239,10 @@ node_remove_from_ed25519_map(node_t *node)
   tor_assert(the_nodelist);
   tor_assert(node);
 
+  /* Whatever removes a node from this map is about to change its ed25519
+   * identity, which its hsdir indices are built from. */
+  node->hsdir_index_gen = 0;
+
   if (ed25519_public_key_is_zero(&node->ed25519_id)) {
     return 0;
   }
@@ -289,90 +296,161 @@ node_add_to_ed25519_map(node_t *node)
   return 1;
 }
 
-/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
- * for the node, both current and next if possible. This can only fails if the
- * node_t ed25519 identity key can't be found which would be a bug. */
-STATIC void
-node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+/** The inputs that the hsdir indices of every node share, as of some
+ * consensus at some time. */
+typedef struct hsdir_index_params_t {
+  uint64_t fetch_tp;
+  uint64_t store_first_tp;
+  uint64_t store_second_tp;
+  uint8_t fetch_srv[DIGEST256_LEN];
+  uint8_t store_first_srv[DIGEST256_LEN];
+  uint8_t store_second_srv[DIGEST256_LEN];
+  /** True iff we are between the start of a time period and the next SRV.
+   */
+  int in_period_between_tp_and_srv;
+} hsdir_index_params_t;
+
+/** The hsdir index parameters that we most recently built hsdir indices
+ * from. */
+static hsdir_index_params_t current_hsdir_params;
+/** The generation of current_hsdir_params: we bump it whenever they change,
+ * so that a node whose hsdir_index_gen matches it has up-to-date indices. */
+static uint32_t current_hsdir_params_gen = 0;
+
+/** Compute the hsdir index parameters for the consensus <b>ns</b> at
+ * <b>now</b> into <b>params</b>.  Return 0 on success, or -1 if <b>ns</b> is
+ * not live, in which case we shouldn't build hsdir indices from it. */
+static int
+hsdir_index_params_compute(hsdir_index_params_t *params,
+                           const networkstatus_t *ns, time_t now)
 {
-  time_t now = approx_time();
-  const ed25519_public_key_t *node_identity_pk;
-  uint8_t *fetch_srv = NULL, *store_first_srv = NULL, *store_second_srv = NULL;
+  uint8_t *fetch_srv, *store_first_srv, *store_second_srv;
   uint64_t next_time_period_num, current_time_period_num;
-  uint64_t fetch_tp, store_first_tp, store_second_tp;
-
-  tor_assert(node);
-  tor_assert(ns);
 
   if (!networkstatus_is_live(ns, now)) {
     static struct ratelim_t live_consensus_ratelim = RATELIM_INIT(30 * 60);
     log_fn_ratelim(&live_consensus_ratelim, LOG_INFO, LD_GENERAL,
                    "Not setting hsdir index with a non-live consensus.");
-    goto done;
+    return -1;
   }
 
-  node_identity_pk = node_get_ed25519_id(node);
-  if (node_identity_pk == NULL) {
-    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
-                          "trying to build the hsdir indexes for node %s",
-              node_describe(node));
-    goto done;
-  }
+  memset(params, 0, sizeof(*params));
 
   /* Get the current and next time period number. */
   current_time_period_num = hs_get_time_period_num(0);
   next_time_period_num = hs_get_next_time_period_num(0);
 
   /* We always use the current time period for fetching descs */
-  fetch_tp = current_time_period_num;
+  params->fetch_tp = current_time_period_num;
+  params->in_period_between_tp_and_srv =
+    hs_in_period_between_tp_and_srv(ns, now);
 
   /* Now extract the needed SRVs and time periods for building hsdir indices */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
-    fetch_srv = hs_get_current_srv(fetch_tp, ns);
+  if (params->in_period_between_tp_and_srv) {
+    fetch_srv = hs_get_current_srv(params->fetch_tp, ns);
 
-    store_first_tp = hs_get_previous_time_period_num(0);
-    store_second_tp = current_time_period_num;
+    params->store_first_tp = hs_get_previous_time_period_num(0);
+    params->store_second_tp = current_time_period_num;
   } else {
-    fetch_srv = hs_get_previous_srv(fetch_tp, ns);
+    fetch_srv = hs_get_previous_srv(params->fetch_tp, ns);
 
-    store_first_tp = current_time_period_num;
-    store_second_tp = next_time_period_num;
+    params->store_first_tp = current_time_period_num;
+    params->store_second_tp = next_time_period_num;
   }
 
   /* We always use the old SRV for storing the first descriptor and the latest
    * SRV for storing the second descriptor */
-  store_first_srv = hs_get_previous_srv(store_first_tp, ns);
-  store_second_srv = hs_get_current_srv(store_second_tp, ns);
+  store_first_srv = hs_get_previous_srv(params->store_first_tp, ns);
+  store_second_srv = hs_get_current_srv(params->store_second_tp, ns);
+
+  memcpy(params->fetch_srv, fetch_srv, DIGEST256_LEN);
+  memcpy(params->store_first_srv, store_first_srv, DIGEST256_LEN);
+  memcpy(params->store_second_srv, store_second_srv, DIGEST256_LEN);
+
+  tor_free(fetch_srv);
+  tor_free(store_first_srv);
+  tor_free(store_second_srv);
+  return 0;
+}
+
+/** Make <b>params</b> the current hsdir index parameters, if they aren't
+ * already, and return their generation. */
+static uint32_t
+hsdir_index_params_note(const hsdir_index_params_t *params)
+{
+  if (current_hsdir_params_gen == 0 ||
+      fast_memneq(params, &current_hsdir_params, sizeof(*params))) {
+    memcpy(&current_hsdir_params, params, sizeof(*params));
+    if (++current_hsdir_params_gen == 0)
+      ++current_hsdir_params_gen;
+  }
+  return current_hsdir_params_gen;
+}
+
+/** Build the hsdir indices of <b>node</b>, both current and next, from
+ * <b>params</b>, which have the generation <b>gen</b>.  This can only fail
+ * if the node_t ed25519 identity key can't be found, which would be a bug. */
+static void
+node_set_hsdir_index_from_params(node_t *node,
+                                 const hsdir_index_params_t *params,
+                                 uint32_t gen)
+{
+  const ed25519_public_key_t *node_identity_pk;
+
+  node->hsdir_index_gen = 0;
+
+  node_identity_pk = node_get_ed25519_id(node);
+  if (node_identity_pk == NULL) {
+    log_debug(LD_GENERAL, "ed25519 identity public key not found when "
+                          "trying to build the hsdir indexes for node %s",
+              node_describe(node));
+    return;
+  }
 
   /* Build the fetch index. */
-  hs_build_hsdir_index(node_identity_pk, fetch_srv, fetch_tp,
+  hs_build_hsdir_index(node_identity_pk, params->fetch_srv, params->fetch_tp,
                        node->hsdir_index->fetch);
 
   /* If we are in the time segment between SRV#N and TP#N, the fetch index is
      the same as the first store index */
-  if (!hs_in_period_between_tp_and_srv(ns, now)) {
+  if (!params->in_period_between_tp_and_srv) {
     memcpy(node->hsdir_index->store_first, node->hsdir_index->fetch,
            sizeof(node->hsdir_index->store_first));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_first_srv, store_first_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_first_srv,
+                         params->store_first_tp,
                          node->hsdir_index->store_first);
   }
 
   /* If we are in the time segment between TP#N and SRV#N+1, the fetch index is
      the same as the second store index */
-  if (hs_in_period_between_tp_and_srv(ns, now)) {
+  if (params->in_period_between_tp_and_srv) {
     memcpy(node->hsdir_index->store_second, node->hsdir_index->fetch,
            sizeof(node->hsdir_index->store_second));
   } else {
-    hs_build_hsdir_index(node_identity_pk, store_second_srv, store_second_tp,
+    hs_build_hsdir_index(node_identity_pk, params->store_second_srv,
+                         params->store_second_tp,
                          node->hsdir_index->store_second);
   }
 
- done:
-  tor_free(fetch_srv);
-  tor_free(store_first_srv);
-  tor_free(store_second_srv);
-  return;
+  node->hsdir_index_gen = gen;
+}
+
+/* For a given <b>node</b> for the consensus <b>ns</b>, set the hsdir index
+ * for the node, both current and next if possible. This can only fails if the
+ * node_t ed25519 identity key can't be found which would be a bug. */
+STATIC void
+node_set_hsdir_index(node_t *node, const networkstatus_t *ns)
+{
+  hsdir_index_params_t params;
+
+  tor_assert(node);
+  tor_assert(ns);
+
+  if (hsdir_index_params_compute(&params, ns, approx_time()) < 0)
+    return;
+  node_set_hsdir_index_from_params(node, &params,
+                                   hsdir_index_params_note(&params));
 }
 
 /** Recompute all node hsdir indices. */
@@ -380,6 +458,8 @@ void
 nodelist_recompute_all_hsdir_indices(void)
 {
   networkstatus_t *consensus;
+  hsdir_index_params_t params;
+  uint32_t gen;
   if (!the_nodelist) {
     return;
   }
@@ -389,10 +469,14 @@ nodelist_recompute_all_hsdir_indices(void)
   if (!consensus) {
     return;
   }
+  if (hsdir_index_params_compute(&params, consensus, approx_time()) < 0) {
+    return;
+  }
+  gen = hsdir_index_params_note(&params);
 
   /* Recompute all hsdir indices */
   SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
-    node_set_hsdir_index(node, consensus);
+    node_set_hsdir_index_from_params(node, &params, gen);
   } SMARTLIST_FOREACH_END(node);
 }
 
@@ -405,23 +489,33 @@ node_addrs_changed(node_t *node)
 }
 
 /** Add all address information about <b>node</b> to the current address
- * set (if there is one).
+ * set (if there is one), unless it is there already.
+ *
+ * Whatever changes the rs, ri or md of a node that is in the set must call
+ * node_remove_from_address_set() first, and this function afterwards, so
+ * that the set keeps up with the nodelist between consensuses.
  */
 static void
-node_add_to_address_set(const node_t *node)
+node_add_to_address_set(node_t *node)
 {
-  if (!the_nodelist || !the_nodelist->node_addrs)
+  if (!the_nodelist || !the_nodelist->node_addrs || node->in_address_set)
     return;
+  node->in_address_set = 1;
 
   /* These various address sources can be redundant, but it's likely faster
    * to add them all than to compare them all for equality. */
 
   if (node->rs) {
-    if (node->rs->addr)
-      address_set_add_ipv4h(the_nodelist->node_addrs, node->rs->addr);
-    if (!tor_addr_is_null(&node->rs->ipv6_addr))
-      address_set_add(the_nodelist->node_addrs, &node->rs->ipv6_addr);
+    node->rs_addr_in_set = node->rs->addr;
+    tor_addr_copy(&node->rs_ipv6_addr_in_set, &node->rs->ipv6_addr);
+  } else {
+    node->rs_addr_in_set = 0;
+    tor_addr_make_null(&node->rs_ipv6_addr_in_set, AF_INET6);
   }
+  if (node->rs_addr_in_set)
+    address_set_add_ipv4h(the_nodelist->node_addrs, node->rs_addr_in_set);
+  if (!tor_addr_is_null(&node->rs_ipv6_addr_in_set))
+    address_set_add(the_nodelist->node_addrs, &node->rs_ipv6_addr_in_set);
   if (node->ri) {
     if (node->ri->addr)
       address_set_add_ipv4h(the_nodelist->node_addrs, node->ri->addr);
@@ -434,6 +528,32 @@ node_add_to_address_set(const node_t *node)
   }
 }
 
+/** Remove from the current address set everything that
+ * node_add_to_address_set() added for <b>node</b>, if it did. */
+static void
+node_remove_from_address_set(node_t *node)
+{
+  if (!the_nodelist || !the_nodelist->node_addrs || !node->in_address_set)
+    return;
+  node->in_address_set = 0;
+
+  /* Our rs may be gone already: use our copy of its addresses. */
+  if (node->rs_addr_in_set)
+    address_set_remove_ipv4h(the_nodelist->node_addrs, node->rs_addr_in_set);
+  if (!tor_addr_is_null(&node->rs_ipv6_addr_in_set))
+    address_set_remove(the_nodelist->node_addrs, &node->rs_ipv6_addr_in_set);
+  if (node->ri) {
+    if (node->ri->addr)
+      address_set_remove_ipv4h(the_nodelist->node_addrs, node->ri->addr);
+    if (!tor_addr_is_null(&node->ri->ipv6_addr))
+      address_set_remove(the_nodelist->node_addrs, &node->ri->ipv6_addr);
+  }
+  if (node->md) {
+    if (!tor_addr_is_null(&node->md->ipv6_addr))
+      address_set_remove(the_nodelist->node_addrs, &node->md->ipv6_addr);
+  }
+}
+
 /** Return true if <b>addr</b> is the address of some node in the nodelist.
  * If not, probably return false. */
 int
@@ -465,6 +585,7 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
   node = node_get_or_create(id_digest);
 
   node_remove_from_ed25519_map(node);
+  node_remove_from_address_set(node);
 
   if (node->ri) {
     if (!routers_have_same_or_addrs(node->ri, ri)) {
@@ -476,6 +597,8 @@ nodelist_set_routerinfo(routerinfo_t *ri, routerinfo_t **ri_old_out)
   } else {
     if (ri_old_out)
       *ri_old_out = NULL;
+    if (!node->rs)
+      node->country = -1;
   }
   node->ri = ri;
 
@@ -527,6 +650,7 @@ nodelist_add_microdesc(microdesc_t *md)
   node = node_get_mutable_by_id(rs->identity_digest);
   if (node) {
     node_remove_from_ed25519_map(node);
+    node_remove_from_address_set(node);
     if (node->md)
       node->md->held_by_nodes--;
 
@@ -539,10 +663,9 @@ nodelist_add_microdesc(microdesc_t *md)
       node_set_hsdir_index(node, ns);
     }
     node_add_to_ed25519_map(node);
+    node_add_to_address_set(node);
   }
 
-  node_add_to_address_set(node);
-
   return node;
 }
 
@@ -561,47 +684,86 @@ get_estimated_address_per_node, (void))
  * This makes the nodelist change all of the routerstatus entries for
  * the nodes, drop nodes that no longer have enough info to get used,
  * and grab microdescriptors into nodes as appropriate.
+ *
+ * Consecutive consensuses mostly list the same relays, at the same
+ * addresses, with the same microdescriptors.  So rather than rebuilding
+ * everything we derive from the consensus, we only redo the address set
+ * entries, countries, and hsdir indices of the nodes whose inputs changed.
+ * The previous consensus may already be freed: we never look at the old
+ * routerstatus entries.
  */
 void
 nodelist_set_consensus(networkstatus_t *ns)
 {
   const or_options_t *options = get_options();
   int authdir = authdir_mode_v3(options);
+  hsdir_index_params_t hsdir_params;
+  uint32_t hsdir_gen = 0;
+  bitarray_t *listed;
 
   init_nodelist();
   if (ns->flavor == FLAV_MICRODESC)
     (void) get_microdesc_cache(); /* Make sure it exists first. */
 
-  SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
-                    node->rs = NULL);
-
   /* Conservatively estimate that every node will have 2 addresses. */
   const int estimated_addresses = smartlist_len(ns->routerstatus_list) *
                                   get_estimated_address_per_node();
-  address_set_free(the_nodelist->node_addrs);
-  the_nodelist->node_addrs = address_set_new(estimated_addresses);
+  /* We keep the address set from one consensus to the next, and update it
+   * as nodes change.  We only build a new one, sized with some room to
+   * grow, when it has become too small or much too big. */
+  if (!the_nodelist->node_addrs ||
+      estimated_addresses > the_nodelist->node_addrs_sized_for ||
+      estimated_addresses < the_nodelist->node_addrs_sized_for / 4) {
+    SMARTLIST_FOREACH(the_nodelist->nodes, node_t *, node,
+                      node->in_address_set = 0);
+    address_set_free(the_nodelist->node_addrs);
+    the_nodelist->node_addrs_sized_for =
+      estimated_addresses + estimated_addresses / 8;
+    the_nodelist->node_addrs =
+      address_set_new(the_nodelist->node_addrs_sized_for);
+  }
+
+  /* The hsdir indices of all nodes share most of their inputs; only
+   * compute those once. */
+  if (hsdir_index_params_compute(&hsdir_params, ns, approx_time()) == 0)
+    hsdir_gen = hsdir_index_params_note(&hsdir_params);
+
+  listed = bitarray_init_zero(smartlist_len(the_nodelist->nodes) +
+                              smartlist_len(ns->routerstatus_list));
 
   SMARTLIST_FOREACH_BEGIN(ns->routerstatus_list, routerstatus_t *, rs) {
     node_t *node = node_get_or_create(rs->identity_digest);
+    /* The old rs may be gone, but we can still tell whether we had one,
+     * and what its addresses were if the node is in the address set. */
+    const int addrs_changed = !node->rs || !node->in_address_set ||
+      node->rs_addr_in_set != rs->addr ||
+      !tor_addr_eq(&node->rs_ipv6_addr_in_set, &rs->ipv6_addr);
+    const int md_changed = ns->flavor == FLAV_MICRODESC &&
+      (node->md == NULL ||
+       tor_memneq(node->md->digest, rs->descriptor_digest, DIGEST256_LEN));
+
+    bitarray_set(listed, node->nodelist_idx);
+    if (addrs_changed || md_changed)
+      node_remove_from_address_set(node);
+
     node->rs = rs;
-    if (ns->flavor == FLAV_MICRODESC) {
-      if (node->md == NULL ||
-          tor_memneq(node->md->digest,rs->descriptor_digest,DIGEST256_LEN)) {
-        node_remove_from_ed25519_map(node);
-        if (node->md)
-          node->md->held_by_nodes--;
-        node->md = microdesc_cache_lookup_by_digest256(NULL,
-                                                       rs->descriptor_digest);
-        if (node->md)
-          node->md->held_by_nodes++;
-        node_add_to_ed25519_map(node);
-      }
+    if (md_changed) {
+      node_remove_from_ed25519_map(node);
+      if (node->md)
+        node->md->held_by_nodes--;
+      node->md = microdesc_cache_lookup_by_digest256(NULL,
+                                                     rs->descriptor_digest);
+      if (node->md)
+        node->md->held_by_nodes++;
+      node_add_to_ed25519_map(node);
     }
 
-    if (rs->supports_v3_hsdir) {
-      node_set_hsdir_index(node, ns);
+    if (rs->supports_v3_hsdir && hsdir_gen &&
+        node->hsdir_index_gen != hsdir_gen) {
+      node_set_hsdir_index_from_params(node, &hsdir_params, hsdir_gen);
     }
-    node_set_country(node);
+    if (addrs_changed || node->country == -1)
+      node_set_country(node);
 
     /* If we're not an authdir, believe others. */
     if (!authdir) {
@@ -622,6 +784,19 @@ nodelist_set_consensus(networkstatus_t *ns)
 
   } SMARTLIST_FOREACH_END(rs);
 
+  /* Forget the routerstatus of every node that this consensus doesn't
+   * list. */
+  SMARTLIST_FOREACH_BEGIN(the_nodelist->nodes, node_t *, node) {
+    if (node->rs && !bitarray_is_set(listed, node_sl_idx)) {
+      node_remove_from_address_set(node);
+      node->rs = NULL;
+      node->country = -1;
+      if (node->ri)
+        node_set_country(node);
+    }
+  } SMARTLIST_FOREACH_END(node);
+  bitarray_free(listed);
+
   nodelist_purge();
 
   /* Now add all the nodes we have to the address set. */
@@ -662,11 +837,13 @@ nodelist_remove_microdesc(const char *identity_digest, microdesc_t *md)
 {
   node_t *node = node_get_mutable_by_id(identity_digest);
   if (node && node->md == md) {
+    node_remove_from_address_set(node);
     node->md = NULL;
     md->held_by_nodes--;
     if (! node_get_ed25519_id(node)) {
       node_remove_from_ed25519_map(node);
     }
+    node_add_to_address_set(node);
   }
 }
 
@@ -676,10 +853,13 @@ nodelist_remove_routerinfo(routerinfo_t *ri)
 {
   node_t *node = node_get_mutable_by_id(ri->cache_info.identity_digest);
   if (node && node->ri == ri) {
+    node_remove_from_address_set(node);
     node->ri = NULL;
     if (! node_is_usable(node)) {
       nodelist_drop_node(node, 1);
       node_free(node);
+    } else {
+      node_add_to_address_set(node);
     }
   }
 }
@@ -756,13 +936,16 @@ nodelist_purge(void)
 
     if (node->md && !node->rs) {
       /* An md is only useful if there is an rs. */
+      node_remove_from_address_set(node);
       node->md->held_by_nodes--;
       node->md = NULL;
     }
 
     if (node_is_usable(node)) {
+      node_add_to_address_set(node);
       iter = HT_NEXT(nodelist_map, &the_nodelist->nodes_by_id, iter);
     } else {
+      node_remove_from_address_set(node);
       iter = HT_NEXT_RMV(nodelist_map, &the_nodelist->nodes_by_id, iter);
       nodelist_drop_node(node, 0);
       node_free(node);
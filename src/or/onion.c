@@ -67,6 +67,7 @@
 #include "circuitlist.h"
 #include "config.h"
 #include "cpuworker.h"
+#include "main.h"
 #include "networkstatus.h"
 #include "onion.h"
 #include "onion_fast.h"
@@ -114,66 +115,138 @@ static void onion_queue_entry_remove(onion_queue_t *victim);
  * MAX_ONIONSKIN_CHALLENGE/REPLY_LEN."  Also, make sure that we can pass
  * over-large values via EXTEND2/EXTENDED2, for future-compatibility.*/
 
-/** Return true iff we have room to queue another onionskin of type
- * <b>type</b>. */
+/** Reasons why have_room_for_onionskin() can refuse an onionskin. */
+typedef enum onion_drop_reason_t {
+  /** We'd expect the onionskin to wait longer than MaxOnionQueueDelay. */
+  ONION_DROP_DELAY = 0,
+  /** TAP onionskins already use up their share of MaxOnionQueueDelay. */
+  ONION_DROP_TAP_SHARE = 1,
+  /** Ntor onionskins are waiting long enough that we refuse TAP ones. */
+  ONION_DROP_NTOR_PRESSURE = 2,
+} onion_drop_reason_t;
+#define ONION_N_DROP_REASONS 3
+
+/** Indexed by handshake type and onion_drop_reason_t: how many onionskins
+ * have we refused, and why? */
+static uint64_t onionskins_n_dropped[MAX_ONION_HANDSHAKE_TYPE+1]
+                                    [ONION_N_DROP_REASONS];
+
+/** Return how many microseconds of worker time the onionskins already in
+ * ol_list[<b>type</b>] need, including one more of that type. */
+static uint64_t
+onion_queue_usec(uint16_t type)
+{
+  return cpuworker_onionskin_cost_usec(type) * (ol_entries[type] + 1);
+}
+
+/** Return how many milliseconds we expect a new onionskin of type
+ * <b>type</b> to wait before a cpuworker answers it.  We count the work the
+ * cpuworkers already have, the onionskins queued ahead of it (including
+ * the ones of the other type that decide_next_handshake_type() will let in
+ * along the way), the cost of the onionskin itself, and how far behind our
+ * main loop is running. */
+static uint64_t
+onionskin_expected_delay_msec(uint16_t type)
+{
+  const int num_cpus = get_num_cpus(get_options());
+  const int ntor_entries = ol_entries[ONION_HANDSHAKE_TYPE_NTOR];
+  const int tap_entries = ol_entries[ONION_HANDSHAKE_TYPE_TAP];
+  uint64_t usec = onion_queue_usec(type);
+
+  if (type == ONION_HANDSHAKE_TYPE_NTOR) {
+    /* How long would it take to process the tap cells that we expect to
+     * process while draining the ntor queue? */
+    usec += cpuworker_onionskin_cost_usec(ONION_HANDSHAKE_TYPE_TAP) *
+      MIN(tap_entries, (ntor_entries + 1) / num_ntors_per_tap());
+  } else if (type == ONION_HANDSHAKE_TYPE_TAP) {
+    /* How long would it take to process the ntor cells that we expect to
+     * process while draining the tap queue? */
+    usec += cpuworker_onionskin_cost_usec(ONION_HANDSHAKE_TYPE_NTOR) *
+      MIN(ntor_entries, (tap_entries + 1) * num_ntors_per_tap());
+  }
+
+  usec += cpuworker_backlog_usec();
+
+  return usec / num_cpus / 1000 + get_main_loop_lag_msec();
+}
+
+/** Return -1 if we have room to queue another onionskin of type
+ * <b>type</b>, or the onion_drop_reason_t that says why not. */
 static int
 have_room_for_onionskin(uint16_t type)
 {
-  const or_options_t *options = get_options();
-  int num_cpus;
-  uint64_t tap_usec, ntor_usec;
-  uint64_t ntor_during_tap_usec, tap_during_ntor_usec;
+  const uint64_t max_delay = get_options()->MaxOnionQueueDelay;
 
   /* If we've got fewer than 50 entries, we always have room for one more. */
   if (ol_entries[type] < 50)
-    return 1;
-  num_cpus = get_num_cpus(options);
-  /* Compute how many microseconds we'd expect to need to clear all
-   * onionskins in various combinations of the queues. */
-
-  /* How long would it take to process all the TAP cells in the queue? */
-  tap_usec  = estimated_usec_for_onionskins(
-                                    ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
-
-  /* How long would it take to process all the NTor cells in the queue? */
-  ntor_usec = estimated_usec_for_onionskins(
-                                    ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
-
-  /* How long would it take to process the tap cells that we expect to
-   * process while draining the ntor queue? */
-  tap_during_ntor_usec  = estimated_usec_for_onionskins(
-    MIN(ol_entries[ONION_HANDSHAKE_TYPE_TAP],
-        ol_entries[ONION_HANDSHAKE_TYPE_NTOR] / num_ntors_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_TAP) / num_cpus;
-
-  /* How long would it take to process the ntor cells that we expect to
-   * process while draining the tap queue? */
-  ntor_during_tap_usec  = estimated_usec_for_onionskins(
-    MIN(ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
-        ol_entries[ONION_HANDSHAKE_TYPE_TAP] * num_ntors_per_tap()),
-                                    ONION_HANDSHAKE_TYPE_NTOR) / num_cpus;
+    return -1;
 
   /* See whether that exceeds MaxOnionQueueDelay. If so, we can't queue
    * this. */
-  if (type == ONION_HANDSHAKE_TYPE_NTOR &&
-      (ntor_usec + tap_during_ntor_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
-    return 0;
-
-  if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      (tap_usec + ntor_during_tap_usec) / 1000 >
-       (uint64_t)options->MaxOnionQueueDelay)
-    return 0;
+  if (onionskin_expected_delay_msec(type) > max_delay)
+    return ONION_DROP_DELAY;
+
+  if (type == ONION_HANDSHAKE_TYPE_TAP) {
+    const int num_cpus = get_num_cpus(get_options());
+    /* If we support the ntor handshake, then don't let TAP handshakes use
+     * more than 2/3 of the space on the queue. */
+    if (onion_queue_usec(type) / num_cpus / 1000 > max_delay * 2 / 3)
+      return ONION_DROP_TAP_SHARE;
+    /* And under pressure, save the rest of it for ntor: once new ntor
+     * handshakes would wait for more than half of MaxOnionQueueDelay, take
+     * no more TAP ones. */
+    if (onionskin_expected_delay_msec(ONION_HANDSHAKE_TYPE_NTOR) >
+        max_delay / 2)
+      return ONION_DROP_NTOR_PRESSURE;
+  }
 
-  /* If we support the ntor handshake, then don't let TAP handshakes use
-   * more than 2/3 of the space on the queue. */
-  if (type == ONION_HANDSHAKE_TYPE_TAP &&
-      tap_usec / 1000 > (uint64_t)options->MaxOnionQueueDelay * 2 / 3)
-    return 0;
+  return -1;
+}
 
-  return 1;
+/** Implementation helper for GETINFO: answer questions about how we decide
+ * whether to queue onionskins. */
+int
+getinfo_helper_onion(control_connection_t *control_conn,
+                     const char *question, char **answer,
+                     const char **errmsg)
+{
+  (void) control_conn;
+  (void) errmsg;
+
+  if (!strcmp(question, "onionskins/admission")) {
+    static const uint16_t types[] = {
+      ONION_HANDSHAKE_TYPE_TAP, ONION_HANDSHAKE_TYPE_NTOR
+    };
+    static const char *type_names[] = { "tap", "ntor" };
+    smartlist_t *lines = smartlist_new();
+    unsigned i;
+
+    smartlist_add_asprintf(lines,
+                           "max-delay-ms=%d main-loop-lag-ms=%u "
+                           "worker-backlog-usec="U64_FORMAT" num-cpus=%d",
+                           get_options()->MaxOnionQueueDelay,
+                           get_main_loop_lag_msec(),
+                           U64_PRINTF_ARG(cpuworker_backlog_usec()),
+                           get_num_cpus(get_options()));
+    for (i = 0; i < ARRAY_LENGTH(types); ++i) {
+      const uint16_t type = types[i];
+      const uint64_t *dropped = onionskins_n_dropped[type];
+      smartlist_add_asprintf(lines,
+               "%s queued=%d cost-usec="U64_FORMAT" expected-delay-ms="
+               U64_FORMAT" dropped-delay="U64_FORMAT" dropped-tap-share="
+               U64_FORMAT" dropped-ntor-pressure="U64_FORMAT,
+               type_names[i], ol_entries[type],
+               U64_PRINTF_ARG(cpuworker_onionskin_cost_usec(type)),
+               U64_PRINTF_ARG(onionskin_expected_delay_msec(type)),
+               U64_PRINTF_ARG(dropped[ONION_DROP_DELAY]),
+               U64_PRINTF_ARG(dropped[ONION_DROP_TAP_SHARE]),
+               U64_PRINTF_ARG(dropped[ONION_DROP_NTOR_PRESSURE]));
+    }
+    *answer = smartlist_join_strings(lines, "\n", 0, NULL);
+    SMARTLIST_FOREACH(lines, char *, cp, tor_free(cp));
+    smartlist_free(lines);
+  }
+  return 0;
 }
 
 /** Add <b>circ</b> to the end of ol_list and return 0, except
@@ -184,6 +257,7 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
 {
   onion_queue_t *tmp;
   time_t now = time(NULL);
+  int drop_reason;
 
   if (onionskin->handshake_type > MAX_ONION_HANDSHAKE_TYPE) {
     /* LCOV_EXCL_START
@@ -200,18 +274,27 @@ onion_pending_add(or_circuit_t *circ, create_cell_t *onionskin)
   tmp->onionskin = onionskin;
   tmp->when_added = now;
 
-  if (!have_room_for_onionskin(onionskin->handshake_type)) {
+  drop_reason = have_room_for_onionskin(onionskin->handshake_type);
+  if (drop_reason >= 0) {
 #define WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL (60)
     static ratelim_t last_warned =
       RATELIM_INIT(WARN_TOO_MANY_CIRC_CREATIONS_INTERVAL);
     char *m;
+    ++onionskins_n_dropped[onionskin->handshake_type][drop_reason];
     if (onionskin->handshake_type == ONION_HANDSHAKE_TYPE_NTOR &&
         (m = rate_limit_log(&last_warned, approx_time()))) {
       log_warn(LD_GENERAL,
                "Your computer is too slow to handle this many circuit "
                "creation requests! Please consider using the "
                "MaxAdvertisedBandwidth config option or choosing a more "
-               "restricted exit policy.%s",m);
+               "restricted exit policy. (New ntor handshakes would wait "
+               U64_FORMAT" msec; %d ntor and %d TAP handshakes queued; "
+               "main loop running %u msec behind.)%s",
+               U64_PRINTF_ARG(onionskin_expected_delay_msec(
+                                            ONION_HANDSHAKE_TYPE_NTOR)),
+               ol_entries[ONION_HANDSHAKE_TYPE_NTOR],
+               ol_entries[ONION_HANDSHAKE_TYPE_TAP],
+               get_main_loop_lag_msec(), m);
       tor_free(m);
     }
     tor_free(tmp);
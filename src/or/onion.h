@@ -18,6 +18,9 @@ or_circuit_t *onion_next_task(struct create_cell_t **onionskin_out);
 int onion_num_pending(uint16_t handshake_type);
 void onion_pending_remove(or_circuit_t *circ);
 void clear_pending_onions(void);
+int getinfo_helper_onion(control_connection_t *control_conn,
+                         const char *question, char **answer,
+                         const char **errmsg);
 
 typedef struct server_onion_keys_t {
   uint8_t my_identity[DIGEST_LEN];
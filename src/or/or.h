@@ -1619,8 +1619,8 @@ typedef struct or_connection_t {
    * control_event_bootstrap_problem. */
   unsigned int have_noted_bootstrap_problem:1;
   /** True iff this is a client connection and its address has been put in the
-   * geoip cache and handled by the DoS mitigation subsystem. We use this to
-   * insure we have a coherent count of concurrent connection. */
+   * client table of the DoS mitigation subsystem. We use this to insure we
+   * have a coherent count of concurrent connection. */
   unsigned int tracked_for_dos_mitigation : 1;
 
   uint16_t link_proto; /**< What protocol version are we using? 0 for
@@ -1711,6 +1711,9 @@ typedef struct edge_connection_t {
   unsigned int is_dns_request:1;
   /** True iff this connection is for a PTR DNS request. (exit only) */
   unsigned int is_reverse_dns_lookup:1;
+  /** True iff we already know that our exit policy accepts this connection's
+   * address and port. (exit only) */
+  unsigned int exit_policy_accepted:1;
 
   unsigned int edge_has_sent_end:1; /**< For debugging; only used on edge
                          * connections.  Set once we've set the stream end,
@@ -2247,6 +2250,9 @@ typedef struct {
   uint32_t bandwidthcapacity;
   smartlist_t *exit_policy; /**< What streams will this OR permit
                              * to exit on IPv4?  NULL for 'reject *:*'. */
+  /** Compiled form of exit_policy, for fast lookups.  Only set on the
+   * routerinfo we build for ourselves; NULL otherwise. */
+  struct compiled_policy_t *exit_policy_compiled;
   /** What streams will this OR permit to exit on IPv6?
    * NULL for 'reject *:*' */
   struct short_policy_t *ipv6_exit_policy;
@@ -2448,6 +2454,10 @@ typedef struct microdesc_t {
   unsigned int no_save : 1;
   /** If true, this microdesc has an entry in the microdesc_map */
   unsigned int held_in_map : 1;
+  /** If true, we loaded this microdesc from the cache index, and have not
+   * parsed its body yet: only the cache information, the body and the
+   * digest are set. */
+  unsigned int is_unparsed : 1;
   /** Reference count: how many node_ts have a reference to this microdesc? */
   unsigned int held_by_nodes;
 
@@ -2560,6 +2570,16 @@ typedef struct node_t {
    * XX/teor - can this become out of date if the torrc changes? */
   unsigned int ipv6_preferred:1;
 
+  /** True iff the addresses of our rs, ri and md are in the nodelist's
+   * address set. */
+  unsigned int in_address_set:1;
+  /** The IPv4 address (in host order) and IPv6 address of <b>rs</b>, as of
+   * the last time we added this node to the nodelist's address set.  We
+   * keep our own copy, since the consensus that held <b>rs</b> is usually
+   * gone by the time we take these out of the set again. */
+  uint32_t rs_addr_in_set;
+  tor_addr_t rs_ipv6_addr_in_set;
+
   /** According to the geoip db what country is this router in? */
   /* XXXprop186 what is this suppose to mean with multiple OR ports? */
   country_t country;
@@ -2575,6 +2595,9 @@ typedef struct node_t {
    * in order to know what's the hs directory index for this node at the time
    * the consensus is set. */
   struct hsdir_index_t *hsdir_index;
+  /** The generation of the nodelist's hsdir index parameters that
+   * <b>hsdir_index</b> was built from, or 0 if it may be out of date. */
+  uint32_t hsdir_index_gen;
 } node_t;
 
 /** Linked list of microdesc hash lines for a single router in a directory
@@ -3878,6 +3901,9 @@ typedef struct {
                             * for queues and buffers, run the OOM handler */
   /** Above this value, consider ourselves low on RAM. */
   uint64_t MaxMemInQueues_low_threshold;
+  /** Evict cached exit DNS answers when the DNS cache grows past this many
+   * bytes.  0 means a tenth of MaxMemInQueues. */
+  uint64_t MaxMemInDNSCache;
 
   /** @name port booleans
    *
@@ -4088,6 +4114,8 @@ typedef struct {
   uint64_t PerConnBWRate; /**< Long-term bw on a single TLS conn, if set. */
   uint64_t PerConnBWBurst; /**< Allowed burst on a single TLS conn, if set. */
   int NumCPUs; /**< How many CPUs should we try to use? */
+  /** If true, try to run each cpuworker thread on a CPU of its own. */
+  int PinCPUWorkers;
   config_line_t *RendConfigLines; /**< List of configuration lines
                                           * for rendezvous services. */
   config_line_t *HidServAuth; /**< List of configuration lines for client-side
@@ -4333,6 +4361,10 @@ typedef struct {
   /** If true, the user wants us to collect statistics as entry node. */
   int EntryStatistics;
 
+  /** If true, keep per-client statistics in fixed-size sketches rather than
+   * one entry per client address. */
+  int ApproximateClientStatistics;
+
   /** If true, the user wants us to collect statistics as hidden service
    * directory, introduction point, or rendezvous point. */
   int HiddenServiceStatistics_option;
@@ -4791,6 +4823,11 @@ typedef struct {
   /** A multiplier for the KIST per-socket limit calculation. */
   double KISTSockBufSizeFactor;
 
+  /** How long, in milliseconds, KIST may reuse the kernel information of a
+   * socket that hasn't used up its write limit. If zero, KIST asks the
+   * kernel about every pending socket on every scheduling run. */
+  int KISTSockInfoCacheTime;
+
   /** The list of scheduler type string ordered by priority that is first one
    * has to be tried first. Default: KIST,KISTLite,Vanilla */
   smartlist_t *Schedulers;
@@ -4825,6 +4862,10 @@ typedef struct {
 
   /** Autobool: Do we refuse single hop client rendezvous? */
   int DoSRefuseSingleHopClientRendezvous;
+
+  /** Maximum memory used by the per-address statistics of the DoS
+   * mitigation subsystem. */
+  uint64_t DoSClientTableMaxMem;
 } or_options_t;
 
 #define LOG_PROTOCOL_WARN (get_protocol_warning_severity_level())
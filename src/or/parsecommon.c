@@ -6,7 +6,11 @@
  * \brief Common code to parse and validate various type of descriptors.
  **/
 
+#define PARSECOMMON_PRIVATE
 #include "parsecommon.h"
+#include "ed25519_cert.h" /* Trunnel interface. */
+#include "hs_descriptor.h"
+#include "routerparse.h"
 #include "torlog.h"
 #include "util_format.h"
 
@@ -27,6 +31,176 @@
     goto done_tokenizing;                                          \
   STMT_END
 
+/** Multiplier for keyword_hash(): the 32-bit FNV prime. */
+#define KEYWORD_HASH_MULT 0x01000193u
+/** Smallest number of slots in a token_table_index_t. */
+#define MIN_INDEX_SLOTS 8
+/** Largest number of slots we will try before giving up on indexing a
+ * table and falling back to a linear search. */
+#define MAX_INDEX_SLOTS 4096
+/** How many seeds we try at each table size before doubling it. */
+#define SEEDS_PER_SIZE 256
+
+/** Hash the <b>len</b>-byte keyword at <b>s</b> with <b>seed</b>. */
+static inline uint32_t
+keyword_hash(uint32_t seed, const char *s, size_t len)
+{
+  uint32_t h = seed ^ (uint32_t)len;
+  size_t i;
+  for (i = 0; i < len; ++i)
+    h = (h ^ (uint8_t)s[i]) * KEYWORD_HASH_MULT;
+  return h ^ (h >> 15);
+}
+
+/** Try to make <b>idx</b> a perfect hash of the keywords of its table with
+ * <b>n_slots</b> slots and <b>seed</b>.  Return 0 on success and -1 if two
+ * different keywords collide.  When a keyword appears more than once, only
+ * its first rule is indexed, since that is the one a linear search would
+ * find. */
+static int
+token_table_index_try(token_table_index_t *idx, uint32_t n_slots,
+                      uint32_t seed)
+{
+  const token_rule_t *table = idx->table;
+  int i;
+
+  memset(idx->slots, 0, n_slots);
+  idx->mask = n_slots - 1;
+  idx->seed = seed;
+  for (i = 0; table[i].t; ++i) {
+    const size_t len = strlen(table[i].t);
+    const uint32_t slot = keyword_hash(seed, table[i].t, len) & idx->mask;
+    if (idx->slots[slot]) {
+      if (!strcmp(table[idx->slots[slot] - 1].t, table[i].t))
+        continue; /* Duplicate keyword: keep the first rule. */
+      return -1;
+    }
+    idx->slots[slot] = (uint8_t)(i + 1);
+  }
+  return 0;
+}
+
+/** Build and return a perfect-hash index for the keywords in <b>table</b>.
+ * If we can't find one of a reasonable size, return an index with no slots,
+ * and let token_table_index_lookup() fall back to a linear search. */
+STATIC token_table_index_t *
+token_table_index_new(token_rule_t *table)
+{
+  token_table_index_t *idx = tor_malloc_zero(sizeof(token_table_index_t));
+  uint32_t n_slots = MIN_INDEX_SLOTS;
+  int n_rules = 0;
+
+  idx->table = table;
+  while (table[n_rules].t)
+    ++n_rules;
+  if (n_rules >= UINT8_MAX)
+    return idx;
+  while (n_slots < 2 * (uint32_t)n_rules)
+    n_slots <<= 1;
+
+  for ( ; n_slots <= MAX_INDEX_SLOTS; n_slots <<= 1) {
+    uint32_t seed;
+    idx->slots = tor_realloc(idx->slots, n_slots);
+    for (seed = 1; seed <= SEEDS_PER_SIZE; ++seed) {
+      if (token_table_index_try(idx, n_slots, seed) == 0)
+        return idx;
+    }
+  }
+  /* LCOV_EXCL_START */
+  log_info(LD_BUG, "Couldn't find a perfect hash for a table of %d "
+           "keywords; using a linear search.", n_rules);
+  tor_free(idx->slots);
+  idx->mask = 0;
+  return idx;
+  /* LCOV_EXCL_STOP */
+}
+
+/** Release all storage held by <b>idx</b>. */
+STATIC void
+token_table_index_free(token_table_index_t *idx)
+{
+  if (!idx)
+    return;
+  tor_free(idx->slots);
+  tor_free(idx);
+}
+
+/** Return the first rule in the table of <b>idx</b> whose keyword is the
+ * <b>len</b>-byte string at <b>s</b>, or NULL if there is none. */
+STATIC const token_rule_t *
+token_table_index_lookup(const token_table_index_t *idx,
+                         const char *s, size_t len)
+{
+  const token_rule_t *table = idx->table;
+  if (PREDICT_LIKELY(idx->slots)) {
+    const uint32_t slot = keyword_hash(idx->seed, s, len) & idx->mask;
+    const uint8_t r = idx->slots[slot];
+    if (r && !strcmp_len(s, table[r - 1].t, len))
+      return &table[r - 1];
+    return NULL;
+  } else {
+    int i;
+    for (i = 0; table[i].t; ++i) {
+      if (!strcmp_len(s, table[i].t, len))
+        return &table[i];
+    }
+    return NULL;
+  }
+}
+
+/** Indices for every token table we know, so that parsecommon_free_all()
+ * can find them. */
+static smartlist_t *token_table_indices = NULL;
+
+/** Build the keyword index for <b>table</b>, unless it has one already.
+ * Call this from the main thread before starting any thread that parses
+ * with <b>table</b>: after that, the index is only ever read. */
+void
+token_table_add_index(token_rule_t *table)
+{
+  token_table_index_t *idx;
+
+  if (table[0].index)
+    return;
+  idx = token_table_index_new(table);
+  if (!token_table_indices)
+    token_table_indices = smartlist_new();
+  smartlist_add(token_table_indices, idx);
+  table[0].index = idx;
+}
+
+/** Build the keyword indices for all our token tables.  Call this before
+ * launching any threads. */
+void
+parsecommon_init(void)
+{
+  routerparse_add_token_indices();
+  hs_desc_add_token_indices();
+}
+
+/** Return the index for <b>table</b>, which must have been built with
+ * token_table_add_index(). */
+static inline const token_table_index_t *
+token_table_get_index(const token_rule_t *table)
+{
+  tor_assert(table[0].index);
+  return table[0].index;
+}
+
+/** Release all the keyword indices built by the tokenizer. */
+void
+parsecommon_free_all(void)
+{
+  if (token_table_indices) {
+    SMARTLIST_FOREACH_BEGIN(token_table_indices, token_table_index_t *, idx) {
+      idx->table[0].index = NULL;
+      token_table_index_free(idx);
+    } SMARTLIST_FOREACH_END(idx);
+    smartlist_free(token_table_indices);
+    token_table_indices = NULL;
+  }
+}
+
 /** Free all resources allocated for <b>tok</b> */
 void
 token_clear(directory_token_t *tok)
@@ -35,6 +209,10 @@ token_clear(directory_token_t *tok)
     crypto_pk_free(tok->key);
 }
 
+static directory_token_t *get_next_token_indexed(memarea_t *area,
+                                         const char **s, const char *eos,
+                                         const token_table_index_t *idx);
+
 /** Read all tokens from a string between <b>start</b> and <b>end</b>, and add
  * them to <b>out</b>.  Parse according to the token rules in <b>table</b>.
  * Caller must free tokens in <b>out</b>.  If <b>end</b> is NULL, use the
@@ -47,10 +225,12 @@ tokenize_string(memarea_t *area,
 {
   const char **s;
   directory_token_t *tok = NULL;
+  const token_table_index_t *idx;
   int counts[NIL_];
   int i;
   int first_nonannotation;
   int prev_len = smartlist_len(out);
+  const int severity = (flags & TS_QUIET) ? LOG_DEBUG : LOG_WARN;
   tor_assert(area);
 
   s = &start;
@@ -59,7 +239,7 @@ tokenize_string(memarea_t *area,
   } else {
     /* it's only meaningful to check for nuls if we got an end-of-string ptr */
     if (memchr(start, '\0', end-start)) {
-      log_warn(LD_DIR, "parse error: internal NUL character.");
+      log_fn(severity, LD_DIR, "parse error: internal NUL character.");
       return -1;
     }
   }
@@ -68,10 +248,11 @@ tokenize_string(memarea_t *area,
 
   SMARTLIST_FOREACH(out, const directory_token_t *, t, ++counts[t->tp]);
 
+  idx = token_table_get_index(table);
   while (*s < end && (!tok || tok->tp != EOF_)) {
-    tok = get_next_token(area, s, end, table);
+    tok = get_next_token_indexed(area, s, end, idx);
     if (tok->tp == ERR_) {
-      log_warn(LD_DIR, "parse error: %s", tok->error);
+      log_fn(severity, LD_DIR, "parse error: %s", tok->error);
       token_clear(tok);
       return -1;
     }
@@ -93,19 +274,20 @@ tokenize_string(memarea_t *area,
       }
     }
     if (first_nonannotation < 0) {
-      log_warn(LD_DIR, "parse error: item contains only annotations");
+      log_fn(severity, LD_DIR, "parse error: item contains only annotations");
       return -1;
     }
     for (i=first_nonannotation;  i < smartlist_len(out); ++i) {
       tok = smartlist_get(out, i);
       if (tok->tp >= MIN_ANNOTATION && tok->tp <= MAX_ANNOTATION) {
-        log_warn(LD_DIR, "parse error: Annotations mixed with keywords");
+        log_fn(severity, LD_DIR,
+               "parse error: Annotations mixed with keywords");
         return -1;
       }
     }
     if ((flags & TS_NO_NEW_ANNOTATIONS)) {
       if (first_nonannotation != prev_len) {
-        log_warn(LD_DIR, "parse error: Unexpected annotations.");
+        log_fn(severity, LD_DIR, "parse error: Unexpected annotations.");
         return -1;
       }
     }
@@ -113,7 +295,7 @@ tokenize_string(memarea_t *area,
     for (i=0;  i < smartlist_len(out); ++i) {
       tok = smartlist_get(out, i);
       if (tok->tp >= MIN_ANNOTATION && tok->tp <= MAX_ANNOTATION) {
-        log_warn(LD_DIR, "parse error: no annotations allowed.");
+        log_fn(severity, LD_DIR, "parse error: no annotations allowed.");
         return -1;
       }
     }
@@ -121,24 +303,27 @@ tokenize_string(memarea_t *area,
   }
   for (i = 0; table[i].t; ++i) {
     if (counts[table[i].v] < table[i].min_cnt) {
-      log_warn(LD_DIR, "Parse error: missing %s element.", table[i].t);
+      log_fn(severity, LD_DIR, "Parse error: missing %s element.", table[i].t);
       return -1;
     }
     if (counts[table[i].v] > table[i].max_cnt) {
-      log_warn(LD_DIR, "Parse error: too many %s elements.", table[i].t);
+      log_fn(severity, LD_DIR, "Parse error: too many %s elements.",
+             table[i].t);
       return -1;
     }
     if (table[i].pos & AT_START) {
       if (smartlist_len(out) < 1 ||
           (tok = smartlist_get(out, first_nonannotation))->tp != table[i].v) {
-        log_warn(LD_DIR, "Parse error: first item is not %s.", table[i].t);
+        log_fn(severity, LD_DIR, "Parse error: first item is not %s.",
+               table[i].t);
         return -1;
       }
     }
     if (table[i].pos & AT_END) {
       if (smartlist_len(out) < 1 ||
           (tok = smartlist_get(out, smartlist_len(out)-1))->tp != table[i].v) {
-        log_warn(LD_DIR, "Parse error: last item is not %s.", table[i].t);
+        log_fn(severity, LD_DIR, "Parse error: last item is not %s.",
+               table[i].t);
         return -1;
       }
     }
@@ -150,27 +335,30 @@ tokenize_string(memarea_t *area,
  * <b>eol</b>, and store them in the args field of <b>tok</b>.  Store the
  * number of parsed elements into the n_args field of <b>tok</b>.  Allocate
  * all storage in <b>area</b>.  Return the number of arguments parsed, or
- * return -1 if there was an insanely high number of arguments. */
+ * return -1 if there was an insanely high number of arguments.
+ *
+ * The line is copied and split in one pass, into a single allocation. */
 static inline int
 get_token_arguments(memarea_t *area, directory_token_t *tok,
                     const char *s, const char *eol)
 {
 /** Largest number of arguments we'll accept to any token, ever. */
 #define MAX_ARGS 512
-  char *mem = memarea_strndup(area, s, eol-s);
-  char *cp = mem;
+  char *cp = memarea_alloc(area, eol-s+1);
   int j = 0;
   char *args[MAX_ARGS];
-  memset(args, 0, sizeof(args));
-  while (*cp) {
+  while (s < eol && *s) {
+    const char *e;
     if (j == MAX_ARGS)
       return -1;
+    e = find_whitespace_eos(s, eol);
     args[j++] = cp;
-    cp = (char*)find_whitespace(cp);
-    if (!cp || !*cp)
-      break; /* End of the line. */
+    memcpy(cp, s, e-s);
+    cp += e-s;
     *cp++ = '\0';
-    cp = (char*)eat_whitespace(cp);
+    if (e == eol || !*e)
+      break; /* End of the line. */
+    s = eat_whitespace_eos(e+1, eol);
   }
   tok->n_args = j;
   tok->args = memarea_memdup(area, args, j*sizeof(char*));
@@ -250,6 +438,16 @@ token_check_object(memarea_t *area, const char *kwd,
 directory_token_t *
 get_next_token(memarea_t *area,
                const char **s, const char *eos, token_rule_t *table)
+{
+  return get_next_token_indexed(area, s, eos, token_table_get_index(table));
+}
+
+/** As get_next_token(), but look keywords up in <b>idx</b>, the index of
+ * the table we're parsing with. */
+static directory_token_t *
+get_next_token_indexed(memarea_t *area,
+                       const char **s, const char *eos,
+                       const token_table_index_t *idx)
 {
   /** Reject any object at least this big; it is probably an overflow, an
    * attack, a bug, or some other nonsense. */
@@ -260,7 +458,7 @@ get_next_token(memarea_t *area,
 
   const char *next, *eol, *obstart;
   size_t obname_len;
-  int i;
+  const token_rule_t *rule;
   directory_token_t *tok;
   obj_syntax o_syn = NO_OBJ;
   char ebuf[128];
@@ -290,38 +488,34 @@ get_next_token(memarea_t *area,
     RET_ERR("Unexpected EOF");
   }
 
-  /* Search the table for the appropriate entry.  (I tried a binary search
-   * instead, but it wasn't any faster.) */
-  for (i = 0; table[i].t ; ++i) {
-    if (!strcmp_len(*s, table[i].t, next-*s)) {
-      /* We've found the keyword. */
-      kwd = table[i].t;
-      tok->tp = table[i].v;
-      o_syn = table[i].os;
-      *s = eat_whitespace_eos_no_nl(next, eol);
-      /* We go ahead whether there are arguments or not, so that tok->args is
-       * always set if we want arguments. */
-      if (table[i].concat_args) {
-        /* The keyword takes the line as a single argument */
-        tok->args = ALLOC(sizeof(char*));
-        tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
-        tok->n_args = 1;
-      } else {
-        /* This keyword takes multiple arguments. */
-        if (get_token_arguments(area, tok, *s, eol)<0) {
-          tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
-          RET_ERR(ebuf);
-        }
-        *s = eol;
-      }
-      if (tok->n_args < table[i].min_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
-        RET_ERR(ebuf);
-      } else if (tok->n_args > table[i].max_args) {
-        tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+  /* Look the keyword up in the table's perfect hash. */
+  rule = token_table_index_lookup(idx, *s, next-*s);
+  if (rule) {
+    kwd = rule->t;
+    tok->tp = rule->v;
+    o_syn = rule->os;
+    *s = eat_whitespace_eos_no_nl(next, eol);
+    /* We go ahead whether there are arguments or not, so that tok->args is
+     * always set if we want arguments. */
+    if (rule->concat_args) {
+      /* The keyword takes the line as a single argument */
+      tok->args = ALLOC(sizeof(char*));
+      tok->args[0] = STRNDUP(*s,eol-*s); /* Grab everything on line */
+      tok->n_args = 1;
+    } else {
+      /* This keyword takes multiple arguments. */
+      if (get_token_arguments(area, tok, *s, eol)<0) {
+        tor_snprintf(ebuf, sizeof(ebuf),"Far too many arguments to %s", kwd);
         RET_ERR(ebuf);
       }
-      break;
+      *s = eol;
+    }
+    if (tok->n_args < rule->min_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too few arguments to %s", kwd);
+      RET_ERR(ebuf);
+    } else if (tok->n_args > rule->max_args) {
+      tor_snprintf(ebuf, sizeof(ebuf), "Too many arguments to %s", kwd);
+      RET_ERR(ebuf);
     }
   }
 
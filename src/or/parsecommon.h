@@ -228,6 +228,8 @@ typedef enum {
 #define TS_ANNOTATIONS_OK 1
 #define TS_NOCHECK 2
 #define TS_NO_NEW_ANNOTATIONS 4
+/** Log problems at debug level rather than as warnings. */
+#define TS_QUIET 8
 
 /**
  * @name macros for defining token rules
@@ -239,23 +241,23 @@ typedef enum {
 /**@{*/
 
 /** Appears to indicate the end of a table. */
-#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0 }
+#define END_OF_TABLE { NULL, NIL_, 0,0,0, NO_OBJ, 0, INT_MAX, 0, 0, NULL }
 /** An item with no restrictions: used for obsolete document types */
-#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T(s,t,a,o)    { s, t, a, o, 0, INT_MAX, 0, 0, NULL }
 /** An item with no restrictions on multiplicity or location. */
-#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0 }
+#define T0N(s,t,a,o)  { s, t, a, o, 0, INT_MAX, 0, 0, NULL }
 /** An item that must appear exactly once */
-#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0 }
+#define T1(s,t,a,o)   { s, t, a, o, 1, 1, 0, 0, NULL }
 /** An item that must appear exactly once, at the start of the document */
-#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0 }
+#define T1_START(s,t,a,o)   { s, t, a, o, 1, 1, AT_START, 0, NULL }
 /** An item that must appear exactly once, at the end of the document */
-#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0 }
+#define T1_END(s,t,a,o)   { s, t, a, o, 1, 1, AT_END, 0, NULL }
 /** An item that must appear one or more times */
-#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0 }
+#define T1N(s,t,a,o)  { s, t, a, o, 1, INT_MAX, 0, 0, NULL }
 /** An item that must appear no more than once */
-#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0 }
+#define T01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 0, NULL }
 /** An annotation that must appear no more than once */
-#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1 }
+#define A01(s,t,a,o)  { s, t, a, o, 0, 1, 0, 1, NULL }
 
 /** Argument multiplicity: any number of arguments. */
 #define ARGS        0,INT_MAX,0
@@ -293,6 +295,9 @@ typedef struct token_rule_t {
   int pos;
   /** True iff this token is an annotation. */
   int is_annotation;
+  /** In the first rule of a table only: the keyword index for the whole
+   * table, set by token_table_add_index(). */
+  struct token_table_index_t *index;
 } token_rule_t;
 
 void token_clear(directory_token_t *tok);
@@ -318,5 +323,32 @@ directory_token_t *find_opt_by_keyword(smartlist_t *s,
                                        directory_keyword keyword);
 smartlist_t * find_all_by_keyword(const smartlist_t *s, directory_keyword k);
 
+void token_table_add_index(token_rule_t *table);
+void parsecommon_init(void);
+void parsecommon_free_all(void);
+
+#ifdef PARSECOMMON_PRIVATE
+/** A perfect hash from the keywords of one token table to their rules. */
+typedef struct token_table_index_t {
+  /** The table we index. */
+  token_rule_t *table;
+  /** Seed for the keyword hash, chosen so that no two keywords in
+   * <b>table</b> share a slot. */
+  uint32_t seed;
+  /** One less than the number of slots. */
+  uint32_t mask;
+  /** For each slot, one more than the index in <b>table</b> of the rule
+   * whose keyword hashes there, or 0 for an empty slot.  NULL if we could
+   * not find a perfect hash, in which case we search the table linearly. */
+  uint8_t *slots;
+} token_table_index_t;
+
+STATIC token_table_index_t *token_table_index_new(token_rule_t *table);
+STATIC void token_table_index_free(token_table_index_t *idx);
+STATIC const token_rule_t *token_table_index_lookup(
+                                             const token_table_index_t *idx,
+                                             const char *s, size_t len);
+#endif /* defined(PARSECOMMON_PRIVATE) */
+
 #endif /* !defined(TOR_PARSECOMMON_H) */
 
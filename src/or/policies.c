@@ -31,8 +31,12 @@
 
 /** Policy that addresses for incoming SOCKS connections must match. */
 static smartlist_t *socks_policy = NULL;
+/** Compiled form of socks_policy, or NULL. */
+static compiled_policy_t *socks_policy_compiled = NULL;
 /** Policy that addresses for incoming directory connections must match. */
 static smartlist_t *dir_policy = NULL;
+/** Compiled form of dir_policy, or NULL. */
+static compiled_policy_t *dir_policy_compiled = NULL;
 /** Policy that addresses for incoming router descriptors must match in order
  * to be published by us. */
 static smartlist_t *authdir_reject_policy = NULL;
@@ -343,15 +347,10 @@ firewall_is_fascist_dir(void)
   return (reachable_dir_addr_policy != NULL || firewall_is_fascist_impl());
 }
 
-/** Return true iff <b>policy</b> (possibly NULL) will allow a
- * connection to <b>addr</b>:<b>port</b>.
- */
+/** Return true iff the policy lookup result <b>p</b> allows a connection. */
 static int
-addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
-                            smartlist_t *policy)
+addr_policy_result_permits(addr_policy_result_t p)
 {
-  addr_policy_result_t p;
-  p = compare_tor_addr_to_addr_policy(addr, port, policy);
   switch (p) {
     case ADDR_POLICY_PROBABLY_ACCEPTED:
     case ADDR_POLICY_ACCEPTED:
@@ -365,6 +364,17 @@ addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** Return true iff <b>policy</b> (possibly NULL) will allow a
+ * connection to <b>addr</b>:<b>port</b>.
+ */
+static int
+addr_policy_permits_tor_addr(const tor_addr_t *addr, uint16_t port,
+                            smartlist_t *policy)
+{
+  return addr_policy_result_permits(
+                         compare_tor_addr_to_addr_policy(addr, port, policy));
+}
+
 /** Return true iff <b> policy</b> (possibly NULL) will allow a connection to
  * <b>addr</b>:<b>port</b>.  <b>addr</b> is an IPv4 address given in host
  * order. */
@@ -1044,7 +1054,9 @@ fascist_firewall_choose_address_dir_server(const dir_server_t *ds,
 int
 dir_policy_permits_address(const tor_addr_t *addr)
 {
-  return addr_policy_permits_tor_addr(addr, 1, dir_policy);
+  return addr_policy_result_permits(
+     compare_tor_addr_to_compiled_policy(addr, 1, dir_policy,
+                                         dir_policy_compiled));
 }
 
 /** Return 1 if <b>addr</b> is permitted to connect to our socks port,
@@ -1053,7 +1065,9 @@ dir_policy_permits_address(const tor_addr_t *addr)
 int
 socks_policy_permits_address(const tor_addr_t *addr)
 {
-  return addr_policy_permits_tor_addr(addr, 1, socks_policy);
+  return addr_policy_result_permits(
+     compare_tor_addr_to_compiled_policy(addr, 1, socks_policy,
+                                         socks_policy_compiled));
 }
 
 /** Return true iff the address <b>addr</b> is in a country listed in the
@@ -1236,6 +1250,10 @@ policies_parse_from_options(const or_options_t *options)
   if (load_policy_from_option(options->DirPolicy, "DirPolicy",
                               &dir_policy, -1) < 0)
     ret = -1;
+  compiled_policy_free(socks_policy_compiled);
+  socks_policy_compiled = compiled_policy_new(socks_policy);
+  compiled_policy_free(dir_policy_compiled);
+  dir_policy_compiled = compiled_policy_new(dir_policy);
   if (load_policy_from_option(options->AuthDirReject, "AuthDirReject",
                               &authdir_reject_policy, ADDR_POLICY_REJECT) < 0)
     ret = -1;
@@ -1508,6 +1526,362 @@ compare_tor_addr_to_addr_policy,(const tor_addr_t *addr, uint16_t port,
   }
 }
 
+/** A 128-bit address, used as a lookup key in a compiled_policy_t.  IPv4
+ * addresses are stored in the top 32 bits, so that a prefix of
+ * <b>maskbits</b> bits covers the same keys in either family. */
+typedef struct policy_addr_key_t {
+  uint64_t hi;
+  uint64_t lo;
+} policy_addr_key_t;
+
+/** The compiled form of the entries of an address policy for a single
+ * address family.  The address space is split into ranges, each of which
+ * is matched by the same set of policy entries; every range gets a table
+ * of port intervals with the verdict of the first entry that matches each
+ * port. */
+typedef struct compiled_policy_family_t {
+  /** Number of address ranges; at least 1. */
+  int n_ranges;
+  /** Sorted array of the first key in each address range.  The first
+   * range always starts at 0. */
+  policy_addr_key_t *range_start;
+  /** Array of n_ranges+1 indices into port_start and port_accept: the
+   * port table for range i is at range_ports[i] up to range_ports[i+1]. */
+  int *range_ports;
+  /** The lowest port in each port interval, ascending within each range's
+   * port table; each table starts with port 0. */
+  uint16_t *port_start;
+  /** True iff ports in the corresponding interval are accepted. */
+  uint8_t *port_accept;
+} compiled_policy_family_t;
+
+/** An immutable decision structure built from an address policy, for
+ * answering "is addr:port accepted?" in O(log n) time instead of walking
+ * the whole policy.  First-match semantics are the same as
+ * compare_known_tor_addr_to_addr_policy(). */
+struct compiled_policy_t {
+  /** Compiled entries for AF_INET and AF_INET6, in that order. */
+  compiled_policy_family_t family[2];
+};
+
+/** If compiling a policy would need more port intervals than this, give up
+ * and let the caller keep using the linear lookup. */
+#define COMPILED_POLICY_MAX_PORT_INTERVALS (1<<20)
+
+/** An address policy entry, flattened for compilation. */
+typedef struct compiled_policy_rule_t {
+  policy_addr_key_t first; /**< Lowest address key matched. */
+  policy_addr_key_t last; /**< Highest address key matched. */
+  uint16_t prt_min; /**< Lowest port matched. */
+  uint16_t prt_max; /**< Highest port matched. */
+  uint8_t accept; /**< True iff this is an accept entry. */
+} compiled_policy_rule_t;
+
+/** Return -1, 0, or 1 if <b>a</b> is less than, equal to, or greater than
+ * <b>b</b>. */
+static inline int
+policy_addr_key_cmp(const policy_addr_key_t *a, const policy_addr_key_t *b)
+{
+  if (a->hi != b->hi)
+    return a->hi < b->hi ? -1 : 1;
+  if (a->lo != b->lo)
+    return a->lo < b->lo ? -1 : 1;
+  return 0;
+}
+
+/** Helper for qsort: compare two policy_addr_key_t. */
+static int
+policy_addr_key_cmp_(const void *a, const void *b)
+{
+  return policy_addr_key_cmp(a, b);
+}
+
+/** Helper for qsort: compare two uint16_t. */
+static int
+compare_uint16_(const void *a, const void *b)
+{
+  uint16_t x = *(const uint16_t *)a, y = *(const uint16_t *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/** Set *<b>key_out</b> to the lookup key for <b>addr</b>, which must be an
+ * AF_INET or AF_INET6 address. */
+static void
+policy_addr_key_from_tor_addr(policy_addr_key_t *key_out,
+                              const tor_addr_t *addr)
+{
+  if (tor_addr_family(addr) == AF_INET) {
+    key_out->hi = ((uint64_t)tor_addr_to_ipv4h(addr)) << 32;
+    key_out->lo = 0;
+  } else {
+    const uint8_t *a = tor_addr_to_in6_addr8(addr);
+    key_out->hi = tor_ntohll(get_uint64(a));
+    key_out->lo = tor_ntohll(get_uint64(a+8));
+  }
+}
+
+/** Fill in the range of keys matched by <b>ent</b> in <b>rule</b>. */
+static void
+compiled_policy_rule_set_range(compiled_policy_rule_t *rule,
+                               const addr_policy_t *ent)
+{
+  int bits = ent->maskbits;
+  uint64_t hi_mask, lo_mask;
+
+  if (tor_addr_family(&ent->addr) == AF_INET && bits > 32)
+    bits = 32;
+  else if (bits > 128)
+    bits = 128;
+
+  if (bits == 0) {
+    hi_mask = lo_mask = 0;
+  } else if (bits <= 64) {
+    hi_mask = UINT64_MAX << (64 - bits);
+    lo_mask = 0;
+  } else {
+    hi_mask = UINT64_MAX;
+    lo_mask = (bits == 128) ? UINT64_MAX : UINT64_MAX << (128 - bits);
+  }
+
+  policy_addr_key_from_tor_addr(&rule->first, &ent->addr);
+  rule->first.hi &= hi_mask;
+  rule->first.lo &= lo_mask;
+  rule->last.hi = rule->first.hi | ~hi_mask;
+  rule->last.lo = rule->first.lo | ~lo_mask;
+}
+
+/** Compile the entries of <b>policy</b> whose address family is
+ * <b>family</b> into <b>out</b>.  Return 0 on success, -1 if the result
+ * would be too large. */
+static int
+compiled_policy_family_build(compiled_policy_family_t *out,
+                             const smartlist_t *policy, sa_family_t family)
+{
+  compiled_policy_rule_t *rules;
+  policy_addr_key_t *bounds;
+  uint16_t *ports;
+  int *matching;
+  int n_rules = 0, n_bounds = 0, i, j;
+  int ports_used = 0, ports_allocated = 0;
+  int r = -1;
+
+  rules = tor_calloc(smartlist_len(policy) + 1, sizeof(*rules));
+  bounds = tor_calloc(2 * smartlist_len(policy) + 1, sizeof(*bounds));
+  ports = tor_calloc(2 * smartlist_len(policy) + 1, sizeof(*ports));
+  matching = tor_calloc(smartlist_len(policy) + 1, sizeof(int));
+
+  /* Flatten the entries for this family, in order, and collect the
+   * addresses where the set of matching entries can change. */
+  memset(&bounds[n_bounds++], 0, sizeof(policy_addr_key_t));
+  SMARTLIST_FOREACH_BEGIN(policy, const addr_policy_t *, ent) {
+    compiled_policy_rule_t *rule;
+    if (tor_addr_family(&ent->addr) != family)
+      continue;
+    rule = &rules[n_rules++];
+    compiled_policy_rule_set_range(rule, ent);
+    rule->prt_min = ent->prt_min;
+    rule->prt_max = ent->prt_max;
+    rule->accept = (ent->policy_type == ADDR_POLICY_ACCEPT);
+    bounds[n_bounds++] = rule->first;
+    if (rule->last.hi != UINT64_MAX || rule->last.lo != UINT64_MAX) {
+      policy_addr_key_t *next = &bounds[n_bounds++];
+      *next = rule->last;
+      if (++next->lo == 0)
+        ++next->hi;
+    }
+  } SMARTLIST_FOREACH_END(ent);
+
+  qsort(bounds, n_bounds, sizeof(*bounds), policy_addr_key_cmp_);
+
+  out->range_start = tor_calloc(n_bounds, sizeof(policy_addr_key_t));
+  out->range_ports = tor_calloc(n_bounds + 1, sizeof(int));
+  out->n_ranges = 0;
+
+  for (i = 0; i < n_bounds; ++i) {
+    const policy_addr_key_t *start = &bounds[i];
+    int n_ports = 0, n_matching = 0, first_port;
+
+    if (i && !policy_addr_key_cmp(start, &bounds[i-1]))
+      continue;
+
+    /* Every entry boundary is a range boundary, so an entry matches this
+     * whole range iff it matches its first key.  Collect those entries and
+     * the ports where the verdict can change... */
+    ports[n_ports++] = 0;
+    for (j = 0; j < n_rules; ++j) {
+      if (policy_addr_key_cmp(&rules[j].first, start) > 0 ||
+          policy_addr_key_cmp(&rules[j].last, start) < 0)
+        continue;
+      matching[n_matching++] = j;
+      ports[n_ports++] = rules[j].prt_min;
+      if (rules[j].prt_max != UINT16_MAX)
+        ports[n_ports++] = rules[j].prt_max + 1;
+    }
+    qsort(ports, n_ports, sizeof(uint16_t), compare_uint16_);
+
+    if (ports_used + n_ports > ports_allocated) {
+      ports_allocated = MAX(ports_allocated * 2, ports_used + n_ports);
+      if (ports_allocated > COMPILED_POLICY_MAX_PORT_INTERVALS)
+        goto done;
+      out->port_start = tor_reallocarray(out->port_start, ports_allocated,
+                                         sizeof(uint16_t));
+      out->port_accept = tor_reallocarray(out->port_accept, ports_allocated,
+                                          sizeof(uint8_t));
+    }
+
+    /* ... then give each port interval the verdict of the first entry that
+     * matches it, merging neighbours with the same verdict. */
+    first_port = ports_used;
+    for (j = 0; j < n_ports; ++j) {
+      uint16_t port = ports[j];
+      uint8_t accept = 1; /* accept all by default. */
+      int k;
+      if (j && port == ports[j-1])
+        continue;
+      for (k = 0; k < n_matching; ++k) {
+        const compiled_policy_rule_t *rule = &rules[matching[k]];
+        if (port >= rule->prt_min && port <= rule->prt_max) {
+          accept = rule->accept;
+          break;
+        }
+      }
+      if (ports_used > first_port && out->port_accept[ports_used-1] == accept)
+        continue;
+      out->port_start[ports_used] = port;
+      out->port_accept[ports_used] = accept;
+      ++ports_used;
+    }
+
+    /* If the previous range had the same port table, just extend it. */
+    if (out->n_ranges) {
+      int prev = out->range_ports[out->n_ranges-1];
+      int prev_len = first_port - prev;
+      if (prev_len == ports_used - first_port &&
+          fast_memeq(out->port_start + prev, out->port_start + first_port,
+                     prev_len * sizeof(uint16_t)) &&
+          fast_memeq(out->port_accept + prev, out->port_accept + first_port,
+                     prev_len)) {
+        ports_used = first_port;
+        continue;
+      }
+    }
+    out->range_start[out->n_ranges] = *start;
+    out->range_ports[out->n_ranges] = first_port;
+    out->range_ports[++out->n_ranges] = ports_used;
+  }
+  r = 0;
+
+ done:
+  tor_free(rules);
+  tor_free(bounds);
+  tor_free(ports);
+  tor_free(matching);
+  return r;
+}
+
+/** Release all storage held in <b>fam</b>. */
+static void
+compiled_policy_family_clear(compiled_policy_family_t *fam)
+{
+  tor_free(fam->range_start);
+  tor_free(fam->range_ports);
+  tor_free(fam->port_start);
+  tor_free(fam->port_accept);
+}
+
+/** Build and return a compiled_policy_t that gives the same answers as
+ * compare_tor_addr_to_addr_policy() on <b>policy</b> for known IPv4 and
+ * IPv6 addresses with known ports.  Return NULL if <b>policy</b> is NULL,
+ * or too complex to compile.  The result does not refer to <b>policy</b>,
+ * so it stays valid if <b>policy</b> is freed, but it does not change if
+ * <b>policy</b> does. */
+compiled_policy_t *
+compiled_policy_new(const smartlist_t *policy)
+{
+  compiled_policy_t *cp;
+
+  if (!policy)
+    return NULL;
+
+  cp = tor_malloc_zero(sizeof(compiled_policy_t));
+  if (compiled_policy_family_build(&cp->family[0], policy, AF_INET) < 0 ||
+      compiled_policy_family_build(&cp->family[1], policy, AF_INET6) < 0) {
+    log_info(LD_CONFIG, "Address policy with %d entries is too complex to "
+             "compile; using the slow lookup for it.",
+             smartlist_len(policy));
+    compiled_policy_free(cp);
+    return NULL;
+  }
+  return cp;
+}
+
+/** Release all storage held by <b>cp</b>. */
+void
+compiled_policy_free(compiled_policy_t *cp)
+{
+  if (!cp)
+    return;
+  compiled_policy_family_clear(&cp->family[0]);
+  compiled_policy_family_clear(&cp->family[1]);
+  tor_free(cp);
+}
+
+/** Return the index of the last element of the sorted array <b>start</b>,
+ * holding <b>n</b> keys, that is no greater than <b>key</b>.  The first
+ * element must be no greater than any key. */
+static int
+compiled_policy_find_range(const policy_addr_key_t *start, int n,
+                           const policy_addr_key_t *key)
+{
+  int lo = 0, hi = n - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (policy_addr_key_cmp(&start[mid], key) <= 0)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+/** Decide whether <b>addr</b>:<b>port</b> is accepted or rejected by the
+ * address policy <b>policy</b>, whose compiled form is <b>compiled</b>.
+ * Use <b>compiled</b> when it can answer the question, and fall back to
+ * compare_tor_addr_to_addr_policy() on <b>policy</b> otherwise: when
+ * <b>compiled</b> is NULL, the address or port is unknown, or the address
+ * is neither IPv4 nor IPv6. */
+addr_policy_result_t
+compare_tor_addr_to_compiled_policy(const tor_addr_t *addr, uint16_t port,
+                                    const smartlist_t *policy,
+                                    const compiled_policy_t *compiled)
+{
+  const compiled_policy_family_t *fam;
+  policy_addr_key_t key;
+  int range, lo, hi;
+
+  if (!compiled || !policy || !addr || port == 0 ||
+      (tor_addr_family(addr) != AF_INET &&
+       tor_addr_family(addr) != AF_INET6) ||
+      tor_addr_is_null(addr))
+    return compare_tor_addr_to_addr_policy(addr, port, policy);
+
+  fam = &compiled->family[tor_addr_family(addr) == AF_INET ? 0 : 1];
+  policy_addr_key_from_tor_addr(&key, addr);
+  range = compiled_policy_find_range(fam->range_start, fam->n_ranges, &key);
+
+  /* Find the last port interval starting at or below port. */
+  lo = fam->range_ports[range];
+  hi = fam->range_ports[range+1] - 1;
+  while (lo < hi) {
+    int mid = lo + (hi - lo + 1) / 2;
+    if (fam->port_start[mid] <= port)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return fam->port_accept[lo] ? ADDR_POLICY_ACCEPTED : ADDR_POLICY_REJECTED;
+}
+
 /** Return true iff the address policy <b>a</b> covers every case that
  * would be covered by <b>b</b>, so that a,b is redundant. */
 static int
@@ -3058,8 +3432,12 @@ policies_free_all(void)
   reachable_dir_addr_policy = NULL;
   addr_policy_list_free(socks_policy);
   socks_policy = NULL;
+  compiled_policy_free(socks_policy_compiled);
+  socks_policy_compiled = NULL;
   addr_policy_list_free(dir_policy);
   dir_policy = NULL;
+  compiled_policy_free(dir_policy_compiled);
+  dir_policy_compiled = NULL;
   addr_policy_list_free(authdir_reject_policy);
   authdir_reject_policy = NULL;
   addr_policy_list_free(authdir_invalid_policy);
@@ -82,6 +82,14 @@ MOCK_DECL(addr_policy_result_t, compare_tor_addr_to_addr_policy,
 addr_policy_result_t compare_tor_addr_to_node_policy(const tor_addr_t *addr,
                               uint16_t port, const node_t *node);
 
+typedef struct compiled_policy_t compiled_policy_t;
+compiled_policy_t *compiled_policy_new(const smartlist_t *policy);
+void compiled_policy_free(compiled_policy_t *cp);
+addr_policy_result_t compare_tor_addr_to_compiled_policy(
+                                         const tor_addr_t *addr, uint16_t port,
+                                         const smartlist_t *policy,
+                                         const compiled_policy_t *compiled);
+
 int policies_parse_exit_policy_from_options(
                                           const or_options_t *or_options,
                                           uint32_t local_address,
@@ -1855,6 +1855,9 @@ router_get_advertised_dir_port(const or_options_t *options, uint16_t dirport)
 
 /** My routerinfo. */
 static routerinfo_t *desc_routerinfo = NULL;
+/** Incremented whenever desc_routerinfo, and so possibly our exit policy,
+ * changes. Never 0. */
+static uint32_t desc_routerinfo_generation = 1;
 /** My extrainfo */
 static extrainfo_t *desc_extrainfo = NULL;
 /** Why did we most recently decide to regenerate our descriptor?  Used to
@@ -1915,6 +1918,16 @@ router_upload_dir_desc_to_dirservers(int force)
   tor_free(msg);
 }
 
+/** Return a number that changes whenever the routerinfo returned by
+ * router_get_my_routerinfo(), and so our exit policy, may have changed.
+ * Callers can use it to tell whether the result of an earlier
+ * router_compare_to_my_exit_policy() call still holds. Never returns 0. */
+uint32_t
+router_get_my_exit_policy_generation(void)
+{
+  return desc_routerinfo_generation;
+}
+
 /** OR only: Check whether my exit policy says to allow connection to
  * conn.  Return 0 if we accept; non-0 if we reject.
  */
@@ -1937,8 +1950,9 @@ router_compare_to_my_exit_policy(const tor_addr_t *addr, uint16_t port)
    * summary. */
   if ((tor_addr_family(addr) == AF_INET ||
        tor_addr_family(addr) == AF_INET6)) {
-    return compare_tor_addr_to_addr_policy(addr, port,
-                               me->exit_policy) != ADDR_POLICY_ACCEPTED;
+    return compare_tor_addr_to_compiled_policy(addr, port, me->exit_policy,
+                                               me->exit_policy_compiled)
+      != ADDR_POLICY_ACCEPTED;
 #if 0
   } else if (tor_addr_family(addr) == AF_INET6) {
     return get_options()->IPv6Exit &&
@@ -2268,6 +2282,7 @@ router_build_fresh_descriptor(routerinfo_t **r, extrainfo_t **e)
   ri->policy_is_reject_star =
     policy_is_reject_star(ri->exit_policy, AF_INET, 1) &&
     policy_is_reject_star(ri->exit_policy, AF_INET6, 1);
+  ri->exit_policy_compiled = compiled_policy_new(ri->exit_policy);
 
   if (options->IPv6Exit) {
     char *p_tmp = policy_summarize(ri->exit_policy, AF_INET6);
@@ -2441,6 +2456,8 @@ router_rebuild_descriptor(int force)
 
   routerinfo_free(desc_routerinfo);
   desc_routerinfo = ri;
+  if (++desc_routerinfo_generation == 0)
+    desc_routerinfo_generation = 1;
   extrainfo_free(desc_extrainfo);
   desc_extrainfo = ei;
 
@@ -58,6 +58,7 @@
 #include "or.h"
 #include "config.h"
 #include "circuitstats.h"
+#include "cpuworker.h"
 #include "dirserv.h"
 #include "dirvote.h"
 #include "parsecommon.h"
@@ -370,6 +371,13 @@ static int router_get_hashes_impl(const char *s, size_t s_len,
                                   const char *start_str, const char *end_str,
                                   char end_char);
 static smartlist_t *find_all_exitpolicy(smartlist_t *s);
+static routerstatus_t *routerstatus_parse_entry_impl(memarea_t *area,
+                                          const char **s, smartlist_t *tokens,
+                                          networkstatus_t *vote,
+                                          vote_routerstatus_t *vote_rs,
+                                          int consensus_method,
+                                          consensus_flavor_t flav,
+                                          int pretokenized);
 
 #define CST_NO_CHECK_OBJTYPE  (1<<0)
 static int check_signature_token(const char *digest,
@@ -2551,6 +2559,22 @@ routerstatus_parse_entry_from_string(memarea_t *area,
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav)
+{
+  return routerstatus_parse_entry_impl(area, s, tokens, vote, vote_rs,
+                                       consensus_method, flav, 0);
+}
+
+/** As routerstatus_parse_entry_from_string(), but if <b>pretokenized</b>
+ * is set, <b>tokens</b> already holds the tokens of the entry at *<b>s</b>,
+ * so we don't tokenize it again. */
+static routerstatus_t *
+routerstatus_parse_entry_impl(memarea_t *area,
+                              const char **s, smartlist_t *tokens,
+                              networkstatus_t *vote,
+                              vote_routerstatus_t *vote_rs,
+                              int consensus_method,
+                              consensus_flavor_t flav,
+                              int pretokenized)
 {
   const char *eos, *s_dup = *s;
   routerstatus_t *rs = NULL;
@@ -2567,7 +2591,8 @@ routerstatus_parse_entry_from_string(memarea_t *area,
 
   eos = find_start_of_next_routerstatus(*s);
 
-  if (tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
+  if (!pretokenized &&
+      tokenize_string(area,*s, eos, tokens, rtrstatus_token_table,0)) {
     log_warn(LD_DIR, "Error tokenizing router status");
     goto err;
   }
@@ -2852,6 +2877,160 @@ routerstatus_parse_entry_from_string(memarea_t *area,
   return rs;
 }
 
+/** A document whose items (routerstatus entries or microdescriptors) we're
+ * tokenizing in parallel with cpuworker_parallel_for().  The workers only
+ * tokenize: everything else about parsing an item logs, looks at our
+ * options, or calls non-thread-safe helpers like escaped(), so we leave it
+ * to the main thread. */
+typedef struct parallel_tokenize_t {
+  /** Number of items. */
+  int n_items;
+  /** Item <b>i</b> runs from bounds[i] to bounds[i+1]. */
+  const char **bounds;
+  /** Table and flags to tokenize each item with. */
+  token_rule_t *table;
+  int flags;
+  /** For each item, a smartlist of its tokens, or NULL if we couldn't
+   * tokenize it. */
+  smartlist_t **item_tokens;
+  /** The chunks we split the items into.  Chunk <b>i</b> covers items
+   * chunk_first[i] up to chunk_first[i+1], and keeps their tokens in
+   * chunk_area[i]. */
+  int n_chunks;
+  int *chunk_first;
+  memarea_t **chunk_area;
+} parallel_tokenize_t;
+
+/** Don't bother tokenizing a document in parallel unless it has at least
+ * this many bytes of items. */
+#define MIN_PARALLEL_PARSE_LEN (64*1024)
+/** Split documents that we tokenize in parallel into chunks of about this
+ * many bytes. */
+#define PARALLEL_PARSE_CHUNK_LEN (16*1024)
+
+/** cpuworker_parallel_for() callback: tokenize chunk <b>idx</b> of the
+ * parallel_tokenize_t <b>arg</b>. */
+static void
+parallel_tokenize_chunk(void *arg, int idx)
+{
+  parallel_tokenize_t *pt = arg;
+  memarea_t *area = memarea_new();
+  int i;
+
+  for (i = pt->chunk_first[idx]; i < pt->chunk_first[idx+1]; ++i) {
+    smartlist_t *tokens = smartlist_new();
+    if (tokenize_string(area, pt->bounds[i], pt->bounds[i+1], tokens,
+                        pt->table, pt->flags|TS_QUIET) < 0) {
+      /* The main thread will tokenize it again, and say what's wrong. */
+      SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+      smartlist_free(tokens);
+      tokens = NULL;
+    }
+    pt->item_tokens[i] = tokens;
+  }
+  pt->chunk_area[idx] = area;
+}
+
+/** Set up <b>pt</b> for the items whose boundaries are in <b>bounds</b>, and
+ * if there are enough of them, tokenize them in parallel with <b>table</b>
+ * and <b>flags</b>.  Otherwise leave every item's tokens NULL.  The caller
+ * keeps ownership of <b>bounds</b>, which must outlive <b>pt</b>. */
+static void
+parallel_tokenize(parallel_tokenize_t *pt, smartlist_t *bounds,
+                  token_rule_t *table, int flags)
+{
+  const int n = smartlist_len(bounds) - 1;
+  size_t chunk_len = 0;
+  int i;
+
+  memset(pt, 0, sizeof(*pt));
+  pt->n_items = n;
+  pt->bounds = (const char **)bounds->list;
+  pt->table = table;
+  pt->flags = flags;
+  pt->item_tokens = tor_calloc(n + 1, sizeof(smartlist_t *));
+  if (n < 1 || pt->bounds[n] - pt->bounds[0] < MIN_PARALLEL_PARSE_LEN)
+    return;
+
+  pt->chunk_first = tor_calloc(n + 1, sizeof(int));
+  for (i = 0; i < n; ++i) {
+    chunk_len += pt->bounds[i+1] - pt->bounds[i];
+    if (chunk_len >= PARALLEL_PARSE_CHUNK_LEN || i == n - 1) {
+      pt->chunk_first[++pt->n_chunks] = i + 1;
+      chunk_len = 0;
+    }
+  }
+  pt->chunk_area = tor_calloc(pt->n_chunks, sizeof(memarea_t *));
+  cpuworker_parallel_for(pt->n_chunks, parallel_tokenize_chunk, pt);
+}
+
+/** Release all storage held by <b>pt</b>, including any tokens that are
+ * left. */
+static void
+parallel_tokenize_clear(parallel_tokenize_t *pt)
+{
+  int i;
+  for (i = 0; i < pt->n_items; ++i) {
+    if (pt->item_tokens[i]) {
+      SMARTLIST_FOREACH(pt->item_tokens[i], directory_token_t *, t,
+                        token_clear(t));
+      smartlist_free(pt->item_tokens[i]);
+    }
+  }
+  for (i = 0; i < pt->n_chunks; ++i)
+    memarea_drop_all(pt->chunk_area[i]);
+  tor_free(pt->item_tokens);
+  tor_free(pt->chunk_first);
+  tor_free(pt->chunk_area);
+}
+
+/** Parse the routerstatus entries of a consensus, made with
+ * <b>consensus_method</b> and of flavor <b>flav</b>, from <b>s</b> onwards,
+ * and add them to <b>out</b>.  Skip any entries that we can't parse.
+ * Return a pointer to the end of the last entry.
+ *
+ * We tokenize the entries of big consensuses on the cpuworker threads. */
+STATIC const char *
+consensus_parse_routerstatuses(const char *s, smartlist_t *out,
+                               int consensus_method, consensus_flavor_t flav)
+{
+  parallel_tokenize_t pt;
+  smartlist_t *bounds = smartlist_new();
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  int i;
+
+  while (!strcmpstart(s, "r ")) {
+    smartlist_add(bounds, (void*)s);
+    s = find_start_of_next_routerstatus(s);
+  }
+  smartlist_add(bounds, (void*)s);
+  parallel_tokenize(&pt, bounds, rtrstatus_token_table, 0);
+
+  for (i = 0; i < pt.n_items; ++i) {
+    const char *cp = pt.bounds[i];
+    smartlist_t *item_tokens = pt.item_tokens[i];
+    routerstatus_t *rs;
+    if (item_tokens)
+      rs = routerstatus_parse_entry_impl(NULL, &cp, item_tokens, NULL, NULL,
+                                         consensus_method, flav, 1);
+    else
+      rs = routerstatus_parse_entry_impl(area, &cp, tokens, NULL, NULL,
+                                         consensus_method, flav, 0);
+    if (rs) {
+      /* Use exponential-backoff scheduling when downloading microdescs */
+      rs->dl_status.backoff = DL_SCHED_RANDOM_EXPONENTIAL;
+      smartlist_add(out, rs);
+    }
+  }
+
+  parallel_tokenize_clear(&pt);
+  smartlist_free(bounds);
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  return s;
+}
+
 int
 compare_vote_routerstatus_entries(const void **_a, const void **_b)
 {
@@ -3763,8 +3942,8 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
   s = end_of_header;
   ns->routerstatus_list = smartlist_new();
 
-  while (!strcmpstart(s, "r ")) {
-    if (ns->type != NS_TYPE_CONSENSUS) {
+  if (ns->type != NS_TYPE_CONSENSUS) {
+    while (!strcmpstart(s, "r ")) {
       vote_routerstatus_t *rs = tor_malloc_zero(sizeof(vote_routerstatus_t));
       if (routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens, ns,
                                                rs, 0, 0)) {
@@ -3772,17 +3951,10 @@ networkstatus_parse_vote_from_string(const char *s, const char **eos_out,
       } else {
         vote_routerstatus_free(rs);
       }
-    } else {
-      routerstatus_t *rs;
-      if ((rs = routerstatus_parse_entry_from_string(rs_area, &s, rs_tokens,
-                                                     NULL, NULL,
-                                                     ns->consensus_method,
-                                                     flav))) {
-        /* Use exponential-backoff scheduling when downloading microdescs */
-        rs->dl_status.backoff = DL_SCHED_RANDOM_EXPONENTIAL;
-        smartlist_add(ns->routerstatus_list, rs);
-      }
     }
+  } else {
+    s = consensus_parse_routerstatuses(s, ns->routerstatus_list,
+                                       ns->consensus_method, flav);
   }
   for (i = 1; i < smartlist_len(ns->routerstatus_list); ++i) {
     routerstatus_t *rs1, *rs2;
@@ -4671,6 +4843,150 @@ find_start_of_next_microdesc(const char *s, const char *eos)
 #undef NEXT_LINE
 }
 
+/** Parse the microdescriptor that runs from <b>s</b> to <b>eos</b>, and if
+ * it is well-formed, add it to <b>result</b>.  <b>start</b> is the start of
+ * the whole string we're parsing, and <b>flags</b>, <b>where</b> and
+ * <b>invalid_digests_out</b> are as for microdescs_parse_from_string().
+ *
+ * If <b>pretokenized</b> is set, <b>tokens</b> already holds the tokens of
+ * the microdescriptor.  Otherwise, tokenize it into the empty smartlist
+ * <b>tokens</b>, allocating in <b>area</b>.  Either way, leave
+ * <b>tokens</b> empty. */
+static void
+microdesc_parse_one(memarea_t *area, smartlist_t *tokens, int pretokenized,
+                    const char *s, const char *eos, const char *start,
+                    int flags, saved_location_t where,
+                    smartlist_t *result, smartlist_t *invalid_digests_out)
+{
+  microdesc_t *md = NULL;
+  const int copy_body = (where != SAVED_IN_CACHE);
+  directory_token_t *tok;
+  int okay = 0;
+
+  md = tor_malloc_zero(sizeof(microdesc_t));
+  {
+    const char *cp = tor_memstr(s, eos-s, "onion-key");
+    const int no_onion_key = (cp == NULL);
+    if (no_onion_key) {
+      cp = s; /* So that we have *some* junk to put in the body */
+    }
+
+    md->bodylen = eos - cp;
+    md->saved_location = where;
+    if (copy_body)
+      md->body = tor_memdup_nulterm(cp, md->bodylen);
+    else
+      md->body = (char*)cp;
+    md->off = cp - start;
+    crypto_digest256(md->digest, md->body, md->bodylen, DIGEST_SHA256);
+    if (no_onion_key) {
+      log_fn(LOG_PROTOCOL_WARN, LD_DIR, "Malformed or truncated descriptor");
+      goto next;
+    }
+  }
+
+  if (!pretokenized &&
+      tokenize_string(area, s, eos, tokens,
+                      microdesc_token_table, flags)) {
+    log_warn(LD_DIR, "Unparseable microdescriptor");
+    goto next;
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, A_LAST_LISTED))) {
+    if (parse_iso_time(tok->args[0], &md->last_listed)) {
+      log_warn(LD_DIR, "Bad last-listed time in microdescriptor");
+      goto next;
+    }
+  }
+
+  tok = find_by_keyword(tokens, K_ONION_KEY);
+  if (!crypto_pk_public_exponent_ok(tok->key)) {
+    log_warn(LD_DIR,
+             "Relay's onion key had invalid exponent.");
+    goto next;
+  }
+  md->onion_pkey = tok->key;
+  tok->key = NULL;
+
+  if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
+    curve25519_public_key_t k;
+    tor_assert(tok->n_args >= 1);
+    if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
+      log_warn(LD_DIR, "Bogus ntor-onion-key in microdesc");
+      goto next;
+    }
+    md->onion_curve25519_pkey =
+      tor_memdup(&k, sizeof(curve25519_public_key_t));
+  }
+
+  smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
+  if (id_lines) {
+    SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
+      tor_assert(t->n_args >= 2);
+      if (!strcmp(t->args[0], "ed25519")) {
+        if (md->ed25519_identity_pkey) {
+          log_warn(LD_DIR, "Extra ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          goto next;
+        }
+        ed25519_public_key_t k;
+        if (ed25519_public_from_base64(&k, t->args[1])<0) {
+          log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
+          smartlist_free(id_lines);
+          goto next;
+        }
+        md->ed25519_identity_pkey = tor_memdup(&k, sizeof(k));
+      }
+    } SMARTLIST_FOREACH_END(t);
+    smartlist_free(id_lines);
+  }
+
+  {
+    smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
+    if (a_lines) {
+      find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
+      smartlist_free(a_lines);
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
+    int i;
+    md->family = smartlist_new();
+    for (i=0;i<tok->n_args;++i) {
+      if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
+        log_warn(LD_DIR, "Illegal nickname %s in family line",
+                 escaped(tok->args[i]));
+        goto next;
+      }
+      smartlist_add_strdup(md->family, tok->args[i]);
+    }
+  }
+
+  if ((tok = find_opt_by_keyword(tokens, K_P))) {
+    md->exit_policy = parse_short_policy(tok->args[0]);
+  }
+  if ((tok = find_opt_by_keyword(tokens, K_P6))) {
+    md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
+  }
+
+  smartlist_add(result, md);
+  okay = 1;
+
+  md = NULL;
+ next:
+  if (! okay && invalid_digests_out) {
+    smartlist_add(invalid_digests_out,
+                  tor_memdup(md->digest, DIGEST256_LEN));
+  }
+  microdesc_free(md);
+  md = NULL;
+
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  if (!pretokenized)
+    memarea_clear(area);
+  smartlist_clear(tokens);
+}
+
 /** Parse as many microdescriptors as are found from the string starting at
  * <b>s</b> and ending at <b>eos</b>.  If allow_annotations is set, read any
  * annotations we recognize and ignore ones we don't.
@@ -4681,23 +4997,25 @@ find_start_of_next_microdesc(const char *s, const char *eos)
  * Return all newly parsed microdescriptors in a newly allocated
  * smartlist_t. If <b>invalid_disgests_out</b> is provided, add a SHA256
  * microdesc digest to it for every microdesc that we found to be badly
- * formed. (This may cause duplicates) */
+ * formed. (This may cause duplicates)
+ *
+ * We tokenize big batches of microdescriptors, which is where we decode
+ * their onion keys, on the cpuworker threads. */
 smartlist_t *
 microdescs_parse_from_string(const char *s, const char *eos,
                              int allow_annotations,
                              saved_location_t where,
                              smartlist_t *invalid_digests_out)
 {
+  parallel_tokenize_t pt;
   smartlist_t *tokens;
   smartlist_t *result;
-  microdesc_t *md = NULL;
+  smartlist_t *bounds;
   memarea_t *area;
   const char *start = s;
   const char *start_of_next_microdesc;
   int flags = allow_annotations ? TS_ANNOTATIONS_OK : 0;
-  const int copy_body = (where != SAVED_IN_CACHE);
-
-  directory_token_t *tok;
+  int i;
 
   if (!eos)
     eos = s + strlen(s);
@@ -4706,139 +5024,28 @@ microdescs_parse_from_string(const char *s, const char *eos,
   area = memarea_new();
   result = smartlist_new();
   tokens = smartlist_new();
+  bounds = smartlist_new();
 
   while (s < eos) {
-    int okay = 0;
-
     start_of_next_microdesc = find_start_of_next_microdesc(s, eos);
     if (!start_of_next_microdesc)
       start_of_next_microdesc = eos;
-
-    md = tor_malloc_zero(sizeof(microdesc_t));
-    {
-      const char *cp = tor_memstr(s, start_of_next_microdesc-s,
-                                  "onion-key");
-      const int no_onion_key = (cp == NULL);
-      if (no_onion_key) {
-        cp = s; /* So that we have *some* junk to put in the body */
-      }
-
-      md->bodylen = start_of_next_microdesc - cp;
-      md->saved_location = where;
-      if (copy_body)
-        md->body = tor_memdup_nulterm(cp, md->bodylen);
-      else
-        md->body = (char*)cp;
-      md->off = cp - start;
-      crypto_digest256(md->digest, md->body, md->bodylen, DIGEST_SHA256);
-      if (no_onion_key) {
-        log_fn(LOG_PROTOCOL_WARN, LD_DIR, "Malformed or truncated descriptor");
-        goto next;
-      }
-    }
-
-    if (tokenize_string(area, s, start_of_next_microdesc, tokens,
-                        microdesc_token_table, flags)) {
-      log_warn(LD_DIR, "Unparseable microdescriptor");
-      goto next;
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, A_LAST_LISTED))) {
-      if (parse_iso_time(tok->args[0], &md->last_listed)) {
-        log_warn(LD_DIR, "Bad last-listed time in microdescriptor");
-        goto next;
-      }
-    }
-
-    tok = find_by_keyword(tokens, K_ONION_KEY);
-    if (!crypto_pk_public_exponent_ok(tok->key)) {
-      log_warn(LD_DIR,
-               "Relay's onion key had invalid exponent.");
-      goto next;
-    }
-    md->onion_pkey = tok->key;
-    tok->key = NULL;
-
-    if ((tok = find_opt_by_keyword(tokens, K_ONION_KEY_NTOR))) {
-      curve25519_public_key_t k;
-      tor_assert(tok->n_args >= 1);
-      if (curve25519_public_from_base64(&k, tok->args[0]) < 0) {
-        log_warn(LD_DIR, "Bogus ntor-onion-key in microdesc");
-        goto next;
-      }
-      md->onion_curve25519_pkey =
-        tor_memdup(&k, sizeof(curve25519_public_key_t));
-    }
-
-    smartlist_t *id_lines = find_all_by_keyword(tokens, K_ID);
-    if (id_lines) {
-      SMARTLIST_FOREACH_BEGIN(id_lines, directory_token_t *, t) {
-        tor_assert(t->n_args >= 2);
-        if (!strcmp(t->args[0], "ed25519")) {
-          if (md->ed25519_identity_pkey) {
-            log_warn(LD_DIR, "Extra ed25519 key in microdesc");
-            smartlist_free(id_lines);
-            goto next;
-          }
-          ed25519_public_key_t k;
-          if (ed25519_public_from_base64(&k, t->args[1])<0) {
-            log_warn(LD_DIR, "Bogus ed25519 key in microdesc");
-            smartlist_free(id_lines);
-            goto next;
-          }
-          md->ed25519_identity_pkey = tor_memdup(&k, sizeof(k));
-        }
-      } SMARTLIST_FOREACH_END(t);
-      smartlist_free(id_lines);
-    }
-
-    {
-      smartlist_t *a_lines = find_all_by_keyword(tokens, K_A);
-      if (a_lines) {
-        find_single_ipv6_orport(a_lines, &md->ipv6_addr, &md->ipv6_orport);
-        smartlist_free(a_lines);
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_FAMILY))) {
-      int i;
-      md->family = smartlist_new();
-      for (i=0;i<tok->n_args;++i) {
-        if (!is_legal_nickname_or_hexdigest(tok->args[i])) {
-          log_warn(LD_DIR, "Illegal nickname %s in family line",
-                   escaped(tok->args[i]));
-          goto next;
-        }
-        smartlist_add_strdup(md->family, tok->args[i]);
-      }
-    }
-
-    if ((tok = find_opt_by_keyword(tokens, K_P))) {
-      md->exit_policy = parse_short_policy(tok->args[0]);
-    }
-    if ((tok = find_opt_by_keyword(tokens, K_P6))) {
-      md->ipv6_exit_policy = parse_short_policy(tok->args[0]);
-    }
-
-    smartlist_add(result, md);
-    okay = 1;
-
-    md = NULL;
-  next:
-    if (! okay && invalid_digests_out) {
-      smartlist_add(invalid_digests_out,
-                    tor_memdup(md->digest, DIGEST256_LEN));
-    }
-    microdesc_free(md);
-    md = NULL;
-
-    SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
-    memarea_clear(area);
-    smartlist_clear(tokens);
+    smartlist_add(bounds, (void*)s);
     s = start_of_next_microdesc;
   }
+  smartlist_add(bounds, (void*)s);
+  parallel_tokenize(&pt, bounds, microdesc_token_table, flags);
 
-  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  for (i = 0; i < pt.n_items; ++i) {
+    smartlist_t *item_tokens = pt.item_tokens[i];
+    microdesc_parse_one(area, item_tokens ? item_tokens : tokens,
+                        item_tokens != NULL,
+                        pt.bounds[i], pt.bounds[i+1], start, flags, where,
+                        result, invalid_digests_out);
+  }
+
+  parallel_tokenize_clear(&pt);
+  smartlist_free(bounds);
   memarea_drop_all(area);
   smartlist_free(tokens);
 
@@ -5689,10 +5896,29 @@ routerparse_init(void)
   }
 }
 
+/** Build the keyword indices for the token tables in this file. */
+void
+routerparse_add_token_indices(void)
+{
+  token_table_add_index(routerdesc_token_table);
+  token_table_add_index(extrainfo_token_table);
+  token_table_add_index(rtrstatus_token_table);
+  token_table_add_index(dir_key_certificate_table);
+  token_table_add_index(desc_token_table);
+  token_table_add_index(ipo_token_table);
+  token_table_add_index(client_keys_token_table);
+  token_table_add_index(networkstatus_token_table);
+  token_table_add_index(networkstatus_consensus_token_table);
+  token_table_add_index(networkstatus_vote_footer_token_table);
+  token_table_add_index(networkstatus_detached_signature_token_table);
+  token_table_add_index(microdesc_token_table);
+}
+
 /** Clean up all data structures used by routerparse.c at exit */
 void
 routerparse_free_all(void)
 {
   dump_desc_fifo_cleanup();
+  parsecommon_free_all();
 }
 
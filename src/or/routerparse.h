@@ -94,6 +94,7 @@ int rend_parse_introduction_points(rend_service_descriptor_t *parsed,
 int rend_parse_client_keys(strmap_t *parsed_clients, const char *str);
 
 void routerparse_init(void);
+void routerparse_add_token_indices(void);
 void routerparse_free_all(void);
 
 #ifdef ROUTERPARSE_PRIVATE
@@ -127,6 +128,10 @@ STATIC routerstatus_t *routerstatus_parse_entry_from_string(
                                      vote_routerstatus_t *vote_rs,
                                      int consensus_method,
                                      consensus_flavor_t flav);
+STATIC const char *consensus_parse_routerstatuses(const char *s,
+                                                  smartlist_t *out,
+                                                  int consensus_method,
+                                                  consensus_flavor_t flav);
 MOCK_DECL(STATIC void,dump_desc,(const char *desc, const char *type));
 MOCK_DECL(STATIC int, router_compute_hash_final,(char *digest,
                            const char *start, size_t len,
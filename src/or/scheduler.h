@@ -107,6 +107,15 @@ typedef struct scheduler_s {
 #define KIST_SCHED_RUN_INTERVAL_MIN 0
 /* Maximum interval that KIST runs (in ms). */
 #define KIST_SCHED_RUN_INTERVAL_MAX 100
+/* Maximum time (in ms) KIST may reuse kernel socket information without
+ * asking the kernel again. */
+#define KIST_SOCK_INFO_CACHE_TIME_MAX 100
+/* Default number of cells KIST flushes from a channel each time it picks it
+ * from the pending list. */
+#define KIST_FLUSH_QUANTUM_DEFAULT 8
+/* Minimum and maximum values of the KISTFlushQuantum consensus parameter. */
+#define KIST_FLUSH_QUANTUM_MIN 1
+#define KIST_FLUSH_QUANTUM_MAX 64
 
 /*****************************************************************************
  * Globally visible scheduler functions
@@ -168,6 +177,9 @@ void scheduler_touch_channel(channel_t *chan);
 
 #ifdef SCHEDULER_KIST_PRIVATE
 
+/* Number of bytes of TLS overhead we account for every cell we write. */
+#define TLS_PER_CELL_OVERHEAD 29
+
 /* Socket table entry which holds information of a channel's socket and kernel
  * TCP information. Only used by KIST. */
 typedef struct socket_table_ent_s {
@@ -182,12 +194,18 @@ typedef struct socket_table_ent_s {
   uint32_t unacked;
   uint32_t mss;
   uint32_t notsent;
+  /* Coarse monotonic time in msec at which we last asked the kernel about
+   * this socket, or 0 if we never did. */
+  uint64_t last_update_msec;
+  /* True iff the channel is on the list of channels whose outbuf needs to
+   * be written to the kernel at the end of this scheduling run. */
+  unsigned int outbuf_pending : 1;
+  /* Number of cells this channel was allowed to flush but couldn't because it
+   * hit its write limit. They are added to its next flush quantum. */
+  uint32_t flush_deficit;
 } socket_table_ent_t;
 
-typedef HT_HEAD(outbuf_table_s, outbuf_table_ent_s) outbuf_table_t;
-
-MOCK_DECL(int, channel_should_write_to_kernel,
-          (outbuf_table_t *table, channel_t *chan));
+MOCK_DECL(int, channel_should_write_to_kernel, (channel_t *chan));
 MOCK_DECL(void, channel_write_to_kernel, (channel_t *chan));
 MOCK_DECL(void, update_socket_info_impl, (socket_table_ent_t *ent));
 
@@ -196,9 +214,12 @@ void scheduler_kist_set_full_mode(void);
 void scheduler_kist_set_lite_mode(void);
 scheduler_t *get_kist_scheduler(void);
 int kist_scheduler_run_interval(void);
+int kist_scheduler_flush_quantum(void);
 
 #ifdef TOR_UNIT_TESTS
 extern int32_t sched_run_interval;
+extern int kist_flush_quantum;
+extern smartlist_t *outbuf_list;
 #endif /* TOR_UNIT_TESTS */
 
 #endif /* defined(SCHEDULER_KIST_PRIVATE) */
@@ -16,8 +16,6 @@
 #define SCHEDULER_PRIVATE_
 #include "scheduler.h"
 
-#define TLS_PER_CELL_OVERHEAD 29
-
 #ifdef HAVE_KIST_SUPPORT
 /* Kernel interface needed for KIST. */
 #include <netinet/tcp.h>
@@ -52,32 +50,13 @@ HT_PROTOTYPE(socket_table_s, socket_table_ent_s, node, socket_table_ent_hash,
 HT_GENERATE2(socket_table_s, socket_table_ent_s, node, socket_table_ent_hash,
              socket_table_ent_eq, 0.6, tor_reallocarray, tor_free_)
 
-/* outbuf_table hash table stuff. The outbuf_table keeps track of which
- * channels have data sitting in their outbuf so the kist scheduler can force
- * a write from outbuf to kernel periodically during a run and at the end of a
- * run. */
-
-typedef struct outbuf_table_ent_s {
-  HT_ENTRY(outbuf_table_ent_s) node;
-  channel_t *chan;
-} outbuf_table_ent_t;
-
-static uint32_t
-outbuf_table_ent_hash(const outbuf_table_ent_t *ent)
-{
-  return (uint32_t)ent->chan->global_identifier;
-}
-
-static unsigned
-outbuf_table_ent_eq(const outbuf_table_ent_t *a, const outbuf_table_ent_t *b)
-{
-  return a->chan->global_identifier == b->chan->global_identifier;
-}
-
-HT_PROTOTYPE(outbuf_table_s, outbuf_table_ent_s, node, outbuf_table_ent_hash,
-             outbuf_table_ent_eq)
-HT_GENERATE2(outbuf_table_s, outbuf_table_ent_s, node, outbuf_table_ent_hash,
-             outbuf_table_ent_eq, 0.6, tor_reallocarray, tor_free_)
+/* The outbuf list keeps track of which channels have data sitting in their
+ * outbuf so the kist scheduler can force a write from outbuf to kernel
+ * periodically during a run and at the end of a run. It is emptied at the end
+ * of every run but never freed until KIST goes away so we don't reallocate
+ * it on each run. A channel is on it at most once, which is tracked by the
+ * outbuf_pending flag of its socket table entry. */
+STATIC smartlist_t *outbuf_list = NULL;
 
 /*****************************************************************************
  * Other internal data
@@ -92,6 +71,11 @@ static monotime_t scheduler_last_run;
 static double sock_buf_size_factor = 1.0;
 /* How often the scheduler runs. */
 STATIC int sched_run_interval = KIST_SCHED_RUN_INTERVAL_DEFAULT;
+/* How many cells we flush from a channel each time we pick it. */
+STATIC int kist_flush_quantum = KIST_FLUSH_QUANTUM_DEFAULT;
+/* For how long, in msec, we can reuse the kernel information of a socket
+ * that hasn't hit its write limit. 0 means always ask the kernel. */
+static int sock_info_cache_time = 0;
 
 #ifdef HAVE_KIST_SUPPORT
 /* Indicate if KIST lite mode is on or off. We can disable it at runtime.
@@ -122,26 +106,6 @@ channel_outbuf_length(channel_t *chan)
   return buf_datalen(TO_CONN(BASE_CHAN_TO_TLS(chan)->conn)->outbuf);
 }
 
-/* Little helper function for HT_FOREACH_FN. */
-static int
-each_channel_write_to_kernel(outbuf_table_ent_t *ent, void *data)
-{
-  (void) data; /* Make compiler happy. */
-  channel_write_to_kernel(ent->chan);
-  return 0; /* Returning non-zero removes the element from the table. */
-}
-
-/* Free the given outbuf table entry ent. */
-static int
-free_outbuf_info_by_ent(outbuf_table_ent_t *ent, void *data)
-{
-  (void) data; /* Make compiler happy. */
-  log_debug(LD_SCHED, "Freeing outbuf table entry from chan=%" PRIu64,
-            ent->chan->global_identifier);
-  tor_free(ent);
-  return 1; /* So HT_FOREACH_FN will remove the element */
-}
-
 /* Free the given socket table entry ent. */
 static int
 free_socket_info_by_ent(socket_table_ent_t *ent, void *data)
@@ -149,6 +113,8 @@ free_socket_info_by_ent(socket_table_ent_t *ent, void *data)
   (void) data; /* Make compiler happy. */
   log_debug(LD_SCHED, "Freeing socket table entry from chan=%" PRIu64,
             ent->chan->global_identifier);
+  /* The channel outlives its entry, don't leave it a dangling pointer. */
+  ((channel_t *) ent->chan)->kist_sock_info = NULL;
   tor_free(ent);
   return 1; /* So HT_FOREACH_FN will remove the element */
 }
@@ -161,13 +127,14 @@ free_all_socket_info(void)
   HT_CLEAR(socket_table_s, &socket_table);
 }
 
+/* Return the socket table entry of chan or NULL if none. The table owns the
+ * entries but the channel keeps a pointer to its own so we never have to
+ * hash on the hot path. */
 static socket_table_ent_t *
 socket_table_search(socket_table_t *table, const channel_t *chan)
 {
-  socket_table_ent_t search, *ent = NULL;
-  search.chan = chan;
-  ent = HT_FIND(socket_table_s, table, &search);
-  return ent;
+  (void) table;
+  return chan->kist_sock_info;
 }
 
 /* Free a socket entry in table for the given chan. */
@@ -184,6 +151,18 @@ free_socket_info_by_chan(socket_table_t *table, const channel_t *chan)
   free_socket_info_by_ent(ent, NULL);
 }
 
+/* Return true iff the kernel information we have for the socket in ent is
+ * recent enough, as of now_msec, to be used again for this scheduling run
+ * instead of asking the kernel. */
+static int
+socket_info_is_fresh(const socket_table_ent_t *ent, uint64_t now_msec)
+{
+  if (sock_info_cache_time <= 0 || ent->last_update_msec == 0) {
+    return 0;
+  }
+  return now_msec - ent->last_update_msec < (uint64_t) sock_info_cache_time;
+}
+
 /* Perform system calls for the given socket in order to calculate kist's
  * per-socket limit as documented in the function body. */
 MOCK_IMPL(void,
@@ -312,11 +291,9 @@ update_socket_info_impl, (socket_table_ent_t *ent))
                 TLS_PER_CELL_OVERHEAD);
 }
 
-/* Given a socket that isn't in the table, add it.
- * Given a socket that is in the table, re-init values that need init-ing
- * every scheduling run
- */
-static void
+/* Given a socket that isn't in the table, add it and return its entry.
+ * Given a socket that is in the table, return its entry. */
+static socket_table_ent_t *
 init_socket_info(socket_table_t *table, const channel_t *chan)
 {
   socket_table_ent_t *ent = NULL;
@@ -327,37 +304,56 @@ init_socket_info(socket_table_t *table, const channel_t *chan)
     ent = tor_malloc_zero(sizeof(*ent));
     ent->chan = chan;
     HT_INSERT(socket_table_s, table, ent);
+    ((channel_t *) chan)->kist_sock_info = ent;
   }
-  ent->written = 0;
+  return ent;
 }
 
-/* Add chan to the outbuf table if it isn't already in it. If it is, then don't
+/* Add chan to the outbuf list if it isn't already in it. If it is, then don't
  * do anything */
 static void
-outbuf_table_add(outbuf_table_t *table, channel_t *chan)
+outbuf_list_add(channel_t *chan)
 {
-  outbuf_table_ent_t search, *ent;
-  search.chan = chan;
-  ent = HT_FIND(outbuf_table_s, table, &search);
-  if (!ent) {
-    log_debug(LD_SCHED, "scheduler init outbuf info for chan=%" PRIu64,
-              chan->global_identifier);
-    ent = tor_malloc_zero(sizeof(*ent));
-    ent->chan = chan;
-    HT_INSERT(outbuf_table_s, table, ent);
+  socket_table_ent_t *ent = socket_table_search(&socket_table, chan);
+  if (ent) {
+    if (ent->outbuf_pending) {
+      return;
+    }
+    ent->outbuf_pending = 1;
+  } else if (smartlist_contains(outbuf_list, chan)) {
+    /* The channel was released during this run so it lost its entry. */
+    return;
   }
+  smartlist_add(outbuf_list, chan);
 }
 
+/* Remove chan from the outbuf list if it is in it. */
 static void
-outbuf_table_remove(outbuf_table_t *table, channel_t *chan)
+outbuf_list_remove(channel_t *chan)
 {
-  outbuf_table_ent_t search, *ent;
-  search.chan = chan;
-  ent = HT_FIND(outbuf_table_s, table, &search);
+  socket_table_ent_t *ent = socket_table_search(&socket_table, chan);
   if (ent) {
-    HT_REMOVE(outbuf_table_s, table, ent);
-    free_outbuf_info_by_ent(ent, NULL);
+    if (!ent->outbuf_pending) {
+      return;
+    }
+    ent->outbuf_pending = 0;
   }
+  smartlist_remove(outbuf_list, chan);
+}
+
+/* Write the outbuf of every channel on the outbuf list to the kernel and
+ * empty the list for the next scheduling run. */
+static void
+outbuf_list_flush_all(void)
+{
+  SMARTLIST_FOREACH_BEGIN(outbuf_list, channel_t *, chan) {
+    socket_table_ent_t *ent = socket_table_search(&socket_table, chan);
+    if (ent) {
+      ent->outbuf_pending = 0;
+    }
+    channel_write_to_kernel(chan);
+  } SMARTLIST_FOREACH_END(chan);
+  smartlist_clear(outbuf_list);
 }
 
 /* Set the scheduler running interval. */
@@ -393,15 +389,74 @@ socket_can_write(socket_table_t *table, const channel_t *chan)
   return kist_limit_space > 0;
 }
 
-/* Update the channel's socket kernel information. */
+/* Return how many cells chan should flush now that it has been picked by the
+ * scheduler: its flush quantum plus whatever it was owed from the last time
+ * it was cut short, bounded by the room left under its kist-imposed write
+ * limit. Always at least 1 so a picked channel makes progress. */
+static int
+socket_cells_to_flush(socket_table_t *table, const channel_t *chan)
+{
+  socket_table_ent_t *ent = NULL;
+  int64_t room, credit;
+  ent = socket_table_search(table, chan);
+  if (SCHED_BUG(!ent, chan)) {
+    return 1;
+  }
+
+  room = (int64_t) (ent->limit - ent->written) /
+         (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
+  credit = kist_flush_quantum + (int64_t) ent->flush_deficit;
+  return (int) MAX(1, MIN(room, credit));
+}
+
+/* Update the flush deficit of chan after it was asked to flush n_asked cells
+ * and flushed n_flushed of them. A channel keeps what it was owed only if it
+ * still has cells and was held back by its write limit rather than by its
+ * quantum; that is what keeps multi-cell flushing fair between channels that
+ * hit their limit and those that don't. */
 static void
-update_socket_info(socket_table_t *table, const channel_t *chan)
+update_socket_flush_deficit(socket_table_t *table, channel_t *chan,
+                            int n_asked, int n_flushed)
+{
+  socket_table_ent_t *ent = NULL;
+  int64_t credit;
+  ent = socket_table_search(table, chan);
+  if (SCHED_BUG(!ent, chan)) {
+    return;
+  }
+
+  credit = kist_flush_quantum + (int64_t) ent->flush_deficit;
+  if (n_flushed < n_asked || n_asked >= credit ||
+      !channel_more_to_flush(chan)) {
+    ent->flush_deficit = 0;
+  } else {
+    /* Never owe more than a quantum so a channel can't build up a burst. */
+    ent->flush_deficit = (uint32_t) MIN(credit - n_flushed,
+                                        kist_flush_quantum);
+  }
+}
+
+/* Update the channel's socket kernel information, as of now_msec. If the
+ * information we already have is fresh enough and the socket can still write,
+ * keep it along with what was written against it: that is a conservative
+ * view since the kernel can only have drained its queues in the meantime. */
+static void
+update_socket_info(socket_table_t *table, const channel_t *chan,
+                   uint64_t now_msec)
 {
   socket_table_ent_t *ent = NULL;
   ent = socket_table_search(table, chan);
   if (SCHED_BUG(!ent, chan)) {
     return; // Whelp. Entry didn't exist for some reason so nothing to do.
   }
+  if (socket_info_is_fresh(ent, now_msec) && socket_can_write(table, chan)) {
+    log_debug(LD_SCHED, "chan=%" PRIu64 " reusing socket info, limit: %"
+                        PRIu64 ", written: %" PRIu64,
+              ent->chan->global_identifier, ent->limit, ent->written);
+    return;
+  }
+  ent->written = 0;
+  ent->last_update_msec = now_msec;
   update_socket_info_impl(ent);
   log_debug(LD_SCHED, "chan=%" PRIu64 " updated socket info, limit: %" PRIu64
                       ", cwnd: %" PRIu32 ", unacked: %" PRIu32
@@ -435,10 +490,8 @@ update_socket_written(socket_table_t *table, channel_t *chan, size_t bytes)
  * by only writing a channel's outbuf to the kernel if it has 8 cells or more
  * in it.
  */
-MOCK_IMPL(int, channel_should_write_to_kernel,
-          (outbuf_table_t *table, channel_t *chan))
+MOCK_IMPL(int, channel_should_write_to_kernel, (channel_t *chan))
 {
-  outbuf_table_add(table, chan);
   /* CELL_MAX_NETWORK_SIZE * 8 because we only want to write the outbuf to the
    * kernel if there's 8 or more cells waiting */
   return channel_outbuf_length(chan) > (CELL_MAX_NETWORK_SIZE * 8);
@@ -470,6 +523,10 @@ static void
 kist_free_all(void)
 {
   free_all_socket_info();
+  /* KIST can come back after another scheduler has been in use, so the
+   * next run must allocate a fresh list. */
+  smartlist_free(outbuf_list);
+  outbuf_list = NULL;
 }
 
 /* Function of the scheduler interface: on_channel_free() */
@@ -484,6 +541,7 @@ static void
 kist_scheduler_on_new_consensus(void)
 {
   set_scheduler_run_interval();
+  kist_flush_quantum = kist_scheduler_flush_quantum();
 }
 
 /* Function of the scheduler interface: on_new_options() */
@@ -491,9 +549,11 @@ static void
 kist_scheduler_on_new_options(void)
 {
   sock_buf_size_factor = get_options()->KISTSockBufSizeFactor;
+  sock_info_cache_time = get_options()->KISTSockInfoCacheTime;
 
   /* Calls kist_scheduler_run_interval which calls get_options(). */
   set_scheduler_run_interval();
+  kist_flush_quantum = kist_scheduler_flush_quantum();
 }
 
 /* Function of the scheduler interface: init() */
@@ -566,16 +626,20 @@ kist_scheduler_run(void)
   /* The last distinct chan served in a sched loop. */
   channel_t *prev_chan = NULL;
   int flush_result; // temporarily store results from flush calls
+  int flush_asked; // number of cells we asked the channel to flush
   /* Channels to be re-adding to pending at the end */
   smartlist_t *to_readd = NULL;
   smartlist_t *cp = get_channels_pending();
+  const uint64_t now_msec = monotime_coarse_absolute_msec();
 
-  outbuf_table_t outbuf_table = HT_INITIALIZER();
+  if (!outbuf_list) {
+    outbuf_list = smartlist_new();
+  }
 
   /* For each pending channel, collect new kernel information */
   SMARTLIST_FOREACH_BEGIN(cp, const channel_t *, pchan) {
       init_socket_info(&socket_table, pchan);
-      update_socket_info(&socket_table, pchan);
+      update_socket_info(&socket_table, pchan, now_msec);
   } SMARTLIST_FOREACH_END(pchan);
 
   log_debug(LD_SCHED, "Running the scheduler. %d channels pending",
@@ -592,7 +656,7 @@ kist_scheduler_run(void)
        */
       continue;
     }
-    outbuf_table_add(&outbuf_table, chan);
+    outbuf_list_add(chan);
 
     /* if we have switched to a new channel, consider writing the previous
      * channel's outbuf to the kernel. */
@@ -600,17 +664,20 @@ kist_scheduler_run(void)
       prev_chan = chan;
     }
     if (prev_chan != chan) {
-      if (channel_should_write_to_kernel(&outbuf_table, prev_chan)) {
+      if (channel_should_write_to_kernel(prev_chan)) {
         channel_write_to_kernel(prev_chan);
-        outbuf_table_remove(&outbuf_table, prev_chan);
+        outbuf_list_remove(prev_chan);
       }
       prev_chan = chan;
     }
 
     /* Only flush and write if the per-socket limit hasn't been hit */
     if (socket_can_write(&socket_table, chan)) {
-      /* flush to channel queue/outbuf */
-      flush_result = (int)channel_flush_some_cells(chan, 1); // 1 for num cells
+      /* flush to channel queue/outbuf, as many cells as the channel's
+       * quantum and its write limit allow so we don't go through the pqueue
+       * for every single cell. */
+      flush_asked = socket_cells_to_flush(&socket_table, chan);
+      flush_result = (int)channel_flush_some_cells(chan, flush_asked);
       /* XXX: While flushing cells, it is possible that the connection write
        * fails leading to the channel to be closed which triggers a release
        * and free its entry in the socket table. And because of a engineering
@@ -627,6 +694,8 @@ kist_scheduler_run(void)
       if (flush_result > 0) {
         update_socket_written(&socket_table, chan, flush_result *
                               (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD));
+        update_socket_flush_deficit(&socket_table, chan, flush_asked,
+                                    flush_result);
       } else {
         /* XXX: This can happen because tor sometimes does flush in an
          * opportunistic way cells from the circuit to the outbuf so the
@@ -708,11 +777,7 @@ kist_scheduler_run(void)
   } /* End of main scheduling loop */
 
   /* Write the outbuf of any channels that still have data */
-  HT_FOREACH_FN(outbuf_table_s, &outbuf_table, each_channel_write_to_kernel,
-                NULL);
-  /* We are done with it. */
-  HT_FOREACH_FN(outbuf_table_s, &outbuf_table, free_outbuf_info_by_ent, NULL);
-  HT_CLEAR(outbuf_table_s, &outbuf_table);
+  outbuf_list_flush_all();
 
   log_debug(LD_SCHED, "len pending=%d, len to_readd=%d",
             smartlist_len(cp),
@@ -792,6 +857,17 @@ kist_scheduler_run_interval(void)
                                  KIST_SCHED_RUN_INTERVAL_MAX);
 }
 
+/* Return the number of cells KIST flushes from a channel each time it picks
+ * it, as set by the KISTFlushQuantum consensus parameter. */
+int
+kist_scheduler_flush_quantum(void)
+{
+  return networkstatus_get_param(NULL, "KISTFlushQuantum",
+                                 KIST_FLUSH_QUANTUM_DEFAULT,
+                                 KIST_FLUSH_QUANTUM_MIN,
+                                 KIST_FLUSH_QUANTUM_MAX);
+}
+
 /* Set KISTLite mode that is KIST without kernel support. */
 void
 scheduler_kist_set_lite_mode(void)
@@ -17,6 +17,7 @@
 #include "or.h"
 #include "circuituse.h"
 #include "config.h"
+#include "consdiffmgr.h"
 #include "status.h"
 #include "nodelist.h"
 #include "relay.h"
@@ -28,6 +29,7 @@
 #include "rephist.h"
 #include "statefile.h"
 #include "dos.h"
+#include "dns.h"
 
 static void log_accounting(const time_t now, const or_options_t *options);
 #include "geoip.h"
@@ -147,8 +149,12 @@ log_heartbeat(time_t now)
     rep_hist_log_circuit_handshake_stats(now);
     rep_hist_log_link_protocol_counts();
     dos_log_heartbeat();
+    dns_log_heartbeat();
   }
 
+  if (dir_server_mode(options))
+    consdiffmgr_log_heartbeat();
+
   circuit_log_ancient_one_hop_circuits(1800);
 
   if (options->BridgeRelay) {
@@ -2232,7 +2232,7 @@ static int _viterbi_workers_init(uint num_workers) {
 
   if (!viterbi_thread_pool) {
     viterbi_thread_pool = threadpool_new(num_workers, viterbi_reply_queue,
-        _viterbi_worker_state_new, _viterbi_worker_state_free, NULL);
+        _viterbi_worker_state_new, _viterbi_worker_state_free, NULL, 0);
 
     if(viterbi_thread_pool) {
       log_notice(LD_GENERAL, "Successfully created viterbi thread pool "
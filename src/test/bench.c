@@ -15,8 +15,15 @@ const char tor_git_revision[] = "";
 
 #include "orconfig.h"
 
+#define BUFFERS_PRIVATE
 #include "or.h"
+#include "address_set.h"
+#include "buffers.h"
+#include "dns.h"
+#include "dns_structs.h"
+#include "parsecommon.h"
 #include "onion_tap.h"
+#include "policies.h"
 #include "relay.h"
 #include <openssl/opensslv.h>
 #include <openssl/evp.h>
@@ -27,9 +34,14 @@ const char tor_git_revision[] = "";
 #include "config.h"
 #include "crypto_curve25519.h"
 #include "onion_ntor.h"
+#include "workqueue.h"
 #include "crypto_ed25519.h"
 #include "consdiff.h"
 
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
+
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_PROCESS_CPUTIME_ID)
 static uint64_t nanostart;
 static inline uint64_t
@@ -253,6 +265,148 @@ bench_onion_ntor(void)
   }
 }
 
+/** Inputs shared by all the worker threads in bench_onion_workers(). */
+static struct {
+  di_digest256_map_t *keymap;
+  uint8_t nodeid[DIGEST_LEN];
+  uint8_t onionskin[NTOR_ONIONSKIN_LEN];
+} onion_workers_input;
+/** How many replies has bench_onion_workers() handled so far? */
+static int onion_workers_n_done = 0;
+
+static workqueue_reply_t
+bench_onion_workers_threadfn(void *state, void *arg)
+{
+  uint8_t *reply = arg;
+  uint8_t key_out[CPATH_KEY_MATERIAL_LEN];
+  (void)state;
+  onion_skin_ntor_server_handshake(onion_workers_input.onionskin,
+                                   onion_workers_input.keymap, NULL,
+                                   onion_workers_input.nodeid, reply,
+                                   key_out, sizeof(key_out));
+  return WQ_RPL_REPLY;
+}
+
+static void
+bench_onion_workers_replyfn(void *arg)
+{
+  tor_free(arg);
+  ++onion_workers_n_done;
+}
+
+static void *
+bench_onion_workers_state_new(void *arg)
+{
+  (void)arg;
+  return tor_malloc_zero(1);
+}
+
+static workqueue_reply_t
+bench_onion_workers_shutdown(void *state, void *arg)
+{
+  (void)arg;
+  tor_free(state);
+  return WQ_RPL_SHUTDOWN;
+}
+
+/** Block until the alert socket of <b>rq</b> is readable. */
+static void
+bench_wait_for_replies(replyqueue_t *rq)
+{
+  tor_socket_t sock = replyqueue_get_socket(rq);
+  fd_set readable;
+
+  FD_ZERO(&readable);
+  FD_SET(sock, &readable);
+  if (select(sock + 1, &readable, NULL, NULL, NULL) < 0)
+    perror("select");
+}
+
+/** Measure how many ntor server handshakes per second a threadpool with a
+ * thread per CPU can answer, with <b>batch</b> jobs queued at a time, and
+ * with <b>flags</b> passed to threadpool_new(). */
+static void
+bench_onion_workers_impl(int batch, unsigned flags)
+{
+  const int iters = 1<<13;
+  const int n_threads = compute_num_cpus();
+  replyqueue_t *rq = replyqueue_new(0);
+  threadpool_t *pool;
+  void *args[64];
+  workqueue_entry_t *entries[64];
+  uint64_t start, end;
+  int j, n_sent = 0, n_wakeups = 0;
+
+  tor_assert(batch <= (int)ARRAY_LENGTH(args));
+  pool = threadpool_new(n_threads, rq, bench_onion_workers_state_new,
+                        tor_free_, NULL, flags);
+  onion_workers_n_done = 0;
+
+  reset_perftime();
+  start = perftime();
+  while (onion_workers_n_done < iters) {
+    /* Keep a few batches' worth of work in flight per thread, the way
+     * cpuworker.c does when it is busy. */
+    while (n_sent < iters &&
+           n_sent - onion_workers_n_done < n_threads * 64) {
+      const int n = MIN(batch, iters - n_sent);
+      for (j = 0; j < n; ++j)
+        args[j] = tor_malloc(NTOR_REPLY_LEN);
+      if (batch == 1) {
+        threadpool_queue_work(pool, bench_onion_workers_threadfn,
+                              bench_onion_workers_replyfn, args[0]);
+      } else {
+        threadpool_queue_work_batch(pool, WQ_PRI_HIGH,
+                                    bench_onion_workers_threadfn,
+                                    bench_onion_workers_replyfn,
+                                    args, n, entries);
+      }
+      n_sent += n;
+    }
+    /* Sleep until a worker tells us it has replies, as the main loop
+     * does, so that every pass through here is a real wakeup. */
+    bench_wait_for_replies(rq);
+    replyqueue_process(rq);
+    ++n_wakeups;
+  }
+  end = perftime();
+
+  printf("%d threads, batches of %2d%s: %.2f usec per handshake, "
+         "%.1f replies per wakeup.\n", n_threads, batch,
+         (flags & THREADPOOL_PIN_THREADS) ? ", pinned" : "",
+         NANOCOUNT(start, end, iters)/1e3,
+         n_wakeups ? ((double)iters) / n_wakeups : 0.0);
+
+  threadpool_queue_update(pool, NULL, bench_onion_workers_shutdown,
+                          NULL, NULL);
+  threadpool_free(pool);
+  replyqueue_free(rq);
+}
+
+static void
+bench_onion_workers(void)
+{
+  curve25519_keypair_t keypair;
+  ntor_handshake_state_t *state = NULL;
+
+  curve25519_secret_key_generate(&keypair.seckey, 0);
+  curve25519_public_key_generate(&keypair.pubkey, &keypair.seckey);
+  dimap_add_entry(&onion_workers_input.keymap, keypair.pubkey.public_key,
+                  &keypair);
+  crypto_rand((char *)onion_workers_input.nodeid,
+              sizeof(onion_workers_input.nodeid));
+  onion_skin_ntor_create(onion_workers_input.nodeid, &keypair.pubkey,
+                         &state, onion_workers_input.onionskin);
+  ntor_handshake_state_free(state);
+
+  bench_onion_workers_impl(1, 0);
+  bench_onion_workers_impl(32, 0);
+  bench_onion_workers_impl(32, THREADPOOL_PIN_THREADS);
+
+  dimap_free(onion_workers_input.keymap, NULL);
+  onion_workers_input.keymap = NULL;
+}
+
 static void
 bench_ed25519_impl(void)
 {
@@ -427,6 +581,48 @@ bench_dmap(void)
   smartlist_free(sl2);
 }
 
+static void
+bench_address_set(void)
+{
+  /* About as many addresses as the nodelist holds. */
+  const int n_addrs = 14000;
+  const int iters = 1<<20;
+  const double fp_rates[] = { 0.01, 0.001, 0.0002 };
+  tor_addr_t *probes = tor_calloc(iters, sizeof(tor_addr_t));
+  uint64_t start, end;
+  unsigned i;
+  int j;
+
+  for (j = 0; j < iters; ++j)
+    tor_addr_from_ipv4h(&probes[j], crypto_rand_int(INT_MAX) * 2);
+
+  for (i = 0; i < ARRAY_LENGTH(fp_rates); ++i) {
+    address_set_t *set = address_set_new_with_fp_rate(n_addrs, fp_rates[i]);
+    int n_hits = 0;
+
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < n_addrs; ++j)
+      address_set_add_ipv4h(set, j * 2 + 1);
+    end = perftime();
+    printf("fp rate %.4f: %u bytes, %.2f ns per add\n", fp_rates[i],
+           (unsigned) address_set_get_size(set),
+           NANOCOUNT(start, end, n_addrs));
+
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < iters; ++j)
+      n_hits += address_set_probably_contains(set, &probes[j]);
+    end = perftime();
+    printf("  %.2f ns per lookup, measured fp rate %.4f\n",
+           NANOCOUNT(start, end, iters), n_hits / (double) iters);
+
+    address_set_free(set);
+  }
+
+  tor_free(probes);
+}
+
 static void
 bench_siphash(void)
 {
@@ -540,6 +736,302 @@ bench_cell_ops(void)
   tor_free(cell);
 }
 
+/** Flush buffers made of many small chunks to a socket, either one chunk
+ * per call or letting buf_flush_to_socket() write as many chunks at once as
+ * it can. */
+static void
+bench_buffers(void)
+{
+  const int iters = 1<<10;
+  const size_t total = 1<<15;
+  const size_t chunk_sizes[] = { 256, 1024, 4096 };
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  char *data = tor_malloc_zero(total), *sink = tor_malloc(total);
+  uint64_t start, end;
+  unsigned i;
+  int one_chunk, j;
+
+  if (tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+      set_socket_nonblocking(fds[0]) < 0 ||
+      set_socket_nonblocking(fds[1]) < 0) {
+    printf("Couldn't make a socket pair; skipping.\n");
+    goto done;
+  }
+
+  for (i = 0; i < ARRAY_LENGTH(chunk_sizes); ++i) {
+    for (one_chunk = 1; one_chunk >= 0; --one_chunk) {
+      uint64_t n_calls = 0, n_chunks = 0;
+      reset_perftime();
+      start = perftime();
+      for (j = 0; j < iters; ++j) {
+        buf_t *buf = buf_new_with_capacity(chunk_sizes[i]);
+        size_t flushlen = total;
+        chunk_t *ch;
+        size_t off;
+        /* Add in small pieces so the buffer is made of many chunks. */
+        for (off = 0; off < total; off += 64)
+          buf_add(buf, data + off, 64);
+        for (ch = buf->head; ch; ch = ch->next)
+          ++n_chunks;
+        while (flushlen) {
+          size_t sz = one_chunk ? MIN(buf->head->datalen, flushlen)
+                                : flushlen;
+          if (buf_flush_to_socket(buf, fds[0], sz, &flushlen) < 0) {
+            printf("Flush failed; skipping.\n");
+            buf_free(buf);
+            goto done;
+          }
+          ++n_calls;
+          while (tor_socket_recv(fds[1], sink, total, 0) > 0)
+            ;
+        }
+        buf_free(buf);
+      }
+      end = perftime();
+      printf("%lu-byte chunks (%.1f per buffer), %s: %.2f ns per byte, "
+             "%.1f flush calls per buffer\n",
+             (unsigned long)chunk_sizes[i], ((double)n_chunks) / iters,
+             one_chunk ? "one chunk per call" : "all chunks per call",
+             NANOCOUNT(start, end, ((uint64_t)iters) * total),
+             ((double)n_calls) / iters);
+    }
+  }
+
+ done:
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+  tor_free(data);
+  tor_free(sink);
+}
+
+/** Replay a Zipf-distributed trace of lookups through the exit DNS cache
+ * under several MaxMemInDNSCache limits, and report the time per query,
+ * the hit rate and the memory used. */
+static void
+bench_dns_cache(void)
+{
+  const int n_names = 100000, iters = 1<<20;
+  const uint64_t limits[] = { 0, 4<<20, 1<<20, 256<<10 };
+  double *cdf = tor_calloc(n_names, sizeof(double));
+  int *trace = tor_calloc(iters, sizeof(int));
+  or_options_t *options = get_options_mutable();
+  uint64_t old_limit = options->MaxMemInDNSCache;
+  uint64_t start, end;
+  double total = 0.0;
+  unsigned i;
+  int j;
+
+  /* Replay a trace of lookups whose names follow a Zipf distribution, the
+   * way an exit's popular destinations do. */
+  for (j = 0; j < n_names; ++j) {
+    total += 1.0 / (j + 1);
+    cdf[j] = total;
+  }
+  for (j = 0; j < iters; ++j) {
+    double r = crypto_rand_double() * total;
+    int lo = 0, hi = n_names - 1;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (cdf[mid] < r)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    trace[j] = lo;
+  }
+
+  for (i = 0; i < ARRAY_LENGTH(limits); ++i) {
+    const time_t expire = time(NULL) + 3600;
+    cached_resolve_t query;
+    int n_hits = 0;
+
+    options->MaxMemInDNSCache = limits[i];
+    reset_perftime();
+    start = perftime();
+    for (j = 0; j < iters; ++j) {
+      cached_resolve_t *resolve;
+      tor_snprintf(query.address, sizeof(query.address),
+                   "host%d.example.com", trace[j]);
+      resolve = dns_get_cache_entry(&query);
+      if (resolve) {
+        dns_note_cache_hit(resolve);
+        ++n_hits;
+        continue;
+      }
+      resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+      resolve->magic = CACHED_RESOLVE_MAGIC;
+      resolve->state = CACHE_STATE_CACHED;
+      resolve->minheap_idx = -1;
+      resolve->expire = expire;
+      resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+      strlcpy(resolve->address, query.address, sizeof(resolve->address));
+      dns_insert_cache_entry(resolve);
+    }
+    end = perftime();
+    if (limits[i])
+      printf("limit %5d KB: ", (int)(limits[i] >> 10));
+    else
+      printf("default limit: ");
+    printf("%.2f ns per query, %.1f%% hits, %.1f KB cached\n",
+           NANOCOUNT(start, end, iters),
+           100.0 * n_hits / iters,
+           dns_cache_total_allocation() / 1024.0);
+    dns_free_all();
+  }
+
+  options->MaxMemInDNSCache = old_limit;
+  tor_free(cdf);
+  tor_free(trace);
+}
+
+/** Token rules for a routerstatus entry, as in a consensus. */
+static token_rule_t bench_rtrstatus_table[] = {
+  T01("p",                   K_P,               CONCAT_ARGS, NO_OBJ ),
+  T1( "r",                   K_R,                   GE(7),   NO_OBJ ),
+  T0N("a",                   K_A,                   GE(1),   NO_OBJ ),
+  T1( "s",                   K_S,                   ARGS,    NO_OBJ ),
+  T01("v",                   K_V,               CONCAT_ARGS, NO_OBJ ),
+  T01("w",                   K_W,                   ARGS,    NO_OBJ ),
+  T0N("m",                   K_M,               CONCAT_ARGS, NO_OBJ ),
+  T0N("id",                  K_ID,                  GE(2),   NO_OBJ ),
+  T01("pr",                  K_PROTO,           CONCAT_ARGS, NO_OBJ ),
+  T0N("opt",                 K_OPT,             CONCAT_ARGS, OBJ_OK ),
+  END_OF_TABLE
+};
+
+/** Tokenize the routerstatus entries of a consensus-sized document. */
+static void
+bench_tokenize(void)
+{
+  const int n_entries = 8000, iters = 10;
+  const char *entry =
+    "r Unnamed AAoQ1DAR6kkoo19hBAX5K0QztNw 6r4SvfiVcmSMPaAa1c5MM+Ai8Ho "
+    "2018-01-01 01:02:03 192.0.2.1 9001 0\n"
+    "a [2001:db8::1]:9001\n"
+    "s Fast Guard HSDir Running Stable V2Dir Valid\n"
+    "v Tor 0.3.2.10\n"
+    "pr Cons=1-2 Desc=1-2 DirCache=1-2 HSDir=1-2 HSIntro=3-4 HSRend=1-2 "
+    "Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+    "w Bandwidth=1000\n"
+    "p accept 20-23,43,53,79-81,88,110,143,194,220,389,443,464-465\n";
+  const size_t entry_len = strlen(entry);
+  char *doc = tor_malloc(entry_len * n_entries + 1);
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  uint64_t start, end;
+  int i, j, n_tokens = 0;
+
+  token_table_add_index(bench_rtrstatus_table);
+  for (i = 0; i < n_entries; ++i)
+    memcpy(doc + i * entry_len, entry, entry_len);
+  doc[entry_len * n_entries] = '\0';
+
+  reset_perftime();
+  start = perftime();
+  for (i = 0; i < iters; ++i) {
+    const char *s = doc;
+    for (j = 0; j < n_entries; ++j) {
+      if (tokenize_string(area, s, s + entry_len, tokens,
+                          bench_rtrstatus_table, 0) < 0) {
+        puts("tokenize_string failed!");
+        goto done;
+      }
+      n_tokens += smartlist_len(tokens);
+      SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+      smartlist_clear(tokens);
+      memarea_clear(area);
+      s += entry_len;
+    }
+  }
+  end = perftime();
+  printf("Tokenize %d routerstatus entries: %.2f usec/entry, "
+         "%.2f nsec/line\n", n_entries,
+         NANOCOUNT(start, end, iters * n_entries) / 1000.0,
+         NANOCOUNT(start, end, n_tokens));
+
+ done:
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(doc);
+  parsecommon_free_all();
+}
+
+/** Look up random IPv4 addr:ports in exit policies of growing length, with
+ * the linear policy walk and with a compiled policy. */
+static void
+bench_policies(void)
+{
+  const int iters = 1<<16;
+  const int n_extra[] = { 0, 100, 1000 };
+  tor_addr_t *addrs = tor_calloc(iters, sizeof(tor_addr_t));
+  uint16_t *ports = tor_calloc(iters, sizeof(uint16_t));
+  uint64_t start, end;
+  unsigned i;
+  int j, compiled;
+
+  for (j = 0; j < iters; ++j) {
+    tor_addr_from_ipv4h(&addrs[j], crypto_rand_int(INT_MAX) * 2);
+    ports[j] = 1 + crypto_rand_int(65535);
+  }
+
+  for (i = 0; i < ARRAY_LENGTH(n_extra); ++i) {
+    smartlist_t *policy = NULL, *items = smartlist_new();
+    compiled_policy_t *cp;
+    config_line_t line;
+    char *policy_str;
+    int n_accepted[2] = { 0, 0 };
+
+    /* Some accepted ports, then a lot of rejected /24s, before the default
+     * exit policy. */
+    smartlist_add_strdup(items, "accept *:53,accept *:443");
+    for (j = 0; j < n_extra[i]; ++j)
+      smartlist_add_asprintf(items, "reject %d.%d.%d.0/24:*",
+                             1 + crypto_rand_int(223), crypto_rand_int(256),
+                             crypto_rand_int(256));
+    policy_str = smartlist_join_strings(items, ",", 0, NULL);
+    line.key = (char*)"ExitPolicy";
+    line.value = policy_str;
+    line.next = NULL;
+    policies_parse_exit_policy(&line, &policy,
+                               EXIT_POLICY_REJECT_PRIVATE |
+                               EXIT_POLICY_ADD_DEFAULT, NULL);
+
+    reset_perftime();
+    start = perftime();
+    cp = compiled_policy_new(policy);
+    end = perftime();
+    printf("%d entries: compiled in %.2f usec\n", smartlist_len(policy),
+           NANOCOUNT(start, end, 1000));
+
+    for (compiled = 0; compiled <= 1; ++compiled) {
+      reset_perftime();
+      start = perftime();
+      for (j = 0; j < iters; ++j) {
+        addr_policy_result_t r = compiled ?
+          compare_tor_addr_to_compiled_policy(&addrs[j], ports[j], policy,
+                                              cp) :
+          compare_tor_addr_to_addr_policy(&addrs[j], ports[j], policy);
+        n_accepted[compiled] += (r == ADDR_POLICY_ACCEPTED);
+      }
+      end = perftime();
+      printf("  %s: %.2f ns per lookup\n",
+             compiled ? "compiled" : "linear  ",
+             NANOCOUNT(start, end, iters));
+    }
+    /* Both lookups must agree. */
+    tor_assert(n_accepted[0] == n_accepted[1]);
+
+    compiled_policy_free(cp);
+    addr_policy_list_free(policy);
+    SMARTLIST_FOREACH(items, char *, cp_str, tor_free(cp_str));
+    smartlist_free(items);
+    tor_free(policy_str);
+  }
+
+  tor_free(addrs);
+  tor_free(ports);
+}
+
 static void
 bench_dh(void)
 {
@@ -637,15 +1129,21 @@ typedef struct benchmark_t {
 
 static struct benchmark_t benchmarks[] = {
   ENT(dmap),
+  ENT(address_set),
   ENT(siphash),
   ENT(digest),
   ENT(aes),
   ENT(onion_TAP),
   ENT(onion_ntor),
+  ENT(onion_workers),
   ENT(ed25519),
 
   ENT(cell_aes),
   ENT(cell_ops),
+  ENT(buffers),
+  ENT(policies),
+  ENT(dns_cache),
+  ENT(tokenize),
   ENT(dh),
   ENT(ecdh_p256),
   ENT(ecdh_p224),
@@ -676,25 +1174,57 @@ main(int argc, const char **argv)
 
   tor_threads_init();
   tor_compress_init();
+  parsecommon_init();
 
-  if (argc == 4 && !strcmp(argv[1], "diff")) {
+  if (argc >= 4 && !strcmp(argv[1], "diff")) {
+    /* Diff each consensus against the next one on the command line, and
+     * report how long each phase took on average.  With exactly two
+     * consensuses, also print their diff. */
     init_logging(1);
     const int N = 200;
-    char *f1 = read_file_to_str(argv[2], RFTS_BIN, NULL);
-    char *f2 = read_file_to_str(argv[3], RFTS_BIN, NULL);
-    if (! f1 || ! f2) {
-      perror("X");
-      return 1;
+    consdiff_timing_t total;
+    int n_pairs = 0;
+    memset(&total, 0, sizeof(total));
+    for (int f = 2; f + 1 < argc; ++f) {
+      consdiff_timing_t timing;
+      memset(&timing, 0, sizeof(timing));
+      char *f1 = read_file_to_str(argv[f], RFTS_BIN, NULL);
+      char *f2 = read_file_to_str(argv[f+1], RFTS_BIN, NULL);
+      if (! f1 || ! f2) {
+        perror("X");
+        return 1;
+      }
+      for (i = 0; i < N; ++i) {
+        char *diff = consensus_diff_generate_timed(f1, f2, &timing);
+        tor_free(diff);
+      }
+      fprintf(stderr, "%s -> %s: split %.1f, lcs %.1f, "
+              "encode %.1f, verify %.1f usec\n", argv[f], argv[f+1],
+              (double)timing.split_usec / N,
+              (double)timing.lcs_usec / N,
+              (double)timing.encode_usec / N,
+              (double)timing.verify_usec / N);
+      total.split_usec += timing.split_usec;
+      total.lcs_usec += timing.lcs_usec;
+      total.encode_usec += timing.encode_usec;
+      total.verify_usec += timing.verify_usec;
+      ++n_pairs;
+      if (argc == 4) {
+        char *diff = consensus_diff_generate(f1, f2);
+        printf("%s", diff);
+        tor_free(diff);
+      }
+      tor_free(f1);
+      tor_free(f2);
     }
-    for (i = 0; i < N; ++i) {
-      char *diff = consensus_diff_generate(f1, f2);
-      tor_free(diff);
+    if (n_pairs > 1) {
+      fprintf(stderr, "Average over %d pairs: split %.1f, "
+              "lcs %.1f, encode %.1f, verify %.1f usec\n", n_pairs,
+              (double)total.split_usec / (N * n_pairs),
+              (double)total.lcs_usec / (N * n_pairs),
+              (double)total.encode_usec / (N * n_pairs),
+              (double)total.verify_usec / (N * n_pairs));
     }
-    char *diff = consensus_diff_generate(f1, f2);
-    printf("%s", diff);
-    tor_free(f1);
-    tor_free(f2);
-    tor_free(diff);
     return 0;
   }
 
@@ -6,6 +6,7 @@
 #include "backtrace.h"
 #include "config.h"
 #include "fuzzing.h"
+#include "parsecommon.h"
 #include "crypto.h"
 #include "crypto_ed25519.h"
 
@@ -98,6 +99,7 @@ global_init(void)
 {
   tor_threads_init();
   tor_compress_init();
+  parsecommon_init();
   {
     struct sipkey sipkey = { 1337, 7331 };
     siphash_set_global_key(&sipkey);
@@ -352,6 +352,88 @@ test_onion_queues(void *arg)
   tor_free(onionskin);
 }
 
+/** Add a new circuit with an onionskin of type <b>type</b> to the onion
+ * queues, remembering the circuit in <b>circs</b>. Return what
+ * onion_pending_add() returned. */
+static int
+onion_queue_add_one(smartlist_t *circs, uint16_t type)
+{
+  or_circuit_t *circ = or_circuit_new(0, NULL);
+  create_cell_t *create = tor_malloc_zero(sizeof(create_cell_t));
+  uint8_t buf[TAP_ONIONSKIN_CHALLENGE_LEN] = {0};
+  int r;
+
+  if (type == ONION_HANDSHAKE_TYPE_NTOR)
+    create_cell_init(create, CELL_CREATE2, type, NTOR_ONIONSKIN_LEN, buf);
+  else
+    create_cell_init(create, CELL_CREATE, type,
+                     TAP_ONIONSKIN_CHALLENGE_LEN, buf);
+  smartlist_add(circs, circ);
+  r = onion_pending_add(circ, create);
+  if (r < 0)
+    tor_free(create);
+  return r;
+}
+
+/** Run unit tests for deciding which onionskins to queue. */
+static void
+test_onion_queue_admission(void *arg)
+{
+  or_options_t *options = get_options_mutable();
+  const int old_num_cpus = options->NumCPUs;
+  const int old_max_delay = options->MaxOnionQueueDelay;
+  smartlist_t *circs = smartlist_new();
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  int i, n_dropped = 0;
+  (void)arg;
+
+  /* With no measurements, each onionskin costs 1 msec on our one CPU. */
+  options->NumCPUs = 1;
+  options->MaxOnionQueueDelay = 200;
+
+  /* 120 ntor onionskins take 120 msec: all of them fit. */
+  for (i = 0; i < 120; ++i)
+    tt_int_op(0, OP_EQ, onion_queue_add_one(circs, ONION_HANDSHAKE_TYPE_NTOR));
+
+  /* TAP onionskins always fit while there are fewer than 50 queued. After
+   * that, they don't, since new ntor ones would already wait for 133 msec,
+   * more than half of MaxOnionQueueDelay. */
+  for (i = 0; i < 50; ++i)
+    tt_int_op(0, OP_EQ, onion_queue_add_one(circs, ONION_HANDSHAKE_TYPE_TAP));
+  tt_int_op(-1, OP_EQ, onion_queue_add_one(circs, ONION_HANDSHAKE_TYPE_TAP));
+  tt_int_op(50, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_TAP));
+
+  /* Ntor onionskins fit until they, and the TAP ones we'll process among
+   * them, would take more than 200 msec. */
+  for (i = 0; i < 70; ++i) {
+    if (onion_queue_add_one(circs, ONION_HANDSHAKE_TYPE_NTOR) < 0)
+      ++n_dropped;
+  }
+  tt_int_op(8, OP_EQ, n_dropped);
+  tt_int_op(182, OP_EQ, onion_num_pending(ONION_HANDSHAKE_TYPE_NTOR));
+
+  tt_int_op(0, OP_EQ, getinfo_helper_onion(NULL, "onionskins/admission",
+                                           &answer, &errmsg));
+  tt_assert(answer);
+  tt_assert(strstr(answer, "max-delay-ms=200 "));
+  tt_assert(strstr(answer, "tap queued=50 cost-usec=1000 "));
+  tt_assert(strstr(answer, "dropped-delay=0 dropped-tap-share=0 "
+                   "dropped-ntor-pressure=1\n"));
+  tt_assert(strstr(answer, "ntor queued=182 cost-usec=1000 "));
+  tt_assert(strstr(answer, "dropped-delay=8 dropped-tap-share=0 "
+                   "dropped-ntor-pressure=0"));
+
+ done:
+  clear_pending_onions();
+  SMARTLIST_FOREACH(circs, or_circuit_t *, circ,
+                    circuit_free(TO_CIRCUIT(circ)));
+  smartlist_free(circs);
+  tor_free(answer);
+  options->NumCPUs = old_num_cpus;
+  options->MaxOnionQueueDelay = old_max_delay;
+}
+
 static void
 test_circuit_timeout(void *arg)
 {
@@ -996,6 +1078,75 @@ test_geoip_with_pt(void *arg)
   tor_free(s);
 }
 
+/** Run unit tests for the approximate client statistics. Counts are
+ * estimates, so we pick ones that are far enough from the rounding
+ * boundaries. */
+static void
+test_geoip_approximate(void *arg)
+{
+  time_t now = 1281533250; /* 2010-08-11 13:27:30 UTC */
+  char *s = NULL, *v = NULL;
+  int i;
+  tor_addr_t addr;
+  struct in6_addr in6;
+
+  (void)arg;
+  tt_int_op(0,OP_EQ, geoip_parse_entry("10,50,AB", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("52,90,XY", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("105,140,ZZ", AF_INET));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::a,::32,AB", AF_INET6));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::34,::5a,XY", AF_INET6));
+  tt_int_op(0,OP_EQ, geoip_parse_entry("::69,::8c,ZZ", AF_INET6));
+  memset(&in6, 0, sizeof(in6));
+
+  get_options_mutable()->BridgeRelay = 1;
+  get_options_mutable()->BridgeRecordUsageByCountry = 1;
+  get_options_mutable()->ApproximateClientStatistics = 1;
+
+  /* 6 clients in AB, seen several times, 3 in XY and 14 in ZZ. */
+  for (i = 32; i < 38; ++i) {
+    SET_TEST_ADDRESS(i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+  }
+  for (i = 52; i < 55; ++i) {
+    SET_TEST_ADDRESS(i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+  }
+  for (i = 106; i < 120; ++i) {
+    SET_TEST_ADDRESS(i);
+    geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, NULL, now);
+  }
+  /* One of them also came with a transport. */
+  SET_TEST_ADDRESS(110);
+  geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &addr, "alpha", now);
+
+  /* None of them got an entry of their own. */
+  tt_ptr_op(geoip_lookup_client(&addr, NULL, GEOIP_CLIENT_CONNECT),
+            OP_EQ, NULL);
+
+  geoip_get_client_history(GEOIP_CLIENT_CONNECT, &s, &v);
+  tt_str_op("zz=16,ab=8,xy=8",OP_EQ, s);
+  tt_str_op("v4=16,v6=16",OP_EQ, v);
+  tor_free(s);
+  tor_free(v);
+  s = geoip_get_transport_history();
+  tt_str_op("<OR>=24,alpha=8",OP_EQ, s);
+  tor_free(s);
+
+  /* Starting a new interval forgets them all. */
+  geoip_reset_entry_stats(now);
+  geoip_get_client_history(GEOIP_CLIENT_CONNECT, &s, &v);
+  tt_ptr_op(s, OP_EQ, NULL);
+  tt_str_op("v4=0,v6=0",OP_EQ, v);
+  tt_ptr_op(geoip_get_transport_history(), OP_EQ, NULL);
+
+ done:
+  get_options_mutable()->ApproximateClientStatistics = 0;
+  tor_free(s);
+  tor_free(v);
+}
+
 #undef SET_TEST_ADDRESS
 #undef SET_TEST_IPV6
 #undef CHECK_COUNTRY
@@ -1160,6 +1311,77 @@ test_stats(void *arg)
   tor_free(s);
 }
 
+/** Run unit tests for loading text and precompiled GeoIP databases. */
+static void
+test_geoip_load_file(void *arg)
+{
+  const char text[] = "# comment\n52,90,XY\n10,50,AB\n";
+  const char *fname = get_fname("geoip");
+  char digest_hex[HEX_DIGEST_LEN+1];
+  uint8_t db[40 + 8 + 2*4 + 2*4 + 2*2];
+  uint8_t *cp = db;
+
+  (void)arg;
+
+  /* A text file, out of order. */
+  tt_int_op(0, OP_EQ, write_str_to_file(fname, text, 0));
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname));
+  tt_assert(geoip_is_loaded(AF_INET));
+  tt_str_op("ab", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(10)));
+  tt_str_op("xy", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(90)));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(51));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(91));
+  strlcpy(digest_hex, geoip_db_digest(AF_INET), sizeof(digest_hex));
+
+  /* The same database, precompiled, with "zz" and "xy" in its country
+   * table, and "zz" unused. */
+  memset(db, 0, sizeof(db));
+  memcpy(cp, "TORGEOIP", 8);
+  cp[8] = 1; /* version */
+  cp[9] = 4; /* family */
+  set_uint16(cp + 10, htons(3));
+  set_uint32(cp + 12, htonl(2));
+  crypto_digest((char *)cp + 16, text, strlen(text));
+  cp += 40;
+  memcpy(cp, "abzzxy", 6);
+  cp += 8;
+  set_uint32(cp, htonl(10));
+  set_uint32(cp + 4, htonl(52));
+  cp += 8;
+  set_uint32(cp, htonl(50));
+  set_uint32(cp + 4, htonl(90));
+  cp += 8;
+  set_uint16(cp, htons(0));
+  set_uint16(cp + 2, htons(2));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, (char *)db, sizeof(db), 1));
+
+  tt_int_op(0, OP_EQ, geoip_load_file(AF_INET, fname));
+  tt_assert(geoip_is_loaded(AF_INET));
+  tt_str_op("ab", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(10)));
+  tt_str_op("ab", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(50)));
+  tt_str_op("xy", OP_EQ,
+            geoip_get_country_name(geoip_get_country_by_ipv4(52)));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(9));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(51));
+  tt_int_op(0, OP_EQ, geoip_get_country_by_ipv4(1000));
+  /* We report the digest of the text file it was compiled from. */
+  tt_str_op(digest_hex, OP_EQ, geoip_db_digest(AF_INET));
+
+  /* A truncated database, or one for the wrong family, doesn't load. */
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, (char *)db,
+                                          sizeof(db) - 1, 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET, fname));
+  tt_int_op(0, OP_EQ, write_bytes_to_file(fname, (char *)db, sizeof(db), 1));
+  tt_int_op(-1, OP_EQ, geoip_load_file(AF_INET6, fname));
+
+ done:
+  ;
+}
+
 #define ENT(name)                                                       \
   { #name, test_ ## name , 0, NULL, NULL }
 #define FORK(name)                                                      \
@@ -1169,12 +1391,15 @@ static struct testcase_t test_array[] = {
   ENT(onion_handshake),
   { "bad_onion_handshake", test_bad_onion_handshake, 0, NULL, NULL },
   ENT(onion_queues),
+  FORK(onion_queue_admission),
   { "ntor_handshake", test_ntor_handshake, 0, NULL, NULL },
   { "fast_handshake", test_fast_handshake, 0, NULL, NULL },
   FORK(circuit_timeout),
   FORK(rend_fns),
   ENT(geoip),
   FORK(geoip_with_pt),
+  FORK(geoip_approximate),
+  FORK(geoip_load_file),
   FORK(stats),
 
   END_OF_TESTCASES
@@ -1233,6 +1458,7 @@ struct testgroup_t testgroups[] = {
   { "oom/", oom_tests },
   { "oos/", oos_tests },
   { "options/", options_tests },
+  { "parsecommon/", parsecommon_tests },
   { "policy/" , policy_tests },
   { "procmon/", procmon_tests },
   { "proto/http/", proto_http_tests },
@@ -78,11 +78,85 @@ test_contains(void *arg)
   address_set_free(set);
 }
 
+static void
+test_remove(void *arg)
+{
+  address_set_t *set = NULL;
+  tor_addr_t addr;
+  uint32_t i;
+
+  (void) arg;
+
+  set = address_set_new(1000);
+  for (i = 0; i < 1000; ++i)
+    address_set_add_ipv4h(set, i);
+  /* Add one of them twice. */
+  address_set_add_ipv4h(set, 0);
+
+  /* Removing half of them keeps the others. */
+  for (i = 0; i < 1000; i += 2)
+    address_set_remove_ipv4h(set, i);
+  for (i = 1; i < 1000; i += 2) {
+    tor_addr_from_ipv4h(&addr, i);
+    tt_int_op(address_set_probably_contains(set, &addr), OP_EQ, 1);
+  }
+  /* 0 was added twice, so it's still there. */
+  tor_addr_from_ipv4h(&addr, 0);
+  tt_int_op(address_set_probably_contains(set, &addr), OP_EQ, 1);
+
+  /* Once everything is gone, the set is empty again, unless some counter
+   * overflowed, which is very unlikely with so few addresses. */
+  address_set_remove_ipv4h(set, 0);
+  for (i = 1; i < 1000; i += 2)
+    address_set_remove_ipv4h(set, i);
+  for (i = 0; i < 1000; ++i) {
+    tor_addr_from_ipv4h(&addr, i);
+    tt_int_op(address_set_probably_contains(set, &addr), OP_EQ, 0);
+  }
+
+ done:
+  address_set_free(set);
+}
+
+static void
+test_fp_rate(void *arg)
+{
+  address_set_t *set = NULL, *bigger_set = NULL;
+  tor_addr_t addr;
+  uint32_t i;
+  int n_fp;
+
+  (void) arg;
+
+  /* About 10 four-bit counters per address for 1%, and more for less. */
+  set = address_set_new_with_fp_rate(10000, 0.01);
+  tt_size_op(address_set_get_size(set), OP_GE, 10000 * 10 * 4 / 8);
+  bigger_set = address_set_new_with_fp_rate(10000, 0.0001);
+  tt_size_op(address_set_get_size(set), OP_LT,
+             address_set_get_size(bigger_set));
+
+  /* Fill it up and check how often other addresses match. */
+  for (i = 0; i < 10000; ++i)
+    address_set_add_ipv4h(set, 0x0a000000 | i);
+  n_fp = 0;
+  for (i = 0; i < 100000; ++i) {
+    tor_addr_from_ipv4h(&addr, 0x0b000000 | i);
+    n_fp += address_set_probably_contains(set, &addr);
+  }
+  tt_int_op(n_fp, OP_LT, 1000);
+
+ done:
+  address_set_free(set);
+  address_set_free(bigger_set);
+}
+
 static void
 test_nodelist(void *arg)
 {
   int ret;
   routerstatus_t *rs = NULL; microdesc_t *md = NULL; routerinfo_t *ri = NULL;
+  routerinfo_t *ri2 = NULL;
+  tor_addr_t other_addr;
 
   (void) arg;
 
@@ -154,7 +228,29 @@ test_nodelist(void *arg)
   ret = nodelist_probably_contains_address(&dummy_addr);
   tt_int_op(ret, OP_EQ, 0);
 
+  /* Descriptors that arrive between consensuses update the set. */
+  memcpy(ri->cache_info.identity_digest, rs->identity_digest, DIGEST_LEN);
+  ri->addr = ipv4h + 1;
+  nodelist_set_routerinfo(ri, NULL);
+  tor_addr_from_ipv4h(&other_addr, ipv4h + 1);
+  tt_int_op(nodelist_probably_contains_address(&other_addr), OP_EQ, 1);
+
+  ri2 = tor_malloc_zero(sizeof(*ri2));
+  memcpy(ri2->cache_info.identity_digest, rs->identity_digest, DIGEST_LEN);
+  ri2->addr = ipv4h + 2;
+  nodelist_set_routerinfo(ri2, NULL);
+  tt_int_op(nodelist_probably_contains_address(&other_addr), OP_EQ, 0);
+  tor_addr_from_ipv4h(&other_addr, ipv4h + 2);
+  tt_int_op(nodelist_probably_contains_address(&other_addr), OP_EQ, 1);
+
+  nodelist_remove_routerinfo(ri2);
+  tt_int_op(nodelist_probably_contains_address(&other_addr), OP_EQ, 0);
+  /* The consensus still has the node's own addresses. */
+  tt_int_op(nodelist_probably_contains_address(&addr_v4), OP_EQ, 1);
+  tt_int_op(nodelist_probably_contains_address(&addr_v6), OP_EQ, 1);
+
  done:
+  routerinfo_free(ri2);
   routerstatus_free(rs); routerinfo_free(ri); microdesc_free(md);
   smartlist_clear(dummy_ns->routerstatus_list);
   networkstatus_vote_free(dummy_ns);
@@ -166,6 +262,10 @@ test_nodelist(void *arg)
 struct testcase_t address_set_tests[] = {
   { "contains", test_contains, TT_FORK,
     NULL, NULL },
+  { "remove", test_remove, TT_FORK,
+    NULL, NULL },
+  { "fp_rate", test_fp_rate, TT_FORK,
+    NULL, NULL },
   { "nodelist", test_nodelist, TT_FORK,
     NULL, NULL },
 
@@ -700,6 +700,105 @@ test_buffers_tls_read_mocked(void *arg)
   buf_free(buf);
 }
 
+/** Helper for test_buffers_external: count the times we release a chunk. */
+static void
+count_release(void *arg)
+{
+  ++*(int *)arg;
+}
+
+static void
+test_buffers_external(void *arg)
+{
+  buf_t *buf = NULL, *buf2 = NULL;
+  char *body = tor_malloc(10000);
+  char *out = tor_malloc(10020);
+  const char *head = NULL;
+  size_t headlen = 0;
+  size_t r;
+  int n_released = 0, n_released2 = 0;
+  int i;
+  (void)arg;
+
+  for (i = 0; i < 10000; ++i)
+    body[i] = 'a' + (i % 26);
+
+  /* The buffer refers to external data instead of copying it, and never
+   * appends to it. */
+  buf = buf_new();
+  buf_add(buf, "head", 4);
+  tt_int_op(buf_add_external(buf, body, 10000, count_release, &n_released),
+            OP_EQ, 10004);
+  tt_ptr_op(buf->tail->data, OP_EQ, body);
+  tt_int_op(buf_slack(buf), OP_EQ, 0);
+  buf_add(buf, "tail", 4);
+  buf_assert_ok(buf);
+  tt_int_op(buf_datalen(buf), OP_EQ, 10008);
+  buf_peek(buf, out, 10008);
+  tt_mem_op(out, OP_EQ, "head", 4);
+  tt_mem_op(out+4, OP_EQ, body, 10000);
+  tt_mem_op(out+10004, OP_EQ, "tail", 4);
+
+  /* Copies own their data. */
+  buf2 = buf_copy(buf);
+  buf_assert_ok(buf2);
+  tt_int_op(buf_datalen(buf2), OP_EQ, 10008);
+  buf_free(buf2);
+  buf2 = NULL;
+  tt_int_op(n_released, OP_EQ, 0);
+
+  /* Moving whole chunks keeps the reference. */
+  buf2 = buf_new();
+  r = 10004;
+  tt_int_op(buf_move_to_buf(buf2, buf, &r), OP_EQ, 10004);
+  tt_int_op(r, OP_EQ, 0);
+  buf_assert_ok(buf);
+  buf_assert_ok(buf2);
+  tt_ptr_op(buf2->tail->data, OP_EQ, body);
+  tt_int_op(buf_datalen(buf), OP_EQ, 4);
+  tt_int_op(n_released, OP_EQ, 0);
+
+  /* Draining part of it keeps the reference too. */
+  buf_drain(buf2, 10);
+  tt_ptr_op(buf2->head->data, OP_EQ, body+6);
+  tt_int_op(n_released, OP_EQ, 0);
+
+  /* Pulling up what's already there doesn't copy it... */
+  buf_pullup(buf2, 5000, &head, &headlen);
+  tt_ptr_op(head, OP_EQ, body+6);
+  tt_int_op(headlen, OP_EQ, 9994);
+
+  /* ... but pulling up more than that does. */
+  buf_add(buf2, "zz", 2);
+  buf_pullup(buf2, 9996, &head, &headlen);
+  tt_int_op(headlen, OP_EQ, 9996);
+  tt_mem_op(head, OP_EQ, body+6, 9994);
+  tt_mem_op(head+9994, OP_EQ, "zz", 2);
+  tt_int_op(n_released, OP_EQ, 1);
+  buf_assert_ok(buf2);
+  tt_int_op(buf_get_bytes(buf2, out, 9996), OP_EQ, 0);
+
+  /* Draining all of it releases it. */
+  buf_add_external(buf2, body, 100, count_release, &n_released2);
+  buf_add(buf2, "x", 1);
+  buf_drain(buf2, 100);
+  tt_int_op(n_released2, OP_EQ, 1);
+
+  /* So does freeing the buffer, or failing to add to it. */
+  buf_add_external(buf2, body, 100, count_release, &n_released2);
+  buf_add_external(buf2, body, 0, count_release, &n_released2);
+  tt_int_op(n_released2, OP_EQ, 2);
+  buf_free(buf2);
+  buf2 = NULL;
+  tt_int_op(n_released2, OP_EQ, 3);
+
+ done:
+  buf_free(buf);
+  buf_free(buf2);
+  tor_free(body);
+  tor_free(out);
+}
+
 static void
 test_buffers_chunk_size(void *arg)
 {
@@ -764,6 +863,72 @@ test_buffers_find_contentlen(void *arg)
   ;
 }
 
+/** Flush a buffer made of many small chunks to a socket, and read it back
+ * into a buffer whose tail chunk is partly full, so that both the single
+ * chunk and the multi-chunk paths of the socket functions get used. */
+static void
+test_buffers_socket_io(void *arg)
+{
+  tor_socket_t fds[2] = { TOR_INVALID_SOCKET, TOR_INVALID_SOCKET };
+  buf_t *out = NULL, *in = NULL;
+  char *msg = NULL, *got = NULL;
+  const size_t msglen = 20000;
+  size_t flushlen, i;
+  int r, eof = 0, err = 0;
+  (void)arg;
+
+  tt_int_op(tor_socketpair(AF_UNIX, SOCK_STREAM, 0, fds), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[0]), OP_EQ, 0);
+  tt_int_op(set_socket_nonblocking(fds[1]), OP_EQ, 0);
+
+  msg = tor_malloc(msglen);
+  for (i = 0; i < msglen; ++i)
+    msg[i] = (char)(i * 7);
+
+  /* Many small chunks on the way out. */
+  out = buf_new_with_capacity(256);
+  for (i = 0; i < msglen; i += 100)
+    buf_add(out, msg + i, 100);
+  tt_int_op(buf_datalen(out), OP_EQ, msglen);
+  tt_assert(out->head != out->tail);
+
+  /* Start with a partly full tail on the way in. */
+  in = buf_new_with_capacity(4096);
+  buf_add(in, msg, 10);
+
+  flushlen = buf_datalen(out);
+  while (flushlen) {
+    size_t before = flushlen;
+    r = buf_flush_to_socket(out, fds[0], flushlen, &flushlen);
+    tt_int_op(r, OP_GE, 0);
+    tt_int_op(before - flushlen, OP_EQ, r);
+    r = buf_read_from_socket(in, fds[1], msglen, &eof, &err);
+    tt_int_op(r, OP_GE, 0);
+    tt_int_op(eof, OP_EQ, 0);
+  }
+  do {
+    r = buf_read_from_socket(in, fds[1], msglen, &eof, &err);
+    tt_int_op(r, OP_GE, 0);
+  } while (r > 0);
+  buf_assert_ok(out);
+  buf_assert_ok(in);
+  tt_int_op(buf_datalen(out), OP_EQ, 0);
+  tt_int_op(buf_datalen(in), OP_EQ, msglen + 10);
+
+  got = tor_malloc(msglen + 10);
+  buf_get_bytes(in, got, msglen + 10);
+  tt_mem_op(got, OP_EQ, msg, 10);
+  tt_mem_op(got + 10, OP_EQ, msg, msglen);
+
+ done:
+  tor_close_socket(fds[0]);
+  tor_close_socket(fds[1]);
+  buf_free(out);
+  buf_free(in);
+  tor_free(msg);
+  tor_free(got);
+}
+
 static void
 test_buffer_peek_startswith(void *arg)
 {
@@ -795,12 +960,14 @@ struct testcase_t buffer_tests[] = {
   { "copy", test_buffer_copy, TT_FORK, NULL, NULL },
   { "pullup", test_buffer_pullup, TT_FORK, NULL, NULL },
   { "startswith", test_buffer_peek_startswith, 0, NULL, NULL },
+  { "socket_io", test_buffers_socket_io, TT_FORK, NULL, NULL },
   { "allocation_tracking", test_buffer_allocation_tracking, TT_FORK,
     NULL, NULL },
   { "time_tracking", test_buffer_time_tracking, TT_FORK, NULL, NULL },
   { "tls_read_mocked", test_buffers_tls_read_mocked, 0,
     NULL, NULL },
   { "chunk_size", test_buffers_chunk_size, 0, NULL, NULL },
+  { "external", test_buffers_external, 0, NULL, NULL },
   { "find_contentlen", test_buffers_find_contentlen, 0, NULL, NULL },
 
   { "compress/zlib", test_buffers_compress, TT_FORK,
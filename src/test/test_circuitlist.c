@@ -176,6 +176,79 @@ test_clist_maps(void *arg)
   UNMOCK(circuitmux_detach_circuit);
 }
 
+static void
+test_clist_circid_cache(void *arg)
+{
+  channel_t *ch1 = new_fake_channel();
+  channel_t *ch2 = new_fake_channel();
+  or_circuit_t *or_c1=NULL, *or_c2=NULL;
+
+  (void) arg;
+
+  MOCK(circuitmux_attach_circuit, circuitmux_attach_mock);
+  MOCK(circuitmux_detach_circuit, circuitmux_detach_mock);
+  memset(&cam, 0, sizeof(cam));
+  memset(&cdm, 0, sizeof(cdm));
+
+  tt_assert(ch1);
+  tt_assert(ch2);
+  ch1->cmux = tor_malloc(1);
+  ch2->cmux = tor_malloc(1);
+
+  /* Those two IDs use the same slot of the channel's circuit ID cache. */
+  or_c1 = or_circuit_new(1, ch1);
+  or_c2 = or_circuit_new(1 + CHANNEL_CIRCID_CACHE_SIZE, ch1);
+  tt_assert(or_c1);
+  tt_assert(or_c2);
+
+  /* Lookups that keep evicting each other from the cache are still right. */
+  tt_ptr_op(circuit_get_by_circid_channel(1, ch1), OP_EQ, TO_CIRCUIT(or_c1));
+  tt_ptr_op(circuit_get_by_circid_channel(1 + CHANNEL_CIRCID_CACHE_SIZE, ch1),
+            OP_EQ, TO_CIRCUIT(or_c2));
+  tt_ptr_op(circuit_get_by_circid_channel(1, ch1), OP_EQ, TO_CIRCUIT(or_c1));
+  tt_ptr_op(circuit_get_by_circid_channel(1 + CHANNEL_CIRCID_CACHE_SIZE, ch1),
+            OP_EQ, TO_CIRCUIT(or_c2));
+  /* The cache is per channel. */
+  tt_ptr_op(circuit_get_by_circid_channel(1, ch2), OP_EQ, NULL);
+
+  /* Moving a circuit away invalidates what the old channel cached. */
+  tt_ptr_op(circuit_get_by_circid_channel(1, ch1), OP_EQ, TO_CIRCUIT(or_c1));
+  circuit_set_p_circid_chan(or_c1, 7, ch2);
+  tt_ptr_op(circuit_get_by_circid_channel(1, ch1), OP_EQ, NULL);
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch2), OP_EQ, TO_CIRCUIT(or_c1));
+
+  /* A placeholder isn't a circuit, even if the ID was cached. */
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch2), OP_EQ, TO_CIRCUIT(or_c1));
+  circuit_set_p_circid_chan(or_c1, 0, NULL);
+  channel_mark_circid_unusable(ch2, 7);
+  tt_ptr_op(circuit_get_by_circid_channel(7, ch2), OP_EQ, NULL);
+  tt_int_op(circuit_id_in_use_on_channel(7, ch2), OP_EQ, 2);
+  channel_mark_circid_usable(ch2, 7);
+  tt_int_op(circuit_id_in_use_on_channel(7, ch2), OP_EQ, 0);
+
+  /* Freeing a circuit invalidates the cache too. */
+  tt_ptr_op(circuit_get_by_circid_channel(1 + CHANNEL_CIRCID_CACHE_SIZE, ch1),
+            OP_EQ, TO_CIRCUIT(or_c2));
+  circuit_free(TO_CIRCUIT(or_c2));
+  or_c2 = NULL;
+  tt_ptr_op(circuit_get_by_circid_channel(1 + CHANNEL_CIRCID_CACHE_SIZE, ch1),
+            OP_EQ, NULL);
+
+ done:
+  if (or_c1)
+    circuit_free(TO_CIRCUIT(or_c1));
+  if (or_c2)
+    circuit_free(TO_CIRCUIT(or_c2));
+  if (ch1)
+    tor_free(ch1->cmux);
+  if (ch2)
+    tor_free(ch2->cmux);
+  tor_free(ch1);
+  tor_free(ch2);
+  UNMOCK(circuitmux_attach_circuit);
+  UNMOCK(circuitmux_detach_circuit);
+}
+
 static void
 test_rend_token_maps(void *arg)
 {
@@ -460,6 +533,7 @@ test_hs_circuitmap_isolation(void *arg)
 
 struct testcase_t circuitlist_tests[] = {
   { "maps", test_clist_maps, TT_FORK, NULL, NULL },
+  { "circid_cache", test_clist_circid_cache, TT_FORK, NULL, NULL },
   { "rend_token_maps", test_rend_token_maps, TT_FORK, NULL, NULL },
   { "pick_circid", test_pick_circid, TT_FORK, NULL, NULL },
   { "hs_circuitmap_isolation", test_hs_circuitmap_isolation,
@@ -321,6 +321,35 @@ test_conscache_filter(void *arg)
   tt_assert( (!strcmp(idx1, "28") && !strcmp(idx2, "13")) ||
              (!strcmp(idx1, "13") && !strcmp(idx2, "28")) );
 
+  /* Deleted entries disappear from every label's lookups. */
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod3", "1");
+  SMARTLIST_FOREACH(lst, consensus_cache_entry_t *, e,
+                    consensus_cache_entry_mark_for_removal(e));
+  consensus_cache_delete_pending(cache, 0);
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod3", "1");
+  tt_int_op(smartlist_len(lst), OP_EQ, 0);
+  tt_ptr_op(consensus_cache_find_first(cache, "index", "13"), OP_EQ, NULL);
+  consensus_cache_find_all(lst, cache, "mod5", "3");
+  tt_int_op(smartlist_len(lst), OP_EQ, 4);
+
+  /* With a duplicate key, only the first value counts. */
+  {
+    config_line_t *labels = NULL;
+    config_line_append(&labels, "mod3", "1");
+    config_line_append(&labels, "mod3", "2");
+    consensus_cache_entry_t *ent =
+      consensus_cache_add(cache, labels, (const uint8_t *)"dup", 3);
+    config_free_lines(labels);
+    tt_assert(ent);
+    tt_ptr_op(ent, OP_EQ, consensus_cache_find_first(cache, "mod3", "1"));
+    consensus_cache_entry_decref(ent);
+  }
+  smartlist_clear(lst);
+  consensus_cache_find_all(lst, cache, "mod3", "2");
+  tt_int_op(smartlist_len(lst), OP_EQ, 10);
+
  done:
   tor_free(ddir_fname);
   consensus_cache_free(cache);
@@ -62,9 +62,9 @@ test_consdiff_smartlist_slice_string_pos(void *arg)
 
   /* See that smartlist_slice_string_pos respects the bounds of the slice. */
   sls = smartlist_slice(sl, 2, 5);
-  cdline_t a_line = { "a", 1 };
+  cdline_t a_line = { "a", 1, 0 };
   tt_int_op(3, OP_EQ, smartlist_slice_string_pos(sls, &a_line));
-  cdline_t d_line = { "d", 1 };
+  cdline_t d_line = { "d", 1, 0 };
   tt_int_op(-1, OP_EQ, smartlist_slice_string_pos(sls, &d_line));
 
  done:
@@ -310,14 +310,76 @@ test_consdiff_calc_changes(void *arg)
   memarea_drop_all(area);
 }
 
+static void
+test_consdiff_line_hash(void *arg)
+{
+  smartlist_t *sl1 = smartlist_new();
+  smartlist_t *sl2 = smartlist_new();
+  smartlist_slice_t *sls1 = NULL, *sls2 = NULL;
+  bitarray_t *changed1 = bitarray_init_zero(4);
+  bitarray_t *changed2 = bitarray_init_zero(4);
+  memarea_t *area = memarea_new();
+
+  (void)arg;
+  consensus_split_lines(sl1, "a\nb\nc\nd\n", area);
+  consensus_split_lines(sl2, "a\nx\nc\nd\n", area);
+
+  /* Every line gets a nonzero fingerprint, which only depends on its
+   * contents. */
+  SMARTLIST_FOREACH(sl1, cdline_t *, line, tt_u64_op(line->hash, OP_NE, 0));
+  cdline_t *a1 = smartlist_get(sl1, 0), *a2 = smartlist_get(sl2, 0);
+  cdline_t *b1 = smartlist_get(sl1, 1), *x2 = smartlist_get(sl2, 1);
+  tt_u64_op(a1->hash, OP_EQ, a2->hash);
+  tt_u64_op(a1->hash, OP_EQ, cdline_hash("a", 1));
+  tt_u64_op(b1->hash, OP_NE, x2->hash);
+  tt_assert(lines_eq(a1, a2));
+  tt_assert(!lines_eq(b1, x2));
+
+  /* Lines without a fingerprint are compared by their contents. */
+  cdline_t a_line = { "a", 1, 0 };
+  tt_assert(lines_eq(&a_line, a1));
+
+  /* A collision doesn't make different lines equal... */
+  b1->hash = x2->hash;
+  tt_assert(!lines_eq(b1, x2));
+
+  /* ... and doesn't make us miss any changes, even though the lcs now
+   * thinks that the lines match. */
+  smartlist_clear(sl2);
+  consensus_split_lines(sl2, "x\nb\ny\nd\n", area);
+  x2 = smartlist_get(sl2, 0);
+  b1->hash = cdline_hash("b", 1);
+  a1->hash = x2->hash;
+  sls1 = smartlist_slice(sl1, 0, -1);
+  sls2 = smartlist_slice(sl2, 0, -1);
+  calc_changes(sls1, sls2, changed1, changed2);
+  tt_assert(bitarray_is_set(changed1, 0));
+  tt_assert(!bitarray_is_set(changed1, 1));
+  tt_assert(bitarray_is_set(changed1, 2));
+  tt_assert(!bitarray_is_set(changed1, 3));
+  tt_assert(bitarray_is_set(changed2, 0));
+  tt_assert(!bitarray_is_set(changed2, 1));
+  tt_assert(bitarray_is_set(changed2, 2));
+  tt_assert(!bitarray_is_set(changed2, 3));
+
+ done:
+  bitarray_free(changed1);
+  bitarray_free(changed2);
+  tor_free(sls1);
+  tor_free(sls2);
+  smartlist_free(sl1);
+  smartlist_free(sl2);
+  memarea_drop_all(area);
+}
+
 static void
 test_consdiff_get_id_hash(void *arg)
 {
   (void)arg;
 
-  cdline_t line1 = { "r name", 6 };
-  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28 };
-  cdline_t line3 = { "r name hash+valid+base64 etc", 28 };
+  cdline_t line1 = { "r name", 6, 0 };
+  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28, 0 };
+  cdline_t line3 = { "r name hash+valid+base64 etc", 28, 0 };
   cdline_t tmp;
 
   /* No hash. */
@@ -339,15 +401,15 @@ test_consdiff_is_valid_router_entry(void *arg)
 {
   /* Doesn't start with "r ". */
   (void)arg;
-  cdline_t line0 = { "foo", 3 };
+  cdline_t line0 = { "foo", 3, 0 };
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line0));
 
   /* These are already tested with get_id_hash, but make sure it's run
    * properly. */
 
-  cdline_t line1 = { "r name", 6 };
-  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28 };
-  cdline_t line3 = { "r name hash+valid+base64 etc", 28 };
+  cdline_t line1 = { "r name", 6, 0 };
+  cdline_t line2 = { "r name _hash_isnt_base64 etc", 28, 0 };
+  cdline_t line3 = { "r name hash+valid+base64 etc", 28, 0 };
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line1));
   tt_int_op(0, OP_EQ, is_valid_router_entry(&line2));
   tt_int_op(1, OP_EQ, is_valid_router_entry(&line3));
@@ -390,8 +452,8 @@ test_consdiff_next_router(void *arg)
 static int
 base64cmp_wrapper(const char *a, const char *b)
 {
-  cdline_t aa = { a, a ? (uint32_t) strlen(a) : 0 };
-  cdline_t bb = { b, b ? (uint32_t) strlen(b) : 0 };
+  cdline_t aa = { a, a ? (uint32_t) strlen(a) : 0, 0 };
+  cdline_t bb = { b, b ? (uint32_t) strlen(b) : 0, 0 };
   return base64cmp(&aa, &bb);
 }
 
@@ -456,7 +518,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, "r name ccccccccccccccccccccccccccc etc");
   smartlist_add_linecpy(cons2, area, "bar");
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the base consensus doesn't have its router entries sorted "
@@ -464,7 +526,7 @@ test_consdiff_gen_ed_diff(void *arg)
 
   /* Same, but now with the second consensus. */
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons2, cons1, area);
+  diff = gen_ed_diff(cons2, cons1, area, NULL);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the target consensus doesn't have its router entries sorted "
@@ -476,14 +538,14 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons1, area, "r name aaaaaaaaaaaaaaaaaaaaaaaaaaa etc");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the base consensus doesn't have its router entries sorted "
          "properly.");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons2, cons1, area);
+  diff = gen_ed_diff(cons2, cons1, area, NULL);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the target consensus doesn't have its router entries sorted "
@@ -498,7 +560,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons1, area, "bar");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
          "because the base consensus doesn't have its router entries sorted "
@@ -516,7 +578,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, "foo2");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Cannot generate consensus diff "
          "because one of the lines to be added is \".\".");
@@ -530,7 +592,7 @@ test_consdiff_gen_ed_diff(void *arg)
   for (i=0; i < MAX_LINE_COUNT; ++i) smartlist_add_linecpy(cons1, area, "b");
 
   mock_clean_saved_logs();
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
 
   tt_ptr_op(NULL, OP_EQ, diff);
   expect_single_log_msg_containing("Refusing to generate consensus diff "
@@ -549,7 +611,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, ".");
   smartlist_add_linecpy(cons2, area, "foo2");
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   smartlist_free(diff);
 
@@ -557,7 +619,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_clear(cons1);
   smartlist_clear(cons2);
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(0, OP_EQ, smartlist_len(diff));
   smartlist_free(diff);
@@ -568,7 +630,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_add_linecpy(cons2, area, "foo");
   smartlist_add_linecpy(cons2, area, "bar");
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(0, OP_EQ, smartlist_len(diff));
   smartlist_free(diff);
@@ -576,7 +638,7 @@ test_consdiff_gen_ed_diff(void *arg)
   /* Everything is deleted. */
   smartlist_clear(cons2);
 
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(1, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("1,2d", smartlist_get(diff, 0));
@@ -584,7 +646,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_free(diff);
 
   /* Everything is added. */
-  diff = gen_ed_diff(cons2, cons1, area);
+  diff = gen_ed_diff(cons2, cons1, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(4, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("0a", smartlist_get(diff, 0));
@@ -597,7 +659,7 @@ test_consdiff_gen_ed_diff(void *arg)
   /* Everything is changed. */
   smartlist_add_linecpy(cons2, area, "foo2");
   smartlist_add_linecpy(cons2, area, "bar2");
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(4, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("1,2c", smartlist_get(diff, 0));
@@ -612,7 +674,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_clear(cons2);
   consensus_split_lines(cons1, "A\nB\nC\nD\nE\n", area);
   consensus_split_lines(cons2, "A\nC\nO\nE\nU\n", area);
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(7, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("5a", smartlist_get(diff, 0));
@@ -629,7 +691,7 @@ test_consdiff_gen_ed_diff(void *arg)
   smartlist_clear(cons2);
   consensus_split_lines(cons1, "B\n", area);
   consensus_split_lines(cons2, "A\nB\n", area);
-  diff = gen_ed_diff(cons1, cons2, area);
+  diff = gen_ed_diff(cons1, cons2, area, NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(3, OP_EQ, smartlist_len(diff));
   tt_str_eq_line("0a", smartlist_get(diff, 0));
@@ -925,7 +987,8 @@ test_consdiff_gen_diff(void *arg)
   consensus_split_lines(cons1, cons1_str, area);
   consensus_split_lines(cons2, cons2_str, area);
 
-  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area);
+  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area,
+                           NULL);
   tt_ptr_op(NULL, OP_EQ, diff);
 
   /* Check that the headers are done properly. */
@@ -940,7 +1003,8 @@ test_consdiff_gen_diff(void *arg)
       consensus_compute_digest_as_signed(cons1_str, &digests1));
   smartlist_clear(cons1);
   consensus_split_lines(cons1, cons1_str, area);
-  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area);
+  diff = consdiff_gen_diff(cons1, cons2, &digests1, &digests2, area,
+                           NULL);
   tt_ptr_op(NULL, OP_NE, diff);
   tt_int_op(11, OP_EQ, smartlist_len(diff));
   tt_assert(line_str_eq(smartlist_get(diff, 0),
@@ -1172,6 +1236,7 @@ struct testcase_t consdiff_tests[] = {
   CONSDIFF_LEGACY(trim_slices),
   CONSDIFF_LEGACY(set_changed),
   CONSDIFF_LEGACY(calc_changes),
+  CONSDIFF_LEGACY(line_hash),
   CONSDIFF_LEGACY(get_id_hash),
   CONSDIFF_LEGACY(is_valid_router_entry),
   CONSDIFF_LEGACY(next_router),
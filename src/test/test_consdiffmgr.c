@@ -127,17 +127,22 @@ mock_cpuworker_run_work(void)
   });
   return 0;
 }
+/* Replies can queue more work, such as compressing a diff that was just
+ * computed: run that too, until nothing is left. */
 static void
 mock_cpuworker_handle_replies(void)
 {
-  if (! fake_cpuworker_queue)
-    return;
-  SMARTLIST_FOREACH(fake_cpuworker_queue, fake_work_queue_ent_t *, ent, {
-      ent->reply_fn(ent->arg);
-      tor_free(ent);
-  });
-  smartlist_free(fake_cpuworker_queue);
-  fake_cpuworker_queue = NULL;
+  while (fake_cpuworker_queue) {
+    smartlist_t *queue = fake_cpuworker_queue;
+    fake_cpuworker_queue = NULL;
+    SMARTLIST_FOREACH(queue, fake_work_queue_ent_t *, ent, {
+        ent->reply_fn(ent->arg);
+        tor_free(ent);
+    });
+    smartlist_free(queue);
+    if (mock_cpuworker_run_work() < 0)
+      return;
+  }
 }
 
 // ==============================  Other helpers
@@ -632,6 +637,100 @@ test_consdiffmgr_diff_pending(void *arg)
 #undef N
 }
 
+static void
+test_consdiffmgr_compress_levels(void *arg)
+{
+  (void)arg;
+  consdiff_compress_stats_t st;
+  const consdiff_compress_stats_t *stp;
+  char *md_body[2];
+  networkstatus_t *md_ns[2];
+  time_t start = approx_time() - 120;
+  consensus_cache_entry_t *ent = NULL;
+  int i;
+  for (i = 0; i < 2; ++i) {
+    md_body[i] = fake_ns_body_new(FLAV_MICRODESC, start + i * 30);
+    md_ns[i] = fake_ns_new(FLAV_MICRODESC, start + i * 30);
+  }
+
+  /* With no history, we compress as well as we can... */
+  memset(&st, 0, sizeof(st));
+  tt_int_op(BEST_COMPRESSION, OP_EQ, cdm_choose_compression_level(&st, 0, 4));
+  /* ... unless the workers are swamped. */
+  tt_int_op(LOW_COMPRESSION, OP_EQ, cdm_choose_compression_level(&st, 8, 4));
+  tt_int_op(LOW_COMPRESSION, OP_EQ, cdm_choose_compression_level(&st, 2, 0));
+
+  /* Documents that nobody fetches much get less effort. */
+  st.n_compressed = 10;
+  st.compress_usec = 10 * 1000;
+  st.n_served = 10;
+  tt_int_op(HIGH_COMPRESSION, OP_EQ, cdm_choose_compression_level(&st, 0, 4));
+  /* Popular ones get the most. */
+  st.n_served = 80;
+  tt_int_op(BEST_COMPRESSION, OP_EQ, cdm_choose_compression_level(&st, 4, 4));
+  /* Slow, unpopular methods back off when the pool is busy. */
+  st.n_served = 10;
+  st.compress_usec = 10 * 1000 * 1000;
+  tt_int_op(HIGH_COMPRESSION, OP_EQ, cdm_choose_compression_level(&st, 3, 4));
+  tt_int_op(MEDIUM_COMPRESSION, OP_EQ,
+            cdm_choose_compression_level(&st, 4, 4));
+
+  /* Now make sure that the stats get collected. */
+  MOCK(cpuworker_queue_work, mock_cpuworker_queue_work);
+  tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[0], md_ns[0]));
+  tt_int_op(0, OP_EQ, consdiffmgr_add_consensus(md_body[1], md_ns[1]));
+  stp = consdiffmgr_get_compress_stats(CONSDIFF_DOC_CONSENSUS, ZLIB_METHOD);
+  tt_assert(stp);
+  tt_u64_op(stp->n_compressed, OP_EQ, 2);
+  tt_u64_op(stp->bytes_in, OP_EQ, strlen(md_body[0]) + strlen(md_body[1]));
+  tt_u64_op(stp->bytes_out, OP_GT, 0);
+  tt_u64_op(stp->n_served, OP_EQ, 0);
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            consdiffmgr_find_consensus(&ent, FLAV_MICRODESC, ZLIB_METHOD));
+  tt_u64_op(stp->n_served, OP_EQ, 1);
+  tt_ptr_op(NULL, OP_EQ,
+            consdiffmgr_get_compress_stats(CONSDIFF_DOC_DIFF, UNKNOWN_METHOD));
+
+  /* The diff gets computed in one job, then compressed in one job for each
+   * method besides NO_METHOD. */
+  consdiffmgr_rescan();
+  tt_int_op(1, OP_EQ, smartlist_len(fake_cpuworker_queue));
+  tt_int_op(0, OP_EQ, mock_cpuworker_run_work());
+  mock_cpuworker_handle_replies();
+  tt_ptr_op(NULL, OP_EQ, fake_cpuworker_queue);
+
+  stp = consdiffmgr_get_compress_stats(CONSDIFF_DOC_DIFF, GZIP_METHOD);
+  tt_u64_op(stp->n_compressed, OP_EQ, 1);
+  tt_u64_op(stp->bytes_out, OP_GT, 0);
+  stp = consdiffmgr_get_compress_stats(CONSDIFF_DOC_DIFF, NO_METHOD);
+  tt_u64_op(stp->n_compressed, OP_EQ, 1);
+  tt_u64_op(stp->bytes_out, OP_EQ, stp->bytes_in);
+  tt_int_op(CONSDIFF_AVAILABLE, OP_EQ,
+            lookup_diff_from(&ent, FLAV_MICRODESC, md_body[0]));
+  tt_u64_op(stp->n_served, OP_EQ, 1);
+
+  /* The heartbeat sums it all up in one notice... */
+  setup_capture_of_logs(LOG_NOTICE);
+  consdiffmgr_log_heartbeat();
+  tt_int_op(mock_saved_log_n_entries(), OP_EQ, 1);
+  expect_log_msg_containing("consensus diffs in ");
+  expect_log_msg_containing("Served them 2 times.");
+  teardown_capture_of_logs();
+  /* ... and gives the details for each method at info level. */
+  setup_capture_of_logs(LOG_INFO);
+  consdiffmgr_log_heartbeat();
+  tt_int_op(mock_saved_log_n_entries(), OP_GT, 2);
+  expect_log_msg_containing("consensus diffs with gzipped in ");
+
+ done:
+  teardown_capture_of_logs();
+  UNMOCK(cpuworker_queue_work);
+  for (i = 0; i < 2; ++i) {
+    tor_free(md_body[i]);
+    networkstatus_vote_free(md_ns[i]);
+  }
+}
+
 static void
 test_consdiffmgr_cleanup_old(void *arg)
 {
@@ -883,6 +982,7 @@ struct testcase_t consdiffmgr_tests[] = {
   TEST(diff_rules),
   TEST(diff_failure),
   TEST(diff_pending),
+  TEST(compress_levels),
   TEST(cleanup_old),
   TEST(cleanup_bad_valid_after),
   TEST(cleanup_no_valid_after),
@@ -662,6 +662,80 @@ test_container_digestset(void *arg)
   smartlist_free(included);
 }
 
+/** Run unit tests for count-min sketches. */
+static void
+test_container_cmsketch(void *arg)
+{
+  cmsketch_t *sketch = NULL;
+  uint32_t i, key;
+  unsigned n_over = 0;
+
+  (void)arg;
+  sketch = cmsketch_new(4, 1000);
+  tt_uint_op(sketch->mask, OP_EQ, 1023);
+
+  /* One heavy key among many light ones. */
+  key = 0;
+  for (i = 0; i < 500; ++i)
+    tt_uint_op(cmsketch_add(sketch, &key, sizeof(key)), OP_EQ, i + 1);
+  for (key = 1; key <= 2000; ++key)
+    cmsketch_add(sketch, &key, sizeof(key));
+
+  /* Estimates are never too low, and rarely much too high. */
+  key = 0;
+  tt_uint_op(cmsketch_estimate(sketch, &key, sizeof(key)), OP_GE, 500);
+  tt_uint_op(cmsketch_estimate(sketch, &key, sizeof(key)), OP_LE, 510);
+  for (key = 1; key <= 2000; ++key) {
+    unsigned est = cmsketch_estimate(sketch, &key, sizeof(key));
+    tt_uint_op(est, OP_GE, 1);
+    if (est > 3)
+      ++n_over;
+  }
+  tt_uint_op(n_over, OP_LT, 100);
+
+  /* Decaying halves the counts. */
+  cmsketch_decay(sketch);
+  key = 0;
+  tt_uint_op(cmsketch_estimate(sketch, &key, sizeof(key)), OP_GE, 250);
+  tt_uint_op(cmsketch_estimate(sketch, &key, sizeof(key)), OP_LE, 255);
+
+ done:
+  cmsketch_free(sketch);
+}
+
+/** Run unit tests for HyperLogLog counters. */
+static void
+test_container_hll(void *arg)
+{
+  hll_t *hll = hll_new();
+  uint32_t i, j;
+  uint64_t est;
+
+  (void)arg;
+  tt_u64_op(hll_estimate(hll), OP_EQ, 0);
+
+  /* Small counts are close to exact, and repeats don't count. */
+  for (j = 0; j < 3; ++j)
+    for (i = 0; i < 20; ++i)
+      hll_add(hll, &i, sizeof(i));
+  est = hll_estimate(hll);
+  tt_u64_op(est, OP_GE, 16);
+  tt_u64_op(est, OP_LE, 22);
+
+  /* Large ones are within a few standard errors. */
+  for (i = 20; i < 100000; ++i)
+    hll_add(hll, &i, sizeof(i));
+  est = hll_estimate(hll);
+  tt_u64_op(est, OP_GE, 85000);
+  tt_u64_op(est, OP_LE, 115000);
+
+  hll_clear(hll);
+  tt_u64_op(hll_estimate(hll), OP_EQ, 0);
+
+ done:
+  hll_free(hll);
+}
+
 typedef struct pq_entry_t {
   const char *val;
   int idx;
@@ -1284,6 +1358,8 @@ struct testcase_t container_tests[] = {
   CONTAINER(smartlist_ints_eq, 0),
   CONTAINER_LEGACY(bitarray),
   CONTAINER_LEGACY(digestset),
+  CONTAINER(cmsketch, 0),
+  CONTAINER(hll, 0),
   CONTAINER_LEGACY(strmap),
   CONTAINER_LEGACY(pqueue),
   CONTAINER_LEGACY(order_functions),
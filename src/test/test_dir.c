@@ -36,11 +36,13 @@
 #include "routerparse.h"
 #include "routerset.h"
 #include "shared_random_state.h"
+#include "workqueue.h"
 #include "test.h"
 #include "test_dir_common.h"
 #include "torcert.h"
 #include "relay.h"
 #include "log_test_helpers.h"
+#include "test_helpers.h"
 
 #define NS_MODULE dir
 
@@ -2741,6 +2743,121 @@ test_dir_v3_networkstatus(void *arg)
                        test_routerstatus_for_v3ns);
 }
 
+/** Helper: add a signature on <b>con</b> by the authority with certificate
+ * <b>cert_str</b> and signing key <b>key_str</b>, making the authority a
+ * trusted one and its certificate known.  Return the signature. */
+static document_signature_t *
+add_test_consensus_signature(networkstatus_t *con, const char *nickname,
+                             const char *cert_str, const char *key_str)
+{
+  authority_cert_t *cert = authority_cert_parse_from_string(cert_str, NULL);
+  crypto_pk_t *key = crypto_pk_new();
+  networkstatus_voter_info_t *voter;
+  document_signature_t *sig = NULL;
+  char digest[DIGEST_LEN];
+
+  tt_assert(cert);
+  tt_int_op(0, OP_EQ, crypto_pk_read_private_key_from_string(key, key_str,
+                                                             -1));
+  tt_int_op(0, OP_EQ, crypto_pk_get_digest(cert->identity_key, digest));
+  dir_server_add(trusted_dir_server_new(nickname, "127.0.0.1", 80, 443,
+                                        NULL, digest,
+                                        cert->cache_info.identity_digest,
+                                        V3_DIRINFO, 1.0));
+  tt_int_op(0, OP_EQ, trusted_dirs_load_certs_from_string(cert_str,
+                                  TRUSTED_DIRS_CERTS_SRC_FROM_STORE, 0, NULL));
+  /* The test certificates expired long ago. */
+  authority_cert_get_by_digests(cert->cache_info.identity_digest,
+                                cert->signing_key_digest)->expires = TIME_MAX;
+
+  voter = tor_malloc_zero(sizeof(networkstatus_voter_info_t));
+  voter->nickname = tor_strdup(nickname);
+  voter->address = tor_strdup("127.0.0.1");
+  memcpy(voter->identity_digest, cert->cache_info.identity_digest,
+         DIGEST_LEN);
+  voter->sigs = smartlist_new();
+  smartlist_add(con->voters, voter);
+
+  sig = tor_malloc_zero(sizeof(document_signature_t));
+  sig->alg = DIGEST_SHA256;
+  memcpy(sig->identity_digest, cert->cache_info.identity_digest, DIGEST_LEN);
+  memcpy(sig->signing_key_digest, cert->signing_key_digest, DIGEST_LEN);
+  sig->signature = tor_malloc(crypto_pk_keysize(key));
+  sig->signature_len = crypto_pk_private_sign(key, sig->signature,
+                                              crypto_pk_keysize(key),
+                                              con->digests.d[DIGEST_SHA256],
+                                              DIGEST256_LEN);
+  smartlist_add(voter->sigs, sig);
+
+ done:
+  authority_cert_free(cert);
+  crypto_pk_free(key);
+  return sig;
+}
+
+#define CHECKED(sig) ((sig)->good_signature || (sig)->bad_signature)
+
+static void
+test_dir_check_consensus_signature_lazily(void *arg)
+{
+  networkstatus_t *con = tor_malloc_zero(sizeof(networkstatus_t));
+  document_signature_t *sig1, *sig2, *sig3;
+  (void)arg;
+
+  clear_dir_servers();
+  routerlist_free_all();
+
+  con->type = NS_TYPE_CONSENSUS;
+  con->voters = smartlist_new();
+  crypto_rand(con->digests.d[DIGEST_SHA256], DIGEST256_LEN);
+  sig1 = add_test_consensus_signature(con, "auth1", AUTHORITY_CERT_1,
+                                      AUTHORITY_SIGNKEY_1);
+  sig2 = add_test_consensus_signature(con, "auth2", AUTHORITY_CERT_2,
+                                      AUTHORITY_SIGNKEY_2);
+  sig3 = add_test_consensus_signature(con, "auth3", AUTHORITY_CERT_3,
+                                      AUTHORITY_SIGNKEY_3);
+  tt_assert(sig1 && sig2 && sig3);
+  tt_int_op(get_n_authorities(V3_DIRINFO), OP_EQ, 3);
+
+  /* Once two of the three authorities have signed, we don't check the
+   * third, this time or next time. */
+  tt_int_op(0, OP_EQ,
+            networkstatus_check_consensus_signature_lazily(con, -1));
+  tt_assert(sig1->good_signature);
+  tt_assert(sig2->good_signature);
+  tt_assert(! CHECKED(sig3));
+  tt_int_op(0, OP_EQ,
+            networkstatus_check_consensus_signature_lazily(con, -1));
+  tt_assert(! CHECKED(sig3));
+
+  /* A full check gets the rest. */
+  tt_int_op(1, OP_EQ, networkstatus_check_consensus_signature(con, -1));
+  tt_assert(sig3->good_signature);
+
+  /* A bad signature doesn't stop us from looking for good ones. */
+  sig1->good_signature = sig2->good_signature = sig3->good_signature = 0;
+  sig1->signature[0] ^= 0x80;
+  tt_int_op(0, OP_EQ,
+            networkstatus_check_consensus_signature_lazily(con, -1));
+  tt_assert(sig1->bad_signature);
+  tt_assert(sig2->good_signature);
+  tt_assert(sig3->good_signature);
+
+  /* And we still refuse a consensus without enough good ones. */
+  sig1->bad_signature = sig2->good_signature = sig3->good_signature = 0;
+  sig2->signature[0] ^= 0x80;
+  tt_int_op(-2, OP_EQ,
+            networkstatus_check_consensus_signature_lazily(con, -1));
+  tt_assert(sig3->good_signature);
+
+ done:
+  networkstatus_vote_free(con);
+  clear_dir_servers();
+  routerlist_free_all();
+}
+
+#undef CHECKED
+
 static void
 test_dir_scale_bw(void *testdata)
 {
@@ -6090,6 +6207,105 @@ test_dir_assumed_flags(void *arg)
   routerstatus_free(rs);
 }
 
+/* Parse a consensus-sized run of routerstatus entries, big enough to be
+ * tokenized in chunks, and make sure we get the same answers as we would
+ * parsing them one at a time.  If <b>arg</b> is "threaded", tokenize the
+ * chunks on a threadpool. */
+static void
+test_dir_parse_routerstatuses(void *arg)
+{
+  threadpool_t *pool = NULL;
+  smartlist_t *chunks = smartlist_new();
+  smartlist_t *out = smartlist_new();
+  smartlist_t *tokens = smartlist_new();
+  memarea_t *area = memarea_new();
+  routerstatus_t *rs = NULL;
+  char *body = NULL;
+  const char *end;
+  const int n_entries = 600;
+  int i, n_good = 0;
+
+  for (i = 0; i < n_entries; ++i) {
+    char id[DIGEST_LEN], md[DIGEST256_LEN];
+    char id64[BASE64_DIGEST_LEN+1], md64[BASE64_DIGEST256_LEN+1];
+    memset(id, 0, sizeof(id));
+    set_uint32(id, htonl(i));
+    memset(md, i & 0xff, sizeof(md));
+    digest_to_base64(id64, id);
+    digest256_to_base64(md64, md);
+    if (i == 100) {
+      /* Fails in the tokenizer: too few arguments to "r". */
+      smartlist_add_asprintf(chunks, "r bad%d %s\n", i, id64);
+    } else if (i == 300) {
+      /* Tokenizes fine, but has a bad address. */
+      smartlist_add_asprintf(chunks,
+               "r bad%d %s 2015-08-30 12:00:00 999.1.1.1 9001 0\n"
+               "m %s\ns Fast Running Valid\n", i, id64, md64);
+    } else {
+      smartlist_add_asprintf(chunks,
+               "r node%d %s 2015-08-30 12:00:00 10.0.%d.%d 9001 0\n"
+               "m %s\n"
+               "s Fast Running Stable Valid\n"
+               "v Tor 0.3.2.10\n"
+               "pr Cons=1-2 Desc=1-2 DirCache=1 HSDir=1 HSIntro=3-4 "
+               "HSRend=1-2 Link=1-5 LinkAuth=1,3 Microdesc=1-2 Relay=1-2\n"
+               "w Bandwidth=%d\n",
+               i, id64, i >> 8, i & 0xff, md64, i + 1);
+      ++n_good;
+    }
+  }
+  smartlist_add_strdup(chunks, "directory-footer\n");
+  body = smartlist_join_strings(chunks, "", 0, NULL);
+  tt_int_op(strlen(body), OP_GT, 64*1024);
+
+  if (arg && !strcmp(arg, "threaded"))
+    pool = helper_start_cpuworkers(2);
+  end = consensus_parse_routerstatuses(body, out, 26, FLAV_MICRODESC);
+  helper_stop_cpuworkers(pool);
+  pool = NULL;
+  tt_str_op(end, OP_EQ, "directory-footer\n");
+  tt_int_op(smartlist_len(out), OP_EQ, n_good);
+
+  /* Compare with the results of parsing each entry alone. */
+  n_good = 0;
+  SMARTLIST_FOREACH_BEGIN(chunks, const char *, chunk) {
+    const char *cp = chunk;
+    if (chunk_sl_idx == n_entries)
+      break;
+    rs = routerstatus_parse_entry_from_string(area, &cp, tokens, NULL, NULL,
+                                              26, FLAV_MICRODESC);
+    if (chunk_sl_idx == 100 || chunk_sl_idx == 300) {
+      tt_ptr_op(rs, OP_EQ, NULL);
+      continue;
+    }
+    tt_assert(rs);
+    routerstatus_t *rs2 = smartlist_get(out, n_good++);
+    tt_str_op(rs2->nickname, OP_EQ, rs->nickname);
+    tt_mem_op(rs2->identity_digest, OP_EQ, rs->identity_digest, DIGEST_LEN);
+    tt_mem_op(rs2->descriptor_digest, OP_EQ, rs->descriptor_digest,
+              DIGEST256_LEN);
+    tt_int_op(rs2->addr, OP_EQ, rs->addr);
+    tt_int_op(rs2->bandwidth_kb, OP_EQ, chunk_sl_idx + 1);
+    tt_int_op(rs2->is_stable, OP_EQ, 1);
+    tt_int_op(rs2->supports_extend2_cells, OP_EQ,
+              rs->supports_extend2_cells);
+    tt_int_op(rs2->dl_status.backoff, OP_EQ, DL_SCHED_RANDOM_EXPONENTIAL);
+    routerstatus_free(rs);
+    rs = NULL;
+  } SMARTLIST_FOREACH_END(chunk);
+
+ done:
+  helper_stop_cpuworkers(pool);
+  routerstatus_free(rs);
+  SMARTLIST_FOREACH(out, routerstatus_t *, r, routerstatus_free(r));
+  smartlist_free(out);
+  SMARTLIST_FOREACH(chunks, char *, c, tor_free(c));
+  smartlist_free(chunks);
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  tor_free(body);
+}
+
 static void
 test_dir_post_parsing(void *arg)
 {
@@ -6201,6 +6417,7 @@ struct testcase_t dir_tests[] = {
   DIR_LEGACY(param_voting),
   DIR(param_voting_lookup, 0),
   DIR_LEGACY(v3_networkstatus),
+  DIR(check_consensus_signature_lazily, TT_FORK),
   DIR(random_weighted, 0),
   DIR(scale_bw, 0),
   DIR_LEGACY(clip_unmeasured_bw_kb),
@@ -6239,6 +6456,8 @@ struct testcase_t dir_tests[] = {
   DIR_ARG(find_dl_schedule, TT_FORK, "cfr"),
   DIR_ARG(find_dl_schedule, TT_FORK, "car"),
   DIR(assumed_flags, 0),
+  DIR(parse_routerstatuses, 0),
+  DIR_ARG(parse_routerstatuses, 0, "threaded"),
   DIR(networkstatus_compute_bw_weights_v10, 0),
   DIR(platform_str, 0),
   END_OF_TESTCASES
@@ -8,6 +8,7 @@
 #define CONNECTION_PRIVATE
 #define CONFIG_PRIVATE
 #define RENDCACHE_PRIVATE
+#define DIRECTORY_PRIVATE
 
 #include "or.h"
 #include "config.h"
@@ -2569,6 +2570,117 @@ test_dir_handle_get_parse_accept_encoding(void *arg)
   ;
 }
 
+static void
+test_dir_handle_get_accept_encoding_header(void *arg)
+{
+  (void)arg;
+  const unsigned B_LZMA_DICT = 1u << LZMA_DICT_METHOD;
+  const unsigned B_ZSTD_DICT = 1u << ZSTD_DICT_METHOD;
+  char *plain = accept_encoding_header(0);
+  char *with_dict = accept_encoding_header(1);
+  unsigned encodings;
+
+  /* Without a diff to ask for, we never offer the dictionary methods. */
+  encodings = parse_accept_encoding_header(plain);
+  tt_uint_op(encodings & (B_LZMA_DICT|B_ZSTD_DICT), OP_EQ, 0);
+  tt_assert(encodings & (1u << ZLIB_METHOD));
+
+  /* With one, we offer the ones we support first, then everything else. */
+  encodings = parse_accept_encoding_header(with_dict);
+  tt_int_op(!!(encodings & B_LZMA_DICT), OP_EQ,
+            tor_compress_supports_method(LZMA_DICT_METHOD));
+  tt_int_op(!!(encodings & B_ZSTD_DICT), OP_EQ,
+            tor_compress_supports_method(ZSTD_DICT_METHOD));
+  tt_assert(!strcmpend(with_dict, plain));
+  if (encodings & B_LZMA_DICT)
+    tt_assert(!strcmpstart(with_dict, "x-tor-lzma-dict1, "));
+
+ done:
+  tor_free(plain);
+  tor_free(with_dict);
+}
+
+/** Bitfield of the compression methods that
+ * mock_consdiffmgr_find_diff_from() has a diff for. */
+static unsigned mock_diff_methods = 0;
+/** Stands in for a consensus cache entry in find_best_diff tests. */
+static int mock_diff_entry;
+
+static consdiff_status_t
+mock_consdiffmgr_find_diff_from(struct consensus_cache_entry_t **entry_out,
+                                consensus_flavor_t flavor,
+                                int digest_type,
+                                const uint8_t *digest,
+                                size_t digestlen,
+                                compress_method_t method)
+{
+  (void)flavor;
+  (void)digest_type;
+  (void)digest;
+  (void)digestlen;
+  if (0 == (mock_diff_methods & (1u << method)))
+    return CONSDIFF_NOT_FOUND;
+  *entry_out = (struct consensus_cache_entry_t *)&mock_diff_entry;
+  return CONSDIFF_AVAILABLE;
+}
+
+static void
+test_dir_handle_get_find_best_diff(void *arg)
+{
+  (void)arg;
+  const unsigned B_NONE = 1u << NO_METHOD;
+  const unsigned B_ZLIB = 1u << ZLIB_METHOD;
+  const unsigned B_GZIP = 1u << GZIP_METHOD;
+  const unsigned B_LZMA = 1u << LZMA_METHOD;
+  const unsigned B_LZMA_DICT = 1u << LZMA_DICT_METHOD;
+  const unsigned B_ZSTD_DICT = 1u << ZSTD_DICT_METHOD;
+  smartlist_t *digests = smartlist_new();
+  uint8_t digest[DIGEST256_LEN];
+  compress_method_t method = UNKNOWN_METHOD;
+
+  memset(digest, 0x5a, sizeof(digest));
+  smartlist_add(digests, digest);
+  MOCK(consdiffmgr_find_diff_from, mock_consdiffmgr_find_diff_from);
+  mock_diff_methods = B_NONE|B_ZLIB|B_GZIP|B_LZMA|B_LZMA_DICT|B_ZSTD_DICT;
+
+  /* A client that didn't ask for a dictionary method doesn't get one, even
+   * though we have them. */
+  tt_ptr_op(find_best_diff(digests, FLAV_MICRODESC,
+                           B_NONE|B_ZLIB|B_GZIP|B_LZMA, &method),
+            OP_EQ, &mock_diff_entry);
+  tt_int_op(method, OP_EQ, LZMA_METHOD);
+
+  /* One that did gets the dictionary method it asked for. */
+  tt_ptr_op(find_best_diff(digests, FLAV_MICRODESC,
+                           B_NONE|B_ZLIB|B_LZMA|B_ZSTD_DICT, &method),
+            OP_EQ, &mock_diff_entry);
+  tt_int_op(method, OP_EQ, ZSTD_DICT_METHOD);
+  tt_ptr_op(find_best_diff(digests, FLAV_MICRODESC,
+                           B_NONE|B_ZLIB|B_LZMA|B_LZMA_DICT|B_ZSTD_DICT,
+                           &method),
+            OP_EQ, &mock_diff_entry);
+  tt_int_op(method, OP_EQ, LZMA_DICT_METHOD);
+
+  /* If we don't have a diff with that method, we fall back. */
+  mock_diff_methods = B_NONE|B_ZLIB;
+  tt_ptr_op(find_best_diff(digests, FLAV_MICRODESC,
+                           B_NONE|B_LZMA|B_LZMA_DICT, &method),
+            OP_EQ, &mock_diff_entry);
+  tt_int_op(method, OP_EQ, NO_METHOD);
+  mock_diff_methods = B_ZLIB;
+  tt_ptr_op(find_best_diff(digests, FLAV_MICRODESC,
+                           B_NONE|B_LZMA_DICT, &method),
+            OP_EQ, &mock_diff_entry);
+  tt_int_op(method, OP_EQ, ZLIB_METHOD);
+  mock_diff_methods = 0;
+  tt_ptr_op(find_best_diff(digests, FLAV_MICRODESC,
+                           B_NONE|B_LZMA_DICT, &method), OP_EQ, NULL);
+
+ done:
+  UNMOCK(consdiffmgr_find_diff_from);
+  smartlist_free(digests);
+}
+
 #define DIR_HANDLE_CMD(name,flags) \
   { #name, test_dir_handle_get_##name, (flags), NULL, NULL }
 
@@ -2628,6 +2740,8 @@ struct testcase_t dir_handle_get_tests[] = {
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures_busy, 0),
   DIR_HANDLE_CMD(status_vote_next_consensus_signatures, 0),
   DIR_HANDLE_CMD(parse_accept_encoding, 0),
+  DIR_HANDLE_CMD(accept_encoding_header, 0),
+  DIR_HANDLE_CMD(find_best_diff, 0),
   END_OF_TESTCASES
 };
 
@@ -5,7 +5,10 @@
 
 #include "dns.h"
 #include "connection.h"
+#include "policies.h"
 #include "router.h"
+#include "routerparse.h"
+#include <event2/dns.h>
 
 #define NS_MODULE dns
 
@@ -583,11 +586,11 @@ static cached_resolve_t *last_resolve = NULL;
 
 static int
 NS(set_exitconn_info_from_resolve)(edge_connection_t *exitconn,
-                                   const cached_resolve_t *resolve,
+                                   cached_resolve_t *resolve,
                                    char **hostname_out)
 {
   last_exitconn = exitconn;
-  last_resolve = (cached_resolve_t *)resolve;
+  last_resolve = resolve;
 
   (void)hostname_out;
 
@@ -728,6 +731,268 @@ NS(test_main)(void *arg)
 
 #undef NS_SUBMODULE
 
+#define NS_SUBMODULE cache_lru
+
+/* Given some cached answers, we want a cache hit to make an answer the most
+ * recently used one, and eviction and the OOM handler to drop the least
+ * recently used answers first while keeping the memory accounting right.
+ */
+static int
+NS(router_my_exit_policy_is_reject_star)(void)
+{
+  return 0;
+}
+
+static int
+NS(set_exitconn_info_from_resolve)(edge_connection_t *exitconn,
+                                   cached_resolve_t *resolve,
+                                   char **hostname_out)
+{
+  (void)exitconn;
+  (void)resolve;
+  (void)hostname_out;
+  return 0;
+}
+
+static uint64_t
+getinfo_u64(const char *question)
+{
+  char *answer = NULL;
+  const char *errmsg = NULL;
+  uint64_t v = 0;
+  tt_int_op(0, OP_EQ, getinfo_helper_dns(NULL, question, &answer, &errmsg));
+  tt_assert(answer);
+  v = tor_parse_uint64(answer, 10, 0, UINT64_MAX, NULL, NULL);
+ done:
+  tor_free(answer);
+  return v;
+}
+
+static void
+NS(test_main)(void *arg)
+{
+  static const char *names[] = { "a.example", "b.example", "c.example" };
+  cached_resolve_t *entries[3];
+  cached_resolve_t query, *resolve_out = NULL;
+  edge_connection_t *exitconn = create_valid_exitconn();
+  or_circuit_t *on_circ = tor_malloc_zero(sizeof(or_circuit_t));
+  int made_pending = 0, i;
+  uint64_t hits, negative_hits, evictions;
+
+  (void)arg;
+
+  NS_MOCK(router_my_exit_policy_is_reject_star);
+  NS_MOCK(set_exitconn_info_from_resolve);
+
+  dns_init();
+
+  for (i = 0; i < 3; ++i) {
+    entries[i] = tor_malloc_zero(sizeof(cached_resolve_t));
+    entries[i]->magic = CACHED_RESOLVE_MAGIC;
+    entries[i]->state = CACHE_STATE_CACHED;
+    entries[i]->minheap_idx = -1;
+    entries[i]->expire = time(NULL) + 60 * 60;
+    strlcpy(entries[i]->address, names[i], sizeof(entries[i]->address));
+    dns_insert_cache_entry(entries[i]);
+  }
+  tt_u64_op(dns_cache_total_allocation(), OP_EQ,
+            3 * sizeof(cached_resolve_t));
+  tt_u64_op(getinfo_u64("dns/cache/entries"), OP_EQ, 3);
+
+  hits = getinfo_u64("dns/cache/hits");
+  negative_hits = getinfo_u64("dns/cache/negative-hits");
+  evictions = getinfo_u64("dns/cache/evictions");
+
+  /* Look up a.example, so that b.example is now the oldest. */
+  TO_CONN(exitconn)->address = tor_strdup(names[0]);
+  tt_int_op(0, OP_EQ, dns_resolve_impl(exitconn, 1, on_circ, NULL,
+                                       &made_pending, &resolve_out));
+  tt_int_op(made_pending, OP_EQ, 0);
+  tt_ptr_op(resolve_out, OP_EQ, entries[0]);
+  tt_u64_op(getinfo_u64("dns/cache/hits"), OP_EQ, hits + 1);
+  /* None of its lookups succeeded, so that was a negative hit. */
+  tt_u64_op(getinfo_u64("dns/cache/negative-hits"), OP_EQ,
+            negative_hits + 1);
+
+  tt_u64_op(dns_cache_evict_lru(1), OP_EQ, sizeof(cached_resolve_t));
+  strlcpy(query.address, names[1], sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, NULL);
+  strlcpy(query.address, names[0], sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, entries[0]);
+  strlcpy(query.address, names[2], sizeof(query.address));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, entries[2]);
+  tt_u64_op(dns_cache_total_allocation(), OP_EQ,
+            2 * sizeof(cached_resolve_t));
+
+  /* The OOM handler evicts answers that haven't expired if it has to. */
+  tt_u64_op(dns_cache_handle_oom(time(NULL), 1), OP_EQ,
+            sizeof(cached_resolve_t));
+  tt_ptr_op(dns_get_cache_entry(&query), OP_EQ, NULL);
+  tt_u64_op(dns_cache_handle_oom(time(NULL), 1000), OP_EQ,
+            sizeof(cached_resolve_t));
+  tt_u64_op(dns_cache_total_allocation(), OP_EQ, 0);
+  tt_u64_op(getinfo_u64("dns/cache/entries"), OP_EQ, 0);
+  tt_u64_op(getinfo_u64("dns/cache/evictions"), OP_EQ, evictions + 3);
+
+  /* Nothing left to evict. */
+  tt_u64_op(dns_cache_evict_lru(1), OP_EQ, 0);
+
+ done:
+  NS_UNMOCK(router_my_exit_policy_is_reject_star);
+  NS_UNMOCK(set_exitconn_info_from_resolve);
+  tor_free(on_circ);
+  tor_free(TO_CONN(exitconn)->address);
+  tor_free(exitconn);
+}
+
+#undef NS_SUBMODULE
+
+#define NS_SUBMODULE stats
+
+/* Given some finished upstream requests, we want GETINFO dns/stats/ to count
+ * each outcome for the right query type, and to put each latency in the
+ * right histogram bucket.
+ */
+static void
+NS(test_main)(void *arg)
+{
+  char *answer = NULL;
+  const char *errmsg = NULL;
+
+  (void)arg;
+
+  tt_int_op(dns_latency_bucket(0), OP_EQ, 0);
+  tt_int_op(dns_latency_bucket(1), OP_EQ, 1);
+  tt_int_op(dns_latency_bucket(2), OP_EQ, 2);
+  tt_int_op(dns_latency_bucket(3), OP_EQ, 2);
+  tt_int_op(dns_latency_bucket(4), OP_EQ, 3);
+  tt_int_op(dns_latency_bucket(1000), OP_EQ, 10);
+  tt_int_op(dns_latency_bucket(UINT64_MAX), OP_EQ, 15);
+
+  dns_note_request_done(DNS_IPv4_A, DNS_ERR_NONE, 1000, 1000);
+  dns_note_request_done(DNS_IPv4_A, DNS_ERR_NOTEXIST, 1000, 1003);
+  dns_note_request_done(DNS_IPv4_A, DNS_ERR_SERVERFAILED, 1000, 1003);
+  dns_note_request_done(DNS_IPv4_A, DNS_ERR_TIMEOUT, 1000, 6000);
+  dns_note_request_done(DNS_IPv4_A, DNS_ERR_FORMAT, 1000, 1001);
+  dns_note_request_done(DNS_PTR, DNS_ERR_NONE, 1000, 1001);
+  /* The clock went backwards: count the answer, but not its latency. */
+  dns_note_request_done(DNS_PTR, DNS_ERR_NONE, 1000, 999);
+
+  tt_int_op(0, OP_EQ, getinfo_helper_dns(NULL, "dns/stats/A",
+                                         &answer, &errmsg));
+  tt_str_op(answer, OP_EQ,
+            "launched=0 ok=1 nxdomain=1 servfail=1 timeout=1 other=1 "
+            "latency-ms=1,1,2,0,0,0,0,0,0,0,0,0,0,1,0,0");
+  tor_free(answer);
+  tt_int_op(0, OP_EQ, getinfo_helper_dns(NULL, "dns/stats/PTR",
+                                         &answer, &errmsg));
+  tt_str_op(answer, OP_EQ,
+            "launched=0 ok=2 nxdomain=0 servfail=0 timeout=0 other=0 "
+            "latency-ms=0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0");
+  tor_free(answer);
+  tt_int_op(0, OP_EQ, getinfo_helper_dns(NULL, "dns/stats/MX",
+                                         &answer, &errmsg));
+  tt_ptr_op(answer, OP_EQ, NULL);
+
+ done:
+  tor_free(answer);
+}
+
+#undef NS_SUBMODULE
+
+#define NS_SUBMODULE policy_verdict
+
+/* Given a cached answer, we want exit policy verdicts to be computed once
+ * per port, reused until our policy changes, and passed on to the exit
+ * connection.
+ */
+
+static routerinfo_t *mock_my_routerinfo = NULL;
+
+static const routerinfo_t *
+NS(router_get_my_routerinfo)(void)
+{
+  return mock_my_routerinfo;
+}
+
+static void
+NS(test_main)(void *arg)
+{
+  routerinfo_t ri;
+  cached_resolve_t *resolve = tor_malloc_zero(sizeof(cached_resolve_t));
+  edge_connection_t *exitconn = tor_malloc_zero(sizeof(edge_connection_t));
+  const dns_policy_verdict_t *v, *v2;
+  char *hostname = NULL;
+  int malformed = 0;
+  uint64_t hits;
+
+  (void)arg;
+
+  memset(&ri, 0, sizeof(ri));
+  ri.exit_policy = smartlist_new();
+  smartlist_add(ri.exit_policy,
+     router_parse_addr_policy_item_from_string("reject *4:25", -1,
+                                               &malformed));
+  smartlist_add(ri.exit_policy,
+     router_parse_addr_policy_item_from_string("accept *4:*", -1,
+                                               &malformed));
+  NS_MOCK(router_get_my_routerinfo);
+
+  strlcpy(resolve->address, "www.example.com", sizeof(resolve->address));
+  resolve->state = CACHE_STATE_CACHED;
+  resolve->res_status_ipv4 = RES_STATUS_DONE_OK;
+  resolve->result_ipv4.addr_ipv4 = 0x01020304;
+  resolve->res_status_ipv6 = RES_STATUS_DONE_ERR;
+
+  /* No descriptor, no verdict. */
+  tt_ptr_op(dns_get_policy_verdict(resolve, 80), OP_EQ, NULL);
+  mock_my_routerinfo = &ri;
+
+  hits = getinfo_u64("dns/cache/verdict-hits");
+  v = dns_get_policy_verdict(resolve, 80);
+  tt_assert(v);
+  tt_int_op(v->ipv4_accepted, OP_EQ, 1);
+  tt_int_op(v->ipv6_accepted, OP_EQ, 0);
+  tt_u64_op(getinfo_u64("dns/cache/verdict-hits"), OP_EQ, hits);
+  v2 = dns_get_policy_verdict(resolve, 25);
+  tt_assert(v2);
+  tt_ptr_op(v2, OP_NE, v);
+  tt_int_op(v2->ipv4_accepted, OP_EQ, 0);
+  tt_ptr_op(dns_get_policy_verdict(resolve, 80), OP_EQ, v);
+  tt_u64_op(getinfo_u64("dns/cache/verdict-hits"), OP_EQ, hits + 1);
+
+  /* A verdict from before our policy changed gets recomputed. */
+  resolve->policy_verdicts[0].policy_generation =
+    router_get_my_exit_policy_generation() + 1;
+  resolve->policy_verdicts[0].ipv4_accepted = 0;
+  v = dns_get_policy_verdict(resolve, 80);
+  tt_int_op(v->ipv4_accepted, OP_EQ, 1);
+  tt_int_op(v->policy_generation, OP_EQ,
+            router_get_my_exit_policy_generation());
+  tt_u64_op(getinfo_u64("dns/cache/verdict-hits"), OP_EQ, hits + 1);
+
+  /* The verdict on the answer we give is passed on to the connection. */
+  exitconn->base_.purpose = EXIT_PURPOSE_CONNECT;
+  exitconn->base_.port = 80;
+  tt_int_op(set_exitconn_info_from_resolve(exitconn, resolve, &hostname),
+            OP_EQ, 1);
+  tt_int_op(exitconn->exit_policy_accepted, OP_EQ, 1);
+  exitconn->base_.port = 25;
+  tt_int_op(set_exitconn_info_from_resolve(exitconn, resolve, &hostname),
+            OP_EQ, 1);
+  tt_int_op(exitconn->exit_policy_accepted, OP_EQ, 0);
+  tt_u64_op(getinfo_u64("dns/cache/verdict-hits"), OP_EQ, hits + 3);
+
+ done:
+  NS_UNMOCK(router_get_my_routerinfo);
+  mock_my_routerinfo = NULL;
+  addr_policy_list_free(ri.exit_policy);
+  tor_free(resolve);
+  tor_free(exitconn);
+}
+
+#undef NS_SUBMODULE
+
 struct testcase_t dns_tests[] = {
    TEST_CASE(clip_ttl),
    TEST_CASE(resolve),
@@ -738,6 +1003,9 @@ struct testcase_t dns_tests[] = {
    TEST_CASE_ASPECT(resolve_impl, cache_hit_pending),
    TEST_CASE_ASPECT(resolve_impl, cache_hit_cached),
    TEST_CASE_ASPECT(resolve_impl, cache_miss),
+   TEST_CASE(cache_lru),
+   TEST_CASE(stats),
+   TEST_CASE(policy_verdict),
    END_OF_TESTCASES
 };
 
@@ -8,7 +8,9 @@
 #include "or.h"
 #include "dos.h"
 #include "circuitlist.h"
+#include "config.h"
 #include "geoip.h"
+#include "main.h"
 #include "channel.h"
 #include "microdesc.h"
 #include "networkstatus.h"
@@ -213,11 +215,9 @@ test_dos_bucket_refill(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, addr, NULL, now);
   dos_new_client_conn(&or_conn);
 
-  /* Fetch this client from the geoip cache and get its DoS structs */
-  clientmap_entry_t *entry = geoip_lookup_client(addr, NULL,
-                                                 GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  dos_client_stats_t* dos_stats = &entry->dos_stats;
+  /* Fetch this client from the client table and get its DoS structs */
+  dos_client_stats_t* dos_stats = dos_client_table_lookup(addr);
+  tt_assert(dos_stats);
   /* Check that the circuit bucket is still uninitialized */
   tt_uint_op(dos_stats->cc_stats.circuit_bucket, OP_EQ, 0);
 
@@ -416,7 +416,7 @@ test_dos_bucket_refill(void *arg)
 static void
 test_known_relay(void *arg)
 {
-  clientmap_entry_t *entry = NULL;
+  dos_client_stats_t *stats = NULL;
   routerstatus_t *rs = NULL; microdesc_t *md = NULL; routerinfo_t *ri = NULL;
 
   (void) arg;
@@ -459,10 +459,9 @@ test_known_relay(void *arg)
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
-  /* We should have a count of 0. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 0);
+  /* We should not be tracking it at all. */
+  stats = dos_client_table_lookup(&or_conn.real_addr);
+  tt_ptr_op(stats, OP_EQ, NULL);
 
   /* To make sure that his is working properly, make a unknown client
    * connection and see if we do get it. */
@@ -470,10 +469,10 @@ test_known_relay(void *arg)
   geoip_note_client_seen(GEOIP_CLIENT_CONNECT, &or_conn.real_addr, NULL, 0);
   dos_new_client_conn(&or_conn);
   dos_new_client_conn(&or_conn);
-  entry = geoip_lookup_client(&or_conn.real_addr, NULL, GEOIP_CLIENT_CONNECT);
-  tt_assert(entry);
+  stats = dos_client_table_lookup(&or_conn.real_addr);
+  tt_assert(stats);
   /* We should have a count of 2. */
-  tt_uint_op(entry->dos_stats.concurrent_count, OP_EQ, 2);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 2);
 
  done:
   routerstatus_free(rs); routerinfo_free(ri); microdesc_free(md);
@@ -486,12 +485,216 @@ test_known_relay(void *arg)
   UNMOCK(get_param_cc_enabled);
 }
 
+/* Set <b>or_conn</b>'s address to the <b>i</b>th address of 10.0.0.0/8. */
+static void
+set_client_table_test_addr(or_connection_t *or_conn, uint32_t i)
+{
+  tor_addr_from_ipv4h(&or_conn->real_addr, 0x0a000000 | i);
+}
+
+/* Test that the client table grows, keeps finding its entries as others
+ * come and go, and stays within its memory bound. */
+static void
+test_dos_client_table(void *arg)
+{
+  or_connection_t or_conn;
+  dos_client_stats_t *stats;
+  uint32_t i;
+  int n_tracked;
+
+  (void) arg;
+
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  get_options_mutable()->DoSClientTableMaxMem = 32 << 20;
+  dos_init();
+  memset(&or_conn, 0, sizeof(or_conn));
+
+  /* Well past the initial size: everybody gets in. */
+  for (i = 1; i <= 3000; ++i) {
+    set_client_table_test_addr(&or_conn, i);
+    or_conn.tracked_for_dos_mitigation = 0;
+    dos_new_client_conn(&or_conn);
+    tt_uint_op(or_conn.tracked_for_dos_mitigation, OP_EQ, 1);
+  }
+  /* Close the even ones. Their entries are now stale. */
+  for (i = 2; i <= 3000; i += 2) {
+    set_client_table_test_addr(&or_conn, i);
+    or_conn.tracked_for_dos_mitigation = 1;
+    dos_close_client_conn(&or_conn);
+  }
+  /* New clients make the table drop stale entries as it goes... */
+  for (i = 3001; i <= 6000; ++i) {
+    set_client_table_test_addr(&or_conn, i);
+    dos_new_client_conn(&or_conn);
+  }
+  /* ... but never ones with connections. */
+  for (i = 1; i <= 3000; i += 2) {
+    set_client_table_test_addr(&or_conn, i);
+    stats = dos_client_table_lookup(&or_conn.real_addr);
+    tt_assert(stats);
+    tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+  }
+  dos_free_all();
+
+  /* Now with the smallest possible table: 1024 slots, 768 of them used. */
+  get_options_mutable()->DoSClientTableMaxMem = 0;
+  dos_init();
+  for (i = 1; i <= 768; ++i) {
+    set_client_table_test_addr(&or_conn, i);
+    or_conn.tracked_for_dos_mitigation = 0;
+    dos_new_client_conn(&or_conn);
+    tt_uint_op(or_conn.tracked_for_dos_mitigation, OP_EQ, 1);
+  }
+  /* Everybody has a connection, so a new address can't get in. */
+  set_client_table_test_addr(&or_conn, 769);
+  or_conn.tracked_for_dos_mitigation = 0;
+  dos_new_client_conn(&or_conn);
+  tt_uint_op(or_conn.tracked_for_dos_mitigation, OP_EQ, 0);
+  tt_ptr_op(dos_client_table_lookup(&or_conn.real_addr), OP_EQ, NULL);
+
+  /* Once they have all gone, new addresses take their place. */
+  for (i = 1; i <= 768; ++i) {
+    set_client_table_test_addr(&or_conn, i);
+    or_conn.tracked_for_dos_mitigation = 1;
+    dos_close_client_conn(&or_conn);
+  }
+  n_tracked = 0;
+  for (i = 1000; i < 1100; ++i) {
+    set_client_table_test_addr(&or_conn, i);
+    or_conn.tracked_for_dos_mitigation = 0;
+    dos_new_client_conn(&or_conn);
+    n_tracked += or_conn.tracked_for_dos_mitigation;
+  }
+  tt_int_op(n_tracked, OP_GE, 95);
+
+ done:
+  dos_free_all();
+  UNMOCK(get_param_conn_enabled);
+}
+
+/* Test that freeing the client table forgets which connections it was
+ * tracking, so that closing them doesn't touch a later table. */
+static void
+test_dos_client_table_free_reinit(void *arg)
+{
+  or_connection_t old_conn, new_conn;
+  dos_client_stats_t *stats;
+
+  (void) arg;
+
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  memset(&old_conn, 0, sizeof(old_conn));
+  memset(&new_conn, 0, sizeof(new_conn));
+  old_conn.base_.magic = new_conn.base_.magic = OR_CONNECTION_MAGIC;
+  old_conn.base_.type = new_conn.base_.type = CONN_TYPE_OR;
+  set_client_table_test_addr(&old_conn, 1);
+  set_client_table_test_addr(&new_conn, 1);
+  smartlist_add(get_connection_array(), TO_CONN(&old_conn));
+  smartlist_add(get_connection_array(), TO_CONN(&new_conn));
+
+  dos_init();
+  dos_new_client_conn(&old_conn);
+  tt_uint_op(old_conn.tracked_for_dos_mitigation, OP_EQ, 1);
+
+  /* As when we stop and start being a relay again. */
+  dos_free_all();
+  tt_uint_op(old_conn.tracked_for_dos_mitigation, OP_EQ, 0);
+  dos_init();
+
+  dos_new_client_conn(&new_conn);
+  tt_uint_op(new_conn.tracked_for_dos_mitigation, OP_EQ, 1);
+  stats = dos_client_table_lookup(&new_conn.real_addr);
+  tt_assert(stats);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+
+  /* The old connection mustn't count against the new one. */
+  dos_close_client_conn(&old_conn);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+
+  setup_full_capture_of_logs(LOG_WARN);
+  dos_close_client_conn(&new_conn);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 0);
+  expect_no_log_entry();
+
+ done:
+  teardown_capture_of_logs();
+  smartlist_remove(get_connection_array(), TO_CONN(&old_conn));
+  smartlist_remove(get_connection_array(), TO_CONN(&new_conn));
+  dos_free_all();
+  UNMOCK(get_param_conn_enabled);
+}
+
+/* Test that with approximate client statistics, a full client table only
+ * admits the addresses that keep connecting. */
+static void
+test_dos_client_table_approx(void *arg)
+{
+  or_connection_t or_conn;
+  dos_client_stats_t *stats;
+  uint32_t i;
+  int n_tracked;
+
+  (void) arg;
+
+  MOCK(get_param_conn_enabled, mock_enable_dos_protection);
+  get_options_mutable()->DoSClientTableMaxMem = 0;
+  get_options_mutable()->ApproximateClientStatistics = 1;
+  update_approx_time(1281533250);
+  dos_init();
+  memset(&or_conn, 0, sizeof(or_conn));
+
+  /* Fill the smallest table with clients that have gone, but whose entries
+   * still hold an empty circuit bucket and so can't just be dropped. */
+  for (i = 1; i <= 768; ++i) {
+    set_client_table_test_addr(&or_conn, i);
+    or_conn.tracked_for_dos_mitigation = 0;
+    dos_new_client_conn(&or_conn);
+    tt_uint_op(or_conn.tracked_for_dos_mitigation, OP_EQ, 1);
+    dos_close_client_conn(&or_conn);
+    stats = dos_client_table_lookup(&or_conn.real_addr);
+    tt_assert(stats);
+    stats->cc_stats.circuit_bucket = 0;
+    stats->cc_stats.last_circ_bucket_refill_ts = approx_time();
+  }
+
+  /* A flood of one-off addresses doesn't get in... */
+  n_tracked = 0;
+  for (i = 1000; i < 1500; ++i) {
+    set_client_table_test_addr(&or_conn, i);
+    or_conn.tracked_for_dos_mitigation = 0;
+    dos_new_client_conn(&or_conn);
+    n_tracked += or_conn.tracked_for_dos_mitigation;
+  }
+  tt_int_op(n_tracked, OP_LE, 5);
+
+  /* ... but an address that keeps connecting does. */
+  set_client_table_test_addr(&or_conn, 2000);
+  or_conn.tracked_for_dos_mitigation = 0;
+  for (i = 0; i < 3 && !or_conn.tracked_for_dos_mitigation; ++i) {
+    dos_new_client_conn(&or_conn);
+  }
+  tt_uint_op(or_conn.tracked_for_dos_mitigation, OP_EQ, 1);
+  stats = dos_client_table_lookup(&or_conn.real_addr);
+  tt_assert(stats);
+  tt_uint_op(stats->concurrent_count, OP_EQ, 1);
+
+ done:
+  get_options_mutable()->ApproximateClientStatistics = 0;
+  dos_free_all();
+  UNMOCK(get_param_conn_enabled);
+}
+
 struct testcase_t dos_tests[] = {
   { "conn_creation", test_dos_conn_creation, TT_FORK, NULL, NULL },
   { "circuit_creation", test_dos_circuit_creation, TT_FORK, NULL, NULL },
   { "bucket_refill", test_dos_bucket_refill, TT_FORK, NULL, NULL },
   { "known_relay" , test_known_relay, TT_FORK,
     NULL, NULL },
+  { "client_table", test_dos_client_table, TT_FORK, NULL, NULL },
+  { "client_table_free_reinit", test_dos_client_table_free_reinit, TT_FORK,
+    NULL, NULL },
+  { "client_table_approx", test_dos_client_table_approx, TT_FORK,
+    NULL, NULL },
   END_OF_TESTCASES
 };
 
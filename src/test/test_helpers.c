@@ -18,10 +18,12 @@
 #include "config.h"
 #include "confparse.h"
 #include "connection.h"
+#include "cpuworker.h"
 #include "main.h"
 #include "nodelist.h"
 #include "relay.h"
 #include "routerlist.h"
+#include "workqueue.h"
 
 #include "test.h"
 #include "test_helpers.h"
@@ -277,3 +279,52 @@ helper_parse_options(const char *conf)
   return opt;
 }
 
+/** Threadpool function that makes a helper_start_cpuworkers() thread
+ * exit. */
+static workqueue_reply_t
+helper_cpuworker_shutdown(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  return WQ_RPL_SHUTDOWN;
+}
+
+/** Thread state constructor for helper_start_cpuworkers(): the threads
+ * don't need any state. */
+static void *
+helper_cpuworker_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+/** Start a threadpool of <b>n_threads</b> threads, and have
+ * cpuworker_parallel_for() use it.  Stop it with helper_stop_cpuworkers().
+ */
+threadpool_t *
+helper_start_cpuworkers(int n_threads)
+{
+  threadpool_t *pool;
+  pool = threadpool_new(n_threads, replyqueue_new(0),
+                        helper_cpuworker_state_new, tor_free_, NULL, 0);
+  tor_assert(pool);
+  cpuworker_set_threadpool_for_testing_(pool);
+  return pool;
+}
+
+/** Stop the threads of <b>pool</b>, a threadpool from
+ * helper_start_cpuworkers(), handle their replies, and free it. */
+void
+helper_stop_cpuworkers(threadpool_t *pool)
+{
+  replyqueue_t *rq;
+  if (!pool)
+    return;
+  rq = threadpool_get_replyqueue(pool);
+  cpuworker_set_threadpool_for_testing_(NULL);
+  threadpool_queue_update(pool, NULL, helper_cpuworker_shutdown, NULL, NULL);
+  threadpool_free(pool);
+  replyqueue_process(rq);
+  replyqueue_free(rq);
+}
+
@@ -26,6 +26,10 @@ connection_t *test_conn_get_connection(uint8_t state,
                                        uint8_t type, uint8_t purpose);
 or_options_t *helper_parse_options(const char *conf);
 
+struct threadpool_s;
+struct threadpool_s *helper_start_cpuworkers(int n_threads);
+void helper_stop_cpuworkers(struct threadpool_s *pool);
+
 extern const char TEST_DESCRIPTORS[];
 
 #endif /* !defined(TOR_TEST_HELPERS_H) */
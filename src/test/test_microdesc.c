@@ -11,14 +11,19 @@
 #include "routerlist.h"
 #include "routerparse.h"
 #include "torcert.h"
+#include "workqueue.h"
 
 #include "test.h"
+#include "log_test_helpers.h"
+#include "test_helpers.h"
 
 #ifdef _WIN32
 /* For mkdir() */
 #include <direct.h>
+#include <sys/utime.h>
 #else
 #include <dirent.h>
+#include <utime.h>
 #endif /* defined(_WIN32) */
 
 static const char test_md1[] =
@@ -245,6 +250,127 @@ test_md_cache(void *data)
   tor_free(fn);
 }
 
+/** Make sure that we can load the cache file from its index, and that we
+ * notice when the index doesn't match the cache. */
+static void
+test_md_cache_index(void *data)
+{
+  or_options_t *options = NULL;
+  microdesc_cache_t *mc = NULL;
+  smartlist_t *added = NULL;
+  microdesc_t *md1, *md3;
+  char d1[DIGEST256_LEN], d2[DIGEST256_LEN], d3[DIGEST256_LEN];
+  const char *test_md3_noannotation = strchr(test_md3, '\n')+1;
+  const time_t time1 = time(NULL) - 3600, time3 = time(NULL) - 7200;
+  char *cache_fn = NULL, *index_fn = NULL, *s = NULL;
+  size_t len;
+  struct stat st;
+  struct utimbuf ub;
+  (void)data;
+
+  options = get_options_mutable();
+  tor_free(options->DataDirectory);
+  options->DataDirectory = tor_strdup(get_fname("md_index_test"));
+#ifdef _WIN32
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory));
+#else
+  tt_int_op(0, OP_EQ, mkdir(options->DataDirectory, 0700));
+#endif
+  cache_fn = get_datadir_fname("cached-microdescs");
+  index_fn = get_datadir_fname("cached-microdescs.idx");
+
+  crypto_digest256(d1, test_md1, strlen(test_md1), DIGEST_SHA256);
+  crypto_digest256(d2, test_md2, strlen(test_md2), DIGEST_SHA256);
+  crypto_digest256(d3, test_md3_noannotation, strlen(test_md3_noannotation),
+                   DIGEST_SHA256);
+
+  mc = get_microdesc_cache();
+  added = microdescs_add_to_cache(mc, test_md1, NULL, SAVED_NOWHERE, 0,
+                                  time1, NULL);
+  tt_int_op(smartlist_len(added), OP_EQ, 1);
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md2, NULL, SAVED_NOWHERE, 0,
+                                  time1, NULL);
+  tt_int_op(smartlist_len(added), OP_EQ, 1);
+  smartlist_free(added);
+  added = microdescs_add_to_cache(mc, test_md3_noannotation, NULL,
+                                  SAVED_NOWHERE, 0, time3, NULL);
+  tt_int_op(smartlist_len(added), OP_EQ, 1);
+  smartlist_free(added);
+  added = NULL;
+
+  /* Rebuilding the cache writes an index for it. */
+  tt_int_op(microdesc_cache_rebuild(mc, 1), OP_EQ, 0);
+  s = read_file_to_str(index_fn, RFTS_BIN, &st);
+  tt_assert(s);
+  tt_int_op(st.st_size, OP_EQ, 32 + 3*56);
+  tt_mem_op(s, OP_EQ, "TORMDIDX", 8);
+  tor_free(s);
+
+  /* Load the cache from the index, and look at what we get. */
+  microdesc_free_all();
+  mc = get_microdesc_cache();
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  tt_int_op(md3->is_unparsed, OP_EQ, 0);
+  tt_int_op(md3->last_listed, OP_EQ, time3);
+  tt_int_op(md3->saved_location, OP_EQ, SAVED_IN_CACHE);
+  tt_int_op(md3->bodylen, OP_EQ, strlen(test_md3_noannotation));
+  tt_mem_op(md3->body, OP_EQ, test_md3_noannotation, md3->bodylen);
+  tt_assert(md3->onion_pkey);
+  tt_assert(md3->exit_policy);
+  tt_int_op(smartlist_len(md3->family), OP_EQ, 3);
+  md1 = microdesc_cache_lookup_by_digest256(mc, d1);
+  tt_assert(md1);
+  tt_int_op(md1->last_listed, OP_EQ, time1);
+  tt_assert(md1->onion_pkey);
+  tt_ptr_op(md1->family, OP_EQ, NULL);
+
+  /* Now damage md1 in the cache file without changing its size or mtime:
+   * the index still looks fine, but md1 gets dropped when we parse it. */
+  s = read_file_to_str(cache_fn, RFTS_BIN, &st);
+  tt_assert(s);
+  len = (size_t)st.st_size;
+  s[md1->off + 60] = (s[md1->off + 60] == 'A') ? 'B' : 'A';
+  microdesc_free_all();
+  tt_int_op(write_bytes_to_file(cache_fn, s, len, 1), OP_EQ, 0);
+  ub.actime = ub.modtime = st.st_mtime;
+  tt_int_op(utime(cache_fn, &ub), OP_EQ, 0);
+  tor_free(s);
+
+  mc = get_microdesc_cache();
+  setup_capture_of_logs(LOG_WARN);
+  tt_ptr_op(microdesc_cache_lookup_by_digest256(mc, d1), OP_EQ, NULL);
+  expect_single_log_msg_containing("didn't match the cache index");
+  teardown_capture_of_logs();
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d3));
+
+  /* With a corrupt index, we parse the cache file as before. */
+  microdesc_free_all();
+  tt_int_op(write_str_to_file(index_fn, "TORMDIDX", 1), OP_EQ, 0);
+  mc = get_microdesc_cache();
+  tt_ptr_op(microdesc_cache_lookup_by_digest256(mc, d1), OP_EQ, NULL);
+  md3 = microdesc_cache_lookup_by_digest256(mc, d3);
+  tt_assert(md3);
+  tt_int_op(md3->last_listed, OP_EQ, time3);
+  tt_assert(microdesc_cache_lookup_by_digest256(mc, d2));
+  /* ... and write a good index again. */
+  s = read_file_to_str(index_fn, RFTS_BIN, &st);
+  tt_assert(s);
+  tt_int_op(st.st_size, OP_GE, 32 + 2*56);
+
+ done:
+  if (options)
+    tor_free(options->DataDirectory);
+  teardown_capture_of_logs();
+  microdesc_free_all();
+  smartlist_free(added);
+  tor_free(cache_fn);
+  tor_free(index_fn);
+  tor_free(s);
+}
+
 static const char truncated_md[] =
   "@last-listed 2013-08-08 19:02:59\n"
   "onion-key\n"
@@ -745,6 +871,67 @@ mock_ns_get_by_flavor(consensus_flavor_t f)
   return mock_ns_val;
 }
 
+/** Parse a batch of microdescriptors big enough to be tokenized in chunks,
+ * and make sure nothing gets lost or reordered.  If <b>arg</b> is
+ * "threaded", tokenize the chunks on a threadpool. */
+static void
+test_md_parse_big_batch(void *arg)
+{
+  threadpool_t *pool = NULL;
+  const size_t len = strlen(MD_PARSE_TEST_DATA);
+  const int n_copies = 12;
+  smartlist_t *invalid = smartlist_new();
+  smartlist_t *invalid1 = smartlist_new();
+  smartlist_t *mds = NULL, *mds1 = NULL;
+  char *body = tor_malloc(len * n_copies + 1);
+  int i;
+
+  for (i = 0; i < n_copies; ++i)
+    memcpy(body + len * i, MD_PARSE_TEST_DATA, len);
+  body[len * n_copies] = '\0';
+  tt_int_op(len * n_copies, OP_GT, 64*1024);
+
+  mds1 = microdescs_parse_from_string(MD_PARSE_TEST_DATA, NULL, 1,
+                                      SAVED_NOWHERE, invalid1);
+  if (arg && !strcmp(arg, "threaded"))
+    pool = helper_start_cpuworkers(2);
+  mds = microdescs_parse_from_string(body, NULL, 1, SAVED_IN_CACHE, invalid);
+  helper_stop_cpuworkers(pool);
+  pool = NULL;
+  tt_int_op(smartlist_len(mds1), OP_EQ, 11);
+  tt_int_op(smartlist_len(mds), OP_EQ, 11 * n_copies);
+  tt_int_op(smartlist_len(invalid), OP_EQ, 4 * n_copies);
+
+  SMARTLIST_FOREACH_BEGIN(mds, const microdesc_t *, md) {
+    const microdesc_t *md1 = smartlist_get(mds1, md_sl_idx % 11);
+    tt_mem_op(md->digest, OP_EQ, md1->digest, DIGEST256_LEN);
+    tt_int_op(md->off, OP_EQ, md1->off + len * (md_sl_idx / 11));
+    tt_int_op(md->bodylen, OP_EQ, md1->bodylen);
+    tt_int_op(!!md->onion_pkey, OP_EQ, !!md1->onion_pkey);
+    tt_int_op(!!md->onion_curve25519_pkey, OP_EQ,
+              !!md1->onion_curve25519_pkey);
+    tt_int_op(!!md->exit_policy, OP_EQ, !!md1->exit_policy);
+  } SMARTLIST_FOREACH_END(md);
+  SMARTLIST_FOREACH_BEGIN(invalid, const uint8_t *, d) {
+    tt_mem_op(d, OP_EQ, smartlist_get(invalid1, d_sl_idx % 4),
+              DIGEST256_LEN);
+  } SMARTLIST_FOREACH_END(d);
+
+ done:
+  helper_stop_cpuworkers(pool);
+  if (mds)
+    SMARTLIST_FOREACH(mds, microdesc_t *, md, microdesc_free(md));
+  if (mds1)
+    SMARTLIST_FOREACH(mds1, microdesc_t *, md, microdesc_free(md));
+  smartlist_free(mds);
+  smartlist_free(mds1);
+  SMARTLIST_FOREACH(invalid, char *, cp, tor_free(cp));
+  SMARTLIST_FOREACH(invalid1, char *, cp, tor_free(cp));
+  smartlist_free(invalid);
+  smartlist_free(invalid1);
+  tor_free(body);
+}
+
 static void
 test_md_reject_cache(void *arg)
 {
@@ -848,8 +1035,12 @@ test_md_corrupt_desc(void *arg)
 struct testcase_t microdesc_tests[] = {
   { "cache", test_md_cache, TT_FORK, NULL, NULL },
   { "broken_cache", test_md_cache_broken, TT_FORK, NULL, NULL },
+  { "cache_index", test_md_cache_index, TT_FORK, NULL, NULL },
   { "generate", test_md_generate, 0, NULL, NULL },
   { "parse", test_md_parse, 0, NULL, NULL },
+  { "parse_big_batch", test_md_parse_big_batch, 0, NULL, NULL },
+  { "parse_big_batch_threaded", test_md_parse_big_batch, 0,
+    &passthrough_setup, (void*)"threaded" },
   { "reject_cache", test_md_reject_cache, TT_FORK, NULL, NULL },
   { "corrupt_desc", test_md_corrupt_desc, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
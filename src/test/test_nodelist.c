@@ -203,6 +203,100 @@ test_nodelist_ed_id(void *arg)
   UNMOCK(networkstatus_get_latest_consensus_by_flavor);
 }
 
+/** Make sure that nodelist_set_consensus() keeps the address set up to date
+ * when it moves from one consensus to the next, even when the old consensus
+ * is gone already. */
+static void
+test_nodelist_set_consensus_incremental(void *arg)
+{
+  routerstatus_t *rs1[3], *rs2[3];
+  networkstatus_t *ns1, *ns2;
+  const node_t *node0;
+  tor_addr_t addr;
+  int i;
+  (void)arg;
+
+  ns1 = tor_malloc_zero(sizeof(networkstatus_t));
+  ns1->type = NS_TYPE_CONSENSUS;
+  ns1->flavor = FLAV_NS;
+  ns1->routerstatus_list = smartlist_new();
+  ns2 = tor_malloc_zero(sizeof(networkstatus_t));
+  ns2->type = NS_TYPE_CONSENSUS;
+  ns2->flavor = FLAV_NS;
+  ns2->routerstatus_list = smartlist_new();
+  MOCK(networkstatus_get_latest_consensus,
+       mock_networkstatus_get_latest_consensus);
+
+  /* The first consensus lists 10.0.0.1, 10.0.0.2 and 10.0.0.3. */
+  for (i = 0; i < 3; ++i) {
+    rs1[i] = tor_malloc_zero(sizeof(routerstatus_t));
+    memset(rs1[i]->identity_digest, 'a' + i, DIGEST_LEN);
+    rs1[i]->addr = 0x0a000001 + i;
+    smartlist_add(ns1->routerstatus_list, rs1[i]);
+  }
+  tor_addr_parse(&rs1[1]->ipv6_addr, "1:2::3");
+  dummy_ns = ns1;
+  nodelist_set_consensus(ns1);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  node0 = node_get_by_id(rs1[0]->identity_digest);
+  tt_ptr_op(node0->rs, OP_EQ, rs1[0]);
+  tor_addr_from_ipv4h(&addr, 0x0a000002);
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 1);
+  tor_addr_parse(&addr, "1:2::3");
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 1);
+
+  /* The second one keeps the first relay as it was, moves the second to
+   * 10.0.0.12, drops the third, and adds a new one at 10.0.0.4. */
+  for (i = 0; i < 3; ++i) {
+    rs2[i] = tor_memdup(rs1[i], sizeof(routerstatus_t));
+  }
+  rs2[1]->addr = 0x0a00000c;
+  tor_addr_parse(&rs2[1]->ipv6_addr, "1:2::4");
+  memset(rs2[2]->identity_digest, 'z', DIGEST_LEN);
+  rs2[2]->addr = 0x0a000004;
+  for (i = 0; i < 3; ++i)
+    smartlist_add(ns2->routerstatus_list, rs2[i]);
+
+  /* Free the old consensus first, as networkstatus.c does, and make sure we
+   * would notice if anybody looked at it. */
+  for (i = 0; i < 3; ++i) {
+    memset(rs1[i], 0xff, sizeof(routerstatus_t));
+    tor_free(rs1[i]);
+  }
+  smartlist_clear(ns1->routerstatus_list);
+
+  dummy_ns = ns2;
+  nodelist_set_consensus(ns2);
+  tt_int_op(smartlist_len(nodelist_get_list()), OP_EQ, 3);
+  tt_ptr_op(node_get_by_id(rs2[0]->identity_digest), OP_EQ, node0);
+  tt_ptr_op(node0->rs, OP_EQ, rs2[0]);
+  tt_ptr_op(node_get_by_id(rs2[1]->identity_digest)->rs, OP_EQ, rs2[1]);
+  tt_ptr_op(node_get_by_id(rs2[2]->identity_digest)->rs, OP_EQ, rs2[2]);
+
+  tor_addr_from_ipv4h(&addr, 0x0a000001);
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 1);
+  tor_addr_from_ipv4h(&addr, 0x0a00000c);
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 1);
+  tor_addr_from_ipv4h(&addr, 0x0a000004);
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 1);
+  tor_addr_parse(&addr, "1:2::4");
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 1);
+  /* These are gone.  (The set could have false positives, but with this
+   * few addresses, it won't.) */
+  tor_addr_from_ipv4h(&addr, 0x0a000002);
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 0);
+  tor_addr_from_ipv4h(&addr, 0x0a000003);
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 0);
+  tor_addr_parse(&addr, "1:2::3");
+  tt_int_op(nodelist_probably_contains_address(&addr), OP_EQ, 0);
+
+ done:
+  nodelist_free_all();
+  networkstatus_vote_free(ns1);
+  networkstatus_vote_free(ns2);
+  UNMOCK(networkstatus_get_latest_consensus);
+}
+
 #define NODE(name, flags) \
   { #name, test_nodelist_##name, (flags), NULL, NULL }
 
@@ -211,6 +305,7 @@ struct testcase_t nodelist_tests[] = {
   NODE(node_get_verbose_nickname_not_named, TT_FORK),
   NODE(node_is_dir, TT_FORK),
   NODE(ed_id, TT_FORK),
+  NODE(set_consensus_incremental, TT_FORK),
   END_OF_TESTCASES
 };
 
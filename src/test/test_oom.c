@@ -342,9 +342,68 @@ test_oom_streambuf(void *arg)
   monotime_disable_test_mocking();
 }
 
+/** Make sure circuits_bucket_by_oldest_queued_item() puts every circuit in
+ * exactly one bucket, with older circuits never in earlier buckets. */
+static void
+test_oom_age_buckets(void *arg)
+{
+  smartlist_t *circs = smartlist_new();
+  circuit_t **by_age = NULL;
+  int bucket_start[256+1];
+  uint64_t now_ns = 1389631048 * (uint64_t)1000000000;
+  uint32_t now_ms;
+  int i, b;
+
+  (void) arg;
+
+  monotime_enable_test_mocking();
+
+  /* Nothing queued anywhere: everything lands in the first bucket. */
+  for (i = 0; i < 4; ++i)
+    smartlist_add(circs, dummy_or_circuit_new(0, 0));
+  by_age = tor_calloc(64, sizeof(circuit_t *));
+  now_ms = (uint32_t)(now_ns / 1000000);
+  circuits_bucket_by_oldest_queued_item(circs, now_ms, by_age, bucket_start);
+  tt_int_op(bucket_start[0], OP_EQ, 0);
+  tt_int_op(bucket_start[1], OP_EQ, 4);
+  tt_int_op(bucket_start[256], OP_EQ, 4);
+
+  /* Now queue cells 1ms apart on 40 more circuits. */
+  for (i = 0; i < 40; ++i) {
+    monotime_coarse_set_mock_time_nsec(now_ns);
+    smartlist_add(circs, dummy_or_circuit_new(1, 0));
+    now_ns += 1000000;
+  }
+  now_ms = (uint32_t)monotime_coarse_absolute_msec();
+  circuits_bucket_by_oldest_queued_item(circs, now_ms, by_age, bucket_start);
+  tt_int_op(bucket_start[0], OP_EQ, 0);
+  tt_int_op(bucket_start[256], OP_EQ, smartlist_len(circs));
+  for (b = 0; b < 256; ++b) {
+    tt_int_op(bucket_start[b], OP_LE, bucket_start[b+1]);
+    for (i = bucket_start[b]; i < bucket_start[b+1]; ++i) {
+      tt_int_op(smartlist_pos(circs, by_age[i]), OP_GE, 0);
+      if (i > 0 && by_age[i-1]->age_tmp > by_age[i]->age_tmp)
+        /* Out of order within a bucket is fine, but not across buckets. */
+        tt_int_op(i, OP_NE, bucket_start[b]);
+    }
+  }
+  /* The oldest circuit is alone in the last bucket. */
+  tt_int_op(bucket_start[255], OP_EQ, bucket_start[256] - 1);
+  tt_ptr_op(by_age[bucket_start[255]], OP_EQ, smartlist_get(circs, 4));
+  /* The ones with nothing queued are still in the first. */
+  tt_int_op(bucket_start[1], OP_GE, 4);
+
+ done:
+  SMARTLIST_FOREACH(circs, circuit_t *, c, circuit_free(c));
+  smartlist_free(circs);
+  tor_free(by_age);
+  monotime_disable_test_mocking();
+}
+
 struct testcase_t oom_tests[] = {
   { "circbuf", test_oom_circbuf, TT_FORK, NULL, NULL },
   { "streambuf", test_oom_streambuf, TT_FORK, NULL, NULL },
+  { "age_buckets", test_oom_age_buckets, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
 };
 
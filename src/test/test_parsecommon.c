@@ -0,0 +1,162 @@
+/* Copyright (c) 2001-2004, Roger Dingledine.
+ * Copyright (c) 2004-2006, Roger Dingledine, Nick Mathewson.
+ * Copyright (c) 2007-2017, The Tor Project, Inc. */
+/* See LICENSE for licensing information */
+
+/* Unit tests for the generic directory document tokenizer */
+
+#define PARSECOMMON_PRIVATE
+
+#include "or.h"
+#include "parsecommon.h"
+#include "test.h"
+
+static token_rule_t test_token_table[] = {
+  T1_START("router",       K_ROUTER,        GE(2),       NO_OBJ ),
+  T01("published",         K_PUBLISHED,     CONCAT_ARGS, NO_OBJ ),
+  T0N("reject",            K_REJECT,        ARGS,        NO_OBJ ),
+  T0N("accept",            K_ACCEPT,        ARGS,        NO_OBJ ),
+  T0N("accept6",           K_ACCEPT6,       ARGS,        NO_OBJ ),
+  T01("contact",           K_CONTACT,       CONCAT_ARGS, NO_OBJ ),
+  T01("uptime",            K_UPTIME,        EQ(1),       NO_OBJ ),
+  /* A duplicate: the first rule for a keyword wins. */
+  T0N("reject",            K_REJECT6,       ARGS,        NO_OBJ ),
+  A01("@purpose",          A_PURPOSE,       GE(1),       NO_OBJ ),
+  END_OF_TABLE
+};
+
+static void
+test_parsecommon_index(void *arg)
+{
+  token_table_index_t *idx = NULL;
+  const token_rule_t *r;
+  int i;
+  (void)arg;
+
+  idx = token_table_index_new(test_token_table);
+  tt_assert(idx->slots);
+  tt_int_op(idx->mask + 1, OP_GE, 16);
+
+  /* Every keyword finds its first rule. */
+  for (i = 0; test_token_table[i].t; ++i) {
+    const char *kw = test_token_table[i].t;
+    r = token_table_index_lookup(idx, kw, strlen(kw));
+    tt_assert(r);
+    tt_str_op(r->t, OP_EQ, kw);
+    if (i != 7)
+      tt_ptr_op(r, OP_EQ, &test_token_table[i]);
+  }
+  r = token_table_index_lookup(idx, "reject", 6);
+  tt_int_op(r->v, OP_EQ, K_REJECT);
+
+  /* Prefixes, extensions and strangers are not found. */
+  tt_ptr_op(token_table_index_lookup(idx, "accept6", 6), OP_EQ,
+            token_table_index_lookup(idx, "accept", 6));
+  tt_ptr_op(token_table_index_lookup(idx, "accept66", 8), OP_EQ, NULL);
+  tt_ptr_op(token_table_index_lookup(idx, "rout", 4), OP_EQ, NULL);
+  tt_ptr_op(token_table_index_lookup(idx, "", 0), OP_EQ, NULL);
+  tt_ptr_op(token_table_index_lookup(idx, "platform", 8), OP_EQ, NULL);
+
+  /* Without slots, we fall back to a linear search. */
+  tor_free(idx->slots);
+  r = token_table_index_lookup(idx, "uptime", 6);
+  tt_ptr_op(r, OP_EQ, &test_token_table[6]);
+  tt_ptr_op(token_table_index_lookup(idx, "upti", 4), OP_EQ, NULL);
+
+ done:
+  token_table_index_free(idx);
+}
+
+static void
+test_parsecommon_tokenize(void *arg)
+{
+  memarea_t *area = memarea_new();
+  smartlist_t *tokens = smartlist_new();
+  directory_token_t *tok;
+  token_table_index_t *idx;
+  const char *doc =
+    "@purpose bridge\n"
+    "router  Fred\t127.0.0.1  9001 # a comment\n"
+    "opt published 2018-01-01 00:00:00\n"
+    "reject 1.2.3.4:*#skipped\n"
+    "accept\n"
+    "unknown-keyword with args\n"
+    "contact   Fred   <fred@example.com>\n";
+  (void)arg;
+
+  /* Tables get their index once, before we tokenize anything. */
+  token_table_add_index(test_token_table);
+  idx = test_token_table[0].index;
+  tt_assert(idx);
+  tt_ptr_op(idx->table, OP_EQ, test_token_table);
+  token_table_add_index(test_token_table);
+  tt_ptr_op(test_token_table[0].index, OP_EQ, idx);
+
+  tt_int_op(tokenize_string(area, doc, NULL, tokens, test_token_table,
+                            TS_ANNOTATIONS_OK), OP_EQ, 0);
+  tt_int_op(smartlist_len(tokens), OP_EQ, 7);
+
+  tok = smartlist_get(tokens, 0);
+  tt_int_op(tok->tp, OP_EQ, A_PURPOSE);
+  tt_int_op(tok->n_args, OP_EQ, 1);
+  tt_str_op(tok->args[0], OP_EQ, "bridge");
+
+  tok = smartlist_get(tokens, 1);
+  tt_int_op(tok->tp, OP_EQ, K_ROUTER);
+  tt_int_op(tok->n_args, OP_EQ, 3);
+  tt_str_op(tok->args[0], OP_EQ, "Fred");
+  tt_str_op(tok->args[1], OP_EQ, "127.0.0.1");
+  tt_str_op(tok->args[2], OP_EQ, "9001");
+
+  tok = smartlist_get(tokens, 2);
+  tt_int_op(tok->tp, OP_EQ, K_PUBLISHED);
+  tt_int_op(tok->n_args, OP_EQ, 1);
+  tt_str_op(tok->args[0], OP_EQ, "2018-01-01 00:00:00");
+
+  tok = smartlist_get(tokens, 3);
+  tt_int_op(tok->tp, OP_EQ, K_REJECT);
+  tt_int_op(tok->n_args, OP_EQ, 2);
+  tt_str_op(tok->args[0], OP_EQ, "1.2.3.4:*");
+  tt_str_op(tok->args[1], OP_EQ, "skipped");
+
+  tok = smartlist_get(tokens, 4);
+  tt_int_op(tok->tp, OP_EQ, K_ACCEPT);
+  tt_int_op(tok->n_args, OP_EQ, 0);
+
+  tok = smartlist_get(tokens, 5);
+  tt_int_op(tok->tp, OP_EQ, K_OPT);
+  tt_int_op(tok->n_args, OP_EQ, 1);
+  tt_str_op(tok->args[0], OP_EQ, "unknown-keyword with args");
+
+  tok = smartlist_get(tokens, 6);
+  tt_int_op(tok->tp, OP_EQ, K_CONTACT);
+  tt_str_op(tok->args[0], OP_EQ, "Fred   <fred@example.com>");
+
+  /* Argument counts are still checked. */
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_clear(tokens);
+  tt_int_op(tokenize_string(area, "router Fred\nuptime 1 2\n", NULL, tokens,
+                            test_token_table, 0), OP_EQ, -1);
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_clear(tokens);
+  tt_int_op(tokenize_string(area, "router Fred 1\nuptime 1\n", NULL, tokens,
+                            test_token_table, 0), OP_EQ, 0);
+
+  /* Tokenizing never touches the index, until we free everything. */
+  tt_ptr_op(test_token_table[0].index, OP_EQ, idx);
+  parsecommon_free_all();
+  tt_ptr_op(test_token_table[0].index, OP_EQ, NULL);
+
+ done:
+  SMARTLIST_FOREACH(tokens, directory_token_t *, t, token_clear(t));
+  smartlist_free(tokens);
+  memarea_drop_all(area);
+  parsecommon_free_all();
+}
+
+struct testcase_t parsecommon_tests[] = {
+  { "index", test_parsecommon_index, 0, NULL, NULL },
+  { "tokenize", test_parsecommon_tokenize, TT_FORK, NULL, NULL },
+  END_OF_TESTCASES
+};
+
@@ -2373,10 +2373,98 @@ test_policies_fascist_firewall_choose_address(void *arg)
 #undef CHECK_CHOSEN_ADDR_NODE
 #undef CHECK_CHOSEN_ADDR_RN
 
+/** Check that compiled policies give the same answers as the linear
+ * policy lookup. */
+static void
+test_policies_compiled(void *arg)
+{
+  smartlist_t *policy = NULL;
+  compiled_policy_t *cp = NULL;
+  config_line_t line;
+  tor_addr_t addr;
+  int i, j;
+  (void)arg;
+
+  line.key = (char*)"ExitPolicy";
+  line.value = (char*)"accept 1.2.3.4:80,reject 1.2.3.0/24:*,"
+    "accept 1.0.0.0/8:1-1024,reject 0.0.0.0/1:443,"
+    "accept [2001:db8::]/32:22,reject [2001:db8::1]:*,"
+    "reject [2001::]/16:100-200,accept6 [::]/0:443,reject *4:9000-9100,"
+    "accept 255.255.255.255:65535,reject6 [ffff::]/16:*";
+  line.next = NULL;
+  tt_int_op(0, OP_EQ, policies_parse_exit_policy(&line, &policy,
+                                                 EXIT_POLICY_IPV6_ENABLED |
+                                                 EXIT_POLICY_REJECT_PRIVATE |
+                                                 EXIT_POLICY_ADD_DEFAULT,
+                                                 NULL));
+  cp = compiled_policy_new(policy);
+  tt_assert(cp);
+
+  /* Every address near an entry boundary, with every interesting port. */
+  SMARTLIST_FOREACH_BEGIN(policy, addr_policy_t *, ent) {
+    static const uint16_t ports[] = { 1, 21, 22, 23, 80, 100, 200, 201, 443,
+                                      1024, 1025, 9000, 9100, 65535 };
+    for (i = -1; i <= 1; ++i) {
+      if (tor_addr_family(&ent->addr) == AF_INET) {
+        tor_addr_from_ipv4h(&addr, tor_addr_to_ipv4h(&ent->addr) + i);
+      } else if (tor_addr_family(&ent->addr) == AF_INET6) {
+        uint8_t a[16];
+        memcpy(a, tor_addr_to_in6_addr8(&ent->addr), 16);
+        a[15] += i;
+        tor_addr_from_ipv6_bytes(&addr, (const char*)a);
+      } else {
+        continue;
+      }
+      for (j = 0; j < (int)ARRAY_LENGTH(ports); ++j) {
+        tt_int_op(compare_tor_addr_to_addr_policy(&addr, ports[j], policy),
+                  OP_EQ,
+                  compare_tor_addr_to_compiled_policy(&addr, ports[j],
+                                                      policy, cp));
+      }
+    }
+  } SMARTLIST_FOREACH_END(ent);
+
+  /* And some random ones. */
+  for (i = 0; i < 10000; ++i) {
+    uint16_t port;
+    crypto_rand((char*)&port, sizeof(port));
+    if (i & 1) {
+      uint32_t a;
+      crypto_rand((char*)&a, sizeof(a));
+      tor_addr_from_ipv4h(&addr, (i & 2) ? a : (0x01020300 | (a & 0xff)));
+    } else {
+      uint8_t a[16];
+      crypto_rand((char*)a, sizeof(a));
+      if (i & 2)
+        set_uint32(a, htonl(0x20010db8));
+      tor_addr_from_ipv6_bytes(&addr, (const char*)a);
+    }
+    tt_int_op(compare_tor_addr_to_addr_policy(&addr, port, policy), OP_EQ,
+              compare_tor_addr_to_compiled_policy(&addr, port, policy, cp));
+  }
+
+  /* Unknown ports and addresses fall back to the linear lookup. */
+  tor_addr_from_ipv4h(&addr, 0x01020304);
+  tt_int_op(ADDR_POLICY_PROBABLY_REJECTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&addr, 0, policy, cp));
+  tt_int_op(compare_tor_addr_to_addr_policy(NULL, 80, policy), OP_EQ,
+            compare_tor_addr_to_compiled_policy(NULL, 80, policy, cp));
+
+  /* No policy means accept everything. */
+  tt_ptr_op(NULL, OP_EQ, compiled_policy_new(NULL));
+  tt_int_op(ADDR_POLICY_ACCEPTED, OP_EQ,
+            compare_tor_addr_to_compiled_policy(&addr, 80, NULL, NULL));
+
+ done:
+  compiled_policy_free(cp);
+  addr_policy_list_free(policy);
+}
+
 struct testcase_t policy_tests[] = {
   { "router_dump_exit_policy_to_string", test_dump_exit_policy_to_string, 0,
     NULL, NULL },
   { "general", test_policies_general, 0, NULL, NULL },
+  { "compiled", test_policies_compiled, 0, NULL, NULL },
   { "getinfo_helper_policies", test_policies_getinfo_helper_policies, 0, NULL,
     NULL },
   { "reject_exit_address", test_policies_reject_exit_address, 0, NULL, NULL },
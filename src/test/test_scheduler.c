@@ -96,7 +96,10 @@ mock_kist_networkstatus_get_param(
   (void)default_val;
   (void)min_val;
   (void)max_val;
-  // only support KISTSchedRunInterval right now
+  if (strcmp(param_name, "KISTFlushQuantum") == 0) {
+    return 16;
+  }
+  // only support KISTSchedRunInterval and KISTFlushQuantum right now
   tor_assert(strcmp(param_name, "KISTSchedRunInterval")==0);
   return 12;
 }
@@ -336,9 +339,8 @@ channel_write_to_kernel_mock(channel_t *chan)
 }
 
 static int
-channel_should_write_to_kernel_mock(outbuf_table_t *ot, channel_t *chan)
+channel_should_write_to_kernel_mock(channel_t *chan)
 {
-  (void)ot;
   (void)chan;
   return 1;
   /* We could make this more complicated if we wanted. But I don't think doing
@@ -353,6 +355,9 @@ channel_should_write_to_kernel_mock(outbuf_table_t *ot, channel_t *chan)
   //return 0;
 }
 
+static int channel_flush_some_cells_mock_ctr = 0;
+static ssize_t channel_flush_some_cells_mock_last_asked = 0;
+
 static ssize_t
 channel_flush_some_cells_mock(channel_t *chan, ssize_t num_cells)
 {
@@ -360,6 +365,8 @@ channel_flush_some_cells_mock(channel_t *chan, ssize_t num_cells)
   char unlimited = 0;
   flush_mock_channel_t *found = NULL;
 
+  ++channel_flush_some_cells_mock_ctr;
+  channel_flush_some_cells_mock_last_asked = num_cells;
   tt_ptr_op(chan, OP_NE, NULL);
   if (chan) {
     if (num_cells < 0) {
@@ -409,6 +416,17 @@ update_socket_info_impl_mock(socket_table_ent_t *ent)
   ent->limit = INT_MAX;
 }
 
+static int update_socket_info_impl_counting_mock_ctr = 0;
+static uint64_t update_socket_info_impl_counting_mock_limit = INT_MAX;
+
+static void
+update_socket_info_impl_counting_mock(socket_table_ent_t *ent)
+{
+  ++update_socket_info_impl_counting_mock_ctr;
+  ent->cwnd = ent->unacked = ent->mss = ent->notsent = 0;
+  ent->limit = update_socket_info_impl_counting_mock_limit;
+}
+
 static void
 perform_channel_state_tests(int KISTSchedRunInterval, int sched_type)
 {
@@ -910,6 +928,243 @@ test_scheduler_loop_kist(void *arg)
   return;
 }
 
+static void
+test_scheduler_kist_sock_info_cache(void *arg)
+{
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  channel_t *ch1 = new_fake_channel();
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_counting_mock);
+  monotime_enable_test_mocking();
+  monotime_coarse_set_mock_time_nsec(1000 * (int64_t)1000000);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 11;
+  mocked_options.KISTSockInfoCacheTime = 50;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  update_socket_info_impl_counting_mock_ctr = 0;
+  update_socket_info_impl_counting_mock_limit = INT_MAX;
+
+  tt_assert(ch1);
+  ch1->magic = TLS_CHAN_MAGIC;
+  ch1->state = CHANNEL_STATE_OPENING;
+  ch1->cmux = circuitmux_alloc();
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state_open(ch1);
+  scheduler_channel_has_waiting_cells(ch1);
+  scheduler_channel_wants_writes(ch1);
+  channel_flush_some_cells_mock_set(ch1, 5);
+
+  /* First run: we know nothing about the socket so ask the kernel. */
+  the_scheduler->run();
+  tt_int_op(update_socket_info_impl_counting_mock_ctr, OP_EQ, 1);
+  tt_ptr_op(ch1->kist_sock_info, OP_NE, NULL);
+  tt_u64_op(ch1->kist_sock_info->written, OP_GT, 0);
+
+  /* Same time, room left: the cached information is reused. */
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 5);
+  the_scheduler->run();
+  tt_int_op(update_socket_info_impl_counting_mock_ctr, OP_EQ, 1);
+
+  /* Past the cache time: ask the kernel again. */
+  monotime_coarse_set_mock_time_nsec(1100 * (int64_t)1000000);
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 5);
+  the_scheduler->run();
+  tt_int_op(update_socket_info_impl_counting_mock_ctr, OP_EQ, 2);
+
+  /* A socket that used up its limit is always refreshed, even if its
+   * information is recent. */
+  update_socket_info_impl_counting_mock_limit =
+    CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD;
+  monotime_coarse_set_mock_time_nsec(1200 * (int64_t)1000000);
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 5);
+  the_scheduler->run();
+  tt_int_op(update_socket_info_impl_counting_mock_ctr, OP_EQ, 3);
+  scheduler_channel_has_waiting_cells(ch1);
+  the_scheduler->run();
+  tt_int_op(update_socket_info_impl_counting_mock_ctr, OP_EQ, 4);
+
+  /* Releasing the channel drops its entry. */
+  scheduler_release_channel(ch1);
+  tt_ptr_op(ch1->kist_sock_info, OP_EQ, NULL);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  ch1->state = CHANNEL_STATE_CLOSED;
+  ch1->registered = 0;
+  channel_free(ch1);
+  monotime_disable_test_mocking();
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  scheduler_free_all();
+  return;
+}
+
+static void
+test_scheduler_kist_flush_quantum(void *arg)
+{
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  channel_t *ch1 = new_fake_channel();
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_counting_mock);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 11;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+  /* No consensus, we should be using the default. */
+  tt_int_op(kist_flush_quantum, OP_EQ, KIST_FLUSH_QUANTUM_DEFAULT);
+  update_socket_info_impl_counting_mock_limit = INT_MAX;
+
+  tt_assert(ch1);
+  ch1->magic = TLS_CHAN_MAGIC;
+  ch1->state = CHANNEL_STATE_OPENING;
+  ch1->cmux = circuitmux_alloc();
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state_open(ch1);
+  scheduler_channel_has_waiting_cells(ch1);
+  scheduler_channel_wants_writes(ch1);
+
+  /* Unlimited socket: 20 cells go out in quantum-sized flushes. */
+  channel_flush_some_cells_mock_set(ch1, 20);
+  channel_flush_some_cells_mock_ctr = 0;
+  the_scheduler->run();
+  tt_int_op(channel_flush_some_cells_mock_ctr, OP_EQ, 3);
+  tt_int_op(ch1->kist_sock_info->flush_deficit, OP_EQ, 0);
+
+  /* Socket limited to 3 cells: we flush 3 and are owed the rest of our
+   * quantum. */
+  update_socket_info_impl_counting_mock_limit =
+    3 * (CELL_MAX_NETWORK_SIZE + TLS_PER_CELL_OVERHEAD);
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 20);
+  channel_flush_some_cells_mock_ctr = 0;
+  the_scheduler->run();
+  tt_int_op(channel_flush_some_cells_mock_ctr, OP_EQ, 1);
+  tt_int_op(channel_flush_some_cells_mock_last_asked, OP_EQ, 3);
+  tt_int_op(ch1->kist_sock_info->flush_deficit, OP_EQ,
+            KIST_FLUSH_QUANTUM_DEFAULT - 3);
+
+  /* Limit lifted: the deficit is paid back on the next pick. */
+  update_socket_info_impl_counting_mock_limit = INT_MAX;
+  channel_flush_some_cells_mock_ctr = 0;
+  the_scheduler->run();
+  tt_int_op(channel_flush_some_cells_mock_ctr, OP_GE, 1);
+  tt_int_op(ch1->kist_sock_info->flush_deficit, OP_EQ, 0);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  ch1->state = CHANNEL_STATE_CLOSED;
+  ch1->registered = 0;
+  channel_free(ch1);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  scheduler_free_all();
+  return;
+}
+
+static void
+test_scheduler_kist_switch(void *arg)
+{
+  (void) arg;
+
+#ifndef HAVE_KIST_SUPPORT
+  return;
+#endif
+
+  channel_t *ch1 = new_fake_channel();
+
+  MOCK(get_options, mock_get_options);
+  MOCK(channel_flush_some_cells, channel_flush_some_cells_mock);
+  MOCK(channel_more_to_flush, channel_more_to_flush_mock);
+  MOCK(channel_write_to_kernel, channel_write_to_kernel_mock);
+  MOCK(channel_should_write_to_kernel, channel_should_write_to_kernel_mock);
+  MOCK(update_socket_info_impl, update_socket_info_impl_mock);
+  clear_options();
+  mocked_options.KISTSchedRunInterval = 11;
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_init();
+
+  tt_assert(ch1);
+  ch1->magic = TLS_CHAN_MAGIC;
+  ch1->state = CHANNEL_STATE_OPENING;
+  ch1->cmux = circuitmux_alloc();
+  channel_register(ch1);
+  tt_assert(ch1->registered);
+  channel_change_state_open(ch1);
+  scheduler_channel_wants_writes(ch1);
+
+  /* A KIST run allocates the outbuf list. */
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 5);
+  the_scheduler->run();
+  tt_ptr_op(outbuf_list, OP_NE, NULL);
+
+  /* Switching away from KIST, as on a SIGHUP, frees it... */
+  cleanup_scheduler_options();
+  set_scheduler_options(SCHEDULER_VANILLA);
+  scheduler_conf_changed();
+  tt_ptr_op(the_scheduler, OP_EQ, get_vanilla_scheduler());
+  tt_ptr_op(outbuf_list, OP_EQ, NULL);
+
+  /* ... and switching back makes the next run allocate a new one. */
+  cleanup_scheduler_options();
+  set_scheduler_options(SCHEDULER_KIST);
+  scheduler_conf_changed();
+  tt_ptr_op(the_scheduler, OP_EQ, get_kist_scheduler());
+  scheduler_channel_has_waiting_cells(ch1);
+  channel_flush_some_cells_mock_set(ch1, 5);
+  the_scheduler->run();
+  tt_ptr_op(outbuf_list, OP_NE, NULL);
+  tt_int_op(smartlist_len(outbuf_list), OP_EQ, 0);
+
+ done:
+  channel_flush_some_cells_mock_free_all();
+  ch1->state = CHANNEL_STATE_CLOSED;
+  ch1->registered = 0;
+  channel_free(ch1);
+  UNMOCK(update_socket_info_impl);
+  UNMOCK(channel_should_write_to_kernel);
+  UNMOCK(channel_write_to_kernel);
+  UNMOCK(channel_more_to_flush);
+  UNMOCK(channel_flush_some_cells);
+  UNMOCK(get_options);
+  scheduler_free_all();
+  return;
+}
+
 static void
 test_scheduler_channel_states(void *arg)
 {
@@ -1066,6 +1321,8 @@ test_scheduler_ns_changed(void *arg)
   UNMOCK(networkstatus_get_param);
 #ifdef HAVE_KIST_SUPPORT
   tt_ptr_op(the_scheduler, ==, get_kist_scheduler());
+  /* KIST picked up the flush quantum from the consensus. */
+  tt_int_op(kist_flush_quantum, ==, 16);
 #else
   tt_ptr_op(the_scheduler, ==, get_vanilla_scheduler());
 #endif
@@ -1090,6 +1347,11 @@ struct testcase_t scheduler_tests[] = {
   { "initfree", test_scheduler_initfree, TT_FORK, NULL, NULL },
   { "loop_vanilla", test_scheduler_loop_vanilla, TT_FORK, NULL, NULL },
   { "loop_kist", test_scheduler_loop_kist, TT_FORK, NULL, NULL },
+  { "kist_sock_info_cache", test_scheduler_kist_sock_info_cache, TT_FORK,
+    NULL, NULL },
+  { "kist_flush_quantum", test_scheduler_kist_flush_quantum, TT_FORK,
+    NULL, NULL },
+  { "kist_switch", test_scheduler_kist_switch, TT_FORK, NULL, NULL },
   { "ns_changed", test_scheduler_ns_changed, TT_FORK, NULL, NULL},
   { "should_use_kist", test_scheduler_can_use_kist, TT_FORK, NULL, NULL },
   END_OF_TESTCASES
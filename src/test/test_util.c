@@ -2480,6 +2480,91 @@ test_util_decompress_concatenated(void *arg)
   ;
 }
 
+static void
+test_util_compress_dict(void *arg)
+{
+  const char *methodname = arg;
+  char dict[8192], input[6144];
+  char *dict_copy = NULL;
+  char *c1 = NULL, *c2 = NULL, *c3 = NULL, *result = NULL;
+  size_t sz1, sz2, sz3 = 0, szr;
+  tor_compress_state_t *state = NULL;
+  int r;
+  tt_assert(methodname);
+
+  compress_method_t method = compression_method_get_by_name(methodname);
+  tt_int_op(method, OP_NE, UNKNOWN_METHOD);
+  tt_assert(compression_method_uses_dict(method));
+  if (! tor_compress_supports_method(method)) {
+    tt_skip();
+  }
+
+  /* Random data doesn't compress, unless the dictionary has seen it. */
+  crypto_rand(dict, sizeof(dict));
+  memcpy(input, dict + 1000, 4096);
+  crypto_rand(input + 4096, sizeof(input) - 4096);
+
+  r = tor_compress_with_dict(&c1, &sz1, input, sizeof(input), method,
+                             HIGH_COMPRESSION, dict, sizeof(dict));
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(sz1, OP_LT, sizeof(input) - 3000);
+  r = tor_uncompress_with_dict(&result, &szr, c1, sz1, method,
+                               dict, sizeof(dict), 1, LOG_WARN);
+  tt_int_op(r, OP_EQ, 0);
+  tt_int_op(szr, OP_EQ, sizeof(input));
+  tt_mem_op(result, OP_EQ, input, sizeof(input));
+  tor_free(result);
+
+  /* With the wrong dictionary, we can't get the input back. */
+  dict[1000] ^= 1;
+  r = tor_uncompress_with_dict(&result, &szr, c1, sz1, method,
+                               dict, sizeof(dict), 1, LOG_INFO);
+  tt_assert(r < 0 || szr != sizeof(input) ||
+            fast_memneq(result, input, sizeof(input)));
+  tor_free(result);
+  dict[1000] ^= 1;
+
+  /* Streaming works too, and the dictionary needn't outlive the setup. */
+  dict_copy = tor_memdup(dict, sizeof(dict));
+  state = tor_compress_new_with_dict(1, method, HIGH_COMPRESSION,
+                                     dict_copy, sizeof(dict));
+  tt_assert(state);
+  tor_free(dict_copy);
+  {
+    const char *in = input;
+    size_t in_len = sizeof(input), out_len = 2 * sizeof(input);
+    char *out = c2 = tor_malloc(out_len);
+    tt_int_op(TOR_COMPRESS_DONE, OP_EQ,
+              tor_compress_process(state, &out, &out_len, &in, &in_len, 1));
+    tt_int_op(in_len, OP_EQ, 0);
+    sz2 = out - c2;
+  }
+  r = tor_uncompress_with_dict(&result, &szr, c2, sz2, method,
+                               dict, sizeof(dict), 1, LOG_WARN);
+  tt_int_op(r, OP_EQ, 0);
+  tt_mem_op(result, OP_EQ, input, sizeof(input));
+
+  /* These methods need a dictionary, and the others can't take one. */
+  setup_capture_of_logs(LOG_WARN);
+  tt_int_op(-1, OP_EQ, tor_compress(&c3, &sz3, input, sizeof(input),
+                                    method));
+  expect_log_msg_containing("without a dictionary");
+  mock_clean_saved_logs();
+  tt_ptr_op(NULL, OP_EQ, tor_compress_new_with_dict(1, ZLIB_METHOD,
+                                                    HIGH_COMPRESSION,
+                                                    dict, sizeof(dict)));
+  expect_log_msg_containing("and a dictionary");
+
+ done:
+  teardown_capture_of_logs();
+  tor_compress_free(state);
+  tor_free(dict_copy);
+  tor_free(c1);
+  tor_free(c2);
+  tor_free(c3);
+  tor_free(result);
+}
+
 static void
 test_util_decompress_junk_impl(compress_method_t method)
 {
@@ -6032,6 +6117,11 @@ test_util_get_unquoted_path(void *arg)
   { "compress/" #name, test_util_compress, 0, &passthrough_setup,       \
     (char*)(identifier) }
 
+#define COMPRESS_DICT(name, identifier)                                 \
+  { "compress_dict/" #name, test_util_compress_dict, 0,                 \
+    &passthrough_setup,                                                 \
+    (char*)(identifier) }
+
 #define COMPRESS_CONCAT(name, identifier)                               \
   { "compress_concat/" #name, test_util_decompress_concatenated, 0,     \
     &passthrough_setup,                                                 \
@@ -6081,6 +6171,8 @@ struct testcase_t util_tests[] = {
   COMPRESS_CONCAT(lzma, "x-tor-lzma"),
   COMPRESS_CONCAT(zstd, "x-zstd"),
   COMPRESS_CONCAT(none, "identity"),
+  COMPRESS_DICT(lzma, "x-tor-lzma-dict1"),
+  COMPRESS_DICT(zstd, "x-zstd-dict1"),
   COMPRESS_JUNK(zlib, "deflate"),
   COMPRESS_JUNK(gzip, "gzip"),
   COMPRESS_JUNK(lzma, "x-tor-lzma"),
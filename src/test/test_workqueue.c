@@ -13,6 +13,9 @@
 
 #include <stdio.h>
 #include <event2/event.h>
+#ifdef HAVE_SYS_SELECT_H
+#include <sys/select.h>
+#endif
 
 #define MAX_INFLIGHT (1<<16)
 
@@ -23,6 +26,8 @@ static int opt_n_inflight = 1000;
 static int opt_n_lowwater = 250;
 static int opt_n_cancel = 0;
 static int opt_ratio_rsa = 5;
+static int opt_batch = 0;
+static unsigned opt_pool_flags = 0;
 
 #ifdef TRACK_RESPONSES
 tor_mutex_t bitmap_mutex;
@@ -187,32 +192,80 @@ handle_reply_shutdown(void *arg)
   no_shutdown = 1;
 }
 
-static workqueue_entry_t *
-add_work(threadpool_t *tp)
+/** Return true iff the next item of work should be a slow (RSA) one. */
+static int
+next_work_is_rsa(void)
 {
-  int add_rsa =
-    opt_ratio_rsa == 0 ||
+  return opt_ratio_rsa == 0 ||
     tor_weak_random_range(&weak_rng, opt_ratio_rsa) == 0;
+}
 
-  if (add_rsa) {
-    rsa_work_t *w = tor_malloc_zero(sizeof(*w));
-    w->serial = n_sent++;
-    crypto_rand((char*)w->msg, 20);
-    w->msglen = 20;
-    ++rsa_sent;
+static rsa_work_t *
+new_rsa_work(void)
+{
+  rsa_work_t *w = tor_malloc_zero(sizeof(*w));
+  w->serial = n_sent++;
+  crypto_rand((char*)w->msg, 20);
+  w->msglen = 20;
+  ++rsa_sent;
+  return w;
+}
+
+static ecdh_work_t *
+new_ecdh_work(void)
+{
+  ecdh_work_t *w = tor_malloc_zero(sizeof(*w));
+  w->serial = n_sent++;
+  /* Not strictly right, but this is just for benchmarks. */
+  crypto_rand((char*)w->u.pk.public_key, 32);
+  ++ecdh_sent;
+  return w;
+}
+
+static workqueue_entry_t *
+add_work(threadpool_t *tp)
+{
+  if (next_work_is_rsa()) {
     return threadpool_queue_work_priority(tp,
                                           WQ_PRI_MED,
-                                          workqueue_do_rsa, handle_reply, w);
+                                          workqueue_do_rsa, handle_reply,
+                                          new_rsa_work());
   } else {
-    ecdh_work_t *w = tor_malloc_zero(sizeof(*w));
-    w->serial = n_sent++;
-    /* Not strictly right, but this is just for benchmarks. */
-    crypto_rand((char*)w->u.pk.public_key, 32);
-    ++ecdh_sent;
-    return threadpool_queue_work(tp, workqueue_do_ecdh, handle_reply, w);
+    return threadpool_queue_work(tp, workqueue_do_ecdh, handle_reply,
+                                 new_ecdh_work());
   }
 }
 
+/** Queue <b>n</b> items of work with threadpool_queue_work_batch(): one
+ * batch of RSA items and one of ECDH items.  Store their entries in
+ * <b>entries_out</b>.  Return 0 on success, -1 on failure. */
+static int
+add_work_batch(threadpool_t *tp, int n, workqueue_entry_t **entries_out)
+{
+  void **rsa = tor_calloc(n, sizeof(void*));
+  void **ecdh = tor_calloc(n, sizeof(void*));
+  int n_rsa = 0, n_ecdh = 0, i, r = 0;
+
+  for (i = 0; i < n; ++i) {
+    if (next_work_is_rsa())
+      rsa[n_rsa++] = new_rsa_work();
+    else
+      ecdh[n_ecdh++] = new_ecdh_work();
+  }
+
+  if (threadpool_queue_work_batch(tp, WQ_PRI_MED, workqueue_do_rsa,
+                                  handle_reply, rsa, n_rsa,
+                                  entries_out) < 0 ||
+      threadpool_queue_work_batch(tp, WQ_PRI_HIGH, workqueue_do_ecdh,
+                                  handle_reply, ecdh, n_ecdh,
+                                  entries_out + n_rsa) < 0)
+    r = -1;
+
+  tor_free(rsa);
+  tor_free(ecdh);
+  return r;
+}
+
 static int n_failed_cancel = 0;
 static int n_successful_cancel = 0;
 
@@ -226,6 +279,25 @@ add_n_work_items(threadpool_t *tp, int n)
 
   to_cancel = tor_malloc(sizeof(workqueue_entry_t*) * opt_n_cancel);
 
+  if (opt_batch && n > 0) {
+    workqueue_entry_t **entries = tor_calloc(n, sizeof(workqueue_entry_t*));
+    if (add_work_batch(tp, n, entries) < 0) {
+      puts("Z");
+      tor_event_base_loopexit(tor_libevent_get_base(), NULL);
+      tor_free(entries);
+      tor_free(to_cancel);
+      return -1;
+    }
+    for (i = 0; i < n; ++i) {
+      if (n_try_cancel < opt_n_cancel &&
+          tor_weak_random_range(&weak_rng, n) < opt_n_cancel) {
+        to_cancel[n_try_cancel++] = entries[i];
+      }
+    }
+    tor_free(entries);
+    n = 0;
+  }
+
   while (n_queued++ < n) {
     ent = add_work(tp);
     if (! ent) {
@@ -313,6 +385,106 @@ replysock_readable_cb(tor_socket_t sock, short what, void *arg)
   }
 }
 
+/** Lock and condition for check_reply_after_update(). */
+static tor_mutex_t update_check_lock;
+static tor_cond_t update_check_cond;
+/** True once the job in check_reply_after_update() has started. */
+static int update_check_job_started = 0;
+/** True once check_reply_after_update() has queued its update. */
+static int update_check_update_queued = 0;
+/** True once check_reply_after_update() has handled its job's reply. */
+static int update_check_replied = 0;
+
+static workqueue_reply_t
+update_check_job(void *state, void *work)
+{
+  (void)state;
+  (void)work;
+  tor_mutex_acquire(&update_check_lock);
+  update_check_job_started = 1;
+  tor_cond_signal_all(&update_check_cond);
+  while (!update_check_update_queued)
+    tor_cond_wait(&update_check_cond, &update_check_lock, NULL);
+  tor_mutex_release(&update_check_lock);
+  return WQ_RPL_REPLY;
+}
+
+static void
+update_check_reply(void *arg)
+{
+  (void)arg;
+  update_check_replied = 1;
+}
+
+static workqueue_reply_t
+update_check_noop_update(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  return WQ_RPL_REPLY;
+}
+
+static workqueue_reply_t
+update_check_shutdown(void *state, void *arg)
+{
+  (void)state;
+  (void)arg;
+  return WQ_RPL_SHUTDOWN;
+}
+
+static void *
+update_check_state_new(void *arg)
+{
+  (void)arg;
+  return NULL;
+}
+
+/** Queue a job, and queue an update while the job is running.  Return 0 if
+ * the job's reply reaches us even though the thread then has nothing left
+ * to do but the update, and -1 if it doesn't arrive within a few seconds. */
+static int
+check_reply_after_update(uint32_t as_flags)
+{
+  replyqueue_t *rq = replyqueue_new(as_flags);
+  threadpool_t *tp;
+  tor_socket_t sock;
+  fd_set readable;
+  struct timeval limit = { 5, 0 };
+  int replied;
+
+  if (!rq)
+    return -1;
+  tor_mutex_init_for_cond(&update_check_lock);
+  tor_cond_init(&update_check_cond);
+  tp = threadpool_new(1, rq, update_check_state_new, tor_free_, NULL, 0);
+  tor_assert(tp);
+
+  threadpool_queue_work(tp, update_check_job, update_check_reply, NULL);
+  tor_mutex_acquire(&update_check_lock);
+  while (!update_check_job_started)
+    tor_cond_wait(&update_check_cond, &update_check_lock, NULL);
+  threadpool_queue_update(tp, NULL, update_check_noop_update, NULL, NULL);
+  update_check_update_queued = 1;
+  tor_cond_signal_all(&update_check_cond);
+  tor_mutex_release(&update_check_lock);
+
+  sock = replyqueue_get_socket(rq);
+  FD_ZERO(&readable);
+  FD_SET(sock, &readable);
+  if (select(sock + 1, &readable, NULL, NULL, &limit) > 0)
+    replyqueue_process(rq);
+  /* Shutting down would flush the reply, so look before we do. */
+  replied = update_check_replied;
+
+  threadpool_queue_update(tp, NULL, update_check_shutdown, NULL, NULL);
+  threadpool_free(tp);
+  replyqueue_process(rq);
+  replyqueue_free(rq);
+  tor_cond_uninit(&update_check_cond);
+  tor_mutex_uninit(&update_check_lock);
+  return replied ? 0 : -1;
+}
+
 static void
 help(void)
 {
@@ -326,6 +498,8 @@ help(void)
      "  -L <lowwater> Add items whenever fewer than this many are pending\n"
      "  -C <cancel>   Try to cancel N items of every batch that we add\n"
      "  -R <ratio>    Make one out of this many items be a slow (RSA) one\n"
+     "  -B            Queue each group of items as a batch\n"
+     "  -P            Pin each worker thread to a CPU\n"
      "  --no-{eventfd2,eventfd,pipe2,pipe,socketpair}\n"
      "                Disable one of the alert_socket backends.");
 }
@@ -355,6 +529,10 @@ main(int argc, char **argv)
       opt_ratio_rsa = atoi(argv[++i]);
     } else if (!strcmp(argv[i], "-C") && i+1<argc) {
       opt_n_cancel = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-B")) {
+      opt_batch = 1;
+    } else if (!strcmp(argv[i], "-P")) {
+      opt_pool_flags |= THREADPOOL_PIN_THREADS;
     } else if (!strcmp(argv[i], "--no-eventfd2")) {
       as_flags |= ASOCKS_NOEVENTFD2;
     } else if (!strcmp(argv[i], "--no-eventfd")) {
@@ -401,9 +579,15 @@ main(int argc, char **argv)
   if (as_flags && rq == NULL)
     return 77; // 77 means "skipped".
 
+  if (check_reply_after_update(as_flags) < 0) {
+    puts("Reply held back by an update");
+    puts("FAIL");
+    return 1;
+  }
+
   tor_assert(rq);
   tp = threadpool_new(opt_n_threads,
-                      rq, new_state, free_state, NULL);
+                      rq, new_state, free_state, NULL, opt_pool_flags);
   tor_assert(tp);
 
   crypto_seed_weak_rng(&weak_rng);
@@ -447,6 +631,10 @@ main(int argc, char **argv)
     puts("Accepted work after shutdown\n");
     puts("FAIL");
   } else {
+    /* We queued the shutdown with the last reply, so the threads will exit. */
+    tor_event_free(ev);
+    threadpool_free(tp);
+    replyqueue_free(rq);
     puts("OK");
     return 0;
   }
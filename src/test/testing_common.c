@@ -22,6 +22,7 @@ const char tor_git_revision[] = "";
 #include "backtrace.h"
 #include "test.h"
 #include "channelpadding.h"
+#include "parsecommon.h"
 
 #include <stdio.h>
 #ifdef HAVE_FCNTL_H
@@ -247,6 +248,7 @@ main(int c, const char **v)
   options = options_new();
   tor_threads_init();
   tor_compress_init();
+  parsecommon_init();
 
   network_init();
 